@@ -28,21 +28,139 @@
 #endif
 
 
+/*
+ * Code points below this value are stored in a dense array of tables that
+ * can be indexed directly. Everything else lives in a sparse hash table so
+ * that we do not pay for the entire unicode range.
+ */
+#define FUZZY_N_DENSE_TABLES 128
+
+
+/*
+ * Lookups with fewer candidates than this are not worth splitting across
+ * threads. Larger lookups get one shard per this many candidates, up to
+ * the number of processors.
+ */
+#ifndef FUZZY_SHARD_MIN_CANDIDATES
+#define FUZZY_SHARD_MIN_CANDIDATES 32768
+#endif
+
+#define FUZZY_MAX_SHARDS 64
+
+
+/*
+ * The number of threads lookups may be split across. Tests override this
+ * along with FUZZY_SHARD_MIN_CANDIDATES to exercise sharding on machines
+ * with a single processor.
+ */
+#ifndef FUZZY_N_THREADS
+#define FUZZY_N_THREADS g_get_num_processors()
+#endif
+
+
+/*
+ * Candidates are checked against the needle signature in batches of this
+ * many ids before any of them are matched.
+ */
+#define FUZZY_PREFILTER_BATCH 256
+
+
+/*
+ * Character tables are packed into blocks of at least this many items.
+ * The block directory is what lets a lookup skip ahead without decoding
+ * every item in between, so smaller blocks seek faster but cost more
+ * memory for the directory.
+ */
+#define FUZZY_BLOCK_ITEMS 64
+
+
+/*
+ * Packed items are read and written with unaligned 64-bit loads, so the
+ * packed data of every table is followed by this many zero bytes.
+ */
+#define FUZZY_BLOCK_PADDING 8
+
+
+/*
+ * Removed ids are compacted away once at least 1 in FUZZY_COMPACT_RATIO
+ * of the ids in the index have been removed.
+ */
+#define FUZZY_COMPACT_RATIO 4
+
+
+/*
+ * Index files start with this magic and must match the version, byte
+ * order and word size of the running process exactly. They are a cache,
+ * so anything else is simply rebuilt.
+ */
+#define FUZZY_FILE_MAGIC      "FUZZYIDX"
+#define FUZZY_FILE_VERSION    3
+#define FUZZY_FILE_BYTE_ORDER 0x01020304
+#define FUZZY_FILE_NO_VALUE   G_MAXUINT64
+#define FUZZY_FILE_ALIGN(n)   (((n) + 7) & ~G_GUINT64_CONSTANT(7))
+
+
+/*
+ * Matching a needle character at the start of a word or path component
+ * is worth this many characters of span when scoring.
+ */
+#define FUZZY_BONUS_BOUNDARY  1
+#define FUZZY_BONUS_SEPARATOR 2
+#define FUZZY_BONUS_MAX       FUZZY_BONUS_SEPARATOR
+
+
 /**
  * SECTION:fuzzy
  * @title: Fuzzy Matching
  * @short_description: Fuzzy matching for GLib based programs.
  *
- * TODO:
+ * #Fuzzy indexes UTF-8 encoded strings by unicode code point. Unless the
+ * index is case sensitive, each code point is case-folded before it is
+ * inserted into the index or compared against the needle. Code points in
+ * the ASCII range use a dense table that is indexed directly, so ASCII
+ * corpora do not pay for the unicode support.
  *
  * It is a programming error to modify #Fuzzy while holding onto an array
  * of #FuzzyMatch elements. The position of strings within the FuzzyMatch
- * may no longer be valid.
+ * may no longer be valid. That includes fuzzy_compact(), which gives the
+ * remaining keys new ids and moves their strings.
+ *
+ * Removed keys leave a tombstone behind, which is an id whose signature
+ * is zero. Every inserted key has at least one bit set in its signature,
+ * so tombstones are rejected by the signature prefilter like any other
+ * candidate that cannot match.
+ *
+ * A path aware index treats its keys as '/' separated paths. Since '/' is
+ * indexed like any other character, the needle "edit/doc" still only
+ * matches keys with a '/' between "edit" and "doc". On top of that, the
+ * characters between two '/' of the needle must match within a single
+ * component of the key, and the characters after the last one must match
+ * within the last component. The component of each position is worked out
+ * from the key itself while scoring, so no extra data is kept per key.
+ *
+ * Matching never modifies #Fuzzy, so any number of threads may match
+ * against the same index at once. Inserting, removing, replacing and
+ * compacting do modify it, and must not run concurrently with matching
+ * or with each other. Callers that do both from several threads need a
+ * lock of their own around them.
  */
 
 
-typedef struct _FuzzyItem   FuzzyItem;
-typedef struct _FuzzyLookup FuzzyLookup;
+typedef struct _FuzzyBlock      FuzzyBlock;
+typedef struct _FuzzyCursor     FuzzyCursor;
+typedef struct _FuzzyHeap       FuzzyHeap;
+typedef struct _FuzzyItem       FuzzyItem;
+typedef struct _FuzzyWideItem   FuzzyWideItem;
+typedef struct _FuzzyLookup     FuzzyLookup;
+typedef struct _FuzzyPostings   FuzzyPostings;
+typedef struct _FuzzyQueryLevel FuzzyQueryLevel;
+typedef struct _FuzzyRun        FuzzyRun;
+typedef struct _FuzzyShard      FuzzyShard;
+typedef struct _FuzzyShardGroup FuzzyShardGroup;
+typedef struct _FuzzyTable      FuzzyTable;
+typedef struct _FuzzyMapping    FuzzyMapping;
+typedef struct _FuzzyFileHeader FuzzyFileHeader;
+typedef struct _FuzzyFileTable  FuzzyFileTable;
 
 
 struct _Fuzzy
@@ -52,10 +170,24 @@ struct _Fuzzy
    gsize           heap_length;
    gsize           heap_offset;
    GArray         *id_to_text_offset;
+   GArray         *id_to_signature;
    GPtrArray      *id_to_value;
    GPtrArray      *char_tables;
+   GHashTable     *unichar_tables;
+   GDestroyNotify  free_func;
+   guint          *key_index;
+   guint           key_index_size;
+   guint           key_index_used;
+   guint           n_removed;
+   FuzzyMapping   *mapping;
    gboolean        in_bulk_insert;
    gboolean        case_sensitive;
+   gboolean        wide;
+   gboolean        path_aware;
+   guint           generation;
+#ifdef FUZZY_ENABLE_STATS
+   FuzzyStats      stats;
+#endif
 };
 
 
@@ -69,32 +201,345 @@ struct _FuzzyItem
 G_STATIC_ASSERT(sizeof(FuzzyItem) == 4);
 
 
+/*
+ * Items are only kept unpacked while they are being inserted. Indexes
+ * with more than FUZZY_ITEM_MAX_ID ids, or keys longer than
+ * FUZZY_ITEM_MAX_POS characters, use FuzzyWideItem for every table
+ * instead. Padding would round a 32-bit id and 16-bit position up to
+ * 8 bytes anyway, so positions get the full 32 bits.
+ */
+#define FUZZY_ITEM_MAX_ID  ((1 << 20) - 1)
+#define FUZZY_ITEM_MAX_POS ((1 << 12) - 1)
+
+
+struct _FuzzyWideItem
+{
+   guint32 id;
+   guint32 pos;
+};
+
+
+G_STATIC_ASSERT(sizeof(FuzzyWideItem) == 8);
+
+
+/*
+ * FuzzyHeap is a bounded min-heap of FuzzyMatch. The worst match is at the
+ * root so that it can be replaced in O(log n) when a better match arrives.
+ * A @max_matches of zero means the heap is unbounded.
+ */
+struct _FuzzyHeap
+{
+   GArray *matches;
+   gsize   max_matches;
+};
+
+
+/*
+ * The items of a character table are sorted by id and then position, and
+ * packed into blocks. Each block stores every item as the difference from
+ * the id of the previous item followed by the position, using only as
+ * many bits as the largest of each needs within the block. The items for
+ * an id never straddle two blocks, so a block can grow past
+ * FUZZY_BLOCK_ITEMS to finish the last id in it.
+ *
+ * The blocks of a table form a directory that can be searched by id.
+ */
+struct _FuzzyBlock
+{
+   guint32 first_id;
+   guint32 n_items;
+   guint32 offset;
+   guint8  id_bits;
+   guint8  pos_bits;
+   guint16 reserved;
+};
+
+
+G_STATIC_ASSERT(sizeof(FuzzyBlock) == 16);
+
+
+/*
+ * FuzzyTable is a read-only view of the packed items for a single
+ * character, which may live in a FuzzyPostings or in a mapped index file.
+ * For a mapped file, @checked has a bit for each block that has already
+ * been checked by fuzzy_table_check_block(). It is %NULL otherwise.
+ */
+struct _FuzzyTable
+{
+   const FuzzyBlock *blocks;
+   const guint8     *data;
+   volatile guint   *checked;
+   guint             n_blocks;
+   guint             n_items;
+};
+
+
+/*
+ * FuzzyPostings owns the packed items for a single character. New keys
+ * always get the largest id, so inserting only ever appends items. They
+ * are collected unpacked in @tail, which stays sorted without any work,
+ * and fuzzy_postings_flush() packs them after the existing blocks once
+ * the insert or bulk insert is complete, so lookups never write to the
+ * table. @blocks_size and @data_size are the allocated sizes, which grow
+ * geometrically as items are flushed.
+ */
+struct _FuzzyPostings
+{
+   FuzzyBlock *blocks;
+   guint8     *data;
+   gsize       data_len;
+   gsize       data_size;
+   guint       n_blocks;
+   guint       blocks_size;
+   guint       n_items;
+   GArray     *tail;
+};
+
+
+/*
+ * The position of a lookup within a table. @id is the id of the item
+ * before @index, or the first id of the block if @index is zero.
+ */
+struct _FuzzyCursor
+{
+   guint block;
+   guint index;
+   guint id;
+};
+
+
+/*
+ * The positions of the current candidate within a table.
+ */
+struct _FuzzyRun
+{
+   guint *positions;
+   guint  len;
+   guint  size;
+};
+
+
+/*
+ * The on-disk layout written by fuzzy_save(). Every section starts on an
+ * 8 byte boundary so that it can be used in place once mapped.
+ *
+ *   FuzzyFileHeader
+ *   cache key      (NUL terminated)
+ *   string heap    (the heap of the index, verbatim)
+ *   offsets        (gsize per id, into the string heap)
+ *   signatures     (guint64 per id)
+ *   value offsets  (guint64 per id, into the value heap)
+ *   value heap     (NUL terminated strings)
+ *   blocks         (FuzzyBlock, for each table in turn)
+ *   packed items   (for each table in turn, padded)
+ *   tables         (FuzzyFileTable per character)
+ *
+ * The first FUZZY_N_DENSE_TABLES tables are always present and indexed by
+ * character. The rest are sorted by character.
+ */
+struct _FuzzyFileHeader
+{
+   gchar   magic[8];
+   guint32 version;
+   guint32 byte_order;
+   guint32 word_size;
+   guint32 case_sensitive;
+   guint32 wide;
+   guint32 n_ids;
+   guint32 n_tables;
+   guint32 path_aware;
+   guint64 cache_key;
+   guint64 cache_key_length;
+   guint64 heap;
+   guint64 heap_length;
+   guint64 offsets;
+   guint64 signatures;
+   guint64 values;
+   guint64 value_heap;
+   guint64 value_heap_length;
+   guint64 tables;
+};
+
+
+struct _FuzzyFileTable
+{
+   guint32 ch;
+   guint32 n_items;
+   guint32 n_blocks;
+   guint32 reserved;
+   guint64 blocks;
+   guint64 data;
+   guint64 data_len;
+};
+
+
+/*
+ * Only the layout of a mapped file is checked when it is loaded. The
+ * packed items of a block are checked the first time a lookup reads the
+ * block, which is recorded in @checked. @check_base is the index of the
+ * first word of @checked for each table.
+ */
+struct _FuzzyMapping
+{
+   GMappedFile          *file;
+   const gchar          *data;
+   const gsize          *offsets;
+   const guint64        *signatures;
+   const guint64        *values;
+   const gchar          *value_heap;
+   const FuzzyFileTable *tables;
+   volatile guint       *checked;
+   guint                *check_base;
+   guint                 n_ids;
+   guint                 n_tables;
+   volatile gint         corrupt;
+};
+
+
+/*
+ * In a path aware index, @joins is set for each needle character that must
+ * match in the same path component as the one before it, and @anchored if
+ * the last one must match in the last component. @components and
+ * @last_component are filled in for each candidate along with @bonus.
+ */
 struct _FuzzyLookup
 {
    Fuzzy        *fuzzy;
-   GArray      **tables;
-   gint         *state;
+   FuzzyTable   *tables;
+   FuzzyCursor  *state;
+   FuzzyRun     *runs;
    guint         n_tables;
-   gsize         max_matches;
-   const gchar  *needle;
-   GHashTable   *matches;
+   guint64       signature;
+   guint8       *bonus;
+   guint         n_bonus;
+   guint8       *joins;
+   gboolean      anchored;
+   guint        *components;
+   guint         last_component;
+   gint         *costs;
+   guint         n_costs;
+   GCancellable *cancellable;
+   gint64        deadline;
+   gboolean      truncated;
+#ifdef FUZZY_ENABLE_STATS
+   FuzzyStats    stats;
+#endif
 };
 
 
-static gint
-fuzzy_item_compare (gconstpointer a,
-                    gconstpointer b)
+/*
+ * A FuzzyShard matches a contiguous range of candidates. If @candidates is
+ * set, the range is a slice of it. Otherwise the range is a slice of the
+ * blocks of the table for the first character of the needle. Since tables
+ * are sorted by id, each shard covers a distinct range of ids and its
+ * cursors only ever touch that part of each table. The tables themselves
+ * are shared.
+ */
+struct _FuzzyShard
 {
-   gint ret;
+   FuzzyLookup      lookup;
+   const guint     *candidates;
+   guint            begin;
+   guint            end;
+   FuzzyHeap        heap;
+   GArray          *survivors;
+   FuzzyShardGroup *group;
+};
+
+
+struct _FuzzyShardGroup
+{
+   GMutex mutex;
+   GCond  cond;
+   guint  pending;
+};
+
+
+struct _FuzzyQueryLevel
+{
+   gchar  *needle;
+   GArray *survivors;
+};
+
+
+struct _FuzzyQuery
+{
+   Fuzzy     *fuzzy;
+   GPtrArray *levels;
+   guint      generation;
+};
 
-   const FuzzyItem *fa = a;
-   const FuzzyItem *fb = b;
 
-   if ((ret = fa->id - fb->id) == 0) {
-      ret = fa->pos - fb->pos;
+static inline guint
+fuzzy_item_get_id (gconstpointer data,
+                   guint         i,
+                   gboolean      wide)
+{
+   if (wide) {
+      return ((const FuzzyWideItem *)data)[i].id;
    }
 
-   return ret;
+   return ((const FuzzyItem *)data)[i].id;
+}
+
+
+static inline guint
+fuzzy_item_get_pos (gconstpointer data,
+                    guint         i,
+                    gboolean      wide)
+{
+   if (wide) {
+      return ((const FuzzyWideItem *)data)[i].pos;
+   }
+
+   return ((const FuzzyItem *)data)[i].pos;
+}
+
+
+/**
+ * fuzzy_unpack:
+ * @data: Packed items.
+ * @bit: The bit offset of the field within @data.
+ * @bits: The width of the field, at most 32.
+ *
+ * Reads a single bit-packed field. The packed data of every table is
+ * padded with FUZZY_BLOCK_PADDING bytes, so the 64-bit load can never
+ * read past the end of it.
+ *
+ * Returns: The value of the field.
+ */
+static inline guint
+fuzzy_unpack (const guint8 *data,
+              gsize         bit,
+              guint         bits)
+{
+   guint64 word;
+
+   memcpy(&word, data + (bit / 8), sizeof word);
+   word = GUINT64_FROM_LE(word) >> (bit % 8);
+
+   return (guint)(word & ((G_GUINT64_CONSTANT(1) << bits) - 1));
+}
+
+
+static inline void
+fuzzy_pack (guint8 *data,
+            gsize   bit,
+            guint   value)
+{
+   guint64 word;
+
+   memcpy(&word, data + (bit / 8), sizeof word);
+   word = GUINT64_FROM_LE(word) | ((guint64)value << (bit % 8));
+   word = GUINT64_TO_LE(word);
+   memcpy(data + (bit / 8), &word, sizeof word);
+}
+
+
+static inline guint
+fuzzy_bit_storage (guint value)
+{
+   return value ? g_bit_storage(value) : 0;
 }
 
 
@@ -115,6 +560,299 @@ fuzzy_match_compare (gconstpointer a,
 }
 
 
+static void
+fuzzy_query_level_free (gpointer data)
+{
+   FuzzyQueryLevel *level = data;
+
+   g_free(level->needle);
+   g_array_unref(level->survivors);
+   g_free(level);
+}
+
+
+static inline guint
+fuzzy_get_item_size (Fuzzy *fuzzy)
+{
+   return fuzzy->wide ? sizeof(FuzzyWideItem) : sizeof(FuzzyItem);
+}
+
+
+static FuzzyPostings *
+fuzzy_postings_new (void)
+{
+   return g_new0(FuzzyPostings, 1);
+}
+
+
+static void
+fuzzy_postings_free (gpointer data)
+{
+   FuzzyPostings *postings = data;
+
+   if (postings) {
+      g_free(postings->blocks);
+      g_free(postings->data);
+      if (postings->tail) {
+         g_array_unref(postings->tail);
+      }
+      g_free(postings);
+   }
+}
+
+
+static inline gsize
+fuzzy_block_get_end (const FuzzyBlock *block)
+{
+   return block->offset +
+          ((((gsize)block->n_items * (block->id_bits + block->pos_bits)) + 7) / 8);
+}
+
+
+/**
+ * fuzzy_postings_decode:
+ * @fuzzy: A #Fuzzy.
+ * @postings: A #FuzzyPostings.
+ * @first_block: The first block to decode.
+ * @items: A #GArray of #FuzzyItem or #FuzzyWideItem.
+ *
+ * Appends the packed items of @postings, starting from @first_block,
+ * to @items.
+ */
+static void
+fuzzy_postings_decode (Fuzzy               *fuzzy,
+                       const FuzzyPostings *postings,
+                       guint                first_block,
+                       GArray              *items)
+{
+   const FuzzyBlock *block;
+   const guint8 *data;
+   FuzzyWideItem wide_item;
+   FuzzyItem item;
+   guint bits;
+   guint id;
+   guint i;
+   guint j;
+
+   for (i = first_block; i < postings->n_blocks; i++) {
+      block = &postings->blocks[i];
+      data = postings->data + block->offset;
+      bits = block->id_bits + block->pos_bits;
+      id = block->first_id;
+
+      for (j = 0; j < block->n_items; j++) {
+         id += fuzzy_unpack(data, (gsize)j * bits, block->id_bits);
+         if (fuzzy->wide) {
+            wide_item.id = id;
+            wide_item.pos = fuzzy_unpack(data, ((gsize)j * bits) + block->id_bits,
+                                         block->pos_bits);
+            g_array_append_val(items, wide_item);
+         } else {
+            item.id = id;
+            item.pos = fuzzy_unpack(data, ((gsize)j * bits) + block->id_bits,
+                                    block->pos_bits);
+            g_array_append_val(items, item);
+         }
+      }
+   }
+}
+
+
+/**
+ * fuzzy_postings_pack:
+ * @postings: A #FuzzyPostings.
+ * @n_kept: The number of existing blocks to keep.
+ * @items: Sorted #FuzzyItem or #FuzzyWideItem.
+ * @n_items: The number of items in @items.
+ * @wide: If @items are #FuzzyWideItem.
+ *
+ * Replaces the packed items of @postings after the first @n_kept blocks
+ * with @items, which must all have larger ids than the kept blocks. See
+ * #FuzzyBlock for the layout. The block boundaries and field widths are
+ * chosen first so that the packed data can be allocated in one go.
+ */
+static void
+fuzzy_postings_pack (FuzzyPostings *postings,
+                     guint          n_kept,
+                     gconstpointer  items,
+                     guint          n_items,
+                     gboolean       wide)
+{
+   FuzzyBlock block = { 0 };
+   FuzzyBlock *blocks;
+   GArray *array;
+   guint8 *data;
+   guint max_delta;
+   guint max_pos;
+   guint begin;
+   guint end;
+   guint bits;
+   guint i;
+   guint j;
+   gsize base;
+   gsize offset;
+   gsize bit;
+
+   g_assert(n_kept <= postings->n_blocks);
+
+   for (i = n_kept; i < postings->n_blocks; i++) {
+      postings->n_items -= postings->blocks[i].n_items;
+   }
+
+   base = n_kept ? fuzzy_block_get_end(&postings->blocks[n_kept - 1]) : 0;
+   offset = base;
+
+   array = g_array_sized_new(FALSE, FALSE, sizeof(FuzzyBlock),
+                             (n_items / FUZZY_BLOCK_ITEMS) + 1);
+
+   for (begin = 0; begin < n_items; begin = end) {
+      end = MIN(begin + FUZZY_BLOCK_ITEMS, n_items);
+      while ((end < n_items) &&
+             (fuzzy_item_get_id(items, end, wide) ==
+              fuzzy_item_get_id(items, end - 1, wide))) {
+         end++;
+      }
+
+      max_delta = 0;
+      max_pos = 0;
+
+      for (i = begin; i < end; i++) {
+         if (i > begin) {
+            max_delta = MAX(max_delta,
+                            fuzzy_item_get_id(items, i, wide) -
+                            fuzzy_item_get_id(items, i - 1, wide));
+         }
+         max_pos = MAX(max_pos, fuzzy_item_get_pos(items, i, wide));
+      }
+
+      block.first_id = fuzzy_item_get_id(items, begin, wide);
+      block.n_items = end - begin;
+      block.offset = offset;
+      block.id_bits = fuzzy_bit_storage(max_delta);
+      block.pos_bits = fuzzy_bit_storage(max_pos);
+      g_array_append_val(array, block);
+
+      offset = fuzzy_block_get_end(&block);
+   }
+
+   /*
+    * Tables that are appended to repeatedly grow geometrically, while
+    * tables that are packed from scratch are allocated to fit.
+    */
+   if (!n_kept) {
+      g_clear_pointer(&postings->blocks, g_free);
+      g_clear_pointer(&postings->data, g_free);
+      postings->blocks_size = 0;
+      postings->data_size = 0;
+   }
+
+   if ((n_kept + array->len) > postings->blocks_size) {
+      postings->blocks_size = MAX(n_kept + array->len, postings->blocks_size * 2);
+      postings->blocks = g_renew(FuzzyBlock, postings->blocks, postings->blocks_size);
+   }
+
+   if ((offset + FUZZY_BLOCK_PADDING) > postings->data_size) {
+      postings->data_size = MAX(offset + FUZZY_BLOCK_PADDING, postings->data_size * 2);
+      postings->data = g_realloc(postings->data, postings->data_size);
+   }
+
+   blocks = postings->blocks + n_kept;
+   data = postings->data;
+
+   if (array->len) {
+      memcpy(blocks, array->data, array->len * sizeof(FuzzyBlock));
+   }
+   memset(data + base, 0, offset - base + FUZZY_BLOCK_PADDING);
+
+   for (i = 0, begin = 0; i < array->len; i++) {
+      bits = blocks[i].id_bits + blocks[i].pos_bits;
+
+      for (j = 0, bit = 0; j < blocks[i].n_items; j++, bit += bits) {
+         if (j) {
+            fuzzy_pack(data + blocks[i].offset, bit,
+                       fuzzy_item_get_id(items, begin + j, wide) -
+                       fuzzy_item_get_id(items, begin + j - 1, wide));
+         }
+         fuzzy_pack(data + blocks[i].offset, bit + blocks[i].id_bits,
+                    fuzzy_item_get_pos(items, begin + j, wide));
+      }
+
+      begin += blocks[i].n_items;
+   }
+
+   postings->n_blocks = n_kept + array->len;
+   postings->n_items += n_items;
+   postings->data_len = offset + FUZZY_BLOCK_PADDING;
+
+   g_array_unref(array);
+}
+
+
+static void
+fuzzy_postings_append (Fuzzy         *fuzzy,
+                       FuzzyPostings *postings,
+                       guint          id,
+                       guint          pos)
+{
+   FuzzyWideItem wide_item;
+   FuzzyItem item;
+
+   if (!postings->tail) {
+      postings->tail = g_array_new(FALSE, FALSE, fuzzy_get_item_size(fuzzy));
+   }
+
+   if (fuzzy->wide) {
+      wide_item.id = id;
+      wide_item.pos = pos;
+      g_array_append_val(postings->tail, wide_item);
+   } else {
+      item.id = id;
+      item.pos = pos;
+      g_array_append_val(postings->tail, item);
+   }
+}
+
+
+/**
+ * fuzzy_postings_flush:
+ * @fuzzy: A #Fuzzy.
+ * @postings: A #FuzzyPostings.
+ *
+ * Packs the items appended to @postings since the last flush, if any.
+ * The last block is packed again along with them so that single inserts
+ * do not leave a trail of tiny blocks behind. Nothing needs sorting, as
+ * the appended items all come after the packed ones.
+ */
+static void
+fuzzy_postings_flush (Fuzzy         *fuzzy,
+                      FuzzyPostings *postings)
+{
+   GArray *items;
+   guint n_kept;
+
+   if (!postings->tail) {
+      return;
+   }
+
+   if (!postings->n_blocks) {
+      items = postings->tail;
+      n_kept = 0;
+   } else {
+      n_kept = postings->n_blocks - 1;
+      items = g_array_sized_new(FALSE, FALSE, fuzzy_get_item_size(fuzzy),
+                                postings->blocks[n_kept].n_items + postings->tail->len);
+      fuzzy_postings_decode(fuzzy, postings, n_kept, items);
+      g_array_append_vals(items, postings->tail->data, postings->tail->len);
+      g_array_unref(postings->tail);
+   }
+
+   postings->tail = NULL;
+
+   fuzzy_postings_pack(postings, n_kept, items->data, items->len, fuzzy->wide);
+   g_array_unref(items);
+}
+
+
 Fuzzy *
 fuzzy_ref (Fuzzy *fuzzy)
 {
@@ -138,28 +876,7 @@ fuzzy_ref (Fuzzy *fuzzy)
 Fuzzy *
 fuzzy_new (gboolean case_sensitive)
 {
-   GArray *table;
-   Fuzzy *fuzzy;
-   gint i;
-
-   fuzzy = g_new0(Fuzzy, 1);
-   fuzzy->ref_count = 1;
-   fuzzy->heap_length = FUZZY_GROW_HEAP_BY;
-   fuzzy->heap = g_malloc(fuzzy->heap_length);
-   fuzzy->heap_offset = 0;
-   fuzzy->id_to_value = g_ptr_array_new();
-   fuzzy->id_to_text_offset = g_array_new(FALSE, FALSE, sizeof(gsize));
-   fuzzy->char_tables = g_ptr_array_new();
-   fuzzy->case_sensitive = case_sensitive;
-   g_ptr_array_set_free_func(fuzzy->char_tables,
-                             (GDestroyNotify)g_array_unref);
-
-   for (i = 0; i < 256; i++) {
-      table = g_array_new(FALSE, FALSE, sizeof(FuzzyItem));
-      g_ptr_array_add(fuzzy->char_tables, table);
-   }
-
-   return fuzzy;
+   return fuzzy_new_full(case_sensitive, 0, NULL);
 }
 
 
@@ -167,9 +884,55 @@ Fuzzy *
 fuzzy_new_with_free_func (gboolean       case_sensitive,
                           GDestroyNotify free_func)
 {
-   Fuzzy *fuzzy;
+   return fuzzy_new_full(case_sensitive, 0, free_func);
+}
+
+
+/**
+ * fuzzy_new_full:
+ * @case_sensitive: %TRUE if case should be preserved.
+ * @capacity: The number of keys expected, or 0 if unknown.
+ * @free_func: (allow-none): A #GDestroyNotify for the values.
+ *
+ * Creates a new #Fuzzy sized for roughly @capacity keys.
+ *
+ * While keys are being inserted, small indexes keep each character
+ * occurrence in 4 bytes, which limits them to about a million keys of up
+ * to 4096 characters. If @capacity is larger than that, every occurrence
+ * takes 8 bytes from the start instead. An index that outgrows the
+ * compact encoding is converted automatically, so @capacity only avoids
+ * the cost of converting it. Either way, the tables are packed once the
+ * keys have been inserted.
+ *
+ * Returns: A newly allocated #Fuzzy that should be freed with fuzzy_unref().
+ */
+Fuzzy *
+fuzzy_new_full (gboolean       case_sensitive,
+                guint          capacity,
+                GDestroyNotify free_func)
+{
+   Fuzzy *fuzzy;
+   gint i;
+
+   fuzzy = g_new0(Fuzzy, 1);
+   fuzzy->ref_count = 1;
+   fuzzy->heap_length = FUZZY_GROW_HEAP_BY;
+   fuzzy->heap = g_malloc(fuzzy->heap_length);
+   fuzzy->heap_offset = 0;
+   fuzzy->id_to_value = g_ptr_array_sized_new(capacity);
+   fuzzy->id_to_text_offset = g_array_sized_new(FALSE, FALSE, sizeof(gsize), capacity);
+   fuzzy->id_to_signature = g_array_sized_new(FALSE, FALSE, sizeof(guint64), capacity);
+   fuzzy->char_tables = g_ptr_array_new();
+   fuzzy->unichar_tables = g_hash_table_new_full(NULL, NULL, NULL,
+                                                 fuzzy_postings_free);
+   fuzzy->case_sensitive = case_sensitive;
+   fuzzy->wide = (capacity > FUZZY_ITEM_MAX_ID);
+   g_ptr_array_set_free_func(fuzzy->char_tables, fuzzy_postings_free);
+
+   for (i = 0; i < FUZZY_N_DENSE_TABLES; i++) {
+      g_ptr_array_add(fuzzy->char_tables, fuzzy_postings_new());
+   }
 
-   fuzzy = fuzzy_new(case_sensitive);
    fuzzy_set_free_func(fuzzy, free_func);
 
    return fuzzy;
@@ -182,367 +945,3031 @@ fuzzy_set_free_func (Fuzzy          *fuzzy,
 {
    g_return_if_fail(fuzzy);
 
-   g_ptr_array_set_free_func(fuzzy->id_to_value, free_func);
+   fuzzy->free_func = free_func;
+   g_ptr_array_set_free_func(fuzzy->id_to_value, free_func);
+}
+
+
+/**
+ * fuzzy_set_path_aware:
+ * @fuzzy: A #Fuzzy.
+ * @path_aware: %TRUE if keys are '/' separated paths.
+ *
+ * Sets whether the keys of @fuzzy are matched as paths. Each '/' in the
+ * needle starts a new segment. Every segment but the last must match
+ * within a single directory component of the key, in order, and the last
+ * segment must match within the file name. A needle without a '/' only
+ * matches file names, and a needle ending in '/' only matches directory
+ * components. For example, "edit/doc" matches
+ * "src/editor/gb-editor-document.c" but not "doc/editing.txt".
+ *
+ * Only matching is affected, so this may be changed at any time.
+ */
+void
+fuzzy_set_path_aware (Fuzzy    *fuzzy,
+                      gboolean  path_aware)
+{
+   g_return_if_fail(fuzzy);
+
+   path_aware = !!path_aware;
+
+   if (fuzzy->path_aware != path_aware) {
+      fuzzy->path_aware = path_aware;
+      fuzzy->generation++;
+   }
+}
+
+
+/**
+ * fuzzy_fold:
+ * @fuzzy: A #Fuzzy.
+ * @ch: A unicode code point.
+ *
+ * Folds the case of @ch unless @fuzzy is case sensitive. ASCII characters
+ * take a fast path that avoids the unicode tables entirely.
+ *
+ * Returns: The code point to index or match with.
+ */
+static inline gunichar
+fuzzy_fold (Fuzzy    *fuzzy,
+            gunichar  ch)
+{
+   if (fuzzy->case_sensitive) {
+      return ch;
+   } else if (G_LIKELY(ch < 0x80)) {
+      return g_ascii_tolower(ch);
+   }
+
+   return g_unichar_tolower(ch);
+}
+
+
+/**
+ * fuzzy_next_char:
+ * @fuzzy: A #Fuzzy.
+ * @str: (inout): A pointer to a position within a UTF-8 string.
+ *
+ * Reads the code point at @str, folding its case if necessary, and advances
+ * @str to the following character.
+ *
+ * Returns: The folded code point.
+ */
+static inline gunichar
+fuzzy_next_char (Fuzzy        *fuzzy,
+                 const gchar **str)
+{
+   gunichar ch;
+
+   if (G_LIKELY(!(**str & 0x80))) {
+      ch = **str;
+      (*str)++;
+   } else {
+      ch = g_utf8_get_char(*str);
+      *str = g_utf8_next_char(*str);
+   }
+
+   return fuzzy_fold(fuzzy, ch);
+}
+
+
+/**
+ * fuzzy_signature:
+ * @ch: A folded code point.
+ *
+ * Maps @ch to a single bit of a 64-bit character-class signature. Every
+ * letter and digit gets a bit of its own, while punctuation and non-ASCII
+ * code points share the remaining bits. Upper and lower case letters share
+ * a bit so that case sensitive indexes get the same (conservative) filter.
+ *
+ * Returns: A signature with a single bit set.
+ */
+static inline guint64
+fuzzy_signature (gunichar ch)
+{
+   if ((ch >= 'a') && (ch <= 'z')) {
+      return G_GUINT64_CONSTANT(1) << (ch - 'a');
+   } else if ((ch >= 'A') && (ch <= 'Z')) {
+      return G_GUINT64_CONSTANT(1) << (ch - 'A');
+   } else if ((ch >= '0') && (ch <= '9')) {
+      return G_GUINT64_CONSTANT(1) << (26 + ch - '0');
+   }
+
+   return G_GUINT64_CONSTANT(1) << (36 + (ch % 28));
+}
+
+
+/**
+ * fuzzy_get_table:
+ * @fuzzy: A #Fuzzy.
+ * @ch: A folded code point.
+ * @create: If the table should be created when missing.
+ *
+ * Fetches the table for @ch. ASCII characters are resolved with a direct
+ * index, everything else goes through a hash table.
+ *
+ * Returns: (transfer none): A #FuzzyPostings or %NULL.
+ */
+static FuzzyPostings *
+fuzzy_get_table (Fuzzy    *fuzzy,
+                 gunichar  ch,
+                 gboolean  create)
+{
+   FuzzyPostings *table;
+
+   if (G_LIKELY(ch < FUZZY_N_DENSE_TABLES)) {
+      return g_ptr_array_index(fuzzy->char_tables, ch);
+   }
+
+   table = g_hash_table_lookup(fuzzy->unichar_tables, GUINT_TO_POINTER(ch));
+
+   if (!table && create) {
+      table = fuzzy_postings_new();
+      g_hash_table_insert(fuzzy->unichar_tables, GUINT_TO_POINTER(ch), table);
+   }
+
+   return table;
+}
+
+
+/**
+ * fuzzy_get_items:
+ * @fuzzy: A #Fuzzy.
+ * @ch: A folded code point.
+ * @table: (out): A location for the #FuzzyTable.
+ *
+ * Fetches a read-only view of the packed items for @ch, whether @fuzzy
+ * has been built in memory or mapped from a file.
+ *
+ * Returns: %TRUE if there are any items for @ch.
+ */
+static gboolean
+fuzzy_get_items (Fuzzy      *fuzzy,
+                 gunichar    ch,
+                 FuzzyTable *table)
+{
+   const FuzzyFileTable *tables;
+   const FuzzyMapping *mapping = fuzzy->mapping;
+   FuzzyPostings *postings;
+   guint lo;
+   guint hi;
+   guint mid;
+
+   memset(table, 0, sizeof *table);
+
+   if (G_LIKELY(!mapping)) {
+      if ((postings = fuzzy_get_table(fuzzy, ch, FALSE))) {
+         g_assert(!postings->tail);
+         table->blocks = postings->blocks;
+         table->data = postings->data;
+         table->n_blocks = postings->n_blocks;
+         table->n_items = postings->n_items;
+      }
+      return (table->n_items > 0);
+   }
+
+   tables = mapping->tables;
+
+   if (ch < FUZZY_N_DENSE_TABLES) {
+      lo = ch;
+   } else {
+      lo = FUZZY_N_DENSE_TABLES;
+      hi = mapping->n_tables;
+      while (lo < hi) {
+         mid = (lo + hi) / 2;
+         if (tables[mid].ch < ch) {
+            lo = mid + 1;
+         } else {
+            hi = mid;
+         }
+      }
+      if ((lo == mapping->n_tables) || (tables[lo].ch != ch)) {
+         return FALSE;
+      }
+   }
+
+   table->blocks = (gconstpointer)(mapping->data + tables[lo].blocks);
+   table->data = (gconstpointer)(mapping->data + tables[lo].data);
+   table->checked = mapping->checked + mapping->check_base[lo];
+   table->n_blocks = tables[lo].n_blocks;
+   table->n_items = tables[lo].n_items;
+
+   return (table->n_items > 0);
+}
+
+
+static inline guint
+fuzzy_get_n_ids (Fuzzy *fuzzy)
+{
+   if (G_UNLIKELY(fuzzy->mapping)) {
+      return fuzzy->mapping->n_ids;
+   }
+
+   return fuzzy->id_to_text_offset->len;
+}
+
+
+static inline gsize
+fuzzy_get_offset (Fuzzy *fuzzy,
+                  guint  id)
+{
+   if (G_UNLIKELY(fuzzy->mapping)) {
+      return fuzzy->mapping->offsets[id];
+   }
+
+   return g_array_index(fuzzy->id_to_text_offset, gsize, id);
+}
+
+
+static inline const guint64 *
+fuzzy_get_signatures (Fuzzy *fuzzy)
+{
+   if (G_UNLIKELY(fuzzy->mapping)) {
+      return fuzzy->mapping->signatures;
+   }
+
+   return (const guint64 *)(gpointer)fuzzy->id_to_signature->data;
+}
+
+
+static gpointer
+fuzzy_get_value (Fuzzy *fuzzy,
+                 guint  id)
+{
+   const FuzzyMapping *mapping = fuzzy->mapping;
+
+   if (G_LIKELY(!mapping)) {
+      return g_ptr_array_index(fuzzy->id_to_value, id);
+   } else if (mapping->values[id] == FUZZY_FILE_NO_VALUE) {
+      return NULL;
+   }
+
+   return (gpointer)(mapping->value_heap + mapping->values[id]);
+}
+
+
+static void
+fuzzy_flush_postings (gpointer key,
+                      gpointer value,
+                      gpointer user_data)
+{
+   fuzzy_postings_flush(user_data, value);
+}
+
+
+/**
+ * fuzzy_flush:
+ * @fuzzy: A #Fuzzy.
+ *
+ * Packs the items appended to every table, which is only needed after a
+ * bulk insert. Single inserts flush the tables they touch right away.
+ */
+static void
+fuzzy_flush (Fuzzy *fuzzy)
+{
+   guint i;
+
+   if (fuzzy->mapping) {
+      return;
+   }
+
+   for (i = 0; i < fuzzy->char_tables->len; i++) {
+      fuzzy_postings_flush(fuzzy, g_ptr_array_index(fuzzy->char_tables, i));
+   }
+
+   g_hash_table_foreach(fuzzy->unichar_tables, fuzzy_flush_postings, fuzzy);
+}
+
+
+static GArray *
+fuzzy_widen_table (GArray *table)
+{
+   const FuzzyItem *items;
+   FuzzyWideItem item;
+   GArray *wide;
+   guint i;
+
+   items = (const FuzzyItem *)(gpointer)table->data;
+   wide = g_array_sized_new(FALSE, FALSE, sizeof(FuzzyWideItem), table->len);
+
+   for (i = 0; i < table->len; i++) {
+      item.id = items[i].id;
+      item.pos = items[i].pos;
+      g_array_append_val(wide, item);
+   }
+
+   return wide;
+}
+
+
+static void
+fuzzy_widen_postings (gpointer key,
+                      gpointer value,
+                      gpointer user_data)
+{
+   FuzzyPostings *postings = value;
+   GArray *tail;
+
+   if ((tail = postings->tail)) {
+      postings->tail = fuzzy_widen_table(tail);
+      g_array_unref(tail);
+   }
+}
+
+
+/**
+ * fuzzy_widen:
+ * @fuzzy: A #Fuzzy.
+ *
+ * Switches @fuzzy to #FuzzyWideItem, converting the items that have
+ * been appended to each table but not packed yet. The order of the items
+ * is preserved, so the tables do not need to be sorted again. Packed
+ * tables do not depend on the item encoding and are left alone.
+ */
+static void
+fuzzy_widen (Fuzzy *fuzzy)
+{
+   guint i;
+
+   if (fuzzy->wide) {
+      return;
+   }
+
+   for (i = 0; i < fuzzy->char_tables->len; i++) {
+      fuzzy_widen_postings(NULL, g_ptr_array_index(fuzzy->char_tables, i), NULL);
+   }
+
+   g_hash_table_foreach(fuzzy->unichar_tables, fuzzy_widen_postings, NULL);
+
+   fuzzy->wide = TRUE;
+}
+
+
+static gsize
+fuzzy_heap_insert (Fuzzy       *fuzzy,
+                   const gchar *text)
+{
+   gsize offset;
+   gsize req_bytes;
+   gsize len;
+
+   g_assert(fuzzy);
+   g_assert(text);
+
+   len = strlen(text) + 1;
+   req_bytes = fuzzy->heap_offset + len;
+
+   if (req_bytes > fuzzy->heap_length) {
+      fuzzy->heap_length = MAX(fuzzy->heap_length * 2,
+                               ((req_bytes / FUZZY_GROW_HEAP_BY) + 1) *
+                               FUZZY_GROW_HEAP_BY);
+      fuzzy->heap = g_realloc(fuzzy->heap, fuzzy->heap_length);
+   }
+
+   offset = fuzzy->heap_offset;
+   memcpy(fuzzy->heap + offset, text, len);
+   fuzzy->heap_offset += len;
+
+   return offset;
+}
+
+
+static const gchar *
+fuzzy_get_string (Fuzzy *fuzzy,
+                  gint   id)
+{
+   gsize offset;
+
+   g_assert(fuzzy);
+   g_assert(id >= 0);
+
+   offset = fuzzy_get_offset(fuzzy, id);
+   return fuzzy->heap + offset;
+}
+
+
+/**
+ * fuzzy_get_length:
+ * @fuzzy: A #Fuzzy.
+ * @id: The id of the string.
+ *
+ * Gets the length in bytes of the string for @id without touching the
+ * string itself. Strings are packed in the heap in id order, so the length
+ * falls out of the offset of the next string.
+ *
+ * Returns: The length of the string.
+ */
+static gsize
+fuzzy_get_length (Fuzzy *fuzzy,
+                  guint  id)
+{
+   gsize next;
+
+   if ((id + 1) < fuzzy_get_n_ids(fuzzy)) {
+      next = fuzzy_get_offset(fuzzy, id + 1);
+   } else {
+      next = fuzzy->heap_offset;
+   }
+
+   return next - fuzzy_get_offset(fuzzy, id) - 1;
+}
+
+
+static inline gboolean
+fuzzy_is_removed (Fuzzy *fuzzy,
+                  guint  id)
+{
+   return !fuzzy_get_signatures(fuzzy)[id];
+}
+
+
+static void
+fuzzy_mapping_free (FuzzyMapping *mapping)
+{
+   g_mapped_file_unref(mapping->file);
+   g_free((gpointer)mapping->checked);
+   g_free(mapping->check_base);
+   g_free(mapping);
+}
+
+
+/**
+ * fuzzy_block_check:
+ * @fuzzy: A #Fuzzy that is mapped from a file.
+ * @block: A #FuzzyBlock from the file.
+ * @data: The packed data of the table containing @block.
+ * @next_id: The first id of the next block, or the number of ids.
+ *
+ * Decodes @block to check that its ids are sorted and below @next_id, and
+ * that the positions for each id are sorted and within its key. Positions
+ * count characters, so the length of the key in bytes is a safe bound.
+ *
+ * Returns: %TRUE if @block is safe to use.
+ */
+static gboolean
+fuzzy_block_check (Fuzzy            *fuzzy,
+                   const FuzzyBlock *block,
+                   const guint8     *data,
+                   guint             next_id)
+{
+   guint64 id = block->first_id;
+   guint64 prev_id = G_MAXUINT64;
+   gsize len = 0;
+   guint prev_pos = 0;
+   guint bits;
+   guint pos;
+   guint i;
+
+   data += block->offset;
+   bits = block->id_bits + block->pos_bits;
+
+   for (i = 0; i < block->n_items; i++) {
+      if (i) {
+         id += fuzzy_unpack(data, (gsize)i * bits, block->id_bits);
+      }
+      pos = fuzzy_unpack(data, ((gsize)i * bits) + block->id_bits,
+                         block->pos_bits);
+
+      if (id >= next_id) {
+         return FALSE;
+      }
+
+      if (id != prev_id) {
+         len = fuzzy_get_length(fuzzy, id);
+         prev_id = id;
+      } else if (pos <= prev_pos) {
+         return FALSE;
+      }
+
+      if (pos >= len) {
+         return FALSE;
+      }
+
+      prev_pos = pos;
+   }
+
+   return TRUE;
+}
+
+
+/**
+ * fuzzy_table_check_block:
+ * @fuzzy: A #Fuzzy.
+ * @table: A #FuzzyTable.
+ * @index: The index of a block within @table.
+ *
+ * Checks the packed items of a block from a mapped file before they are
+ * first used. Lookups may run on several threads at once, so the result
+ * is recorded with an atomic operation. A block that fails the check is
+ * treated as empty, so a damaged file leaves out matches rather than
+ * crashing.
+ *
+ * Returns: %TRUE if the block may be read.
+ */
+static inline gboolean
+fuzzy_table_check_block (Fuzzy            *fuzzy,
+                         const FuzzyTable *table,
+                         guint             index)
+{
+   FuzzyMapping *mapping = fuzzy->mapping;
+   guint bit = 1U << (index % 32);
+   guint next_id;
+
+   if (G_LIKELY(!table->checked ||
+                (g_atomic_int_get(&table->checked[index / 32]) & bit))) {
+      return TRUE;
+   }
+
+   if ((index + 1) < table->n_blocks) {
+      next_id = table->blocks[index + 1].first_id;
+   } else {
+      next_id = mapping->n_ids;
+   }
+
+   if (!fuzzy_block_check(fuzzy, &table->blocks[index], table->data, next_id)) {
+      if (g_atomic_int_compare_and_exchange(&mapping->corrupt, FALSE, TRUE)) {
+         g_warning("The fuzzy index is corrupt, some matches will be missing");
+      }
+      return FALSE;
+   }
+
+   g_atomic_int_or(&table->checked[index / 32], bit);
+
+   return TRUE;
+}
+
+
+static void
+fuzzy_key_index_insert (Fuzzy *fuzzy,
+                        guint  id)
+{
+   const gchar *key;
+   guint mask;
+   guint slot;
+
+   key = fuzzy->heap + g_array_index(fuzzy->id_to_text_offset, gsize, id);
+   mask = fuzzy->key_index_size - 1;
+
+   for (slot = g_str_hash(key) & mask;
+        fuzzy->key_index[slot];
+        slot = (slot + 1) & mask) { }
+
+   fuzzy->key_index[slot] = id + 1;
+   fuzzy->key_index_used++;
+}
+
+
+/**
+ * fuzzy_thaw:
+ * @fuzzy: A #Fuzzy.
+ *
+ * Copies an index that was mapped with fuzzy_load_mapped() into memory
+ * so that it can be modified. The values become copies owned by @fuzzy.
+ * This does nothing if @fuzzy is not mapped.
+ */
+static void
+fuzzy_thaw (Fuzzy *fuzzy)
+{
+   const FuzzyFileTable *file_table;
+   const FuzzyBlock *blocks;
+   FuzzyMapping *mapping = fuzzy->mapping;
+   FuzzyPostings *table;
+   const gchar *heap;
+   guint next_id;
+   guint i;
+   guint j;
+
+   if (G_LIKELY(!mapping)) {
+      return;
+   }
+
+   heap = fuzzy->heap;
+   fuzzy->heap_length = (((fuzzy->heap_offset / FUZZY_GROW_HEAP_BY) + 1) *
+                         FUZZY_GROW_HEAP_BY);
+   fuzzy->heap = g_malloc(fuzzy->heap_length);
+   memcpy(fuzzy->heap, heap, fuzzy->heap_offset);
+
+   g_array_append_vals(fuzzy->id_to_text_offset, mapping->offsets, mapping->n_ids);
+   g_array_append_vals(fuzzy->id_to_signature, mapping->signatures, mapping->n_ids);
+
+   for (i = 0; i < mapping->n_ids; i++) {
+      g_ptr_array_add(fuzzy->id_to_value, g_strdup(fuzzy_get_value(fuzzy, i)));
+      if (!mapping->signatures[i]) {
+         fuzzy->n_removed++;
+      }
+   }
+
+   for (i = 0; i < mapping->n_tables; i++) {
+      file_table = &mapping->tables[i];
+      blocks = (gconstpointer)(mapping->data + file_table->blocks);
+
+      /*
+       * The copy is used without any further checks, so every block has
+       * to be checked now. A damaged table is left out entirely.
+       */
+      for (j = 0; j < file_table->n_blocks; j++) {
+         next_id = ((j + 1) < file_table->n_blocks) ? blocks[j + 1].first_id
+                                                    : mapping->n_ids;
+         if (!fuzzy_block_check(fuzzy, &blocks[j],
+                                (gconstpointer)(mapping->data + file_table->data),
+                                next_id)) {
+            if (g_atomic_int_compare_and_exchange(&mapping->corrupt, FALSE, TRUE)) {
+               g_warning("The fuzzy index is corrupt, some matches will be missing");
+            }
+            break;
+         }
+      }
+
+      if (file_table->n_items && (j == file_table->n_blocks)) {
+         table = fuzzy_get_table(fuzzy, file_table->ch, TRUE);
+         table->n_blocks = file_table->n_blocks;
+         table->n_items = file_table->n_items;
+         table->data_len = file_table->data_len;
+         table->blocks_size = table->n_blocks;
+         table->data_size = table->data_len;
+         table->blocks = g_new(FuzzyBlock, table->n_blocks);
+         memcpy(table->blocks, mapping->data + file_table->blocks,
+                table->n_blocks * sizeof(FuzzyBlock));
+         table->data = g_malloc(table->data_len);
+         memcpy(table->data, mapping->data + file_table->data, table->data_len);
+      }
+   }
+
+   fuzzy->mapping = NULL;
+   fuzzy_mapping_free(mapping);
+}
+
+
+/**
+ * fuzzy_key_index_build:
+ * @fuzzy: A #Fuzzy.
+ *
+ * (Re)builds the key index, an open addressing hash table of ids hashed by
+ * their string. Slots hold the id plus one so that zero means empty. Ids
+ * that are removed are left in place and skipped during lookups until the
+ * table is next rebuilt.
+ */
+static void
+fuzzy_key_index_build (Fuzzy *fuzzy)
+{
+   guint i;
+
+   g_free(fuzzy->key_index);
+
+   fuzzy->key_index_size = 64;
+   while (fuzzy->key_index_size <
+          (2 * (fuzzy->id_to_text_offset->len - fuzzy->n_removed))) {
+      fuzzy->key_index_size <<= 1;
+   }
+   fuzzy->key_index = g_new0(guint, fuzzy->key_index_size);
+   fuzzy->key_index_used = 0;
+
+   for (i = 0; i < fuzzy->id_to_text_offset->len; i++) {
+      if (!fuzzy_is_removed(fuzzy, i)) {
+         fuzzy_key_index_insert(fuzzy, i);
+      }
+   }
+}
+
+
+static void
+fuzzy_key_index_add (Fuzzy *fuzzy,
+                     guint  id)
+{
+   if (!fuzzy->key_index) {
+      return;
+   }
+
+   if (((fuzzy->key_index_used + 1) * 4) > (fuzzy->key_index_size * 3)) {
+      fuzzy_key_index_build(fuzzy);
+   } else {
+      fuzzy_key_index_insert(fuzzy, id);
+   }
+}
+
+
+/**
+ * fuzzy_key_index_next:
+ * @fuzzy: A #Fuzzy.
+ * @key: The key to look for.
+ * @slot: (inout): The slot to continue from, or %G_MAXUINT to start.
+ * @id: (out): A location for the id.
+ *
+ * Iterates over the live ids whose string is exactly @key. The key index
+ * is only built the first time it is needed, so indexes that never have
+ * keys removed do not pay for it.
+ *
+ * Returns: %TRUE if @id was set.
+ */
+static gboolean
+fuzzy_key_index_next (Fuzzy       *fuzzy,
+                      const gchar *key,
+                      guint       *slot,
+                      guint       *id)
+{
+   const gchar *str;
+   guint mask;
+
+   if (!fuzzy->key_index) {
+      fuzzy_key_index_build(fuzzy);
+   }
+
+   mask = fuzzy->key_index_size - 1;
+
+   if (*slot == G_MAXUINT) {
+      *slot = g_str_hash(key) & mask;
+   } else {
+      *slot = (*slot + 1) & mask;
+   }
+
+   for (; fuzzy->key_index[*slot]; *slot = (*slot + 1) & mask) {
+      *id = fuzzy->key_index[*slot] - 1;
+      str = fuzzy->heap + g_array_index(fuzzy->id_to_text_offset, gsize, *id);
+      if (!fuzzy_is_removed(fuzzy, *id) && (strcmp(str, key) == 0)) {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+
+/**
+ * fuzzy_begin_bulk_insert:
+ * @fuzzy: (in): A #Fuzzy.
+ *
+ * Start a bulk insertion. @fuzzy is not ready for searching until
+ * fuzzy_end_bulk_insert() has been called.
+ *
+ * This allows for inserting large numbers of strings and deferring
+ * packing the tables until fuzzy_end_bulk_insert(), rather than until
+ * the next lookup.
+ */
+void
+fuzzy_begin_bulk_insert (Fuzzy *fuzzy)
+{
+   g_return_if_fail(fuzzy);
+   g_return_if_fail(!fuzzy->in_bulk_insert);
+
+   fuzzy_thaw(fuzzy);
+   fuzzy->in_bulk_insert = TRUE;
+}
+
+
+/**
+ * fuzzy_end_bulk_insert:
+ * @fuzzy: (in): A #Fuzzy.
+ *
+ * Complete a bulk insert, then pack the index.
+ */
+void
+fuzzy_end_bulk_insert (Fuzzy *fuzzy)
+{
+   g_return_if_fail(fuzzy);
+   g_return_if_fail(fuzzy->in_bulk_insert);
+
+   fuzzy->in_bulk_insert = FALSE;
+   fuzzy->generation++;
+
+   fuzzy_flush(fuzzy);
+}
+
+
+/**
+ * fuzzy_insert:
+ * @fuzzy: (in): A #Fuzzy.
+ * @key: (in): A UTF-8 encoded string.
+ * @value: (in): A value to associate with key.
+ *
+ * Inserts a string into the fuzzy matcher.
+ *
+ * Note that @key MUST be valid UTF-8.
+ */
+void
+fuzzy_insert (Fuzzy       *fuzzy,
+              const gchar *key,
+              gpointer     value)
+{
+   const gchar *iter;
+   gunichar ch;
+   guint64 signature = 0;
+   gsize offset;
+   guint id;
+   guint i;
+
+   g_return_if_fail(fuzzy);
+   g_return_if_fail(key);
+
+   fuzzy_thaw(fuzzy);
+
+   g_return_if_fail(fuzzy->id_to_text_offset->len < (G_MAXUINT32 - 1));
+
+   if (!*key) {
+      return;
+   }
+
+   /*
+    * Insert the string into our heap.
+    * Track the offset within the heap since the heap could realloc.
+    */
+   offset = fuzzy_heap_insert(fuzzy, key);
+   g_array_append_val(fuzzy->id_to_text_offset, offset);
+   g_ptr_array_add(fuzzy->id_to_value, value);
+   g_assert_cmpint(fuzzy->id_to_value->len, ==, fuzzy->id_to_text_offset->len);
+
+   id = fuzzy->id_to_text_offset->len - 1;
+   fuzzy->generation++;
+
+   if (id > FUZZY_ITEM_MAX_ID) {
+      fuzzy_widen(fuzzy);
+   }
+
+   /*
+    * Positions are stored as code point offsets rather than byte offsets
+    * so that multi-byte characters do not skew the match score.
+    */
+   for (iter = key, i = 0; *iter; i++) {
+      if (G_UNLIKELY(i > FUZZY_ITEM_MAX_POS)) {
+         fuzzy_widen(fuzzy);
+      }
+
+      ch = fuzzy_next_char(fuzzy, &iter);
+      fuzzy_postings_append(fuzzy, fuzzy_get_table(fuzzy, ch, TRUE), id, i);
+      signature |= fuzzy_signature(ch);
+   }
+
+   g_array_append_val(fuzzy->id_to_signature, signature);
+   fuzzy_key_index_add(fuzzy, id);
+
+   /*
+    * Pack the new items now rather than on the next lookup, so that
+    * matching stays read-only. Flushing a table that was already flushed
+    * for an earlier character of @key does nothing.
+    */
+   if (!fuzzy->in_bulk_insert) {
+      for (iter = key; *iter;) {
+         ch = fuzzy_next_char(fuzzy, &iter);
+         fuzzy_postings_flush(fuzzy, fuzzy_get_table(fuzzy, ch, FALSE));
+      }
+   }
+}
+
+
+static void
+fuzzy_compact_table (GArray      *table,
+                     const guint *remap)
+{
+   FuzzyWideItem *wide_items;
+   FuzzyItem *items;
+   guint n = 0;
+   guint i;
+
+   if (g_array_get_element_size(table) == sizeof(FuzzyWideItem)) {
+      wide_items = (FuzzyWideItem *)(gpointer)table->data;
+      for (i = 0; i < table->len; i++) {
+         if (remap[wide_items[i].id] != G_MAXUINT) {
+            wide_items[n].id = remap[wide_items[i].id];
+            wide_items[n].pos = wide_items[i].pos;
+            n++;
+         }
+      }
+   } else {
+      items = (FuzzyItem *)(gpointer)table->data;
+      for (i = 0; i < table->len; i++) {
+         if (remap[items[i].id] != G_MAXUINT) {
+            items[n].id = remap[items[i].id];
+            items[n].pos = items[i].pos;
+            n++;
+         }
+      }
+   }
+
+   g_array_set_size(table, n);
+}
+
+
+/**
+ * fuzzy_compact_postings:
+ * @fuzzy: A #Fuzzy.
+ * @postings: A #FuzzyPostings.
+ * @remap: The new id for each id, or %G_MAXUINT if it was removed.
+ *
+ * Rewrites the items of @postings with the new ids and packs them again.
+ *
+ * Returns: %TRUE if any items remain.
+ */
+static gboolean
+fuzzy_compact_postings (Fuzzy         *fuzzy,
+                        FuzzyPostings *postings,
+                        const guint   *remap)
+{
+   GArray *items;
+   gboolean ret;
+
+   fuzzy_postings_flush(fuzzy, postings);
+
+   items = g_array_sized_new(FALSE, FALSE, fuzzy_get_item_size(fuzzy),
+                             postings->n_items);
+   fuzzy_postings_decode(fuzzy, postings, 0, items);
+   fuzzy_compact_table(items, remap);
+   ret = (items->len > 0);
+
+   fuzzy_postings_pack(postings, 0, items->data, items->len, fuzzy->wide);
+   g_array_unref(items);
+
+   return ret;
+}
+
+
+/**
+ * fuzzy_compact:
+ * @fuzzy: A #Fuzzy.
+ *
+ * Reclaims the space used by keys that have been removed from @fuzzy.
+ * The remaining keys are given new ids in the same relative order, so the
+ * character tables can be filtered without sorting them again.
+ *
+ * This takes time proportional to the size of the whole index, so it is
+ * never done implicitly. The owner of @fuzzy should call it once
+ * fuzzy_needs_compact() returns %TRUE, from whichever thread and under
+ * whichever lock it uses for fuzzy_remove(). Like any other modification,
+ * it must not run concurrently with matching.
+ */
+void
+fuzzy_compact (Fuzzy *fuzzy)
+{
+   GDestroyNotify free_func;
+   GHashTableIter iter;
+   gpointer value;
+   guint *remap;
+   gsize offset = 0;
+   gsize len;
+   guint n = 0;
+   guint i;
+
+   g_return_if_fail(fuzzy);
+
+   fuzzy_thaw(fuzzy);
+
+   if (!fuzzy->n_removed) {
+      return;
+   }
+
+   remap = g_new(guint, fuzzy->id_to_text_offset->len);
+
+   /*
+    * Slide the live strings down over the removed ones. Strings are packed
+    * in id order, so every string moves towards the front of the heap.
+    */
+   for (i = 0; i < fuzzy->id_to_text_offset->len; i++) {
+      if (fuzzy_is_removed(fuzzy, i)) {
+         remap[i] = G_MAXUINT;
+         continue;
+      }
+
+      len = fuzzy_get_length(fuzzy, i) + 1;
+      memmove(fuzzy->heap + offset,
+              fuzzy->heap + g_array_index(fuzzy->id_to_text_offset, gsize, i),
+              len);
+
+      g_array_index(fuzzy->id_to_text_offset, gsize, n) = offset;
+      g_array_index(fuzzy->id_to_signature, guint64, n) =
+         g_array_index(fuzzy->id_to_signature, guint64, i);
+      g_ptr_array_index(fuzzy->id_to_value, n) =
+         g_ptr_array_index(fuzzy->id_to_value, i);
+
+      remap[i] = n++;
+      offset += len;
+   }
+
+   fuzzy->heap_offset = offset;
+   g_array_set_size(fuzzy->id_to_text_offset, n);
+   g_array_set_size(fuzzy->id_to_signature, n);
+
+   /*
+    * The values past @n have been moved or already released, so they
+    * must not be freed when the array is truncated.
+    */
+   free_func = fuzzy->free_func;
+   g_ptr_array_set_free_func(fuzzy->id_to_value, NULL);
+   g_ptr_array_set_size(fuzzy->id_to_value, n);
+   g_ptr_array_set_free_func(fuzzy->id_to_value, free_func);
+
+   for (i = 0; i < fuzzy->char_tables->len; i++) {
+      fuzzy_compact_postings(fuzzy, g_ptr_array_index(fuzzy->char_tables, i), remap);
+   }
+
+   g_hash_table_iter_init(&iter, fuzzy->unichar_tables);
+   while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      if (!fuzzy_compact_postings(fuzzy, value, remap)) {
+         g_hash_table_iter_remove(&iter);
+      }
+   }
+
+   g_clear_pointer(&fuzzy->key_index, g_free);
+   fuzzy->key_index_size = 0;
+   fuzzy->key_index_used = 0;
+
+   fuzzy->n_removed = 0;
+   fuzzy->generation++;
+
+   g_free(remap);
+}
+
+
+/**
+ * fuzzy_needs_compact:
+ * @fuzzy: A #Fuzzy.
+ *
+ * Checks whether enough keys have been removed from @fuzzy for
+ * fuzzy_compact() to be worth its cost. Compacting only then keeps the
+ * cost of removing a key constant when amortized over many removals.
+ *
+ * Returns: %TRUE if at least 1 in 4 of the ids in @fuzzy are removed.
+ */
+gboolean
+fuzzy_needs_compact (Fuzzy *fuzzy)
+{
+   g_return_val_if_fail(fuzzy, FALSE);
+
+   return (fuzzy->n_removed &&
+           ((fuzzy->n_removed * FUZZY_COMPACT_RATIO) >=
+            fuzzy_get_n_ids(fuzzy)));
+}
+
+
+/**
+ * fuzzy_remove:
+ * @fuzzy: A #Fuzzy.
+ * @key: The key to remove.
+ *
+ * Removes every entry whose key is exactly @key from @fuzzy, releasing
+ * their values with the free func of @fuzzy. This only marks the entries
+ * as removed, which is cheap. The space they use is reclaimed by
+ * fuzzy_compact() when the owner of @fuzzy calls it.
+ *
+ * Returns: %TRUE if @key was found.
+ */
+gboolean
+fuzzy_remove (Fuzzy       *fuzzy,
+              const gchar *key)
+{
+   gpointer value;
+   guint slot = G_MAXUINT;
+   guint id;
+   gboolean ret = FALSE;
+
+   g_return_val_if_fail(fuzzy, FALSE);
+   g_return_val_if_fail(key, FALSE);
+
+   fuzzy_thaw(fuzzy);
+
+   while (fuzzy_key_index_next(fuzzy, key, &slot, &id)) {
+      g_array_index(fuzzy->id_to_signature, guint64, id) = 0;
+
+      value = g_ptr_array_index(fuzzy->id_to_value, id);
+      g_ptr_array_index(fuzzy->id_to_value, id) = NULL;
+      if (value && fuzzy->free_func) {
+         fuzzy->free_func(value);
+      }
+
+      fuzzy->n_removed++;
+      ret = TRUE;
+   }
+
+   if (ret) {
+      fuzzy->generation++;
+   }
+
+   return ret;
+}
+
+
+/**
+ * fuzzy_replace:
+ * @fuzzy: A #Fuzzy.
+ * @key: A UTF-8 encoded string.
+ * @value: The new value for @key.
+ *
+ * Replaces the value of the entry whose key is exactly @key, releasing the
+ * previous value with the free func of @fuzzy. If @key was inserted more
+ * than once, only the first entry is updated. If @key is not found, it is
+ * inserted as if by fuzzy_insert().
+ */
+void
+fuzzy_replace (Fuzzy       *fuzzy,
+               const gchar *key,
+               gpointer     value)
+{
+   gpointer old_value;
+   guint slot = G_MAXUINT;
+   guint id;
+
+   g_return_if_fail(fuzzy);
+   g_return_if_fail(key);
+
+   fuzzy_thaw(fuzzy);
+
+   if (fuzzy_key_index_next(fuzzy, key, &slot, &id)) {
+      old_value = g_ptr_array_index(fuzzy->id_to_value, id);
+      g_ptr_array_index(fuzzy->id_to_value, id) = value;
+      if (old_value && (old_value != value) && fuzzy->free_func) {
+         fuzzy->free_func(old_value);
+      }
+   } else {
+      fuzzy_insert(fuzzy, key, value);
+   }
+}
+
+
+/**
+ * fuzzy_foreach:
+ * @fuzzy: A #Fuzzy.
+ * @func: A #GHFunc to call with each key and value.
+ * @user_data: User data for @func.
+ *
+ * Calls @func for every key in @fuzzy that has not been removed, in the
+ * order they were inserted. This only reads @fuzzy, but @func must not
+ * modify it.
+ */
+void
+fuzzy_foreach (Fuzzy    *fuzzy,
+               GHFunc    func,
+               gpointer  user_data)
+{
+   guint n_ids;
+   guint i;
+
+   g_return_if_fail(fuzzy);
+   g_return_if_fail(!fuzzy->in_bulk_insert);
+   g_return_if_fail(func);
+
+   n_ids = fuzzy_get_n_ids(fuzzy);
+
+   for (i = 0; i < n_ids; i++) {
+      if (!fuzzy_is_removed(fuzzy, i)) {
+         func((gpointer)fuzzy_get_string(fuzzy, i),
+              fuzzy_get_value(fuzzy, i),
+              user_data);
+      }
+   }
+}
+
+
+/**
+ * fuzzy_unref:
+ * @fuzzy: A #Fuzzy.
+ *
+ * Decrements the reference count of fuzzy by one. When the reference count
+ * reaches zero, the structure will be freed.
+ */
+void
+fuzzy_unref (Fuzzy *fuzzy)
+{
+   g_return_if_fail (fuzzy);
+   g_return_if_fail (fuzzy->ref_count > 0);
+
+   if (g_atomic_int_dec_and_test (&fuzzy->ref_count)) {
+      if (fuzzy->mapping) {
+         g_clear_pointer(&fuzzy->mapping, fuzzy_mapping_free);
+      } else {
+         g_free(fuzzy->heap);
+      }
+      fuzzy->heap = 0;
+      fuzzy->heap_offset = 0;
+      fuzzy->heap_length = 0;
+
+      g_array_unref(fuzzy->id_to_text_offset);
+      fuzzy->id_to_text_offset = NULL;
+
+      g_array_unref(fuzzy->id_to_signature);
+      fuzzy->id_to_signature = NULL;
+
+      g_ptr_array_unref(fuzzy->id_to_value);
+      fuzzy->id_to_value = NULL;
+
+      g_ptr_array_unref(fuzzy->char_tables);
+      fuzzy->char_tables = NULL;
+
+      g_hash_table_unref(fuzzy->unichar_tables);
+      fuzzy->unichar_tables = NULL;
+
+      g_free(fuzzy->key_index);
+      fuzzy->key_index = NULL;
+
+      g_free(fuzzy);
+   }
+}
+
+
+void
+fuzzy_free (Fuzzy *fuzzy)
+{
+   if (fuzzy)
+      fuzzy_unref (fuzzy);
+}
+
+
+static void
+fuzzy_heap_init (FuzzyHeap *heap,
+                 gsize      max_matches)
+{
+   heap->max_matches = max_matches;
+   heap->matches = g_array_sized_new(FALSE, FALSE, sizeof(FuzzyMatch),
+                                     MIN(max_matches, 1024));
+}
+
+
+static inline gboolean
+fuzzy_heap_is_full (FuzzyHeap *heap)
+{
+   return (heap->max_matches && (heap->matches->len >= heap->max_matches));
+}
+
+
+/**
+ * fuzzy_heap_worst_score:
+ * @heap: A #FuzzyHeap.
+ *
+ * Gets the score a new match must beat to be added to @heap. This is only
+ * meaningful once the heap is full.
+ *
+ * Returns: The score of the worst match in @heap.
+ */
+static inline gfloat
+fuzzy_heap_worst_score (FuzzyHeap *heap)
+{
+   return g_array_index(heap->matches, FuzzyMatch, 0).score;
+}
+
+
+/**
+ * fuzzy_heap_push:
+ * @heap: A #FuzzyHeap.
+ * @match: The #FuzzyMatch to add.
+ *
+ * Adds @match to the heap. If the heap is full, the worst match is evicted
+ * if @match sorts before it. Otherwise @match is dropped.
+ */
+static void
+fuzzy_heap_push (FuzzyHeap        *heap,
+                 const FuzzyMatch *match)
+{
+   FuzzyMatch *items;
+   FuzzyMatch tmp;
+   guint child;
+   guint parent;
+   guint i;
+
+   if (!fuzzy_heap_is_full(heap)) {
+      /*
+       * Sift up from the end. Parents must sort after their children.
+       */
+      g_array_append_val(heap->matches, *match);
+      items = (FuzzyMatch *)(gpointer)heap->matches->data;
+
+      for (i = heap->matches->len - 1; i > 0; i = parent) {
+         parent = (i - 1) / 2;
+         if (fuzzy_match_compare(&items[parent], &items[i]) >= 0) {
+            break;
+         }
+         tmp = items[parent];
+         items[parent] = items[i];
+         items[i] = tmp;
+      }
+
+      return;
+   }
+
+   items = (FuzzyMatch *)(gpointer)heap->matches->data;
+
+   if (fuzzy_match_compare(match, &items[0]) >= 0) {
+      return;
+   }
+
+   /*
+    * Replace the root and sift down.
+    */
+   items[0] = *match;
+
+   for (i = 0; (child = (2 * i) + 1) < heap->matches->len; i = child) {
+      if (((child + 1) < heap->matches->len) &&
+          (fuzzy_match_compare(&items[child + 1], &items[child]) > 0)) {
+         child++;
+      }
+      if (fuzzy_match_compare(&items[i], &items[child]) >= 0) {
+         break;
+      }
+      tmp = items[child];
+      items[child] = items[i];
+      items[i] = tmp;
+   }
+}
+
+
+/**
+ * fuzzy_heap_finish:
+ * @heap: A #FuzzyHeap.
+ *
+ * Sorts the remaining matches, best first.
+ *
+ * Returns: (transfer full): The #GArray of #FuzzyMatch.
+ */
+static GArray *
+fuzzy_heap_finish (FuzzyHeap *heap)
+{
+   GArray *matches = heap->matches;
+
+   g_array_sort(matches, fuzzy_match_compare);
+   heap->matches = NULL;
+
+   return matches;
+}
+
+
+/**
+ * fuzzy_lookup_seek:
+ * @lookup: A #FuzzyLookup.
+ * @table_index: The needle character to seek.
+ * @id: The candidate id.
+ *
+ * Moves the cursor for @table_index forward past the items for @id and
+ * decodes their positions into the run for @table_index. Candidates are
+ * always visited in increasing id order, so the cursor never needs to
+ * move backwards. We gallop forward over the block directory so that
+ * sparse candidate sets only decode the block that may contain @id.
+ *
+ * Returns: %TRUE if @id contains the character.
+ */
+static gboolean
+fuzzy_lookup_seek (FuzzyLookup *lookup,
+                   guint        table_index,
+                   guint        id)
+{
+   const FuzzyTable *table;
+   const FuzzyBlock *blocks;
+   const FuzzyBlock *block;
+   const guint8 *data;
+   FuzzyCursor *cursor;
+   FuzzyRun *run;
+   gsize bit;
+   guint index;
+   guint bits;
+   guint prev;
+   guint next;
+   guint step;
+   guint lo;
+   guint hi;
+   guint mid;
+
+   table = &lookup->tables[table_index];
+   cursor = &lookup->state[table_index];
+   run = &lookup->runs[table_index];
+   blocks = table->blocks;
+
+   run->len = 0;
+
+   lo = cursor->block;
+
+   if (((lo + 1) < table->n_blocks) && (blocks[lo + 1].first_id <= id)) {
+      for (step = 1, hi = lo + 1;
+           (hi < table->n_blocks) && (blocks[hi].first_id <= id);
+           step <<= 1, hi = lo + step) {
+         lo = hi;
+      }
+      hi = MIN(hi, table->n_blocks);
+      while ((hi - lo) > 1) {
+         mid = (lo + hi) / 2;
+         if (blocks[mid].first_id <= id) {
+            lo = mid;
+         } else {
+            hi = mid;
+         }
+      }
+      cursor->block = lo;
+      cursor->index = 0;
+   }
+
+   if (!fuzzy_table_check_block(lookup->fuzzy, table, cursor->block)) {
+      return FALSE;
+   }
+
+   block = &blocks[cursor->block];
+   data = table->data + block->offset;
+   bits = block->id_bits + block->pos_bits;
+
+   index = cursor->index;
+   prev = index ? cursor->id : block->first_id;
+   bit = (gsize)index * bits;
+
+   for (; index < block->n_items; index++, bit += bits) {
+      next = prev + fuzzy_unpack(data, bit, block->id_bits);
+      if (next >= id) {
+         break;
+      }
+      prev = next;
+   }
+
+   for (; index < block->n_items; index++, bit += bits) {
+      next = prev + fuzzy_unpack(data, bit, block->id_bits);
+      if (next != id) {
+         break;
+      }
+      if (run->len == run->size) {
+         run->size = MAX(16, run->size * 2);
+         run->positions = g_renew(guint, run->positions, run->size);
+      }
+      run->positions[run->len++] = fuzzy_unpack(data, bit + block->id_bits,
+                                                block->pos_bits);
+      prev = next;
+   }
+
+   cursor->index = index;
+   cursor->id = prev;
+
+   return (run->len > 0);
+}
+
+
+/**
+ * fuzzy_lookup_load_bonus:
+ * @lookup: A #FuzzyLookup.
+ * @id: The candidate id.
+ * @n_chars: The number of positions needed.
+ *
+ * Fills the bonus scratch buffer of @lookup with the bonus for matching a
+ * needle character at each of the first @n_chars positions of the string
+ * for @id. Characters that start a path component earn
+ * %FUZZY_BONUS_SEPARATOR, while characters that start a word earn
+ * %FUZZY_BONUS_BOUNDARY. A word starts after a space, '_', '-' or '.', and
+ * at a lower to upper case transition.
+ *
+ * In a path aware lookup, the path component of each position is filled
+ * in too, along with the component of the file name. A '/' belongs to
+ * the component that it ends.
+ */
+static void
+fuzzy_lookup_load_bonus (FuzzyLookup *lookup,
+                         guint        id,
+                         guint        n_chars)
+{
+   const gchar *str;
+   gunichar prev = '/';
+   gunichar ch;
+   guint8 bonus;
+   guint component = 0;
+   guint pos;
+
+   str = fuzzy_get_string(lookup->fuzzy, id);
+
+   if (n_chars > lookup->n_bonus) {
+      lookup->n_bonus = MAX(64, n_chars);
+      lookup->bonus = g_renew(guint8, lookup->bonus, lookup->n_bonus);
+      if (lookup->joins) {
+         lookup->components = g_renew(guint, lookup->components, lookup->n_bonus);
+      }
+   }
+
+   for (pos = 0; (pos < n_chars) && *str; pos++, prev = ch) {
+      if (G_LIKELY(!(*str & 0x80))) {
+         ch = *str++;
+      } else {
+         ch = g_utf8_get_char(str);
+         str = g_utf8_next_char(str);
+      }
+
+      if (lookup->joins) {
+         lookup->components[pos] = component;
+         component += (ch == '/');
+      }
+
+      if (prev == '/') {
+         bonus = FUZZY_BONUS_SEPARATOR;
+      } else if ((prev == ' ') || (prev == '_') || (prev == '-') || (prev == '.')) {
+         bonus = FUZZY_BONUS_BOUNDARY;
+      } else if (G_LIKELY((prev < 0x80) && (ch < 0x80))) {
+         bonus = (g_ascii_islower(prev) && g_ascii_isupper(ch)) ? FUZZY_BONUS_BOUNDARY : 0;
+      } else {
+         bonus = (g_unichar_islower(prev) && g_unichar_isupper(ch)) ? FUZZY_BONUS_BOUNDARY : 0;
+      }
+
+      lookup->bonus[pos] = bonus;
+   }
+
+   /*
+    * Positions are always within the key, unless a damaged index file
+    * says otherwise. Even then, nothing read below should be undefined.
+    */
+   for (; pos < n_chars; pos++) {
+      lookup->bonus[pos] = 0;
+      if (lookup->joins) {
+         lookup->components[pos] = component;
+      }
+   }
+
+   /*
+    * '/' never appears within a multi-byte sequence, so the rest of the
+    * key can be scanned by byte.
+    */
+   if (lookup->joins) {
+      for (; (str = strchr(str, '/')); str++) {
+         component++;
+      }
+      lookup->last_component = component;
+   }
+}
+
+
+/**
+ * fuzzy_do_match:
+ * @lookup: A #FuzzyLookup.
+ * @id: The candidate id.
+ * @score: (out) (allow-none): A location for the cost of the best match.
+ *
+ * Matches the needle against the positions recorded for @id by
+ * fuzzy_lookup_seek().
+ *
+ * If @score is %NULL, we only need to know whether the needle matches at
+ * all. Taking the earliest occurrence of each needle character after the
+ * previous one answers that in a single pass over the runs.
+ *
+ * Otherwise, the best match is found with a dynamic program over the
+ * runs. The cost of placing needle character i at position p is the
+ * cheapest placement of character i - 1 at some position q < p, plus the
+ * gap p - q, minus the bonus for p. Walking both runs in position order
+ * lets us carry min(cost(q) - q) forward, so each layer costs a single
+ * pass over two runs. The total is bounded by O(needle × candidate length)
+ * and uses no recursion.
+ *
+ * In a path aware lookup, a character that must share its component with
+ * the previous one can only follow positions in that component. As
+ * components only grow with the position, the running minimum is simply
+ * restarted whenever a later component is reached. The earliest
+ * occurrences may break those rules, so the dynamic program is used even
+ * if @score is %NULL.
+ *
+ * Returns: %TRUE if @id matched.
+ */
+static gboolean
+fuzzy_do_match (FuzzyLookup *lookup,
+                guint        id,
+                gint        *score)
+{
+   const FuzzyRun *prev_run;
+   const FuzzyRun *run;
+   const guint *components;
+   gboolean joined;
+   gint *prev_cost;
+   gint *cost;
+   gint *tmp;
+   gint best;
+   gint last = -1;
+   gint unused;
+   guint best_component = 0;
+   guint pos;
+   guint max_run = 0;
+   guint max_pos = 0;
+   guint i;
+   guint j;
+   guint k;
+
+   if (!score && lookup->joins) {
+      score = &unused;
+   } else if (!score) {
+      for (i = 0; i < lookup->n_tables; i++) {
+         run = &lookup->runs[i];
+         for (k = 0; (k < run->len) && ((gint)run->positions[k] <= last); k++) { }
+         if (k == run->len) {
+            return FALSE;
+         }
+         last = run->positions[k];
+      }
+      return TRUE;
+   }
+
+   for (i = 0; i < lookup->n_tables; i++) {
+      run = &lookup->runs[i];
+      max_run = MAX(max_run, run->len);
+      max_pos = MAX(max_pos, run->positions[run->len - 1]);
+   }
+
+   if ((2 * max_run) > lookup->n_costs) {
+      lookup->n_costs = MAX(64, 2 * max_run);
+      lookup->costs = g_renew(gint, lookup->costs, lookup->n_costs);
+   }
+
+   fuzzy_lookup_load_bonus(lookup, id, max_pos + 1);
+
+   components = lookup->components;
+   prev_cost = lookup->costs;
+   cost = lookup->costs + max_run;
+
+   run = &lookup->runs[0];
+
+   for (k = 0; k < run->len; k++) {
+      prev_cost[k] = -(gint)lookup->bonus[run->positions[k]];
+   }
+
+   for (i = 1; i < lookup->n_tables; i++) {
+      prev_run = run;
+      run = &lookup->runs[i];
+      joined = (lookup->joins && lookup->joins[i]);
+      best = G_MAXINT;
+      best_component = 0;
+
+      for (j = 0, k = 0; k < run->len; k++) {
+         pos = run->positions[k];
+         for (; (j < prev_run->len) && (prev_run->positions[j] < pos); j++) {
+            if (prev_cost[j] == G_MAXINT) {
+               continue;
+            }
+            if (joined && (components[prev_run->positions[j]] != best_component)) {
+               best_component = components[prev_run->positions[j]];
+               best = prev_cost[j] - (gint)prev_run->positions[j];
+            } else {
+               best = MIN(best, prev_cost[j] - (gint)prev_run->positions[j]);
+            }
+         }
+         if ((best == G_MAXINT) ||
+             (joined && (components[pos] != best_component))) {
+            cost[k] = G_MAXINT;
+         } else {
+            cost[k] = best + pos - lookup->bonus[pos];
+         }
+      }
+
+      /*
+       * Nothing in this layer could follow the previous character.
+       */
+      if (best == G_MAXINT) {
+         return FALSE;
+      }
+
+      tmp = prev_cost;
+      prev_cost = cost;
+      cost = tmp;
+   }
+
+   best = G_MAXINT;
+   for (k = 0; k < run->len; k++) {
+      if (!lookup->anchored ||
+          (components[run->positions[k]] == lookup->last_component)) {
+         best = MIN(best, prev_cost[k]);
+      }
+   }
+
+   if (best == G_MAXINT) {
+      return FALSE;
+   }
+
+   /*
+    * Shift the cost so that it can never drop below the length of the
+    * needle. See fuzzy_lookup_run() for why that matters.
+    */
+   *score = best + (FUZZY_BONUS_MAX * lookup->n_tables) + 1;
+
+   return TRUE;
+}
+
+
+/**
+ * fuzzy_match_id:
+ * @lookup: A #FuzzyLookup.
+ * @id: The candidate id.
+ * @score: (out) (allow-none): A location for the score of the best match.
+ *
+ * Checks to see if the candidate @id matches the needle. The score is the
+ * span of characters containing the needle less any word boundary bonuses,
+ * where lower is better. If @score is %NULL, we stop at the first match.
+ *
+ * Returns: %TRUE if @id matched.
+ */
+static gboolean
+fuzzy_match_id (FuzzyLookup *lookup,
+                guint        id,
+                gint        *score)
+{
+   guint i;
+
+   for (i = 0; i < lookup->n_tables; i++) {
+      if (!fuzzy_lookup_seek(lookup, i, id)) {
+         return FALSE;
+      }
+   }
+
+   return fuzzy_do_match(lookup, id, score);
+}
+
+
+/**
+ * fuzzy_lookup_init:
+ * @lookup: A #FuzzyLookup.
+ * @fuzzy: A #Fuzzy.
+ * @needle: The needle to match.
+ *
+ * Prepares @lookup for matching @needle against @fuzzy.
+ *
+ * Returns: %FALSE if @needle cannot possibly match anything in @fuzzy.
+ */
+static gboolean
+fuzzy_lookup_init (FuzzyLookup *lookup,
+                   Fuzzy       *fuzzy,
+                   const gchar *needle)
+{
+   const gchar *iter;
+   gunichar prev = 0;
+   gunichar ch;
+   guint i;
+
+   memset(lookup, 0, sizeof *lookup);
+
+   lookup->fuzzy = fuzzy;
+   lookup->n_tables = g_utf8_strlen(needle, -1);
+
+   if (!lookup->n_tables) {
+      return FALSE;
+   }
+
+   lookup->tables = g_new0(FuzzyTable, lookup->n_tables);
+
+   if (fuzzy->path_aware) {
+      lookup->joins = g_new0(guint8, lookup->n_tables);
+   }
+
+   /*
+    * If any character of the needle has never been inserted, there
+    * is nothing that can possibly match.
+    */
+   for (iter = needle, i = 0; *iter; i++, prev = ch) {
+      ch = fuzzy_next_char(fuzzy, &iter);
+      lookup->signature |= fuzzy_signature(ch);
+      if (lookup->joins) {
+         lookup->joins[i] = (i && (ch != '/') && (prev != '/'));
+         lookup->anchored = (ch != '/');
+      }
+      if (!fuzzy_get_items(fuzzy, ch, &lookup->tables[i])) {
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+
+static void
+fuzzy_lookup_clear (FuzzyLookup *lookup)
+{
+   g_free(lookup->tables);
+   g_free(lookup->bonus);
+   g_free(lookup->joins);
+   g_free(lookup->components);
+   g_free(lookup->costs);
+}
+
+
+/**
+ * fuzzy_prefilter:
+ * @signatures: The signature for each id in the index.
+ * @signature: The signature of the needle.
+ * @ids: (inout): An array of candidate ids.
+ * @n_ids: The number of ids in @ids.
+ *
+ * Compacts @ids in place, keeping only the ids whose signature contains
+ * every character class found in the needle. The loop has no branches so
+ * that the compiler is free to vectorize the signature comparisons.
+ *
+ * Returns: The number of ids remaining in @ids.
+ */
+static guint
+fuzzy_prefilter (const guint64 *signatures,
+                 guint64        signature,
+                 guint         *ids,
+                 guint          n_ids)
+{
+   guint n = 0;
+   guint i;
+
+   for (i = 0; i < n_ids; i++) {
+      ids[n] = ids[i];
+      n += ((signatures[ids[i]] & signature) == signature);
+   }
+
+   return n;
+}
+
+
+/**
+ * fuzzy_table_read_ids:
+ * @fuzzy: A #Fuzzy.
+ * @table: A #FuzzyTable.
+ * @cursor: A #FuzzyCursor within @table.
+ * @end: The block to stop at.
+ * @ids: (out): A location for the ids.
+ * @n_ids: The number of ids that fit in @ids.
+ *
+ * Reads the next distinct ids of @table into @ids, advancing @cursor and
+ * stopping at block @end.
+ *
+ * Returns: The number of ids read.
+ */
+static guint
+fuzzy_table_read_ids (Fuzzy            *fuzzy,
+                      const FuzzyTable *table,
+                      FuzzyCursor      *cursor,
+                      guint             end,
+                      guint            *ids,
+                      guint             n_ids)
+{
+   const FuzzyBlock *block;
+   const guint8 *data;
+   guint index;
+   guint bits;
+   guint delta;
+   guint id;
+   guint n = 0;
+
+   for (; (cursor->block < end) && (n < n_ids); cursor->block++, cursor->index = 0) {
+      block = &table->blocks[cursor->block];
+      data = table->data + block->offset;
+      bits = block->id_bits + block->pos_bits;
+      index = cursor->index;
+      id = cursor->id;
+
+      if (!index && !fuzzy_table_check_block(fuzzy, table, cursor->block)) {
+         continue;
+      }
+
+      if (!index) {
+         ids[n++] = id = block->first_id;
+         index = 1;
+      }
+
+      for (; (index < block->n_items) && (n < n_ids); index++) {
+         delta = fuzzy_unpack(data, (gsize)index * bits, block->id_bits);
+         if (delta) {
+            ids[n++] = id += delta;
+         }
+      }
+
+      cursor->index = index;
+      cursor->id = id;
+
+      if (index < block->n_items) {
+         break;
+      }
+   }
+
+   return n;
+}
+
+
+/**
+ * fuzzy_lookup_should_stop:
+ * @lookup: A #FuzzyLookup.
+ *
+ * Checks whether the lookup has been cancelled or has run past its
+ * deadline. Both checks are cheap enough to make once per batch.
+ *
+ * Returns: %TRUE if the lookup should stop early.
+ */
+static inline gboolean
+fuzzy_lookup_should_stop (FuzzyLookup *lookup)
+{
+   if (lookup->cancellable && g_cancellable_is_cancelled(lookup->cancellable)) {
+      return TRUE;
+   }
+
+   return (lookup->deadline && (g_get_monotonic_time() >= lookup->deadline));
+}
+
+
+/**
+ * fuzzy_lookup_run:
+ * @lookup: A #FuzzyLookup.
+ * @candidates: (allow-none): Sorted candidate ids, or %NULL.
+ * @begin: The first candidate to check.
+ * @end: The candidate to stop at.
+ * @heap: A #FuzzyHeap to add matches to.
+ * @survivors: (allow-none): A #GArray to append matching ids to.
+ *
+ * Matches each candidate in [@begin, @end) against the needle. If
+ * @candidates is %NULL, the range refers to blocks of the table for the
+ * first character of the needle, and each distinct id is a candidate.
+ *
+ * Candidates are gathered in batches and run through fuzzy_prefilter()
+ * so that ids missing any character of the needle are rejected without
+ * walking the character tables.
+ *
+ * The cost from fuzzy_match_id() is shifted so that it can never be less
+ * than the length of the needle, so once @heap is full we can skip
+ * candidates whose best possible score cannot displace the worst match in
+ * the heap. When @survivors is requested, such candidates are
+ * still checked, but only for whether they match at all.
+ *
+ * If the lookup is cancelled or its deadline passes, the remaining
+ * candidates are skipped and the lookup is marked as truncated.
+ */
+static void
+fuzzy_lookup_run (FuzzyLookup *lookup,
+                  const guint *candidates,
+                  guint        begin,
+                  guint        end,
+                  FuzzyHeap   *heap,
+                  GArray      *survivors)
+{
+   const guint64 *signatures;
+   const FuzzyTable *root;
+   FuzzyCursor cursor = { 0 };
+   FuzzyMatch match;
+   gboolean pruned;
+   gfloat bound;
+   guint batch[FUZZY_PREFILTER_BATCH];
+   guint n_batch;
+   gsize len;
+   guint id;
+   guint i;
+   guint j;
+   gint score;
+
+   root = &lookup->tables[0];
+   signatures = fuzzy_get_signatures(lookup->fuzzy);
+   cursor.block = begin;
+
+   for (i = begin;;) {
+      n_batch = 0;
+
+      if (fuzzy_lookup_should_stop(lookup)) {
+         lookup->truncated = TRUE;
+         break;
+      }
+
+      if (candidates) {
+         for (; (i < end) && (n_batch < G_N_ELEMENTS(batch)); i++) {
+            batch[n_batch++] = candidates[i];
+         }
+      } else {
+         n_batch = fuzzy_table_read_ids(lookup->fuzzy, root, &cursor, end,
+                                        batch, G_N_ELEMENTS(batch));
+      }
+
+      if (!n_batch) {
+         break;
+      }
+
+#ifdef FUZZY_ENABLE_STATS
+      lookup->stats.n_candidates += n_batch;
+#endif
+
+      n_batch = fuzzy_prefilter(signatures, lookup->signature, batch, n_batch);
+
+#ifdef FUZZY_ENABLE_STATS
+      lookup->stats.n_prefiltered += n_batch;
+#endif
+
+      for (j = 0; j < n_batch; j++) {
+         id = batch[j];
+         len = fuzzy_get_length(lookup->fuzzy, id);
+
+         /*
+          * The bound is rounded to a float just like the score would be,
+          * so that a key which can only tie with the worst match is still
+          * scored and left to fuzzy_heap_push() to order by key.
+          */
+         bound = 1.0 / (len + lookup->n_tables);
+         pruned = (fuzzy_heap_is_full(heap) &&
+                   (bound < fuzzy_heap_worst_score(heap)));
+
+         if (pruned) {
+            if (survivors && fuzzy_match_id(lookup, id, NULL)) {
+               g_array_append_val(survivors, id);
+            }
+            continue;
+         }
+
+#ifdef FUZZY_ENABLE_STATS
+         lookup->stats.n_scored++;
+#endif
+
+         if (fuzzy_match_id(lookup, id, &score)) {
+            match.key = fuzzy_get_string(lookup->fuzzy, id);
+            match.score = 1.0 / (len + score);
+            match.value = fuzzy_get_value(lookup->fuzzy, id);
+            fuzzy_heap_push(heap, &match);
+
+            if (survivors) {
+               g_array_append_val(survivors, id);
+            }
+         }
+      }
+   }
+}
+
+
+static void
+fuzzy_shard_run (FuzzyShard *shard)
+{
+   fuzzy_lookup_run(&shard->lookup,
+                    shard->candidates,
+                    shard->begin,
+                    shard->end,
+                    &shard->heap,
+                    shard->survivors);
+}
+
+
+static void
+fuzzy_shard_worker (gpointer data,
+                    gpointer user_data)
+{
+   FuzzyShard *shard = data;
+   FuzzyShardGroup *group = shard->group;
+
+   fuzzy_shard_run(shard);
+
+   g_mutex_lock(&group->mutex);
+   if (!--group->pending) {
+      g_cond_signal(&group->cond);
+   }
+   g_mutex_unlock(&group->mutex);
+}
+
+
+static GThreadPool *
+fuzzy_get_thread_pool (void)
+{
+   static gsize initialized;
+   static GThreadPool *pool;
+
+   if (g_once_init_enter(&initialized)) {
+      pool = g_thread_pool_new(fuzzy_shard_worker,
+                               NULL,
+                               MIN(FUZZY_N_THREADS, FUZZY_MAX_SHARDS),
+                               FALSE,
+                               NULL);
+      g_once_init_leave(&initialized, TRUE);
+   }
+
+   return pool;
+}
+
+
+/**
+ * fuzzy_lookup_execute:
+ * @lookup: A #FuzzyLookup.
+ * @candidates: (allow-none): Sorted candidate ids, or %NULL.
+ * @n_candidates: The number of ids in @candidates.
+ * @max_matches: The max number of matches to return.
+ * @survivors: (allow-none): A #GArray to append matching ids to.
+ *
+ * Splits the candidates into shards and matches them in parallel on a
+ * shared thread pool. The calling thread processes the first shard itself.
+ * Each shard fills its own heap, and the heaps are merged once all of the
+ * shards have completed. Survivors are appended in shard order, so they
+ * remain sorted by id. If any shard stopped early, @lookup is marked as
+ * truncated.
+ *
+ * Returns: (transfer full): A #GArray of #FuzzyMatch.
+ */
+static GArray *
+fuzzy_lookup_execute (FuzzyLookup *lookup,
+                      const guint *candidates,
+                      guint        n_candidates,
+                      gsize        max_matches,
+                      GArray      *survivors)
+{
+   const FuzzyTable *root;
+   FuzzyShardGroup group;
+   FuzzyShard *shards;
+   FuzzyShard *shard;
+   GThreadPool *pool = NULL;
+   FuzzyHeap heap;
+   GArray *matches;
+   guint n_shards;
+   guint n_units;
+   guint begin;
+   guint i;
+   guint j;
+
+   root = &lookup->tables[0];
+
+   /*
+    * Without candidates, shards are split by block of the first table.
+    * The items for an id never straddle blocks, so neither do shards.
+    */
+   if (candidates) {
+      n_units = n_candidates;
+   } else {
+      n_candidates = root->n_items;
+      n_units = root->n_blocks;
+   }
+
+   n_shards = n_candidates / FUZZY_SHARD_MIN_CANDIDATES;
+   n_shards = CLAMP(n_shards, 1, MIN(FUZZY_N_THREADS, FUZZY_MAX_SHARDS));
+
+   if (n_shards > 1) {
+      pool = fuzzy_get_thread_pool();
+   }
+
+   if (!pool) {
+      n_shards = 1;
+   }
+
+   shards = g_new0(FuzzyShard, n_shards);
+
+   for (i = 0, begin = 0; i < n_shards; i++) {
+      shard = &shards[i];
+      shard->lookup = *lookup;
+      shard->lookup.state = g_new0(FuzzyCursor, lookup->n_tables);
+      shard->lookup.runs = g_new0(FuzzyRun, lookup->n_tables);
+      shard->candidates = candidates;
+      shard->begin = begin;
+      shard->end = ((guint64)n_units * (i + 1)) / n_shards;
+      shard->survivors = survivors ? g_array_new(FALSE, FALSE, sizeof(guint)) : NULL;
+      shard->group = &group;
+      fuzzy_heap_init(&shard->heap, max_matches);
+
+      begin = shard->end;
+   }
+
+   if (n_shards > 1) {
+      g_mutex_init(&group.mutex);
+      g_cond_init(&group.cond);
+      group.pending = n_shards - 1;
+
+      for (i = 1; i < n_shards; i++) {
+         g_thread_pool_push(pool, &shards[i], NULL);
+      }
+
+      fuzzy_shard_run(&shards[0]);
+
+      g_mutex_lock(&group.mutex);
+      while (group.pending) {
+         g_cond_wait(&group.cond, &group.mutex);
+      }
+      g_mutex_unlock(&group.mutex);
+
+      g_mutex_clear(&group.mutex);
+      g_cond_clear(&group.cond);
+   } else {
+      fuzzy_shard_run(&shards[0]);
+   }
+
+   if (n_shards == 1) {
+      matches = fuzzy_heap_finish(&shards[0].heap);
+   } else {
+      fuzzy_heap_init(&heap, max_matches);
+      for (i = 0; i < n_shards; i++) {
+         for (j = 0; j < shards[i].heap.matches->len; j++) {
+            fuzzy_heap_push(&heap,
+                            &g_array_index(shards[i].heap.matches, FuzzyMatch, j));
+         }
+         g_array_unref(shards[i].heap.matches);
+      }
+      matches = fuzzy_heap_finish(&heap);
+   }
+
+   for (i = 0; i < n_shards; i++) {
+      shard = &shards[i];
+      lookup->truncated |= shard->lookup.truncated;
+#ifdef FUZZY_ENABLE_STATS
+      lookup->fuzzy->stats.n_candidates += shard->lookup.stats.n_candidates;
+      lookup->fuzzy->stats.n_prefiltered += shard->lookup.stats.n_prefiltered;
+      lookup->fuzzy->stats.n_scored += shard->lookup.stats.n_scored;
+#endif
+      if (survivors) {
+         g_array_append_vals(survivors,
+                             shard->survivors->data,
+                             shard->survivors->len);
+         g_array_unref(shard->survivors);
+      }
+      g_free(shard->lookup.state);
+      for (j = 0; j < lookup->n_tables; j++) {
+         g_free(shard->lookup.runs[j].positions);
+      }
+      g_free(shard->lookup.runs);
+      g_free(shard->lookup.bonus);
+      g_free(shard->lookup.components);
+      g_free(shard->lookup.costs);
+   }
+
+   g_free(shards);
+
+   return matches;
+}
+
+
+/**
+ * fuzzy_match:
+ * @fuzzy: (in): A #Fuzzy.
+ * @needle: (in): The needle to fuzzy search for.
+ * @max_matches: (in): The max number of matches to return.
+ *
+ * Fuzzy searches within @fuzzy for strings that fuzzy match @needle.
+ * Only up to @max_matches will be returned.
+ *
+ * Large indexes are split into shards by id range which are matched in
+ * parallel on a shared thread pool. This function still blocks until
+ * all of the shards have completed.
+ *
+ * @needle MUST be a valid UTF-8 string.
+ *
+ * Returns: (transfer full) (element-type FuzzyMatch): A newly allocated
+ *   #GArray containing #FuzzyMatch elements. This should be freed when
+ *   the caller is done with it using g_array_unref().
+ *   It is a programming error to keep the structure around longer than
+ *   the @fuzzy instance.
+ */
+GArray *
+fuzzy_match (Fuzzy       *fuzzy,
+             const gchar *needle,
+             gsize        max_matches)
+{
+   return fuzzy_match_full(fuzzy, needle, max_matches, NULL, 0, NULL);
+}
+
+
+/**
+ * fuzzy_match_full:
+ * @fuzzy: (in): A #Fuzzy.
+ * @needle: (in): The needle to fuzzy search for.
+ * @max_matches: (in): The max number of matches to return.
+ * @cancellable: (allow-none): A #GCancellable, or %NULL.
+ * @deadline: The monotonic time to stop at, or 0 for no deadline.
+ * @truncated: (out) (allow-none): A location for whether the search
+ *   stopped early.
+ *
+ * Like fuzzy_match(), but stops early if @cancellable is cancelled or
+ * g_get_monotonic_time() reaches @deadline. The best matches found up to
+ * that point are returned and @truncated is set to %TRUE. Cancellation
+ * may come from another thread, and is noticed within a few hundred
+ * candidates.
+ *
+ * Returns: (transfer full) (element-type FuzzyMatch): A newly allocated
+ *   #GArray containing #FuzzyMatch elements.
+ */
+GArray *
+fuzzy_match_full (Fuzzy        *fuzzy,
+                  const gchar  *needle,
+                  gsize         max_matches,
+                  GCancellable *cancellable,
+                  gint64        deadline,
+                  gboolean     *truncated)
+{
+   FuzzyLookup lookup;
+   GArray *matches;
+
+   g_return_val_if_fail(fuzzy, NULL);
+   g_return_val_if_fail(!fuzzy->in_bulk_insert, NULL);
+   g_return_val_if_fail(needle, NULL);
+
+   if (fuzzy_lookup_init(&lookup, fuzzy, needle)) {
+      lookup.cancellable = cancellable;
+      lookup.deadline = deadline;
+      matches = fuzzy_lookup_execute(&lookup, NULL, 0, max_matches, NULL);
+   } else {
+      matches = g_array_new(FALSE, FALSE, sizeof(FuzzyMatch));
+   }
+
+   if (truncated) {
+      *truncated = lookup.truncated;
+   }
+
+   fuzzy_lookup_clear(&lookup);
+
+   return matches;
+}
+
+
+/**
+ * fuzzy_query_new:
+ * @fuzzy: A #Fuzzy.
+ *
+ * Creates a new #FuzzyQuery that can be used to perform type-ahead
+ * searches against @fuzzy.
+ *
+ * A #FuzzyQuery remembers the ids that matched previous needles. When the
+ * needle grows by a character, only the ids that matched the shorter needle
+ * need to be checked again. When the needle shrinks, the results for the
+ * longest cached needle that is still a prefix are used as the starting
+ * point instead of the whole index.
+ *
+ * Returns: (transfer full): A #FuzzyQuery to be freed with
+ *   fuzzy_query_free().
+ */
+FuzzyQuery *
+fuzzy_query_new (Fuzzy *fuzzy)
+{
+   FuzzyQuery *query;
+
+   g_return_val_if_fail(fuzzy, NULL);
+
+   query = g_new0(FuzzyQuery, 1);
+   query->fuzzy = fuzzy_ref(fuzzy);
+   query->generation = fuzzy->generation;
+   query->levels = g_ptr_array_new_with_free_func(fuzzy_query_level_free);
+
+   return query;
 }
 
 
-static gsize
-fuzzy_heap_insert (Fuzzy       *fuzzy,
-                   const gchar *text)
+/**
+ * fuzzy_can_narrow:
+ * @fuzzy: A #Fuzzy.
+ * @prefix: A needle that was searched for before.
+ * @needle: The needle to search for.
+ *
+ * Checks whether everything in @fuzzy matching @needle also matched
+ * @prefix. That holds whenever @prefix is a prefix of @needle, except in a
+ * path aware index, where adding a '/' moves the last segment of @prefix
+ * out of the file name.
+ *
+ * Callers that cache the matches for @prefix can use this to decide
+ * whether @needle may be answered by matching only those again.
+ *
+ * Returns: %TRUE if the matches for @prefix include those for @needle.
+ */
+gboolean
+fuzzy_can_narrow (Fuzzy       *fuzzy,
+                  const gchar *prefix,
+                  const gchar *needle)
 {
-   gsize offset;
-   gsize req_bytes;
    gsize len;
 
-   g_assert(fuzzy);
-   g_assert(text);
+   g_return_val_if_fail(fuzzy, FALSE);
+   g_return_val_if_fail(prefix, FALSE);
+   g_return_val_if_fail(needle, FALSE);
 
-   len = strlen(text) + 1;
-   req_bytes = fuzzy->heap_offset + len;
+   if (!g_str_has_prefix(needle, prefix)) {
+      return FALSE;
+   }
 
-   if (req_bytes > fuzzy->heap_length) {
-      fuzzy->heap_length = (((req_bytes / FUZZY_GROW_HEAP_BY) + 1) *
-                            FUZZY_GROW_HEAP_BY);
-      fuzzy->heap = g_realloc(fuzzy->heap, fuzzy->heap_length);
+   if (!fuzzy->path_aware) {
+      return TRUE;
    }
 
-   offset = fuzzy->heap_offset;
-   memcpy(fuzzy->heap + offset, text, len);
-   fuzzy->heap_offset += len;
+   len = strlen(prefix);
 
-   return offset;
+   return ((len && (prefix[len - 1] == '/')) || !strchr(needle + len, '/'));
 }
 
 
 /**
- * fuzzy_begin_bulk_insert:
- * @fuzzy: (in): A #Fuzzy.
+ * fuzzy_query_can_narrow:
+ * @query: A #FuzzyQuery.
+ * @prefix: A needle that was searched for before.
+ * @needle: The needle to search for.
  *
- * Start a bulk insertion. @fuzzy is not ready for searching until
- * fuzzy_end_bulk_insert() has been called.
+ * Like fuzzy_can_narrow(), for the index that @query searches.
  *
- * This allows for inserting large numbers of strings and deferring
- * the final sort until fuzzy_end_bulk_insert().
+ * Returns: %TRUE if the survivors of @prefix can be used for @needle.
  */
-void
-fuzzy_begin_bulk_insert (Fuzzy *fuzzy)
+gboolean
+fuzzy_query_can_narrow (FuzzyQuery  *query,
+                        const gchar *prefix,
+                        const gchar *needle)
 {
-   g_return_if_fail(fuzzy);
-   g_return_if_fail(!fuzzy->in_bulk_insert);
+   g_return_val_if_fail(query, FALSE);
 
-   fuzzy->in_bulk_insert = TRUE;
+   return fuzzy_can_narrow(query->fuzzy, prefix, needle);
 }
 
 
 /**
- * fuzzy_end_bulk_insert:
- * @fuzzy: (in): A #Fuzzy.
+ * fuzzy_query_match:
+ * @query: A #FuzzyQuery.
+ * @needle: The needle to fuzzy search for.
+ * @max_matches: The max number of matches to return.
  *
- * Complete a bulk insert and resort the index.
+ * Like fuzzy_match(), but reuses the results of previous calls to
+ * fuzzy_query_match() when @needle extends a previous needle.
+ *
+ * Returns: (transfer full) (element-type FuzzyMatch): A newly allocated
+ *   #GArray containing #FuzzyMatch elements.
  */
-void
-fuzzy_end_bulk_insert (Fuzzy *fuzzy)
+GArray *
+fuzzy_query_match (FuzzyQuery  *query,
+                   const gchar *needle,
+                   gsize        max_matches)
 {
-   GArray *table;
-   gint i;
-
-   g_return_if_fail(fuzzy);
-   g_return_if_fail(fuzzy->in_bulk_insert);
-
-   fuzzy->in_bulk_insert = FALSE;
-
-   for (i = 0; i < fuzzy->char_tables->len; i++) {
-      table = g_ptr_array_index(fuzzy->char_tables, i);
-      g_array_sort(table, fuzzy_item_compare);
-   }
+   return fuzzy_query_match_full(query, needle, max_matches, NULL, 0, NULL);
 }
 
 
 /**
- * fuzzy_insert:
- * @fuzzy: (in): A #Fuzzy.
- * @key: (in): An ASCII string.
- * @value: (in): A value to associate with key.
+ * fuzzy_query_match_full:
+ * @query: A #FuzzyQuery.
+ * @needle: The needle to fuzzy search for.
+ * @max_matches: The max number of matches to return.
+ * @cancellable: (allow-none): A #GCancellable, or %NULL.
+ * @deadline: The monotonic time to stop at, or 0 for no deadline.
+ * @truncated: (out) (allow-none): A location for whether the search
+ *   stopped early.
  *
- * Inserts a string into the fuzzy matcher.
+ * Like fuzzy_query_match(), but may stop early as described for
+ * fuzzy_match_full(). The survivors of a truncated search are incomplete,
+ * so they are not remembered for the next needle.
  *
- * Note that @key MUST be an ascii string. UTF-8 is not supported.
+ * Returns: (transfer full) (element-type FuzzyMatch): A newly allocated
+ *   #GArray containing #FuzzyMatch elements.
  */
-void
-fuzzy_insert (Fuzzy       *fuzzy,
-              const gchar *key,
-              gpointer     value)
+GArray *
+fuzzy_query_match_full (FuzzyQuery   *query,
+                        const gchar  *needle,
+                        gsize         max_matches,
+                        GCancellable *cancellable,
+                        gint64        deadline,
+                        gboolean     *truncated)
 {
-   FuzzyItem item;
-   GArray *table;
-   gchar *downcase = NULL;
-   gsize offset;
-   guint idx;
-   gint id;
-   gint i;
+   FuzzyQueryLevel *level = NULL;
+   FuzzyLookup lookup;
+   const guint *candidates = NULL;
+   GArray *matches;
+   GArray *survivors = NULL;
+   guint n_candidates = 0;
+
+   g_return_val_if_fail(query, NULL);
+   g_return_val_if_fail(!query->fuzzy->in_bulk_insert, NULL);
+   g_return_val_if_fail(needle, NULL);
 
-   g_return_if_fail(fuzzy);
-   g_return_if_fail(key);
-   g_return_if_fail(fuzzy->id_to_text_offset->len < ((1 << 20) - 1));
+   /*
+    * Anything we cached is meaningless if the index has changed.
+    */
+   if (query->generation != query->fuzzy->generation) {
+      g_ptr_array_set_size(query->levels, 0);
+      query->generation = query->fuzzy->generation;
+   }
 
-   if (!*key) {
-      return;
+   while (query->levels->len) {
+      level = g_ptr_array_index(query->levels, query->levels->len - 1);
+      if (fuzzy_query_can_narrow(query, level->needle, needle)) {
+         break;
+      }
+      g_ptr_array_set_size(query->levels, query->levels->len - 1);
+      level = NULL;
+   }
+
+   if (truncated) {
+      *truncated = FALSE;
+   }
+
+   if (!fuzzy_lookup_init(&lookup, query->fuzzy, needle)) {
+      fuzzy_lookup_clear(&lookup);
+      return g_array_new(FALSE, FALSE, sizeof(FuzzyMatch));
    }
 
-   if (!fuzzy->case_sensitive) {
-      downcase = g_ascii_strdown(key, -1);
+   lookup.cancellable = cancellable;
+   lookup.deadline = deadline;
+
+   if (level) {
+      candidates = (const guint *)(gpointer)level->survivors->data;
+      n_candidates = level->survivors->len;
    }
 
    /*
-    * Insert the string into our heap.
-    * Track the offset within the heap since the heap could realloc.
+    * If the needle did not change, the cached survivors are the answer
+    * and only need to be scored again.
     */
-   offset = fuzzy_heap_insert(fuzzy, key);
-   g_array_append_val(fuzzy->id_to_text_offset, offset);
-   g_ptr_array_add(fuzzy->id_to_value, value);
-   g_assert_cmpint(fuzzy->id_to_value->len, ==, fuzzy->id_to_text_offset->len);
+   if (!level || (g_strcmp0(needle, level->needle) != 0)) {
+      survivors = g_array_new(FALSE, FALSE, sizeof(guint));
+   }
 
-   id = fuzzy->id_to_text_offset->len - 1;
+   matches = fuzzy_lookup_execute(&lookup,
+                                  candidates,
+                                  n_candidates,
+                                  max_matches,
+                                  survivors);
 
-   if (!fuzzy->case_sensitive) {
-      key = downcase;
+   if (truncated) {
+      *truncated = lookup.truncated;
    }
 
-   for (i = 0; key[i]; i++) {
-      idx = key[i];
-      table = g_ptr_array_index(fuzzy->char_tables, idx);
+   if (survivors && lookup.truncated) {
+      g_array_unref(survivors);
+   } else if (survivors) {
+      level = g_new0(FuzzyQueryLevel, 1);
+      level->needle = g_strdup(needle);
+      level->survivors = survivors;
+      g_ptr_array_add(query->levels, level);
+   }
 
-      item.id = id;
-      item.pos = i;
-      g_array_append_val(table, item);
+   fuzzy_lookup_clear(&lookup);
 
-      if (!fuzzy->in_bulk_insert) {
-         g_array_sort(table, fuzzy_item_compare);
-      }
+   return matches;
+}
+
+
+void
+fuzzy_query_free (FuzzyQuery *query)
+{
+   if (query) {
+      g_ptr_array_unref(query->levels);
+      fuzzy_unref(query->fuzzy);
+      g_free(query);
    }
+}
+
+
+G_DEFINE_QUARK(fuzzy-error-quark, fuzzy_error)
 
-   if (!fuzzy->case_sensitive) {
-      g_free(downcase);
+
+static guint64
+fuzzy_file_append (GString       *buf,
+                   gconstpointer  data,
+                   gsize          len)
+{
+   guint64 offset;
+
+   while (buf->len != FUZZY_FILE_ALIGN(buf->len)) {
+      g_string_append_c(buf, '\0');
    }
+
+   offset = buf->len;
+   g_string_append_len(buf, data, len);
+
+   return offset;
+}
+
+
+static gint
+fuzzy_unichar_compare (gconstpointer a,
+                       gconstpointer b)
+{
+   gunichar ua = *(const gunichar *)a;
+   gunichar ub = *(const gunichar *)b;
+
+   return (ua < ub) ? -1 : (ua > ub);
 }
 
 
 /**
- * fuzzy_unref:
+ * fuzzy_save:
  * @fuzzy: A #Fuzzy.
+ * @filename: The file to write.
+ * @cache_key: (allow-none): A key describing the contents of @fuzzy.
+ * @error: A location for a #GError, or %NULL.
  *
- * Decrements the reference count of fuzzy by one. When the reference count
- * reaches zero, the structure will be freed.
+ * Saves @fuzzy to @filename so that it can later be used with
+ * fuzzy_load_mapped() without building the index again. The file is
+ * written atomically.
+ *
+ * @cache_key should identify whatever @fuzzy was built from, such as a
+ * modification time. fuzzy_load_mapped() will refuse to load the file if
+ * it is given a different key.
+ *
+ * Values are saved as strings, so every value in @fuzzy MUST be a NUL
+ * terminated string or %NULL.
+ *
+ * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
  */
-void
-fuzzy_unref (Fuzzy *fuzzy)
+gboolean
+fuzzy_save (Fuzzy        *fuzzy,
+            const gchar  *filename,
+            const gchar  *cache_key,
+            GError      **error)
 {
-   g_return_if_fail (fuzzy);
-   g_return_if_fail (fuzzy->ref_count > 0);
+   FuzzyFileHeader header = { { 0 } };
+   FuzzyFileTable *tables;
+   GHashTableIter iter;
+   gpointer key;
+   const gchar *value;
+   GString *value_heap;
+   GString *buf;
+   GArray *values;
+   GArray *chars;
+   FuzzyPostings *table;
+   guint64 offset;
+   gboolean ret;
+   gunichar ch;
+   guint i;
+
+   g_return_val_if_fail(fuzzy, FALSE);
+   g_return_val_if_fail(!fuzzy->in_bulk_insert, FALSE);
+   g_return_val_if_fail(filename, FALSE);
+
+   if (!cache_key) {
+      cache_key = "";
+   }
 
-   if (g_atomic_int_dec_and_test (&fuzzy->ref_count)) {
-      g_free(fuzzy->heap);
-      fuzzy->heap = 0;
-      fuzzy->heap_offset = 0;
-      fuzzy->heap_length = 0;
+   /*
+    * Saving an index that is itself mapped is unusual enough that we
+    * don't mind copying it first.
+    */
+   fuzzy_thaw(fuzzy);
+   fuzzy_flush(fuzzy);
+
+   buf = g_string_sized_new(sizeof header + fuzzy->heap_offset);
+   g_string_append_len(buf, (const gchar *)&header, sizeof header);
+
+   memcpy(header.magic, FUZZY_FILE_MAGIC, sizeof header.magic);
+   header.version = FUZZY_FILE_VERSION;
+   header.byte_order = FUZZY_FILE_BYTE_ORDER;
+   header.word_size = sizeof(gsize);
+   header.case_sensitive = !!fuzzy->case_sensitive;
+   header.wide = !!fuzzy->wide;
+   header.path_aware = !!fuzzy->path_aware;
+   header.n_ids = fuzzy->id_to_text_offset->len;
+
+   header.cache_key_length = strlen(cache_key);
+   header.cache_key = fuzzy_file_append(buf, cache_key,
+                                        header.cache_key_length + 1);
+
+   header.heap_length = fuzzy->heap_offset;
+   header.heap = fuzzy_file_append(buf, fuzzy->heap, fuzzy->heap_offset);
+
+   header.offsets = fuzzy_file_append(buf,
+                                      fuzzy->id_to_text_offset->data,
+                                      header.n_ids * sizeof(gsize));
+   header.signatures = fuzzy_file_append(buf,
+                                         fuzzy->id_to_signature->data,
+                                         header.n_ids * sizeof(guint64));
+
+   values = g_array_sized_new(FALSE, FALSE, sizeof(guint64), header.n_ids);
+   value_heap = g_string_new(NULL);
+
+   for (i = 0; i < header.n_ids; i++) {
+      value = g_ptr_array_index(fuzzy->id_to_value, i);
+      offset = value ? value_heap->len : FUZZY_FILE_NO_VALUE;
+      g_array_append_val(values, offset);
+      if (value) {
+         g_string_append_len(value_heap, value, strlen(value) + 1);
+      }
+   }
 
-      g_array_unref(fuzzy->id_to_text_offset);
-      fuzzy->id_to_text_offset = NULL;
+   header.values = fuzzy_file_append(buf, values->data,
+                                     header.n_ids * sizeof(guint64));
+   header.value_heap_length = value_heap->len;
+   header.value_heap = fuzzy_file_append(buf, value_heap->str, value_heap->len);
 
-      g_ptr_array_unref(fuzzy->id_to_value);
-      fuzzy->id_to_value = NULL;
+   g_array_unref(values);
+   g_string_free(value_heap, TRUE);
 
-      g_ptr_array_unref(fuzzy->char_tables);
-      fuzzy->char_tables = NULL;
+   /*
+    * The dense tables are stored by character, followed by the sparse
+    * tables sorted by character so that they can be binary searched.
+    */
+   chars = g_array_new(FALSE, FALSE, sizeof(gunichar));
 
-      g_free(fuzzy);
+   for (ch = 0; ch < FUZZY_N_DENSE_TABLES; ch++) {
+      g_array_append_val(chars, ch);
+   }
+
+   g_hash_table_iter_init(&iter, fuzzy->unichar_tables);
+   while (g_hash_table_iter_next(&iter, &key, (gpointer *)&table)) {
+      if (table->n_items) {
+         ch = GPOINTER_TO_UINT(key);
+         g_array_append_val(chars, ch);
+      }
    }
+
+   g_array_sort(chars, fuzzy_unichar_compare);
+
+   header.n_tables = chars->len;
+   tables = g_new0(FuzzyFileTable, header.n_tables);
+
+   for (i = 0; i < header.n_tables; i++) {
+      ch = g_array_index(chars, gunichar, i);
+      table = fuzzy_get_table(fuzzy, ch, FALSE);
+      tables[i].ch = ch;
+      tables[i].n_items = table->n_items;
+      tables[i].n_blocks = table->n_blocks;
+      tables[i].blocks = fuzzy_file_append(buf, table->blocks,
+                                           table->n_blocks * sizeof(FuzzyBlock));
+      tables[i].data_len = table->data_len;
+      tables[i].data = fuzzy_file_append(buf, table->data, table->data_len);
+   }
+
+   header.tables = fuzzy_file_append(buf, tables,
+                                     header.n_tables * sizeof(FuzzyFileTable));
+
+   g_array_unref(chars);
+   g_free(tables);
+
+   memcpy(buf->str, &header, sizeof header);
+
+   ret = g_file_set_contents(filename, buf->str, buf->len, error);
+
+   g_string_free(buf, TRUE);
+
+   return ret;
 }
 
 
-void
-fuzzy_free (Fuzzy *fuzzy)
+static gboolean
+fuzzy_file_check (gsize   length,
+                  guint64 offset,
+                  guint64 size)
 {
-   if (fuzzy)
-      fuzzy_unref (fuzzy);
+   return ((offset == FUZZY_FILE_ALIGN(offset)) &&
+           (offset <= length) &&
+           (size <= (length - offset)));
 }
 
 
+/**
+ * fuzzy_file_validate:
+ * @data: The contents of an index file.
+ * @length: The length of @data.
+ * @cache_key: The expected cache key.
+ * @error: A location for a #GError, or %NULL.
+ *
+ * Checks that every section of the index file lies within @data, that
+ * every offset and block header it contains is in range, and that every
+ * key is terminated and valid UTF-8, so that a damaged file cannot cause
+ * out of bounds reads once it is in use. The packed items of each block
+ * are only checked when the block is first read, see
+ * fuzzy_table_check_block(), so that loading does not decode every posting.
+ *
+ * Returns: %TRUE if @data can be used as is.
+ */
 static gboolean
-fuzzy_do_match (FuzzyLookup *lookup,
-                FuzzyItem   *item,
-                gint         table_index,
-                gint         score)
+fuzzy_file_validate (const gchar  *data,
+                     gsize         length,
+                     const gchar  *cache_key,
+                     GError      **error)
 {
-   FuzzyItem *iter;
-   gpointer key;
-   GArray *table;
-   gint *state;
-   gint iter_score;
+   const FuzzyFileHeader *header = (gconstpointer)data;
+   const FuzzyFileTable *tables;
+   const FuzzyBlock *blocks;
+   const guint64 *values;
+   const gsize *offsets;
+   guint64 n_items;
+   guint64 end;
+   gsize key_end;
+   guint max_pos_bits;
+   guint bits;
+   guint i;
+   guint j;
+
+   if ((length < sizeof *header) ||
+       (memcmp(header->magic, FUZZY_FILE_MAGIC, sizeof header->magic) != 0) ||
+       (header->version != FUZZY_FILE_VERSION) ||
+       (header->byte_order != FUZZY_FILE_BYTE_ORDER) ||
+       (header->word_size != sizeof(gsize))) {
+      g_set_error(error, FUZZY_ERROR, FUZZY_ERROR_INVALID,
+                  "Not a supported fuzzy index");
+      return FALSE;
+   }
 
-   g_assert(lookup);
-   g_assert(item);
-   g_assert(table_index);
+   /*
+    * The cache key is followed by its NUL. That byte is checked on its
+    * own, since adding one to a damaged length could wrap around.
+    */
+   if ((header->cache_key_length >= length) ||
+       !fuzzy_file_check(length, header->cache_key, header->cache_key_length) ||
+       (header->cache_key_length >= (length - header->cache_key)) ||
+       !fuzzy_file_check(length, header->heap, header->heap_length) ||
+       !fuzzy_file_check(length, header->offsets, header->n_ids * (guint64)sizeof(gsize)) ||
+       !fuzzy_file_check(length, header->signatures, header->n_ids * (guint64)sizeof(guint64)) ||
+       !fuzzy_file_check(length, header->values, header->n_ids * (guint64)sizeof(guint64)) ||
+       !fuzzy_file_check(length, header->value_heap, header->value_heap_length) ||
+       !fuzzy_file_check(length, header->tables, header->n_tables * (guint64)sizeof(FuzzyFileTable)) ||
+       (header->n_ids >= G_MAXUINT32) ||
+       (!header->wide && (header->n_ids > (FUZZY_ITEM_MAX_ID + 1))) ||
+       (header->n_tables < FUZZY_N_DENSE_TABLES) ||
+       (data[header->cache_key + header->cache_key_length] != '\0') ||
+       (header->heap_length && (data[header->heap + header->heap_length - 1] != '\0')) ||
+       (header->value_heap_length &&
+        (data[header->value_heap + header->value_heap_length - 1] != '\0'))) {
+      g_set_error(error, FUZZY_ERROR, FUZZY_ERROR_INVALID,
+                  "The fuzzy index is truncated or corrupt");
+      return FALSE;
+   }
 
-   table = lookup->tables[table_index];
-   state = &lookup->state[table_index];
+   if (g_strcmp0(cache_key ? cache_key : "", data + header->cache_key) != 0) {
+      g_set_error(error, FUZZY_ERROR, FUZZY_ERROR_STALE,
+                  "The fuzzy index is out of date");
+      return FALSE;
+   }
 
-   for (; state[0] < table->len; state[0]++) {
-      iter = &g_array_index(table, FuzzyItem, state[0]);
+   offsets = (gconstpointer)(data + header->offsets);
+   values = (gconstpointer)(data + header->values);
 
-      if ((iter->id < item->id) ||
-          ((iter->id == item->id) && (iter->pos <= item->pos))) {
-         continue;
-      } else if (iter->id > item->id) {
-         break;
+   /*
+    * Each key ends with a NUL right before the next key. Lookups walk
+    * keys a character at a time, so a truncated multi-byte sequence
+    * would step over that NUL.
+    */
+   for (i = 0; i < header->n_ids; i++) {
+      if ((offsets[i] >= header->heap_length) ||
+          (i && (offsets[i] <= offsets[i - 1])) ||
+          ((values[i] != FUZZY_FILE_NO_VALUE) &&
+           (values[i] >= header->value_heap_length))) {
+         goto corrupt;
       }
 
-      iter_score = score + (iter->pos - item->pos);
-
-      if ((table_index + 1) < lookup->n_tables) {
-         if (fuzzy_do_match(lookup, iter, table_index + 1, iter_score)) {
-            return TRUE;
+      if (i) {
+         key_end = offsets[i] - 1;
+         if ((data[header->heap + key_end] != '\0') ||
+             !g_utf8_validate(data + header->heap + offsets[i - 1],
+                              key_end - offsets[i - 1], NULL)) {
+            goto corrupt;
          }
-         continue;
       }
+   }
 
-      key = GINT_TO_POINTER(iter->id);
+   if (header->n_ids &&
+       !g_utf8_validate(data + header->heap + offsets[header->n_ids - 1],
+                        header->heap_length - 1 - offsets[header->n_ids - 1],
+                        NULL)) {
+      goto corrupt;
+   }
 
-      if (!g_hash_table_contains(lookup->matches, key) ||
-          (iter_score < GPOINTER_TO_INT(g_hash_table_lookup(lookup->matches, key)))) {
-         g_hash_table_insert(lookup->matches, key, GINT_TO_POINTER(iter_score));
+   tables = (gconstpointer)(data + header->tables);
+   max_pos_bits = header->wide ? 32 : fuzzy_bit_storage(FUZZY_ITEM_MAX_POS);
+
+   for (i = 0; i < header->n_tables; i++) {
+      if (((i < FUZZY_N_DENSE_TABLES) && (tables[i].ch != i)) ||
+          ((i >= FUZZY_N_DENSE_TABLES) && (tables[i].ch < FUZZY_N_DENSE_TABLES)) ||
+          ((i > FUZZY_N_DENSE_TABLES) && (tables[i].ch <= tables[i - 1].ch)) ||
+          !fuzzy_file_check(length, tables[i].blocks,
+                            tables[i].n_blocks * (guint64)sizeof(FuzzyBlock)) ||
+          !fuzzy_file_check(length, tables[i].data, tables[i].data_len) ||
+          (tables[i].n_blocks && (tables[i].data_len < FUZZY_BLOCK_PADDING))) {
+         goto corrupt;
       }
 
-      return TRUE;
-   }
+      blocks = (gconstpointer)(data + tables[i].blocks);
+      n_items = 0;
 
-   return FALSE;
-}
+      for (j = 0; j < tables[i].n_blocks; j++) {
+         bits = blocks[j].id_bits + blocks[j].pos_bits;
+         end = blocks[j].offset + ((((guint64)blocks[j].n_items * bits) + 7) / 8);
 
+         if (!blocks[j].n_items ||
+             (blocks[j].id_bits > 32) ||
+             (blocks[j].pos_bits > max_pos_bits) ||
+             (end > (tables[i].data_len - FUZZY_BLOCK_PADDING)) ||
+             (blocks[j].first_id >= header->n_ids) ||
+             (j && (blocks[j].first_id <= blocks[j - 1].first_id))) {
+            goto corrupt;
+         }
 
-static const gchar *
-fuzzy_get_string (Fuzzy *fuzzy,
-                  gint   id)
-{
-   gsize offset;
+         n_items += blocks[j].n_items;
+      }
 
-   g_assert(fuzzy);
-   g_assert(id >= 0);
+      if (n_items != tables[i].n_items) {
+         goto corrupt;
+      }
+   }
 
-   offset = g_array_index(fuzzy->id_to_text_offset, gsize, id);
-   return fuzzy->heap + offset;
+   return TRUE;
+
+corrupt:
+   g_set_error(error, FUZZY_ERROR, FUZZY_ERROR_INVALID,
+               "The fuzzy index is corrupt");
+
+   return FALSE;
 }
 
 
 /**
- * fuzzy_match:
- * @fuzzy: (in): A #Fuzzy.
- * @needle: (in): The needle to fuzzy search for.
- * @max_matches: (in): The max number of matches to return.
+ * fuzzy_load_mapped:
+ * @filename: A file written by fuzzy_save().
+ * @cache_key: (allow-none): The key that the file must have been saved with.
+ * @error: A location for a #GError, or %NULL.
  *
- * Fuzzy searches within @fuzzy for strings that fuzzy match @needle.
- * Only up to @max_matches will be returned.
+ * Maps an index saved with fuzzy_save() into memory. The strings, values
+ * and character tables are used directly from the mapping, so the index
+ * is ready for matching without being built or sorted again.
  *
- * @needle MUST be an ascii string.
+ * If the file was saved with a different @cache_key, %FUZZY_ERROR_STALE
+ * is returned and the caller should build a new index.
  *
- * TODO: max_matches is not yet respected.
+ * The values of the resulting #Fuzzy are strings owned by the index. The
+ * first modification copies the index into memory.
  *
- * Returns: (transfer full) (element-type FuzzyMatch): A newly allocated
- *   #GArray containing #FuzzyMatch elements. This should be freed when
- *   the caller is done with it using g_array_unref().
- *   It is a programming error to keep the structure around longer than
- *   the @fuzzy instance.
+ * Returns: (transfer full): A #Fuzzy, or %NULL and @error is set.
  */
-GArray *
-fuzzy_match (Fuzzy       *fuzzy,
-             const gchar *needle,
-             gsize        max_matches)
+Fuzzy *
+fuzzy_load_mapped (const gchar  *filename,
+                   const gchar  *cache_key,
+                   GError      **error)
 {
-   FuzzyLookup lookup = { 0 };
-   FuzzyMatch match;
-   FuzzyItem *item;
-   GArray *matches = NULL;
-   GArray *root;
-   gchar *downcase = NULL;
-   gint i;
+   const FuzzyFileHeader *header;
+   FuzzyMapping *mapping;
+   GMappedFile *file;
+   const gchar *data;
+   Fuzzy *fuzzy;
+   gsize length;
+   guint n_words = 0;
+   guint i;
 
-   g_return_val_if_fail(fuzzy, NULL);
-   g_return_val_if_fail(!fuzzy->in_bulk_insert, NULL);
-   g_return_val_if_fail(needle, NULL);
+   g_return_val_if_fail(filename, NULL);
+
+   if (!(file = g_mapped_file_new(filename, FALSE, error))) {
+      return NULL;
+   }
 
-   matches = g_array_new(FALSE, FALSE, sizeof(FuzzyMatch));
+   data = g_mapped_file_get_contents(file);
+   length = g_mapped_file_get_length(file);
 
-   if (!*needle) {
-      return matches;
+   if (!data || !fuzzy_file_validate(data, length, cache_key, error)) {
+      if (!data) {
+         g_set_error(error, FUZZY_ERROR, FUZZY_ERROR_INVALID,
+                     "Not a supported fuzzy index");
+      }
+      g_mapped_file_unref(file);
+      return NULL;
    }
 
-   if (!fuzzy->case_sensitive) {
-      downcase = g_ascii_strdown(needle, -1);
-      needle = downcase;
+   header = (gconstpointer)data;
+
+   mapping = g_new0(FuzzyMapping, 1);
+   mapping->file = file;
+   mapping->data = data;
+   mapping->offsets = (gconstpointer)(data + header->offsets);
+   mapping->signatures = (gconstpointer)(data + header->signatures);
+   mapping->values = (gconstpointer)(data + header->values);
+   mapping->value_heap = data + header->value_heap;
+   mapping->tables = (gconstpointer)(data + header->tables);
+   mapping->n_ids = header->n_ids;
+   mapping->n_tables = header->n_tables;
+   mapping->check_base = g_new(guint, mapping->n_tables);
+
+   for (i = 0; i < mapping->n_tables; i++) {
+      mapping->check_base[i] = n_words;
+      n_words += (mapping->tables[i].n_blocks + 31) / 32;
    }
 
-   lookup.fuzzy = fuzzy;
-   lookup.n_tables = strlen(needle);
-   lookup.state = g_new0(gint, lookup.n_tables);
-   lookup.tables = g_new0(GArray*, lookup.n_tables);
-   lookup.needle = needle;
-   lookup.max_matches = max_matches;
-   lookup.matches = g_hash_table_new(NULL, NULL);
+   mapping->checked = g_new0(guint, MAX(n_words, 1));
+
+   fuzzy = fuzzy_new_with_free_func(header->case_sensitive, g_free);
+   fuzzy->path_aware = !!header->path_aware;
 
-   for (i = 0; needle[i]; i++) {
-      lookup.tables[i] = g_ptr_array_index(fuzzy->char_tables,
-                                           (guint)needle[i]);
+   if (header->wide) {
+      fuzzy_widen(fuzzy);
    }
 
-   root = g_ptr_array_index(fuzzy->char_tables, (guint)needle[0]);
+   g_free(fuzzy->heap);
+   fuzzy->heap = (gchar *)data + header->heap;
+   fuzzy->heap_offset = header->heap_length;
+   fuzzy->heap_length = 0;
+   fuzzy->mapping = mapping;
 
-   if (G_LIKELY(lookup.n_tables > 1)) {
-      for (i = 0; i < root->len; i++) {
-         item = &g_array_index(root, FuzzyItem, i);
-         fuzzy_do_match(&lookup, item, 1, 0);
-      }
-   } else {
-      for (i = 0; i < root->len; i++) {
-         item = &g_array_index(root, FuzzyItem, i);
-         match.key = fuzzy_get_string(fuzzy, item->id);
-         match.value = g_ptr_array_index(fuzzy->id_to_value, item->id);
-         match.score = 0;
-         g_array_append_val(matches, match);
-      }
-      g_free(downcase);
-      return matches;
-   }
+   return fuzzy;
+}
 
-   {
-      GHashTableIter iter;
-      gpointer key;
-      gpointer value;
 
-      g_hash_table_iter_init(&iter, lookup.matches);
-      while (g_hash_table_iter_next(&iter, &key, &value)) {
-         match.key = fuzzy_get_string(fuzzy, GPOINTER_TO_INT(key));
-         match.score = 1.0 / (strlen(match.key) + GPOINTER_TO_INT(value));
-         match.value = g_ptr_array_index(fuzzy->id_to_value,
-                                         GPOINTER_TO_INT(key));
-         g_array_append_val(matches, match);
-      }
+#ifdef FUZZY_ENABLE_STATS
+static void
+fuzzy_postings_get_stats (const FuzzyPostings *postings,
+                          FuzzyStats          *stats)
+{
+   stats->n_items += postings->n_items;
+   stats->n_table_bytes += (postings->n_blocks * sizeof(FuzzyBlock)) + postings->data_len;
+}
 
-      g_array_sort(matches, fuzzy_match_compare);
 
-      /*
-       * TODO: We could be more clever here when inserting into the array
-       *       only if it is a lower score than the end or < max items.
-       */
+/**
+ * fuzzy_get_stats:
+ * @fuzzy: A #Fuzzy.
+ * @stats: (out): A location for the #FuzzyStats.
+ *
+ * Gets the counters accumulated by all lookups on @fuzzy, along with the
+ * number of items in the character tables and the bytes used to store
+ * them. This is only available when fuzzy is compiled with
+ * FUZZY_ENABLE_STATS, which is meant for benchmarking.
+ */
+void
+fuzzy_get_stats (Fuzzy      *fuzzy,
+                 FuzzyStats *stats)
+{
+   const FuzzyMapping *mapping;
+   GHashTableIter iter;
+   gpointer value;
+   guint i;
+
+   g_return_if_fail(fuzzy);
+   g_return_if_fail(stats);
+
+   *stats = fuzzy->stats;
 
-      if (max_matches && (matches->len > max_matches)) {
-         g_array_set_size(matches, max_matches);
+   if ((mapping = fuzzy->mapping)) {
+      for (i = 0; i < mapping->n_tables; i++) {
+         stats->n_items += mapping->tables[i].n_items;
+         stats->n_table_bytes += ((mapping->tables[i].n_blocks * sizeof(FuzzyBlock)) +
+                                  mapping->tables[i].data_len);
       }
+      return;
    }
 
-   g_free(downcase);
-   g_free(lookup.state);
-   g_free(lookup.tables);
-   g_hash_table_unref(lookup.matches);
+   fuzzy_flush(fuzzy);
 
-   return matches;
+   for (i = 0; i < fuzzy->char_tables->len; i++) {
+      fuzzy_postings_get_stats(g_ptr_array_index(fuzzy->char_tables, i), stats);
+   }
+
+   g_hash_table_iter_init(&iter, fuzzy->unichar_tables);
+   while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      fuzzy_postings_get_stats(value, stats);
+   }
 }
+
+
+void
+fuzzy_reset_stats (Fuzzy *fuzzy)
+{
+   g_return_if_fail(fuzzy);
+
+   memset(&fuzzy->stats, 0, sizeof fuzzy->stats);
+}
+#endif
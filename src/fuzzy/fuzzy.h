@@ -19,12 +19,15 @@
 #ifndef FUZZY_H
 #define FUZZY_H
 
-#include <glib.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
+#define FUZZY_ERROR (fuzzy_error_quark())
+
 typedef struct _Fuzzy      Fuzzy;
 typedef struct _FuzzyMatch FuzzyMatch;
+typedef struct _FuzzyQuery FuzzyQuery;
 
 struct _FuzzyMatch
 {
@@ -33,23 +36,93 @@ struct _FuzzyMatch
    gfloat       score;
 };
 
+typedef enum
+{
+   FUZZY_ERROR_INVALID,
+   FUZZY_ERROR_STALE,
+} FuzzyError;
+
+#ifdef FUZZY_ENABLE_STATS
+typedef struct
+{
+   guint64 n_candidates;
+   guint64 n_prefiltered;
+   guint64 n_scored;
+   guint64 n_items;
+   guint64 n_table_bytes;
+} FuzzyStats;
+#endif
+
+GQuark     fuzzy_error_quark        (void);
 Fuzzy     *fuzzy_new                (gboolean        case_sensitive);
 Fuzzy     *fuzzy_new_with_free_func (gboolean        case_sensitive,
                                      GDestroyNotify  free_func);
+Fuzzy     *fuzzy_new_full           (gboolean        case_sensitive,
+                                     guint           capacity,
+                                     GDestroyNotify  free_func);
 void       fuzzy_set_free_func      (Fuzzy          *fuzzy,
                                      GDestroyNotify  free_func);
+void       fuzzy_set_path_aware     (Fuzzy          *fuzzy,
+                                     gboolean        path_aware);
 void       fuzzy_begin_bulk_insert  (Fuzzy          *fuzzy);
 void       fuzzy_end_bulk_insert    (Fuzzy          *fuzzy);
 void       fuzzy_insert             (Fuzzy          *fuzzy,
                                      const gchar    *key,
                                      gpointer        value);
+void       fuzzy_replace            (Fuzzy          *fuzzy,
+                                     const gchar    *key,
+                                     gpointer        value);
+gboolean   fuzzy_remove             (Fuzzy          *fuzzy,
+                                     const gchar    *key);
+gboolean   fuzzy_needs_compact      (Fuzzy          *fuzzy);
+void       fuzzy_compact            (Fuzzy          *fuzzy);
+void       fuzzy_foreach            (Fuzzy          *fuzzy,
+                                     GHFunc          func,
+                                     gpointer        user_data);
 GArray    *fuzzy_match              (Fuzzy          *fuzzy,
                                      const gchar    *needle,
                                      gsize           max_matches);
+GArray    *fuzzy_match_full         (Fuzzy          *fuzzy,
+                                     const gchar    *needle,
+                                     gsize           max_matches,
+                                     GCancellable   *cancellable,
+                                     gint64          deadline,
+                                     gboolean       *truncated);
+gboolean   fuzzy_can_narrow         (Fuzzy          *fuzzy,
+                                     const gchar    *prefix,
+                                     const gchar    *needle);
+gboolean   fuzzy_save               (Fuzzy          *fuzzy,
+                                     const gchar    *filename,
+                                     const gchar    *cache_key,
+                                     GError        **error);
+Fuzzy     *fuzzy_load_mapped        (const gchar    *filename,
+                                     const gchar    *cache_key,
+                                     GError        **error);
 Fuzzy     *fuzzy_ref                (Fuzzy          *fuzzy);
 void       fuzzy_free               (Fuzzy          *fuzzy);
 void       fuzzy_unref              (Fuzzy          *fuzzy);
 
+FuzzyQuery *fuzzy_query_new         (Fuzzy          *fuzzy);
+GArray     *fuzzy_query_match       (FuzzyQuery     *query,
+                                     const gchar    *needle,
+                                     gsize           max_matches);
+GArray     *fuzzy_query_match_full  (FuzzyQuery     *query,
+                                     const gchar    *needle,
+                                     gsize           max_matches,
+                                     GCancellable   *cancellable,
+                                     gint64          deadline,
+                                     gboolean       *truncated);
+gboolean    fuzzy_query_can_narrow  (FuzzyQuery     *query,
+                                     const gchar    *prefix,
+                                     const gchar    *needle);
+void        fuzzy_query_free        (FuzzyQuery     *query);
+
+#ifdef FUZZY_ENABLE_STATS
+void        fuzzy_get_stats         (Fuzzy          *fuzzy,
+                                     FuzzyStats     *stats);
+void        fuzzy_reset_stats       (Fuzzy          *fuzzy);
+#endif
+
 G_END_DECLS
 
 #endif /* FUZZY_H */
@@ -18,7 +18,7 @@
 
 #define G_LOG_DOMAIN "git-search"
 
-#include <ctype.h>
+#include <errno.h>
 #include <glib/gi18n.h>
 #include <string.h>
 
@@ -34,15 +34,75 @@
 
 #define GB_GIT_SEARCH_PROVIDER_MAX_MATCHES 1000
 
+/*
+ * Give up on the rest of the index and show what we have rather than keep
+ * the user waiting for the best possible match.
+ */
+#define GB_GIT_SEARCH_PROVIDER_MATCH_TIMEOUT_USEC (G_USEC_PER_SEC / 10)
+
+/*
+ * Bump this whenever the keys or values stored in the file index change so
+ * that indexes cached by older versions are rebuilt.
+ */
+#define GB_GIT_SEARCH_PROVIDER_CACHE_VERSION 2
+
+/*
+ * Git rewrites its index a few times in a row for a single command, so wait
+ * for it to settle before updating the file index.
+ */
+#define GB_GIT_SEARCH_PROVIDER_UPDATE_DELAY_MSEC 250
+
+/*
+ * Searches run on a worker thread. @query_lock protects the @file_index
+ * and @file_query pointers. Matching does not modify the index, but the
+ * type-ahead query remembers the previous search, so a search takes the
+ * query for itself while it runs. A search that starts before the previous
+ * one has finished matches against the index directly instead of waiting.
+ *
+ * When the git index changes, @file_index is updated in place on a worker
+ * thread. @index_lock is held for reading while matching and for writing
+ * while the update modifies the index. Only one update runs at a time.
+ *
+ * @index_serial is bumped on the main loop whenever @file_index is
+ * replaced or updated, so that a search which started before then does
+ * not report candidates from the older index.
+ */
 struct _GbGitSearchProviderPrivate
 {
   GgitRepository *repository;
+  GMutex          query_lock;
+  GRWLock         index_lock;
   Fuzzy          *file_index;
+  FuzzyQuery     *file_query;
   GFile          *repository_dir;
+  GFileMonitor   *index_monitor;
   gchar          *repository_shorthand;
   GbWorkbench    *workbench;
+  guint           index_serial;
+  guint           update_timeout;
+  gboolean        updating;
+  gboolean        update_pending;
 };
 
+typedef struct
+{
+  GFile      *repository_dir;
+  Fuzzy      *file_index;
+  GHashTable *paths;
+  GPtrArray  *removed;
+} UpdateState;
+
+typedef struct
+{
+  GbSearchContext *context;
+  gchar           *search_terms;
+  gsize            max_results;
+  Fuzzy           *file_index;
+  guint            index_serial;
+  gboolean         no_index;
+  gboolean         truncated;
+} PopulateState;
+
 G_DEFINE_TYPE_WITH_PRIVATE (GbGitSearchProvider,
                             gb_git_search_provider,
                             GB_TYPE_SEARCH_PROVIDER)
@@ -57,6 +117,8 @@ enum {
 static GParamSpec *gParamSpecs [LAST_PROP];
 static GQuark      gQuarkPath;
 
+static void gb_git_search_provider_queue_update (GbGitSearchProvider *provider);
+
 GbWorkbench *
 gb_git_search_provider_get_workbench (GbGitSearchProvider *provider)
 {
@@ -101,10 +163,104 @@ load_cb (GObject      *object,
       provider->priv->repository_shorthand =
         g_strdup (g_object_get_data (G_OBJECT (task), "shorthand"));
 
+      g_mutex_lock (&provider->priv->query_lock);
+      g_clear_pointer (&provider->priv->file_query, fuzzy_query_free);
       g_clear_pointer (&provider->priv->file_index, fuzzy_unref);
       provider->priv->file_index = fuzzy_ref (file_index);
+      provider->priv->file_query = fuzzy_query_new (file_index);
+      g_mutex_unlock (&provider->priv->query_lock);
       g_message ("Git file index loaded.");
+
+      provider->priv->index_serial++;
+      gb_search_provider_emit_changed (GB_SEARCH_PROVIDER (provider));
+
+      /*
+       * The git index may have changed while the file index was loading.
+       */
+      if (provider->priv->update_pending)
+        gb_git_search_provider_queue_update (provider);
+    }
+}
+
+static gchar *
+gb_git_search_provider_get_cache_path (GFile *repository_dir)
+{
+  gchar *checksum;
+  gchar *path;
+  gchar *ret;
+
+  path = g_file_get_path (repository_dir);
+  if (!path)
+    return NULL;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, path, -1);
+  ret = g_build_filename (g_get_user_cache_dir (),
+                          "gnome-builder",
+                          "git-search",
+                          checksum,
+                          NULL);
+
+  g_free (checksum);
+  g_free (path);
+
+  return ret;
+}
+
+/*
+ * The git index is rewritten whenever files are added, removed or staged,
+ * so its modification time and size are enough to tell whether a cached
+ * file index is still current.
+ */
+static gchar *
+gb_git_search_provider_get_cache_key (GFile *repository_dir)
+{
+  GFileInfo *info;
+  GFile *index_file;
+  gchar *ret = NULL;
+
+  index_file = g_file_get_child (repository_dir, "index");
+  info = g_file_query_info (index_file,
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC","
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE,
+                            NULL,
+                            NULL);
+
+  if (info)
+    {
+      ret = g_strdup_printf ("%u:%"G_GUINT64_FORMAT":%u:%"G_GOFFSET_FORMAT,
+                             GB_GIT_SEARCH_PROVIDER_CACHE_VERSION,
+                             g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                             g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC),
+                             g_file_info_get_size (info));
+      g_object_unref (info);
+    }
+
+  g_object_unref (index_file);
+
+  return ret;
+}
+
+static void
+gb_git_search_provider_save_file_index (Fuzzy       *fuzzy,
+                                        const gchar *cache_path,
+                                        const gchar *cache_key)
+{
+  GError *error = NULL;
+  gchar *dir;
+
+  dir = g_path_get_dirname (cache_path);
+
+  if ((g_mkdir_with_parents (dir, 0750) != 0) ||
+      !fuzzy_save (fuzzy, cache_path, cache_key, &error))
+    {
+      g_debug ("Failed to cache git file index: %s",
+               error ? error->message : g_strerror (errno));
+      g_clear_error (&error);
     }
+
+  g_free (dir);
 }
 
 static void
@@ -120,6 +276,8 @@ gb_git_search_provider_build_file_index (GTask        *task,
   GError *error = NULL;
   GFile *repository_dir = task_data;
   Fuzzy *fuzzy;
+  gchar *cache_path = NULL;
+  gchar *cache_key = NULL;
   guint count;
   guint i;
 
@@ -134,6 +292,10 @@ gb_git_search_provider_build_file_index (GTask        *task,
    *    coallesce the index build, as it's *much* faster since you don't have
    *    to do as much index reordering.
    * 4) Return the fuzzy index back to the task.
+   *
+   * If the git index has not changed since we last built the fuzzy index,
+   * steps 2 and 3 are skipped and the cached copy is mapped instead. A
+   * freshly built index is cached for the next time.
    */
 
   repository = ggit_repository_open (repository_dir, &error);
@@ -157,6 +319,25 @@ gb_git_search_provider_build_file_index (GTask        *task,
       g_clear_object (&ref);
     }
 
+  cache_path = gb_git_search_provider_get_cache_path (repository_dir);
+  cache_key = gb_git_search_provider_get_cache_key (repository_dir);
+
+  if (cache_path && cache_key)
+    {
+      fuzzy = fuzzy_load_mapped (cache_path, cache_key, &error);
+
+      if (fuzzy)
+        {
+          g_task_return_pointer (task, fuzzy, (GDestroyNotify)fuzzy_unref);
+          goto cleanup;
+        }
+
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("Rebuilding git file index: %s", error->message);
+
+      g_clear_error (&error);
+    }
+
   index = ggit_repository_get_index (repository, &error);
   if (!index)
     {
@@ -166,7 +347,12 @@ gb_git_search_provider_build_file_index (GTask        *task,
 
   entries = ggit_index_get_entries (index);
 
-  fuzzy = fuzzy_new_with_free_func (FALSE, g_free);
+  /*
+   * Index the whole path so that directories can narrow the search. The
+   * key is the path itself, so no value is needed.
+   */
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_set_path_aware (fuzzy, TRUE);
   fuzzy_begin_bulk_insert (fuzzy);
 
   count = ggit_index_entries_size (entries);
@@ -179,34 +365,279 @@ gb_git_search_provider_build_file_index (GTask        *task,
       entry = ggit_index_entries_get_by_index (entries, i);
       path = ggit_index_entry_get_path (entry);
 
-      /* FIXME:
-       *
-       *   fuzzy does not yet support UTF-8, which is the native format
-       *   for the filesystem. It wont be as fast, but we can just take
-       *   the cost of gunichar most likely.
+      /*
+       * Paths are not guaranteed to be UTF-8 on disk, but fuzzy requires
+       * valid UTF-8 for both keys and needles.
        */
-      if (g_str_is_ascii (path))
-        {
-          const gchar *shortname = strrchr (path, '/');
-
-          if (shortname)
-            fuzzy_insert (fuzzy, shortname, g_strdup (path));
-          else
-            fuzzy_insert (fuzzy, path, g_strdup (path));
-        }
+      if (g_utf8_validate (path, -1, NULL))
+        fuzzy_insert (fuzzy, path, NULL);
 
       ggit_index_entry_unref (entry);
     }
 
   fuzzy_end_bulk_insert (fuzzy);
+
+  if (cache_path && cache_key)
+    gb_git_search_provider_save_file_index (fuzzy, cache_path, cache_key);
+
   g_task_return_pointer (task, fuzzy, (GDestroyNotify)fuzzy_unref);
 
 cleanup:
+  g_free (cache_path);
+  g_free (cache_key);
   g_clear_pointer (&entries, ggit_index_entries_unref);
   g_clear_object (&index);
   g_clear_object (&repository);
 }
 
+static void
+update_state_free (gpointer data)
+{
+  UpdateState *state = data;
+
+  g_clear_object (&state->repository_dir);
+  g_clear_pointer (&state->file_index, fuzzy_unref);
+  g_clear_pointer (&state->paths, g_hash_table_unref);
+  g_clear_pointer (&state->removed, g_ptr_array_unref);
+  g_free (state);
+}
+
+static void
+gb_git_search_provider_diff_path (gpointer key,
+                                  gpointer value,
+                                  gpointer user_data)
+{
+  UpdateState *state = user_data;
+
+  /*
+   * Whatever is left in @paths afterwards was added to the git index.
+   */
+  if (!g_hash_table_remove (state->paths, key))
+    g_ptr_array_add (state->removed, g_strdup (key));
+}
+
+static void
+gb_git_search_provider_update_file_index (GTask        *task,
+                                          gpointer      source_object,
+                                          gpointer      task_data,
+                                          GCancellable *cancellable)
+{
+  GbGitSearchProvider *self = source_object;
+  GgitRepository *repository = NULL;
+  GgitIndexEntries *entries = NULL;
+  GgitIndex *index = NULL;
+  GHashTableIter iter;
+  UpdateState *state = task_data;
+  gpointer key;
+  GError *error = NULL;
+  gchar *cache_path = NULL;
+  gchar *cache_key = NULL;
+  guint count;
+  guint i;
+
+  g_return_if_fail (GB_IS_GIT_SEARCH_PROVIDER (self));
+
+  /*
+   * Files that are added, removed or renamed are applied to the existing
+   * file index, which is much cheaper than building it again. A rename
+   * is simply a removal and an addition.
+   *
+   * The cache key is read before the git index, so that a change that
+   * lands in between is picked up by the next update rather than cached
+   * as if it had been applied.
+   */
+  cache_path = gb_git_search_provider_get_cache_path (state->repository_dir);
+  cache_key = gb_git_search_provider_get_cache_key (state->repository_dir);
+
+  repository = ggit_repository_open (state->repository_dir, &error);
+  if (!repository)
+    {
+      g_task_return_error (task, error);
+      goto cleanup;
+    }
+
+  index = ggit_repository_get_index (repository, &error);
+  if (!index)
+    {
+      g_task_return_error (task, error);
+      goto cleanup;
+    }
+
+  entries = ggit_index_get_entries (index);
+  count = ggit_index_entries_size (entries);
+
+  state->paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  state->removed = g_ptr_array_new_with_free_func (g_free);
+
+  for (i = 0; i < count; i++)
+    {
+      GgitIndexEntry *entry;
+      const gchar *path;
+
+      entry = ggit_index_entries_get_by_index (entries, i);
+      path = ggit_index_entry_get_path (entry);
+
+      if (g_utf8_validate (path, -1, NULL))
+        g_hash_table_add (state->paths, g_strdup (path));
+
+      ggit_index_entry_unref (entry);
+    }
+
+  /*
+   * Searches may keep reading the file index while we work out what
+   * changed, and only need to wait while it is modified.
+   */
+  g_rw_lock_reader_lock (&self->priv->index_lock);
+  fuzzy_foreach (state->file_index, gb_git_search_provider_diff_path, state);
+  g_rw_lock_reader_unlock (&self->priv->index_lock);
+
+  if (!state->removed->len && !g_hash_table_size (state->paths))
+    {
+      g_task_return_boolean (task, FALSE);
+      goto cleanup;
+    }
+
+  g_rw_lock_writer_lock (&self->priv->index_lock);
+
+  for (i = 0; i < state->removed->len; i++)
+    fuzzy_remove (state->file_index, g_ptr_array_index (state->removed, i));
+
+  if (fuzzy_needs_compact (state->file_index))
+    fuzzy_compact (state->file_index);
+
+  fuzzy_begin_bulk_insert (state->file_index);
+  g_hash_table_iter_init (&iter, state->paths);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    fuzzy_insert (state->file_index, key, NULL);
+  fuzzy_end_bulk_insert (state->file_index);
+
+  g_rw_lock_writer_unlock (&self->priv->index_lock);
+
+  g_debug ("Updated git file index, %u removed and %u added.",
+           state->removed->len, g_hash_table_size (state->paths));
+
+  if (cache_path && cache_key)
+    {
+      g_rw_lock_reader_lock (&self->priv->index_lock);
+      gb_git_search_provider_save_file_index (state->file_index, cache_path,
+                                              cache_key);
+      g_rw_lock_reader_unlock (&self->priv->index_lock);
+    }
+
+  g_task_return_boolean (task, TRUE);
+
+cleanup:
+  g_free (cache_path);
+  g_free (cache_key);
+  g_clear_pointer (&entries, ggit_index_entries_unref);
+  g_clear_object (&index);
+  g_clear_object (&repository);
+}
+
+static void
+update_cb (GObject      *object,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  GbGitSearchProvider *provider = (GbGitSearchProvider *)object;
+  GTask *task = (GTask *)result;
+  UpdateState *state;
+  GError *error = NULL;
+  gboolean changed;
+
+  g_return_if_fail (GB_IS_GIT_SEARCH_PROVIDER (provider));
+  g_return_if_fail (G_IS_TASK (task));
+
+  provider->priv->updating = FALSE;
+
+  state = g_task_get_task_data (task);
+  changed = g_task_propagate_boolean (task, &error);
+
+  if (error)
+    {
+      g_warning ("%s", error->message);
+      g_clear_error (&error);
+    }
+  else if (changed && (state->file_index == provider->priv->file_index))
+    {
+      provider->priv->index_serial++;
+      gb_search_provider_emit_changed (GB_SEARCH_PROVIDER (provider));
+    }
+
+  if (provider->priv->update_pending)
+    gb_git_search_provider_queue_update (provider);
+}
+
+static gboolean
+gb_git_search_provider_update_timeout (gpointer user_data)
+{
+  GbGitSearchProvider *provider = user_data;
+  GbGitSearchProviderPrivate *priv = provider->priv;
+  UpdateState *state;
+  GTask *task;
+
+  priv->update_timeout = 0;
+
+  /*
+   * A running update or load queues another update when it completes,
+   * since it may have read the git index before this change.
+   */
+  if (priv->updating || !priv->file_index)
+    return G_SOURCE_REMOVE;
+
+  priv->update_pending = FALSE;
+  priv->updating = TRUE;
+
+  state = g_new0 (UpdateState, 1);
+  state->repository_dir = g_object_ref (priv->repository_dir);
+  state->file_index = fuzzy_ref (priv->file_index);
+
+  task = g_task_new (provider, NULL, update_cb, NULL);
+  g_task_set_task_data (task, state, update_state_free);
+  g_task_run_in_thread (task, gb_git_search_provider_update_file_index);
+  g_object_unref (task);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+gb_git_search_provider_queue_update (GbGitSearchProvider *provider)
+{
+  GbGitSearchProviderPrivate *priv = provider->priv;
+
+  priv->update_pending = TRUE;
+
+  if (priv->update_timeout)
+    g_source_remove (priv->update_timeout);
+
+  priv->update_timeout =
+    g_timeout_add (GB_GIT_SEARCH_PROVIDER_UPDATE_DELAY_MSEC,
+                   gb_git_search_provider_update_timeout,
+                   provider);
+}
+
+static void
+gb_git_search_provider_index_changed (GbGitSearchProvider *provider,
+                                      GFile               *file,
+                                      GFile               *other_file,
+                                      GFileMonitorEvent    event,
+                                      GFileMonitor        *monitor)
+{
+  g_return_if_fail (GB_IS_GIT_SEARCH_PROVIDER (provider));
+
+  switch (event)
+    {
+    case G_FILE_MONITOR_EVENT_CHANGED:
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_CREATED:
+      gb_git_search_provider_queue_update (provider);
+      break;
+
+    default:
+      break;
+    }
+}
+
 static gchar **
 split_path (const gchar  *path,
             gchar       **shortname)
@@ -260,124 +691,418 @@ activate_cb (GbSearchResult *result,
 }
 
 static void
-gb_git_search_provider_populate (GbSearchProvider *provider,
-                                 GbSearchContext  *context,
-                                 const gchar      *search_terms,
-                                 gsize             max_results,
-                                 GCancellable     *cancellable)
+populate_state_free (gpointer data)
 {
-  GbGitSearchProvider *self = (GbGitSearchProvider *)provider;
+  PopulateState *state = data;
+
+  g_clear_object (&state->context);
+  g_clear_pointer (&state->file_index, fuzzy_unref);
+  g_free (state->search_terms);
+  g_free (state);
+}
+
+static gchar *
+strip_search_terms (const gchar *search_terms)
+{
+  GString *stripped;
+  const gchar *ptr;
+
+  stripped = g_string_new (NULL);
+
+  for (ptr = search_terms; *ptr; ptr = g_utf8_next_char (ptr))
+    {
+      gunichar ch;
+
+      ch = g_utf8_get_char (ptr);
+
+      if (!g_unichar_isspace (ch))
+        g_string_append_unichar (stripped, ch);
+    }
+
+  return g_string_free (stripped, FALSE);
+}
+
+static void
+clear_match (gpointer data)
+{
+  FuzzyMatch *match = data;
+
+  g_free ((gchar *)match->key);
+}
+
+static void
+gb_git_search_provider_populate_worker (GTask        *task,
+                                        gpointer      source_object,
+                                        gpointer      task_data,
+                                        GCancellable *cancellable)
+{
+  GbGitSearchProvider *self = source_object;
+  PopulateState *state = task_data;
+  FuzzyQuery *query = NULL;
+  gchar *stripped;
+  GArray *matches = NULL;
+  gint64 deadline;
+  guint i;
 
   g_return_if_fail (GB_IS_GIT_SEARCH_PROVIDER (self));
-  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
-  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
+  stripped = strip_search_terms (state->search_terms);
+
+  /*
+   * Use the type-ahead query so that each keystroke only needs to
+   * re-check the files that matched the previous search terms.
+   */
+  deadline = g_get_monotonic_time () + GB_GIT_SEARCH_PROVIDER_MATCH_TIMEOUT_USEC;
+
+  g_mutex_lock (&self->priv->query_lock);
   if (self->priv->file_index)
     {
-      GString *str = g_string_new (NULL);
-      GString *stripped = g_string_new (NULL);
-      GbSearchReducer reducer = { 0 };
-      const gchar *ptr;
-      gchar *delimited;
-      GArray *matches;
-      guint i;
-      guint truncate_len;
-
-      for (ptr = search_terms; *ptr; ptr = g_utf8_next_char (ptr))
-        {
-          gunichar ch;
+      state->file_index = fuzzy_ref (self->priv->file_index);
+      query = self->priv->file_query;
+      self->priv->file_query = NULL;
+    }
+  else
+    {
+      state->no_index = TRUE;
+    }
+  g_mutex_unlock (&self->priv->query_lock);
 
-          ch = g_utf8_get_char (ptr);
+  /*
+   * The keys of the matches point into the index, which may be updated
+   * as soon as the lock is released, so take copies of them.
+   */
+  if (state->file_index)
+    {
+      g_rw_lock_reader_lock (&self->priv->index_lock);
+
+      if (query)
+        matches = fuzzy_query_match_full (query, stripped,
+                                          GB_GIT_SEARCH_PROVIDER_MAX_MATCHES,
+                                          cancellable, deadline,
+                                          &state->truncated);
+      else
+        matches = fuzzy_match_full (state->file_index, stripped,
+                                    GB_GIT_SEARCH_PROVIDER_MAX_MATCHES,
+                                    cancellable, deadline,
+                                    &state->truncated);
 
-          if ((isascii (ch) != 0) && !g_unichar_isspace (ch))
-            g_string_append_unichar (stripped, ch);
+      for (i = 0; i < matches->len; i++)
+        {
+          FuzzyMatch *match = &g_array_index (matches, FuzzyMatch, i);
+
+          match->key = g_strdup (match->key);
         }
+      g_array_set_clear_func (matches, clear_match);
 
-      delimited = g_string_free (stripped, FALSE);
-      matches = fuzzy_match (self->priv->file_index, delimited,
-                             GB_GIT_SEARCH_PROVIDER_MAX_MATCHES);
+      g_rw_lock_reader_unlock (&self->priv->index_lock);
+    }
 
-      if (self->priv->repository)
+  /*
+   * Hand the query back for the next search, unless the index has been
+   * reloaded in the meantime.
+   */
+  if (query)
+    {
+      g_mutex_lock (&self->priv->query_lock);
+      if (!self->priv->file_query &&
+          (self->priv->file_index == state->file_index))
         {
-          GFile *repo_dir = NULL;
+          self->priv->file_query = query;
+          query = NULL;
+        }
+      g_mutex_unlock (&self->priv->query_lock);
 
-          repo_dir = ggit_repository_get_location (self->priv->repository);
-          if (repo_dir)
-            {
-              gchar *repo_name;
+      g_clear_pointer (&query, fuzzy_query_free);
+    }
 
-              repo_name = g_file_get_basename (repo_dir);
+  g_free (stripped);
 
-              if (g_strcmp0 (repo_name, ".git") == 0)
-                {
-                  GFile *tmp;
+  if (!matches)
+    matches = g_array_new (FALSE, FALSE, sizeof (FuzzyMatch));
 
-                  tmp = repo_dir;
-                  repo_dir = g_file_get_parent (repo_dir);
-                  g_clear_object (&tmp);
+  g_task_return_pointer (task, matches, (GDestroyNotify)g_array_unref);
+}
 
-                  repo_name = g_file_get_basename (repo_dir);
-                }
+static void
+gb_git_search_provider_populate_async (GbSearchProvider    *provider,
+                                       GbSearchContext     *context,
+                                       const gchar         *search_terms,
+                                       gsize                max_results,
+                                       GCancellable        *cancellable,
+                                       GAsyncReadyCallback  callback,
+                                       gpointer             user_data)
+{
+  GbGitSearchProvider *self = (GbGitSearchProvider *)provider;
+  PopulateState *state;
+  GTask *task;
 
-              g_string_append (str, repo_name);
+  g_return_if_fail (GB_IS_GIT_SEARCH_PROVIDER (self));
+  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
-              g_clear_object (&repo_dir);
-              g_free (repo_name);
-            }
+  state = g_new0 (PopulateState, 1);
+  state->context = g_object_ref (context);
+  state->search_terms = g_strdup (search_terms);
+  state->max_results = max_results;
+  state->index_serial = self->priv->index_serial;
+  state->no_index = !self->priv->file_index;
 
-          if (self->priv->repository_shorthand)
-            g_string_append_printf (str, "[%s]",
-                                    self->priv->repository_shorthand);
-        }
+  task = g_task_new (provider, cancellable, callback, user_data);
+  g_task_set_task_data (task, state, populate_state_free);
 
-      truncate_len = str->len;
+  if (state->no_index)
+    g_task_return_pointer (task,
+                           g_array_new (FALSE, FALSE, sizeof (FuzzyMatch)),
+                           (GDestroyNotify)g_array_unref);
+  else
+    g_task_run_in_thread (task, gb_git_search_provider_populate_worker);
 
-      gb_search_reducer_init (&reducer, context, provider);
+  g_object_unref (task);
+}
 
-      for (i = 0; i < matches->len; i++)
+/*
+ * Builds the results for @matches on the main loop, since adding them to
+ * the context updates the search display.
+ */
+static void
+gb_git_search_provider_add_results (GbGitSearchProvider *self,
+                                    GbSearchContext     *context,
+                                    const gchar         *search_terms,
+                                    gsize                max_results,
+                                    GArray              *matches)
+{
+  GbSearchProvider *provider = (GbSearchProvider *)self;
+  GString *str = g_string_new (NULL);
+  GbSearchReducer reducer = { 0 };
+  const gchar *highlight;
+  guint i;
+  guint truncate_len;
+
+  if (self->priv->repository)
+    {
+      GFile *repo_dir = NULL;
+
+      repo_dir = ggit_repository_get_location (self->priv->repository);
+      if (repo_dir)
         {
-          FuzzyMatch *match;
-          gchar *shortname = NULL;
-          gchar **parts;
-          guint j;
+          gchar *repo_name;
 
-          match = &g_array_index (matches, FuzzyMatch, i);
+          repo_name = g_file_get_basename (repo_dir);
 
-          if (gb_search_reducer_accepts (&reducer, match->score))
+          if (g_strcmp0 (repo_name, ".git") == 0)
             {
-              GbSearchResult *result;
-              gchar *markup;
-
-              parts = split_path (match->value, &shortname);
-              for (j = 0; parts [j]; j++)
-                g_string_append_printf (str, " / %s", parts [j]);
-
-              markup = gb_str_highlight (shortname, search_terms);
-
-              result = gb_search_result_new (markup, str->str, match->score);
-              g_object_set_qdata_full (G_OBJECT (result), gQuarkPath,
-                                       g_strdup (match->value), g_free);
-              g_signal_connect (result,
-                                "activate",
-                                G_CALLBACK (activate_cb),
-                                provider);
-              gb_search_reducer_push (&reducer, result);
-              g_object_unref (result);
-
-              g_free (markup);
-              g_free (shortname);
-              g_strfreev (parts);
-              g_string_truncate (str, truncate_len);
+              GFile *tmp;
+
+              tmp = repo_dir;
+              repo_dir = g_file_get_parent (repo_dir);
+              g_clear_object (&tmp);
+
+              repo_name = g_file_get_basename (repo_dir);
             }
+
+          g_string_append (str, repo_name);
+
+          g_clear_object (&repo_dir);
+          g_free (repo_name);
         }
 
-      gb_search_context_set_provider_count (context, provider, matches->len);
+      if (self->priv->repository_shorthand)
+        g_string_append_printf (str, "[%s]",
+                                self->priv->repository_shorthand);
+    }
+
+  truncate_len = str->len;
+
+  /*
+   * Only the file name is shown with highlights, which can only
+   * match the search terms after the last '/'.
+   */
+  if ((highlight = strrchr (search_terms, '/')))
+    highlight++;
+  else
+    highlight = search_terms;
+
+  gb_search_reducer_init (&reducer, context, provider, max_results);
+
+  for (i = 0; i < matches->len; i++)
+    {
+      FuzzyMatch *match;
+      gchar *shortname = NULL;
+      gchar **parts;
+      guint j;
 
-      gb_search_reducer_destroy (&reducer);
-      g_array_unref (matches);
-      g_free (delimited);
-      g_string_free (str, TRUE);
+      match = &g_array_index (matches, FuzzyMatch, i);
+
+      if (gb_search_reducer_accepts (&reducer, match->score))
+        {
+          GbSearchResult *result;
+          gchar *markup;
+
+          parts = split_path (match->key, &shortname);
+          for (j = 0; parts [j]; j++)
+            g_string_append_printf (str, " / %s", parts [j]);
+
+          markup = gb_str_highlight (shortname, highlight);
+
+          result = gb_search_result_new (markup, str->str, match->score);
+          g_object_set_qdata_full (G_OBJECT (result), gQuarkPath,
+                                   g_strdup (match->key), g_free);
+          g_signal_connect (result,
+                            "activate",
+                            G_CALLBACK (activate_cb),
+                            provider);
+          gb_search_reducer_push (&reducer, result);
+          g_object_unref (result);
+
+          g_free (markup);
+          g_free (shortname);
+          g_strfreev (parts);
+          g_string_truncate (str, truncate_len);
+        }
     }
+
+  gb_search_reducer_finish (&reducer);
+  gb_search_context_set_provider_count (context, provider, matches->len);
+
+  gb_search_reducer_destroy (&reducer);
+  g_string_free (str, TRUE);
+}
+
+/*
+ * Reports every matched path as a candidate for longer search terms, as
+ * long as nothing was left out of @matches.
+ */
+static void
+gb_git_search_provider_set_candidates (GbGitSearchProvider *self,
+                                       GbSearchContext     *context,
+                                       GArray              *matches,
+                                       gboolean             truncated)
+{
+  GPtrArray *candidates;
+  guint i;
+
+  if (truncated || (matches->len >= GB_GIT_SEARCH_PROVIDER_MAX_MATCHES))
+    return;
+
+  candidates = g_ptr_array_new_full (matches->len, g_free);
+
+  for (i = 0; i < matches->len; i++)
+    g_ptr_array_add (candidates,
+                     g_strdup (g_array_index (matches, FuzzyMatch, i).key));
+
+  gb_search_context_set_candidates (context, GB_SEARCH_PROVIDER (self),
+                                    candidates);
+  g_ptr_array_unref (candidates);
+}
+
+static gboolean
+gb_git_search_provider_populate_finish (GbSearchProvider  *provider,
+                                        GAsyncResult      *result,
+                                        GError           **error)
+{
+  GbGitSearchProvider *self = (GbGitSearchProvider *)provider;
+  GTask *task = (GTask *)result;
+  PopulateState *state;
+  GArray *matches;
+
+  g_return_val_if_fail (GB_IS_GIT_SEARCH_PROVIDER (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (task), FALSE);
+
+  /*
+   * If the search was cancelled, the search terms have already changed
+   * and nobody wants these results. GTask reports that as an error.
+   */
+  if (!(matches = g_task_propagate_pointer (task, error)))
+    return FALSE;
+
+  state = g_task_get_task_data (task);
+  gb_git_search_provider_add_results (self, state->context,
+                                      state->search_terms, state->max_results,
+                                      matches);
+
+  /*
+   * Nothing matched before the index is loaded, and matches from an
+   * index that has since changed could miss files. Neither may be used
+   * to answer longer searches.
+   */
+  if (!state->no_index &&
+      (state->file_index == self->priv->file_index) &&
+      (state->index_serial == self->priv->index_serial))
+    gb_git_search_provider_set_candidates (self, state->context, matches,
+                                           state->truncated);
+
+  g_array_unref (matches);
+
+  return TRUE;
+}
+
+/*
+ * The file index is path aware, so appending a '/' can match files that
+ * the shorter search terms did not.
+ */
+static gboolean
+gb_git_search_provider_can_narrow (GbSearchProvider *provider,
+                                   const gchar      *prefix,
+                                   const gchar      *search_terms)
+{
+  GbGitSearchProvider *self = (GbGitSearchProvider *)provider;
+  gboolean ret = FALSE;
+  gchar *stripped_prefix;
+  gchar *stripped;
+
+  g_return_val_if_fail (GB_IS_GIT_SEARCH_PROVIDER (self), FALSE);
+
+  stripped_prefix = strip_search_terms (prefix);
+  stripped = strip_search_terms (search_terms);
+
+  g_mutex_lock (&self->priv->query_lock);
+  if (self->priv->file_index)
+    ret = fuzzy_can_narrow (self->priv->file_index, stripped_prefix, stripped);
+  g_mutex_unlock (&self->priv->query_lock);
+
+  g_free (stripped_prefix);
+  g_free (stripped);
+
+  return ret;
+}
+
+/*
+ * Matches @search_terms against the paths that matched an earlier search,
+ * which are few enough to index on the spot.
+ */
+static void
+gb_git_search_provider_refilter (GbSearchProvider *provider,
+                                 GbSearchContext  *context,
+                                 GPtrArray        *candidates,
+                                 const gchar      *search_terms,
+                                 gsize             max_results)
+{
+  GbGitSearchProvider *self = (GbGitSearchProvider *)provider;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  gchar *stripped;
+  guint i;
+
+  g_return_if_fail (GB_IS_GIT_SEARCH_PROVIDER (self));
+  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
+
+  fuzzy = fuzzy_new_full (FALSE, candidates->len, NULL);
+  fuzzy_set_path_aware (fuzzy, TRUE);
+  fuzzy_begin_bulk_insert (fuzzy);
+  for (i = 0; i < candidates->len; i++)
+    fuzzy_insert (fuzzy, g_ptr_array_index (candidates, i), NULL);
+  fuzzy_end_bulk_insert (fuzzy);
+
+  stripped = strip_search_terms (search_terms);
+  matches = fuzzy_match (fuzzy, stripped, GB_GIT_SEARCH_PROVIDER_MAX_MATCHES);
+
+  gb_git_search_provider_add_results (self, context, search_terms,
+                                      max_results, matches);
+  gb_git_search_provider_set_candidates (self, context, matches, FALSE);
+
+  g_array_unref (matches);
+  g_free (stripped);
+  fuzzy_unref (fuzzy);
 }
 
 GgitRepository *
@@ -403,13 +1128,39 @@ gb_git_search_provider_set_repository (GbGitSearchProvider *provider,
       if (priv->repository)
         g_clear_object (&provider->priv->repository);
 
+      if (priv->update_timeout)
+        {
+          g_source_remove (priv->update_timeout);
+          priv->update_timeout = 0;
+        }
+
+      priv->update_pending = FALSE;
+      g_clear_object (&priv->index_monitor);
+
       if (repository)
         {
+          GFile *index_file;
           GTask *task;
 
           g_clear_object (&priv->repository_dir);
           priv->repository_dir = ggit_repository_get_location (repository);
 
+          /*
+           * Keep the file index up to date as files are added, removed
+           * and renamed, all of which rewrite the git index.
+           */
+          index_file = g_file_get_child (priv->repository_dir, "index");
+          priv->index_monitor = g_file_monitor_file (index_file,
+                                                     G_FILE_MONITOR_NONE,
+                                                     NULL, NULL);
+          if (priv->index_monitor)
+            g_signal_connect_object (priv->index_monitor,
+                                     "changed",
+                                     G_CALLBACK (gb_git_search_provider_index_changed),
+                                     provider,
+                                     G_CONNECT_SWAPPED);
+          g_object_unref (index_file);
+
           priv->repository = g_object_ref (repository);
           task = g_task_new (provider, NULL, load_cb, provider);
           g_task_set_task_data (task,
@@ -434,10 +1185,20 @@ gb_git_search_provider_finalize (GObject *object)
 {
   GbGitSearchProviderPrivate *priv = GB_GIT_SEARCH_PROVIDER (object)->priv;
 
+  if (priv->update_timeout)
+    {
+      g_source_remove (priv->update_timeout);
+      priv->update_timeout = 0;
+    }
+
   g_clear_pointer (&priv->repository_shorthand, g_free);
+  g_clear_object (&priv->index_monitor);
   g_clear_object (&priv->repository_dir);
   g_clear_object (&priv->repository);
+  g_clear_pointer (&priv->file_query, fuzzy_query_free);
   g_clear_pointer (&priv->file_index, fuzzy_unref);
+  g_mutex_clear (&priv->query_lock);
+  g_rw_lock_clear (&priv->index_lock);
 
   G_OBJECT_CLASS (gb_git_search_provider_parent_class)->finalize (object);
 }
@@ -498,7 +1259,10 @@ gb_git_search_provider_class_init (GbGitSearchProviderClass *klass)
   object_class->get_property = gb_git_search_provider_get_property;
   object_class->set_property = gb_git_search_provider_set_property;
 
-  provider_class->populate = gb_git_search_provider_populate;
+  provider_class->populate_async = gb_git_search_provider_populate_async;
+  provider_class->populate_finish = gb_git_search_provider_populate_finish;
+  provider_class->can_narrow = gb_git_search_provider_can_narrow;
+  provider_class->refilter = gb_git_search_provider_refilter;
   provider_class->get_verb = gb_git_search_provider_get_verb;
 
   /**
@@ -536,4 +1300,6 @@ static void
 gb_git_search_provider_init (GbGitSearchProvider *self)
 {
   self->priv = gb_git_search_provider_get_instance_private (self);
+  g_mutex_init (&self->priv->query_lock);
+  g_rw_lock_init (&self->priv->index_lock);
 }
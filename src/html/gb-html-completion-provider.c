@@ -21,6 +21,19 @@
 #include "gb-html-completion-provider.h"
 #include "trie.h"
 
+/*
+ * Only the first page of proposals is built, so that short prefixes do not
+ * walk and allocate an item for every key in the vocabulary.
+ */
+#define MAX_PROPOSALS 100
+
+/*
+ * If nothing starts with the word, allow for a single typo once the word
+ * is long enough for that to still be meaningful.
+ */
+#define MIN_FUZZY_CHARS 3
+#define MAX_FUZZY_EDITS 1
+
 static GHashTable *element_attrs;
 static Trie *css_styles;
 static Trie *elements;
@@ -37,6 +50,7 @@ enum {
 typedef struct
 {
   GList *results;
+  guint n_results;
   gint mode;
 } SearchState;
 
@@ -285,12 +299,56 @@ traverse_cb (Trie        *trie,
                        NULL);
 
   state->results = g_list_prepend (state->results, item);
+  state->n_results++;
 
   g_free (tmp);
 
   return FALSE;
 }
 
+static void
+load_proposals (Trie        *trie,
+                const gchar *word,
+                SearchState *state)
+{
+  TrieIter iter;
+  const gchar *key;
+  gpointer value;
+
+  if (!trie || (state->n_results >= MAX_PROPOSALS))
+    return;
+
+  trie_iter_init_prefix (&iter, trie, word, MAX_PROPOSALS - state->n_results);
+  while (trie_iter_next (&iter, &key, &value))
+    traverse_cb (trie, key, value, state);
+  trie_iter_clear (&iter);
+}
+
+static gboolean
+traverse_fuzzy_cb (Trie        *trie,
+                   const gchar *key,
+                   gpointer     value,
+                   guint        distance,
+                   gpointer     user_data)
+{
+  SearchState *state = user_data;
+
+  traverse_cb (trie, key, value, state);
+
+  return (state->n_results >= MAX_PROPOSALS);
+}
+
+static void
+load_fuzzy_proposals (Trie        *trie,
+                      const gchar *word,
+                      SearchState *state)
+{
+  if (trie && word &&
+      (state->n_results < MAX_PROPOSALS) &&
+      (g_utf8_strlen (word, -1) >= MIN_FUZZY_CHARS))
+    trie_traverse_fuzzy (trie, word, MAX_FUZZY_EDITS, traverse_fuzzy_cb, state);
+}
+
 static gboolean
 find_space (gunichar ch,
             gpointer user_data)
@@ -407,10 +465,7 @@ gb_html_completion_provider_populate (GtkSourceCompletionProvider *provider,
    * Load the values for the context.
    */
   if (trie && word)
-    {
-      trie_traverse (trie, word, G_PRE_ORDER, G_TRAVERSE_LEAVES, -1,
-                     traverse_cb, &state);
-    }
+    load_proposals (trie, word, &state);
 
   /*
    * If we are in an attribute, also load the global attributes values.
@@ -420,8 +475,19 @@ gb_html_completion_provider_populate (GtkSourceCompletionProvider *provider,
       Trie *global;
 
       global = g_hash_table_lookup (element_attrs, "*");
-      trie_traverse (global, word, G_PRE_ORDER, G_TRAVERSE_LEAVES, -1,
-                     traverse_cb, &state);
+      load_proposals (global, word, &state);
+    }
+
+  /*
+   * Nothing starts with the word, so it may contain a typo.
+   */
+  if (!state.results)
+    {
+      load_fuzzy_proposals (trie, word, &state);
+
+      if (mode == MODE_ATTRIBUTE_NAME)
+        load_fuzzy_proposals (g_hash_table_lookup (element_attrs, "*"),
+                              word, &state);
     }
 
   /*
@@ -444,6 +510,14 @@ gb_html_completion_provider_get_icon (GtkSourceCompletionProvider *provider)
   return NULL;
 }
 
+static void
+freeze_attrs_cb (gpointer key,
+                 gpointer value,
+                 gpointer user_data)
+{
+  trie_freeze (value);
+}
+
 static void
 gb_html_completion_provider_class_init (GbHtmlCompletionProviderClass *klass)
 {
@@ -880,6 +954,14 @@ gb_html_completion_provider_class_init (GbHtmlCompletionProviderClass *klass)
   ADD_STRING (css_styles, "text-align");
 
 #undef ADD_STRING
+
+  /*
+   * The vocabularies never change after this, so convert them into their
+   * compact read-only form.
+   */
+  trie_freeze (elements);
+  trie_freeze (css_styles);
+  g_hash_table_foreach (element_attrs, freeze_attrs_cb, NULL);
 }
 
 static void
@@ -26,6 +26,7 @@
 #include "gb-search-context.h"
 #include "gb-search-display.h"
 #include "gb-search-manager.h"
+#include "gb-search-provider.h"
 #include "gb-search-result.h"
 #include "gb-string.h"
 #include "gb-widget.h"
@@ -33,11 +34,23 @@
 
 #define SHORT_DELAY_TIMEOUT_MSEC 30
 #define LONG_DELAY_TIMEOUT_MSEC  30
+#define MAX_DELAY_TIMEOUT_MSEC   250
+
+/*
+ * Searches that complete within a frame are started on every keypress.
+ */
+#define IMMEDIATE_LATENCY_USEC   (G_USEC_PER_SEC / 60)
+
+/*
+ * The number of searches to remember candidates for, per provider.
+ */
+#define MAX_CACHED_QUERIES 32
 
 struct _GbSearchBoxPrivate
 {
   /* References owned by instance */
   GbSearchManager *search_manager;
+  GHashTable      *candidates;
 
   /* Weak references */
   GbWorkbench     *workbench;
@@ -95,12 +108,105 @@ gb_search_box_set_search_manager (GbSearchBox     *box,
     }
 }
 
+static void
+gb_search_box_provider_changed (GbSearchBox      *box,
+                                GbSearchProvider *provider)
+{
+  GHashTable *queries;
+
+  g_return_if_fail (GB_IS_SEARCH_BOX (box));
+  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
+
+  if ((queries = g_hash_table_lookup (box->priv->candidates, provider)))
+    g_hash_table_remove_all (queries);
+}
+
+/*
+ * Remembers the candidates for the search terms of @context, so that
+ * searches that extend them can be answered by refiltering. Candidates
+ * are dropped when the provider reports that its data changed.
+ */
+static void
+gb_search_box_context_candidates_set (GbSearchBox      *box,
+                                      GbSearchProvider *provider,
+                                      GPtrArray        *candidates,
+                                      GbSearchContext  *context)
+{
+  GHashTable *queries;
+  const gchar *search_terms;
+
+  g_return_if_fail (GB_IS_SEARCH_BOX (box));
+  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
+  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
+
+  if (!(search_terms = gb_search_context_get_search_terms (context)))
+    return;
+
+  queries = g_hash_table_lookup (box->priv->candidates, provider);
+
+  if (!queries)
+    {
+      queries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)g_ptr_array_unref);
+      g_hash_table_insert (box->priv->candidates, g_object_ref (provider),
+                           queries);
+      g_signal_connect_object (provider,
+                               "changed",
+                               G_CALLBACK (gb_search_box_provider_changed),
+                               box,
+                               G_CONNECT_SWAPPED);
+    }
+
+  if (g_hash_table_size (queries) >= MAX_CACHED_QUERIES)
+    g_hash_table_remove_all (queries);
+
+  g_hash_table_insert (queries, g_strdup (search_terms),
+                       g_ptr_array_ref (candidates));
+}
+
+/*
+ * Finds the candidates cached for the longest search terms that
+ * @search_text narrows down, since those are the fewest to refilter.
+ */
+static GPtrArray *
+gb_search_box_lookup_candidates (GbSearchBox      *box,
+                                 GbSearchProvider *provider,
+                                 const gchar      *search_text)
+{
+  GHashTableIter iter;
+  GHashTable *queries;
+  GPtrArray *ret = NULL;
+  gpointer key;
+  gpointer value;
+  gsize ret_len = 0;
+
+  if (!(queries = g_hash_table_lookup (box->priv->candidates, provider)))
+    return NULL;
+
+  g_hash_table_iter_init (&iter, queries);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      gsize len = strlen (key);
+
+      if ((!ret || (len > ret_len)) &&
+          gb_search_provider_can_narrow (provider, key, search_text))
+        {
+          ret = value;
+          ret_len = len;
+        }
+    }
+
+  return ret;
+}
+
 static gboolean
 gb_search_box_delay_cb (gpointer user_data)
 {
   GbSearchBox *box = user_data;
   GbSearchContext *context;
   const gchar *search_text;
+  const GList *iter;
 
   g_return_val_if_fail (GB_IS_SEARCH_BOX (box), G_SOURCE_REMOVE);
 
@@ -118,6 +224,25 @@ gb_search_box_delay_cb (gpointer user_data)
     return G_SOURCE_REMOVE;
 
   context = gb_search_manager_search (box->priv->search_manager, NULL, search_text); /* TODO: Remove search text */
+  if (!context)
+    return G_SOURCE_REMOVE;
+
+  for (iter = gb_search_context_get_providers (context); iter; iter = iter->next)
+    {
+      GPtrArray *candidates;
+
+      candidates = gb_search_box_lookup_candidates (box, iter->data,
+                                                    search_text);
+      if (candidates)
+        gb_search_context_reuse_candidates (context, iter->data, candidates);
+    }
+
+  g_signal_connect_object (context,
+                           "candidates-set",
+                           G_CALLBACK (gb_search_box_context_candidates_set),
+                           box,
+                           G_CONNECT_SWAPPED);
+
   gb_search_display_set_context (box->priv->display, context);
   gb_search_context_execute (context, search_text);
   g_object_unref (context);
@@ -163,6 +288,37 @@ gb_search_box_entry_activate (GbSearchBox    *box,
   gb_search_display_activate (box->priv->display);
 }
 
+/*
+ * Picks how long to wait for more typing before searching, based on how
+ * long the slowest provider has been taking. Returns 0 to search right
+ * away.
+ */
+static guint
+gb_search_box_get_delay (GbSearchBox *box,
+                         const gchar *search_text)
+{
+  guint delay_msec = SHORT_DELAY_TIMEOUT_MSEC;
+  gint64 latency = -1;
+
+  if (box->priv->search_manager)
+    latency = gb_search_manager_get_max_latency (box->priv->search_manager);
+
+  if (latency >= 0)
+    {
+      if (latency < IMMEDIATE_LATENCY_USEC)
+        return 0;
+
+      delay_msec = CLAMP (latency / 1000,
+                          SHORT_DELAY_TIMEOUT_MSEC,
+                          MAX_DELAY_TIMEOUT_MSEC);
+    }
+
+  if (strlen (search_text) < 3)
+    delay_msec = MAX (delay_msec, LONG_DELAY_TIMEOUT_MSEC);
+
+  return delay_msec;
+}
+
 static void
 gb_search_box_entry_changed (GbSearchBox    *box,
                              GtkSearchEntry *entry)
@@ -170,7 +326,6 @@ gb_search_box_entry_changed (GbSearchBox    *box,
   GtkToggleButton *button;
   const gchar *text;
   gboolean active;
-  guint delay_msec = SHORT_DELAY_TIMEOUT_MSEC;
 
   g_return_if_fail (GB_IS_SEARCH_BOX (box));
   g_return_if_fail (GTK_IS_SEARCH_ENTRY (entry));
@@ -189,11 +344,17 @@ gb_search_box_entry_changed (GbSearchBox    *box,
       search_text = gtk_entry_get_text (GTK_ENTRY (entry));
       if (search_text)
         {
-          if (strlen (search_text) < 3)
-            delay_msec = LONG_DELAY_TIMEOUT_MSEC;
-          box->priv->delay_timeout = g_timeout_add (delay_msec,
-                                                    gb_search_box_delay_cb,
-                                                    box);
+          guint delay_msec;
+
+          delay_msec = gb_search_box_get_delay (box, search_text);
+          g_debug ("Search delay %u msec", delay_msec);
+
+          if (!delay_msec)
+            gb_search_box_delay_cb (box);
+          else
+            box->priv->delay_timeout = g_timeout_add (delay_msec,
+                                                      gb_search_box_delay_cb,
+                                                      box);
         }
     }
 }
@@ -397,6 +558,7 @@ gb_search_box_finalize (GObject *object)
     }
 
   g_clear_object (&priv->search_manager);
+  g_clear_pointer (&priv->candidates, g_hash_table_unref);
 
   G_OBJECT_CLASS (gb_search_box_parent_class)->finalize (object);
 }
@@ -480,6 +642,9 @@ gb_search_box_init (GbSearchBox *self)
 
   gtk_widget_init_template (GTK_WIDGET (self));
 
+  self->priv->candidates = g_hash_table_new_full (NULL, NULL, g_object_unref,
+                                                  (GDestroyNotify)g_hash_table_unref);
+
   /*
    * WORKAROUND:
    *
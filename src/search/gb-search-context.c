@@ -25,28 +25,127 @@
 
 struct _GbSearchContextPrivate
 {
-  GCancellable *cancellable;
-  GList        *providers;
-  guint         executed : 1;
+  GCancellable  *cancellable;
+  GList         *providers;
+  GHashTable    *max_results;
+  GHashTable    *reused_candidates;
+  GHashTable    *batches;
+  gchar         *search_terms;
+  gint64         begin_time;
+  GdkFrameClock *frame_clock;
+  guint          flush_handler;
+  guint          executed : 1;
+  guint          flush_queued : 1;
 };
 
+/*
+ * Changes for a single provider since "results-changed" was last emitted.
+ */
+typedef struct
+{
+  GPtrArray *added;
+  GPtrArray *removed;
+  guint64    count;
+  guint      has_count : 1;
+} ResultsBatch;
+
 G_DEFINE_TYPE_WITH_PRIVATE (GbSearchContext, gb_search_context, G_TYPE_OBJECT)
 
 enum {
   COUNT_SET,
   RESULT_ADDED,
   RESULT_REMOVED,
+  RESULTS_CHANGED,
+  CANDIDATES_SET,
+  PROVIDER_FINISHED,
   LAST_SIGNAL
 };
 
 static guint gSignals [LAST_SIGNAL];
 
+static void
+results_batch_free (gpointer data)
+{
+  ResultsBatch *batch = data;
+
+  g_ptr_array_unref (batch->added);
+  g_ptr_array_unref (batch->removed);
+  g_free (batch);
+}
+
 GbSearchContext *
 gb_search_context_new (void)
 {
   return g_object_new (GB_TYPE_SEARCH_CONTEXT, NULL);
 }
 
+/**
+ * gb_search_context_get_search_terms:
+ * @context: A #GbSearchContext.
+ *
+ * Returns: The search terms passed to gb_search_context_execute(), or
+ *   %NULL if @context has not been executed.
+ */
+const gchar *
+gb_search_context_get_search_terms (GbSearchContext *context)
+{
+  g_return_val_if_fail (GB_IS_SEARCH_CONTEXT (context), NULL);
+
+  return context->priv->search_terms;
+}
+
+/**
+ * gb_search_context_set_candidates:
+ * @context: A #GbSearchContext.
+ * @provider: A #GbSearchProvider.
+ * @candidates: Every item that matched the search terms of @context.
+ *
+ * Providers that implement the refilter vfunc call this once they have
+ * searched, with everything that matched and not just the results that
+ * were kept. Searches that extend the search terms of @context can then
+ * be answered by narrowing down @candidates with
+ * gb_search_provider_refilter(). The elements of @candidates are only
+ * meaningful to @provider.
+ *
+ * Providers must not call this when their search stopped early, since a
+ * longer search could then match items that are not in @candidates.
+ */
+void
+gb_search_context_set_candidates (GbSearchContext  *context,
+                                  GbSearchProvider *provider,
+                                  GPtrArray        *candidates)
+{
+  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
+  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
+  g_return_if_fail (candidates);
+
+  g_signal_emit (context, gSignals [CANDIDATES_SET], 0, provider, candidates);
+}
+
+/**
+ * gb_search_context_reuse_candidates:
+ * @context: A #GbSearchContext.
+ * @provider: A #GbSearchProvider added to @context.
+ * @candidates: Candidates from an earlier search by @provider whose search
+ *   terms are a prefix of those @context will be executed with.
+ *
+ * Makes gb_search_context_execute() refilter @candidates instead of
+ * running @provider, if @provider supports it.
+ */
+void
+gb_search_context_reuse_candidates (GbSearchContext  *context,
+                                    GbSearchProvider *provider,
+                                    GPtrArray        *candidates)
+{
+  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
+  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
+  g_return_if_fail (candidates);
+  g_return_if_fail (!context->priv->executed);
+
+  g_hash_table_insert (context->priv->reused_candidates, provider,
+                       g_ptr_array_ref (candidates));
+}
+
 const GList *
 gb_search_context_get_providers (GbSearchContext *context)
 {
@@ -55,15 +154,187 @@ gb_search_context_get_providers (GbSearchContext *context)
   return context->priv->providers;
 }
 
+static void
+gb_search_context_flush (GbSearchContext *context)
+{
+  GbSearchContextPrivate *priv = context->priv;
+  GHashTable *batches;
+  GList *iter;
+
+  g_assert (GB_IS_SEARCH_CONTEXT (context));
+
+  priv->flush_queued = FALSE;
+
+  if (!g_hash_table_size (priv->batches))
+    return;
+
+  /*
+   * Handlers may add more results, which start a new batch.
+   */
+  batches = priv->batches;
+  priv->batches = g_hash_table_new_full (NULL, NULL, NULL, results_batch_free);
+
+  g_object_ref (context);
+
+  for (iter = priv->providers; iter; iter = iter->next)
+    {
+      GbSearchProvider *provider = iter->data;
+      ResultsBatch *batch;
+
+      if (!(batch = g_hash_table_lookup (batches, provider)))
+        continue;
+
+      if (batch->added->len || batch->removed->len)
+        g_signal_emit (context, gSignals [RESULTS_CHANGED], 0, provider,
+                       batch->added, batch->removed);
+
+      if (batch->has_count)
+        g_signal_emit (context, gSignals [COUNT_SET], 0, provider,
+                       batch->count);
+    }
+
+  g_hash_table_unref (batches);
+  g_object_unref (context);
+}
+
+static gboolean
+gb_search_context_flush_idle (gpointer user_data)
+{
+  GbSearchContext *context = user_data;
+
+  g_assert (GB_IS_SEARCH_CONTEXT (context));
+
+  context->priv->flush_handler = 0;
+  gb_search_context_flush (context);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+gb_search_context_frame_clock_update (GbSearchContext *context,
+                                      GdkFrameClock   *frame_clock)
+{
+  g_assert (GB_IS_SEARCH_CONTEXT (context));
+  g_assert (GDK_IS_FRAME_CLOCK (frame_clock));
+
+  if (context->priv->flush_queued)
+    gb_search_context_flush (context);
+}
+
+static void
+gb_search_context_queue_flush (GbSearchContext *context)
+{
+  GbSearchContextPrivate *priv = context->priv;
+
+  g_assert (GB_IS_SEARCH_CONTEXT (context));
+
+  if (priv->flush_queued)
+    return;
+
+  priv->flush_queued = TRUE;
+
+  if (priv->frame_clock)
+    gdk_frame_clock_request_phase (priv->frame_clock,
+                                   GDK_FRAME_CLOCK_PHASE_UPDATE);
+  else if (!priv->flush_handler)
+    priv->flush_handler = g_idle_add_full (GDK_PRIORITY_REDRAW,
+                                           gb_search_context_flush_idle,
+                                           context,
+                                           NULL);
+}
+
+static ResultsBatch *
+gb_search_context_get_batch (GbSearchContext  *context,
+                             GbSearchProvider *provider)
+{
+  ResultsBatch *batch;
+
+  g_assert (GB_IS_SEARCH_CONTEXT (context));
+  g_assert (GB_IS_SEARCH_PROVIDER (provider));
+
+  batch = g_hash_table_lookup (context->priv->batches, provider);
+
+  if (!batch)
+    {
+      batch = g_new0 (ResultsBatch, 1);
+      batch->added = g_ptr_array_new_with_free_func (g_object_unref);
+      batch->removed = g_ptr_array_new_with_free_func (g_object_unref);
+      g_hash_table_insert (context->priv->batches, provider, batch);
+    }
+
+  gb_search_context_queue_flush (context);
+
+  return batch;
+}
+
+/**
+ * gb_search_context_set_frame_clock:
+ * @context: A #GbSearchContext.
+ * @frame_clock: (allow-none): A #GdkFrameClock, or %NULL.
+ *
+ * Sets the frame clock used to deliver "results-changed". Changes are
+ * delivered at most once per frame, in the update phase, so that a
+ * display showing the results is only relaid out once per frame. Without
+ * a frame clock, changes are delivered from an idle callback.
+ */
+void
+gb_search_context_set_frame_clock (GbSearchContext *context,
+                                   GdkFrameClock   *frame_clock)
+{
+  GbSearchContextPrivate *priv;
+
+  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
+  g_return_if_fail (!frame_clock || GDK_IS_FRAME_CLOCK (frame_clock));
+
+  priv = context->priv;
+
+  if (priv->frame_clock == frame_clock)
+    return;
+
+  if (priv->frame_clock)
+    {
+      g_signal_handlers_disconnect_by_func (priv->frame_clock,
+                                            G_CALLBACK (gb_search_context_frame_clock_update),
+                                            context);
+      g_clear_object (&priv->frame_clock);
+    }
+
+  if (frame_clock)
+    {
+      priv->frame_clock = g_object_ref (frame_clock);
+      g_signal_connect_object (frame_clock,
+                               "update",
+                               G_CALLBACK (gb_search_context_frame_clock_update),
+                               context,
+                               G_CONNECT_SWAPPED);
+    }
+
+  if (priv->flush_queued)
+    {
+      priv->flush_queued = FALSE;
+      if (priv->flush_handler)
+        {
+          g_source_remove (priv->flush_handler);
+          priv->flush_handler = 0;
+        }
+      gb_search_context_queue_flush (context);
+    }
+}
+
 void
 gb_search_context_add_result (GbSearchContext  *context,
                               GbSearchProvider *provider,
                               GbSearchResult   *result)
 {
+  ResultsBatch *batch;
+
   g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
   g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
   g_return_if_fail (GB_IS_SEARCH_RESULT (result));
 
+  batch = gb_search_context_get_batch (context, provider);
+  g_ptr_array_add (batch->added, g_object_ref (result));
+
   g_signal_emit (context, gSignals [RESULT_ADDED], 0, provider, result);
 }
 
@@ -72,24 +343,100 @@ gb_search_context_remove_result (GbSearchContext  *context,
                                  GbSearchProvider *provider,
                                  GbSearchResult   *result)
 {
+  ResultsBatch *batch;
+
   g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
   g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
   g_return_if_fail (GB_IS_SEARCH_RESULT (result));
 
+  /*
+   * A result that is evicted before it was ever delivered is dropped
+   * from the batch rather than added and then removed again.
+   */
+  g_object_ref (result);
+
+  batch = gb_search_context_get_batch (context, provider);
+  if (!g_ptr_array_remove (batch->added, result))
+    g_ptr_array_add (batch->removed, g_object_ref (result));
+
   g_signal_emit (context, gSignals [RESULT_REMOVED], 0, provider, result);
+
+  g_object_unref (result);
 }
 
+/**
+ * gb_search_context_set_provider_count:
+ * @context: A #GbSearchContext.
+ * @provider: A #GbSearchProvider.
+ * @count: The total number of matches found by @provider.
+ *
+ * Sets the number of matches found by @provider. "count-set" is emitted
+ * along with the next "results-changed", so that the count agrees with
+ * the results that have been delivered.
+ */
 void
 gb_search_context_set_provider_count (GbSearchContext  *context,
                                       GbSearchProvider *provider,
                                       guint64           count)
 {
+  ResultsBatch *batch;
+
   g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
   g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
 
-  g_signal_emit (context, gSignals [COUNT_SET], 0, provider, count);
+  batch = gb_search_context_get_batch (context, provider);
+  batch->count = count;
+  batch->has_count = TRUE;
 }
 
+static void
+gb_search_context_populate_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+  GbSearchProvider *provider = (GbSearchProvider *)object;
+  GbSearchContext *context = user_data;
+  GError *error = NULL;
+  gint64 elapsed;
+
+  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
+  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
+
+  elapsed = g_get_monotonic_time () - context->priv->begin_time;
+
+  if (!gb_search_provider_populate_finish (provider, result, &error))
+    {
+      /*
+       * Slow searches are the ones most likely to be cancelled, so they
+       * are still reported. Otherwise only fast searches would be seen.
+       */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_signal_emit (context, gSignals [PROVIDER_FINISHED], 0, provider,
+                       elapsed, FALSE, TRUE);
+      else
+        g_warning ("%s: %s",
+                   g_type_name (G_TYPE_FROM_INSTANCE (provider)),
+                   error->message);
+      g_clear_error (&error);
+    }
+  else
+    {
+      g_signal_emit (context, gSignals [PROVIDER_FINISHED], 0, provider,
+                     elapsed, FALSE, FALSE);
+    }
+
+  g_object_unref (context);
+}
+
+/**
+ * gb_search_context_execute:
+ * @context: A #GbSearchContext.
+ * @search_terms: The search terms.
+ *
+ * Starts every provider at once. Providers search on worker threads where
+ * they can, and the results of each are added on the main loop as soon as
+ * it finishes, so a slow provider does not hold back the others.
+ */
 void
 gb_search_context_execute (GbSearchContext *context,
                            const gchar     *search_terms)
@@ -101,18 +448,38 @@ gb_search_context_execute (GbSearchContext *context,
   g_return_if_fail (search_terms);
 
   context->priv->executed = TRUE;
+  context->priv->search_terms = g_strdup (search_terms);
+  context->priv->begin_time = g_get_monotonic_time ();
 
   for (iter = context->priv->providers; iter; iter = iter->next)
     {
-      gsize max_results = 0;
-
-      /* TODO: Get the max results for this provider */
-
-      gb_search_provider_populate (iter->data,
-                                   context,
-                                   search_terms,
-                                   max_results,
-                                   context->priv->cancellable);
+      GPtrArray *candidates;
+      gsize max_results;
+      gint64 begin_time;
+
+      max_results = GPOINTER_TO_SIZE (g_hash_table_lookup (context->priv->max_results,
+                                                           iter->data));
+
+      candidates = g_hash_table_lookup (context->priv->reused_candidates,
+                                        iter->data);
+      begin_time = g_get_monotonic_time ();
+
+      if (candidates &&
+          gb_search_provider_refilter (iter->data, context, candidates,
+                                       search_terms, max_results))
+        {
+          g_signal_emit (context, gSignals [PROVIDER_FINISHED], 0, iter->data,
+                         g_get_monotonic_time () - begin_time, TRUE, FALSE);
+          continue;
+        }
+
+      gb_search_provider_populate_async (iter->data,
+                                         context,
+                                         search_terms,
+                                         max_results,
+                                         context->priv->cancellable,
+                                         gb_search_context_populate_cb,
+                                         g_object_ref (context));
     }
 }
 
@@ -125,6 +492,15 @@ gb_search_context_cancel (GbSearchContext *context)
     g_cancellable_cancel (context->priv->cancellable);
 }
 
+/**
+ * gb_search_context_add_provider:
+ * @context: A #GbSearchContext.
+ * @provider: A #GbSearchProvider.
+ * @max_results: The most results to show from @provider, or 0 for the
+ *   provider's default.
+ *
+ * Adds @provider to the providers searched by gb_search_context_execute().
+ */
 void
 gb_search_context_add_provider (GbSearchContext  *context,
                                 GbSearchProvider *provider,
@@ -136,6 +512,8 @@ gb_search_context_add_provider (GbSearchContext  *context,
 
   context->priv->providers = g_list_append (context->priv->providers,
                                             g_object_ref (provider));
+  g_hash_table_insert (context->priv->max_results, provider,
+                       GSIZE_TO_POINTER (max_results));
 }
 
 static void
@@ -143,6 +521,19 @@ gb_search_context_finalize (GObject *object)
 {
   GbSearchContextPrivate *priv = GB_SEARCH_CONTEXT (object)->priv;
 
+  priv->flush_queued = FALSE;
+
+  if (priv->flush_handler)
+    {
+      g_source_remove (priv->flush_handler);
+      priv->flush_handler = 0;
+    }
+
+  gb_search_context_set_frame_clock (GB_SEARCH_CONTEXT (object), NULL);
+  g_clear_pointer (&priv->batches, g_hash_table_unref);
+  g_clear_pointer (&priv->max_results, g_hash_table_unref);
+  g_clear_pointer (&priv->reused_candidates, g_hash_table_unref);
+  g_clear_pointer (&priv->search_terms, g_free);
   g_clear_object (&priv->cancellable);
 
   g_list_foreach (priv->providers, (GFunc)g_object_unref, NULL);
@@ -197,6 +588,84 @@ gb_search_context_class_init (GbSearchContextClass *klass)
                   2,
                   GB_TYPE_SEARCH_PROVIDER,
                   GB_TYPE_SEARCH_RESULT);
+
+  /**
+   * GbSearchContext::results-changed:
+   * @context: A #GbSearchContext.
+   * @provider: The #GbSearchProvider the results belong to.
+   * @added: (element-type GbSearchResult): The results added.
+   * @removed: (element-type GbSearchResult): The results removed.
+   *
+   * Delivers the results added and removed since the last emission for
+   * @provider. This is emitted at most once per frame for each provider,
+   * so handlers can update a view in a single pass rather than once per
+   * result as with "result-added" and "result-removed".
+   */
+  gSignals [RESULTS_CHANGED] =
+    g_signal_new ("results-changed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL,
+                  NULL,
+                  g_cclosure_marshal_generic,
+                  G_TYPE_NONE,
+                  3,
+                  GB_TYPE_SEARCH_PROVIDER,
+                  G_TYPE_PTR_ARRAY,
+                  G_TYPE_PTR_ARRAY);
+
+  /**
+   * GbSearchContext::candidates-set:
+   * @context: A #GbSearchContext.
+   * @provider: The #GbSearchProvider that searched.
+   * @candidates: Every item @provider matched.
+   *
+   * Emitted when @provider reports its candidates with
+   * gb_search_context_set_candidates(), so they can be cached for later
+   * searches.
+   */
+  gSignals [CANDIDATES_SET] =
+    g_signal_new ("candidates-set",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL,
+                  NULL,
+                  g_cclosure_marshal_generic,
+                  G_TYPE_NONE,
+                  2,
+                  GB_TYPE_SEARCH_PROVIDER,
+                  G_TYPE_PTR_ARRAY);
+
+  /**
+   * GbSearchContext::provider-finished:
+   * @context: A #GbSearchContext.
+   * @provider: The #GbSearchProvider that finished.
+   * @elapsed_usec: How long @context waited for @provider, in microseconds.
+   * @refiltered: %TRUE if @provider narrowed down cached candidates
+   *   instead of searching.
+   * @cancelled: %TRUE if the search was cancelled before @provider
+   *   finished, in which case @elapsed_usec is a lower bound.
+   *
+   * Emitted when @provider has added all of its results, or when it
+   * stopped because @context was cancelled. This is not emitted for
+   * providers that failed.
+   */
+  gSignals [PROVIDER_FINISHED] =
+    g_signal_new ("provider-finished",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL,
+                  NULL,
+                  g_cclosure_marshal_generic,
+                  G_TYPE_NONE,
+                  4,
+                  GB_TYPE_SEARCH_PROVIDER,
+                  G_TYPE_INT64,
+                  G_TYPE_BOOLEAN,
+                  G_TYPE_BOOLEAN);
 }
 
 static void
@@ -204,4 +673,10 @@ gb_search_context_init (GbSearchContext *self)
 {
   self->priv = gb_search_context_get_instance_private (self);
   self->priv->cancellable = g_cancellable_new ();
+  self->priv->max_results = g_hash_table_new (NULL, NULL);
+  self->priv->reused_candidates =
+    g_hash_table_new_full (NULL, NULL, NULL,
+                           (GDestroyNotify)g_ptr_array_unref);
+  self->priv->batches = g_hash_table_new_full (NULL, NULL, NULL,
+                                               results_batch_free);
 }
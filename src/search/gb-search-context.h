@@ -19,7 +19,7 @@
 #ifndef GB_SEARCH_CONTEXT_H
 #define GB_SEARCH_CONTEXT_H
 
-#include <glib-object.h>
+#include <gdk/gdk.h>
 
 #include "gb-search-types.h"
 
@@ -54,6 +54,7 @@ struct _GbSearchContextClass
 
 GbSearchContext *gb_search_context_new                (void);
 const GList     *gb_search_context_get_providers      (GbSearchContext  *context);
+const gchar     *gb_search_context_get_search_terms   (GbSearchContext  *context);
 void             gb_search_context_add_provider       (GbSearchContext  *context,
                                                        GbSearchProvider *provider,
                                                        gsize             max_results);
@@ -66,6 +67,14 @@ void             gb_search_context_remove_result      (GbSearchContext  *context
 void             gb_search_context_cancel             (GbSearchContext  *context);
 void             gb_search_context_execute            (GbSearchContext  *context,
                                                        const gchar      *search_terms);
+void             gb_search_context_reuse_candidates   (GbSearchContext  *context,
+                                                       GbSearchProvider *provider,
+                                                       GPtrArray        *candidates);
+void             gb_search_context_set_candidates     (GbSearchContext  *context,
+                                                       GbSearchProvider *provider,
+                                                       GPtrArray        *candidates);
+void             gb_search_context_set_frame_clock    (GbSearchContext  *context,
+                                                       GdkFrameClock    *frame_clock);
 void             gb_search_context_set_provider_count (GbSearchContext  *context,
                                                        GbSearchProvider *provider,
                                                        guint64           count);
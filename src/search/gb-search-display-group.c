@@ -171,6 +171,55 @@ gb_search_display_group_add_result (GbSearchDisplayGroup *group,
   group->priv->count++;
 }
 
+/**
+ * gb_search_display_group_update_results:
+ * @group: A #GbSearchDisplayGroup.
+ * @added: (element-type GbSearchResult): The results to add.
+ * @removed: (element-type GbSearchResult): The results to remove.
+ *
+ * Applies a batch of changes from #GbSearchContext::results-changed. The
+ * rows are only sorted once, after every change has been made.
+ */
+void
+gb_search_display_group_update_results (GbSearchDisplayGroup *group,
+                                        GPtrArray            *added,
+                                        GPtrArray            *removed)
+{
+  guint i;
+
+  g_return_if_fail (GB_IS_SEARCH_DISPLAY_GROUP (group));
+  g_return_if_fail (added);
+  g_return_if_fail (removed);
+
+  for (i = 0; i < removed->len; i++)
+    {
+      GbSearchResult *result = g_ptr_array_index (removed, i);
+      GtkWidget *row;
+
+      row = g_object_get_qdata (G_OBJECT (result), gQuarkRow);
+
+      if (row)
+        {
+          g_object_set_qdata (G_OBJECT (result), gQuarkRow, NULL);
+          gtk_container_remove (GTK_CONTAINER (group->priv->rows), row);
+          group->priv->count--;
+        }
+    }
+
+  for (i = 0; i < added->len; i++)
+    {
+      GbSearchResult *result = g_ptr_array_index (added, i);
+      GtkWidget *row;
+
+      row = gb_search_display_group_create_row (result);
+      gtk_container_add (GTK_CONTAINER (group->priv->rows), row);
+      group->priv->count++;
+    }
+
+  if (added->len)
+    gtk_list_box_invalidate_sort (group->priv->rows);
+}
+
 void
 gb_search_display_group_set_count (GbSearchDisplayGroup *group,
                                    guint64               count)
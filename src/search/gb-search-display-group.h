@@ -45,18 +45,21 @@ struct _GbSearchDisplayGroupClass
   GtkBoxClass parent;
 };
 
-void              gb_search_display_group_clear         (GbSearchDisplayGroup *group);
-GbSearchProvider *gb_search_display_group_get_provider  (GbSearchDisplayGroup *group);
-void              gb_search_display_group_add_result    (GbSearchDisplayGroup *group,
-                                                         GbSearchResult       *result);
-void              gb_search_display_group_remove_result (GbSearchDisplayGroup *group,
-                                                         GbSearchResult       *result);
-void              gb_search_display_group_set_count     (GbSearchDisplayGroup *group,
-                                                         guint64               count);
-void              gb_search_display_group_unselect      (GbSearchDisplayGroup *group);
-void              gb_search_display_group_focus_first   (GbSearchDisplayGroup *group);
-void              gb_search_display_group_focus_last    (GbSearchDisplayGroup *group);
-GbSearchResult   *gb_search_display_group_get_first     (GbSearchDisplayGroup *group);
+void              gb_search_display_group_clear          (GbSearchDisplayGroup *group);
+GbSearchProvider *gb_search_display_group_get_provider   (GbSearchDisplayGroup *group);
+void              gb_search_display_group_add_result     (GbSearchDisplayGroup *group,
+                                                          GbSearchResult       *result);
+void              gb_search_display_group_remove_result  (GbSearchDisplayGroup *group,
+                                                          GbSearchResult       *result);
+void              gb_search_display_group_set_count      (GbSearchDisplayGroup *group,
+                                                          guint64               count);
+void              gb_search_display_group_update_results (GbSearchDisplayGroup *group,
+                                                          GPtrArray            *added,
+                                                          GPtrArray            *removed);
+void              gb_search_display_group_unselect       (GbSearchDisplayGroup *group);
+void              gb_search_display_group_focus_first    (GbSearchDisplayGroup *group);
+void              gb_search_display_group_focus_last     (GbSearchDisplayGroup *group);
+GbSearchResult   *gb_search_display_group_get_first      (GbSearchDisplayGroup *group);
 
 G_END_DECLS
 
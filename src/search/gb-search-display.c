@@ -294,16 +294,16 @@ gb_search_display_remove_provider (GbSearchDisplay  *display,
 }
 
 static void
-gb_search_display_result_added (GbSearchDisplay  *display,
-                                GbSearchProvider *provider,
-                                GbSearchResult   *result,
-                                GbSearchContext  *context)
+gb_search_display_results_changed (GbSearchDisplay  *display,
+                                   GbSearchProvider *provider,
+                                   GPtrArray        *added,
+                                   GPtrArray        *removed,
+                                   GbSearchContext  *context)
 {
   guint i;
 
   g_return_if_fail (GB_IS_SEARCH_DISPLAY (display));
   g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
-  g_return_if_fail (GB_IS_SEARCH_RESULT (result));
   g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
 
   for (i = 0; i < display->priv->providers->len; i++)
@@ -314,35 +314,9 @@ gb_search_display_result_added (GbSearchDisplay  *display,
 
       if (ptr->provider == provider)
         {
-          gb_search_display_group_add_result (ptr->group, result);
-          gtk_widget_show (GTK_WIDGET (ptr->group));
-          break;
-        }
-    }
-}
-
-static void
-gb_search_display_result_removed (GbSearchDisplay  *display,
-                                  GbSearchProvider *provider,
-                                  GbSearchResult   *result,
-                                  GbSearchContext  *context)
-{
-  guint i;
-
-  g_return_if_fail (GB_IS_SEARCH_DISPLAY (display));
-  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
-  g_return_if_fail (GB_IS_SEARCH_RESULT (result));
-  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
-
-  for (i = 0; i < display->priv->providers->len; i++)
-    {
-      ProviderEntry *ptr;
-
-      ptr = &g_array_index (display->priv->providers, ProviderEntry, i);
-
-      if (ptr->provider == provider)
-        {
-          gb_search_display_group_remove_result (ptr->group, result);
+          gb_search_display_group_update_results (ptr->group, added, removed);
+          if (added->len)
+            gtk_widget_show (GTK_WIDGET (ptr->group));
           break;
         }
     }
@@ -389,14 +363,12 @@ gb_search_display_connect_context (GbSearchDisplay *display,
   for (iter = providers; iter; iter = iter->next)
     gb_search_display_add_provider (display, iter->data);
 
+  gb_search_context_set_frame_clock (context,
+                                     gtk_widget_get_frame_clock (GTK_WIDGET (display)));
+
   g_signal_connect_object (context,
-                           "result-added",
-                           G_CALLBACK (gb_search_display_result_added),
-                           display,
-                           G_CONNECT_SWAPPED);
-  g_signal_connect_object (context,
-                           "result-removed",
-                           G_CALLBACK (gb_search_display_result_removed),
+                           "results-changed",
+                           G_CALLBACK (gb_search_display_results_changed),
                            display,
                            G_CONNECT_SWAPPED);
   g_signal_connect_object (context,
@@ -423,8 +395,12 @@ gb_search_display_disconnect_context (GbSearchDisplay *display,
     }
 
   g_signal_handlers_disconnect_by_func (context,
-                                        G_CALLBACK (gb_search_display_result_added),
+                                        G_CALLBACK (gb_search_display_results_changed),
                                         display);
+  g_signal_handlers_disconnect_by_func (context,
+                                        G_CALLBACK (gb_search_display_count_set),
+                                        display);
+  gb_search_context_set_frame_clock (context, NULL);
 }
 
 GbSearchContext *
@@ -492,6 +468,29 @@ gb_search_display_dispose (GObject *object)
   G_OBJECT_CLASS (gb_search_display_parent_class)->dispose (object);
 }
 
+static void
+gb_search_display_realize (GtkWidget *widget)
+{
+  GbSearchDisplay *self = (GbSearchDisplay *)widget;
+
+  GTK_WIDGET_CLASS (gb_search_display_parent_class)->realize (widget);
+
+  if (self->priv->context)
+    gb_search_context_set_frame_clock (self->priv->context,
+                                       gtk_widget_get_frame_clock (widget));
+}
+
+static void
+gb_search_display_unrealize (GtkWidget *widget)
+{
+  GbSearchDisplay *self = (GbSearchDisplay *)widget;
+
+  if (self->priv->context)
+    gb_search_context_set_frame_clock (self->priv->context, NULL);
+
+  GTK_WIDGET_CLASS (gb_search_display_parent_class)->unrealize (widget);
+}
+
 static void
 gb_search_display_get_property (GObject    *object,
                                 guint       prop_id,
@@ -537,6 +536,8 @@ gb_search_display_class_init (GbSearchDisplayClass *klass)
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
   widget_class->grab_focus = gb_search_display_grab_focus;
+  widget_class->realize = gb_search_display_realize;
+  widget_class->unrealize = gb_search_display_unrealize;
 
   object_class->dispose = gb_search_display_dispose;
   object_class->get_property = gb_search_display_get_property;
@@ -16,11 +16,21 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define G_LOG_DOMAIN "search-manager"
+
 #include "gb-search-manager.h"
 
+/*
+ * Each new sample moves the average a quarter of the way, so it follows
+ * changes such as an index being reloaded within a few searches while
+ * smoothing out the odd slow search.
+ */
+#define LATENCY_WEIGHT 4
+
 struct _GbSearchManagerPrivate
 {
-  GList *providers;
+  GList      *providers;
+  GHashTable *latencies;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (GbSearchManager, gb_search_manager, G_TYPE_OBJECT)
@@ -38,6 +48,109 @@ gb_search_manager_new (void)
   return g_object_new (GB_TYPE_SEARCH_MANAGER, NULL);
 }
 
+/*
+ * Only full searches count towards the average. Refiltering cached
+ * candidates is much faster, but only possible when the search terms are
+ * extended, so it says little about how long the next search will take.
+ *
+ * A cancelled search only shows that the provider took at least
+ * @elapsed_usec, so it can raise the average but never lower it.
+ */
+static void
+gb_search_manager_provider_finished (GbSearchManager  *manager,
+                                     GbSearchProvider *provider,
+                                     gint64            elapsed_usec,
+                                     gboolean          refiltered,
+                                     gboolean          cancelled,
+                                     GbSearchContext  *context)
+{
+  gint64 *latency;
+
+  g_return_if_fail (GB_IS_SEARCH_MANAGER (manager));
+  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
+
+  if (refiltered)
+    return;
+
+  latency = g_hash_table_lookup (manager->priv->latencies, provider);
+
+  if (cancelled && latency && (elapsed_usec <= *latency))
+    return;
+
+  if (!latency)
+    {
+      latency = g_new (gint64, 1);
+      *latency = elapsed_usec;
+      g_hash_table_insert (manager->priv->latencies, provider, latency);
+    }
+  else
+    {
+      *latency += (elapsed_usec - *latency) / LATENCY_WEIGHT;
+    }
+
+  g_debug ("%s took %s%"G_GINT64_FORMAT" usec, average %"G_GINT64_FORMAT" usec",
+           G_OBJECT_TYPE_NAME (provider), cancelled ? "at least " : "",
+           elapsed_usec, *latency);
+}
+
+/**
+ * gb_search_manager_get_latency:
+ * @manager: A #GbSearchManager.
+ * @provider: A #GbSearchProvider.
+ *
+ * Gets the rolling average of the time @provider took to finish searches
+ * created with gb_search_manager_search(). Searches answered by refiltering
+ * cached candidates are not included.
+ *
+ * Returns: The average latency in microseconds, or -1 if @provider has
+ *   not finished a search yet.
+ */
+gint64
+gb_search_manager_get_latency (GbSearchManager  *manager,
+                               GbSearchProvider *provider)
+{
+  gint64 *latency;
+
+  g_return_val_if_fail (GB_IS_SEARCH_MANAGER (manager), -1);
+  g_return_val_if_fail (GB_IS_SEARCH_PROVIDER (provider), -1);
+
+  latency = g_hash_table_lookup (manager->priv->latencies, provider);
+
+  return latency ? *latency : -1;
+}
+
+/**
+ * gb_search_manager_get_max_latency:
+ * @manager: A #GbSearchManager.
+ *
+ * Gets the average latency of the slowest provider, which is how long a
+ * search usually takes to complete.
+ *
+ * Returns: The latency in microseconds, or -1 if any provider has not
+ *   finished a search yet.
+ */
+gint64
+gb_search_manager_get_max_latency (GbSearchManager *manager)
+{
+  gint64 ret = -1;
+  GList *iter;
+
+  g_return_val_if_fail (GB_IS_SEARCH_MANAGER (manager), -1);
+
+  for (iter = manager->priv->providers; iter; iter = iter->next)
+    {
+      gint64 latency;
+
+      latency = gb_search_manager_get_latency (manager, iter->data);
+      if (latency < 0)
+        return -1;
+
+      ret = MAX (ret, latency);
+    }
+
+  return ret;
+}
+
 GbSearchContext *
 gb_search_manager_search (GbSearchManager *manager,
                           const GList     *providers,
@@ -60,6 +173,12 @@ gb_search_manager_search (GbSearchManager *manager,
   for (iter = providers; iter; iter = iter->next)
     gb_search_context_add_provider (context, iter->data, 0);
 
+  g_signal_connect_object (context,
+                           "provider-finished",
+                           G_CALLBACK (gb_search_manager_provider_finished),
+                           manager,
+                           G_CONNECT_SWAPPED);
+
   return context;
 }
 
@@ -100,6 +219,8 @@ gb_search_manager_finalize (GObject *object)
   g_list_free (priv->providers);
   priv->providers = NULL;
 
+  g_clear_pointer (&priv->latencies, g_hash_table_unref);
+
   G_OBJECT_CLASS (gb_search_manager_parent_class)->finalize (object);
 }
 
@@ -127,4 +248,5 @@ static void
 gb_search_manager_init (GbSearchManager *self)
 {
   self->priv = gb_search_manager_get_instance_private (self);
+  self->priv->latencies = g_hash_table_new_full (NULL, NULL, NULL, g_free);
 }
@@ -46,13 +46,16 @@ struct _GbSearchManagerClass
   GObjectClass parent;
 };
 
-GbSearchManager *gb_search_manager_new           (void);
-GList           *gb_search_manager_get_providers (GbSearchManager  *manager);
-void             gb_search_manager_add_provider  (GbSearchManager  *manager,
-                                                  GbSearchProvider *provider);
-GbSearchContext *gb_search_manager_search        (GbSearchManager  *manager,
-                                                  const GList      *providers,
-                                                  const gchar      *search_terms);
+GbSearchManager *gb_search_manager_new             (void);
+GList           *gb_search_manager_get_providers   (GbSearchManager  *manager);
+void             gb_search_manager_add_provider    (GbSearchManager  *manager,
+                                                    GbSearchProvider *provider);
+gint64           gb_search_manager_get_latency     (GbSearchManager  *manager,
+                                                    GbSearchProvider *provider);
+gint64           gb_search_manager_get_max_latency (GbSearchManager  *manager);
+GbSearchContext *gb_search_manager_search          (GbSearchManager  *manager,
+                                                    const GList      *providers,
+                                                    const gchar      *search_terms);
 
 G_END_DECLS
 
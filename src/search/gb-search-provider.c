@@ -17,11 +17,34 @@
  */
 
 #include <glib/gi18n.h>
+#include <string.h>
 
 #include "gb-search-provider.h"
 
 G_DEFINE_ABSTRACT_TYPE (GbSearchProvider, gb_search_provider, G_TYPE_OBJECT)
 
+enum {
+  CHANGED,
+  LAST_SIGNAL
+};
+
+static guint gSignals [LAST_SIGNAL];
+
+/**
+ * gb_search_provider_emit_changed:
+ * @provider: A #GbSearchProvider.
+ *
+ * Emits "changed". Providers should call this when the data they search
+ * changes, so that candidates cached for earlier searches are dropped.
+ */
+void
+gb_search_provider_emit_changed (GbSearchProvider *provider)
+{
+  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
+
+  g_signal_emit (provider, gSignals [CHANGED], 0);
+}
+
 const gchar *
 gb_search_provider_get_verb (GbSearchProvider *provider)
 {
@@ -81,9 +104,174 @@ gb_search_provider_populate (GbSearchProvider *provider,
              g_type_name (G_TYPE_FROM_INSTANCE (provider)));
 }
 
+/**
+ * gb_search_provider_populate_async:
+ * @provider: A #GbSearchProvider.
+ * @context: The #GbSearchContext to add results to.
+ * @search_terms: The search terms.
+ * @max_results: The most results wanted, or 0 for the provider's default.
+ * @cancellable: (allow-none): A #GCancellable, or %NULL.
+ * @callback: A callback to run on the main loop once @provider is done.
+ * @user_data: User data for @callback.
+ *
+ * Asynchronously populates @context with results for @search_terms.
+ *
+ * Providers that implement the populate_async vfunc should do the
+ * expensive part of the search on a worker thread, such as with
+ * g_task_run_in_thread(), and add their results to @context from
+ * populate_finish, which is called on the main loop. Providers that only
+ * implement populate are run synchronously.
+ */
+void
+gb_search_provider_populate_async (GbSearchProvider    *provider,
+                                   GbSearchContext     *context,
+                                   const gchar         *search_terms,
+                                   gsize                max_results,
+                                   GCancellable        *cancellable,
+                                   GAsyncReadyCallback  callback,
+                                   gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
+  g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
+  g_return_if_fail (search_terms);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  if (GB_SEARCH_PROVIDER_GET_CLASS (provider)->populate_async)
+    {
+      GB_SEARCH_PROVIDER_GET_CLASS (provider)->populate_async (provider,
+                                                               context,
+                                                               search_terms,
+                                                               max_results,
+                                                               cancellable,
+                                                               callback,
+                                                               user_data);
+      return;
+    }
+
+  /*
+   * GTask defers @callback to the next main loop iteration, so the caller
+   * sees the same ordering as with a real asynchronous provider.
+   */
+  task = g_task_new (provider, cancellable, callback, user_data);
+  gb_search_provider_populate (provider, context, search_terms, max_results,
+                               cancellable);
+  g_task_return_boolean (task, TRUE);
+  g_object_unref (task);
+}
+
+gboolean
+gb_search_provider_populate_finish (GbSearchProvider  *provider,
+                                    GAsyncResult      *result,
+                                    GError           **error)
+{
+  g_return_val_if_fail (GB_IS_SEARCH_PROVIDER (provider), FALSE);
+  g_return_val_if_fail (G_IS_ASYNC_RESULT (result), FALSE);
+
+  if (GB_SEARCH_PROVIDER_GET_CLASS (provider)->populate_finish)
+    return GB_SEARCH_PROVIDER_GET_CLASS (provider)->populate_finish (provider,
+                                                                     result,
+                                                                     error);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * gb_search_provider_can_narrow:
+ * @provider: A #GbSearchProvider.
+ * @prefix: The search terms of an earlier search.
+ * @search_terms: The new search terms.
+ *
+ * Checks whether every result for @search_terms was also a candidate for
+ * @prefix, so that candidates cached for @prefix may be given to
+ * gb_search_provider_refilter().
+ *
+ * By default, that requires @search_terms to start with @prefix and not
+ * to add a '/', since providers that match paths treat the text after
+ * the last '/' differently. Providers can override the can_narrow vfunc
+ * to be more precise.
+ *
+ * Returns: %TRUE if candidates for @prefix can be refiltered.
+ */
+gboolean
+gb_search_provider_can_narrow (GbSearchProvider *provider,
+                               const gchar      *prefix,
+                               const gchar      *search_terms)
+{
+  g_return_val_if_fail (GB_IS_SEARCH_PROVIDER (provider), FALSE);
+  g_return_val_if_fail (prefix, FALSE);
+  g_return_val_if_fail (search_terms, FALSE);
+
+  if (GB_SEARCH_PROVIDER_GET_CLASS (provider)->can_narrow)
+    return GB_SEARCH_PROVIDER_GET_CLASS (provider)->can_narrow (provider,
+                                                                prefix,
+                                                                search_terms);
+
+  return (g_str_has_prefix (search_terms, prefix) &&
+          !strchr (search_terms + strlen (prefix), '/'));
+}
+
+/**
+ * gb_search_provider_refilter:
+ * @provider: A #GbSearchProvider.
+ * @context: The #GbSearchContext to add results to.
+ * @candidates: Candidates that @provider gave to
+ *   gb_search_context_set_candidates() for an earlier search.
+ * @search_terms: The search terms, which extend the earlier search terms.
+ * @max_results: The most results wanted, or 0 for the provider's default.
+ *
+ * Populates @context by narrowing down @candidates rather than searching
+ * everything again. This is only possible for providers that implement
+ * the refilter vfunc, and runs synchronously since @candidates is
+ * expected to be small.
+ *
+ * Returns: %TRUE if @provider populated @context.
+ */
+gboolean
+gb_search_provider_refilter (GbSearchProvider *provider,
+                             GbSearchContext  *context,
+                             GPtrArray        *candidates,
+                             const gchar      *search_terms,
+                             gsize             max_results)
+{
+  g_return_val_if_fail (GB_IS_SEARCH_PROVIDER (provider), FALSE);
+  g_return_val_if_fail (GB_IS_SEARCH_CONTEXT (context), FALSE);
+  g_return_val_if_fail (candidates, FALSE);
+  g_return_val_if_fail (search_terms, FALSE);
+
+  if (!GB_SEARCH_PROVIDER_GET_CLASS (provider)->refilter)
+    return FALSE;
+
+  GB_SEARCH_PROVIDER_GET_CLASS (provider)->refilter (provider,
+                                                     context,
+                                                     candidates,
+                                                     search_terms,
+                                                     max_results);
+
+  return TRUE;
+}
+
 static void
 gb_search_provider_class_init (GbSearchProviderClass *klass)
 {
+  /**
+   * GbSearchProvider::changed:
+   * @provider: A #GbSearchProvider.
+   *
+   * Emitted when the data searched by @provider has changed, such as when
+   * the git index is reloaded.
+   */
+  gSignals [CHANGED] =
+    g_signal_new ("changed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL,
+                  NULL,
+                  g_cclosure_marshal_generic,
+                  G_TYPE_NONE,
+                  0);
 }
 
 static void
@@ -47,21 +47,58 @@ struct _GbSearchProviderClass
   gunichar     (*get_prefix)   (GbSearchProvider *provider);
   gint         (*get_priority) (GbSearchProvider *provider);
   const gchar *(*get_verb)     (GbSearchProvider *provider);
-  void         (*populate)     (GbSearchProvider *provider,
-                                GbSearchContext  *context,
-                                const gchar      *search_terms,
-                                gsize             max_results,
-                                GCancellable     *cancellable);
+  void         (*populate)        (GbSearchProvider     *provider,
+                                   GbSearchContext      *context,
+                                   const gchar          *search_terms,
+                                   gsize                 max_results,
+                                   GCancellable         *cancellable);
+  void         (*populate_async)  (GbSearchProvider     *provider,
+                                   GbSearchContext      *context,
+                                   const gchar          *search_terms,
+                                   gsize                 max_results,
+                                   GCancellable         *cancellable,
+                                   GAsyncReadyCallback   callback,
+                                   gpointer              user_data);
+  gboolean     (*populate_finish) (GbSearchProvider     *provider,
+                                   GAsyncResult         *result,
+                                   GError              **error);
+  gboolean     (*can_narrow)      (GbSearchProvider     *provider,
+                                   const gchar          *prefix,
+                                   const gchar          *search_terms);
+  void         (*refilter)        (GbSearchProvider     *provider,
+                                   GbSearchContext      *context,
+                                   GPtrArray            *candidates,
+                                   const gchar          *search_terms,
+                                   gsize                 max_results);
 };
 
-gunichar     gb_search_provider_get_prefix   (GbSearchProvider *provider);
-gint         gb_search_provider_get_priority (GbSearchProvider *provider);
-const gchar *gb_search_provider_get_verb     (GbSearchProvider *provider);
-void         gb_search_provider_populate     (GbSearchProvider *provider,
-                                              GbSearchContext  *context,
-                                              const gchar      *search_terms,
-                                              gsize             max_results,
-                                              GCancellable     *cancellable);
+gboolean     gb_search_provider_can_narrow      (GbSearchProvider     *provider,
+                                                 const gchar          *prefix,
+                                                 const gchar          *search_terms);
+void         gb_search_provider_emit_changed    (GbSearchProvider     *provider);
+gunichar     gb_search_provider_get_prefix      (GbSearchProvider     *provider);
+gint         gb_search_provider_get_priority    (GbSearchProvider     *provider);
+const gchar *gb_search_provider_get_verb        (GbSearchProvider     *provider);
+void         gb_search_provider_populate        (GbSearchProvider     *provider,
+                                                 GbSearchContext      *context,
+                                                 const gchar          *search_terms,
+                                                 gsize                 max_results,
+                                                 GCancellable         *cancellable);
+void         gb_search_provider_populate_async  (GbSearchProvider     *provider,
+                                                 GbSearchContext      *context,
+                                                 const gchar          *search_terms,
+                                                 gsize                 max_results,
+                                                 GCancellable         *cancellable,
+                                                 GAsyncReadyCallback   callback,
+                                                 gpointer              user_data);
+gboolean     gb_search_provider_populate_finish (GbSearchProvider     *provider,
+                                                 GAsyncResult         *result,
+                                                 GError              **error);
+gboolean     gb_search_provider_refilter        (GbSearchProvider     *provider,
+                                                 GbSearchContext      *context,
+                                                 GPtrArray            *candidates,
+                                                 const gchar          *search_terms,
+                                                 gsize                 max_results);
 
 G_END_DECLS
 
@@ -21,28 +21,118 @@
 #include "gb-search-reducer.h"
 #include "gb-search-result.h"
 
+/*
+ * Used when the provider was added to the context without a limit.
+ */
+#define GB_SEARCH_REDUCER_DEFAULT_MAX_RESULTS 10
+
+/*
+ * The results are kept in a binary min-heap ordered by score, so the
+ * lowest scoring result, which is the next to be evicted, is always at
+ * the root. The heap has a fixed capacity, so pushing a result never
+ * allocates.
+ */
+
+static inline gboolean
+gb_search_reducer_less (GbSearchResult *a,
+                        GbSearchResult *b)
+{
+  return gb_search_result_compare (a, b) < 0;
+}
+
+static void
+gb_search_reducer_sift_up (GbSearchReducer *reducer,
+                           gsize            idx)
+{
+  GbSearchResult **heap = reducer->heap;
+  GbSearchResult *result = heap [idx];
+
+  while (idx > 0)
+    {
+      gsize parent = (idx - 1) / 2;
+
+      if (!gb_search_reducer_less (result, heap [parent]))
+        break;
+
+      heap [idx] = heap [parent];
+      idx = parent;
+    }
+
+  heap [idx] = result;
+}
+
+static void
+gb_search_reducer_sift_down (GbSearchReducer *reducer,
+                             gsize            idx)
+{
+  GbSearchResult **heap = reducer->heap;
+  GbSearchResult *result = heap [idx];
+  gsize count = reducer->count;
+
+  for (;;)
+    {
+      gsize child = (idx * 2) + 1;
+
+      if (child >= count)
+        break;
+
+      if ((child + 1 < count) &&
+          gb_search_reducer_less (heap [child + 1], heap [child]))
+        child++;
+
+      if (!gb_search_reducer_less (heap [child], result))
+        break;
+
+      heap [idx] = heap [child];
+      idx = child;
+    }
+
+  heap [idx] = result;
+}
+
+/**
+ * gb_search_reducer_init:
+ * @reducer: A #GbSearchReducer.
+ * @context: A #GbSearchContext.
+ * @provider: A #GbSearchProvider.
+ * @max_results: The number of results to keep, or 0 for the default.
+ *
+ * Prepares @reducer to keep the @max_results best results pushed by
+ * @provider. Pass the max_results given to the populate vfunc, which is
+ * the limit set with gb_search_context_add_provider().
+ */
 void
 gb_search_reducer_init (GbSearchReducer  *reducer,
                         GbSearchContext  *context,
-                        GbSearchProvider *provider)
+                        GbSearchProvider *provider,
+                        gsize             max_results)
 {
   g_return_if_fail (reducer);
   g_return_if_fail (GB_IS_SEARCH_CONTEXT (context));
   g_return_if_fail (GB_IS_SEARCH_PROVIDER (provider));
 
+  if (!max_results)
+    max_results = GB_SEARCH_REDUCER_DEFAULT_MAX_RESULTS;
+
   reducer->context = context;
   reducer->provider = provider;
-  reducer->sequence = g_sequence_new (g_object_unref);
-  reducer->max_results = 10;
+  reducer->heap = g_new (GbSearchResult *, max_results);
+  reducer->max_results = max_results;
   reducer->count = 0;
 }
 
 void
 gb_search_reducer_destroy (GbSearchReducer *reducer)
 {
+  gsize i;
+
   g_return_if_fail (reducer);
 
-  g_sequence_free (reducer->sequence);
+  for (i = 0; i < reducer->count; i++)
+    g_object_unref (reducer->heap [i]);
+
+  g_clear_pointer (&reducer->heap, g_free);
+  reducer->count = 0;
 }
 
 void
@@ -50,49 +140,70 @@ gb_search_reducer_push (GbSearchReducer *reducer,
                         GbSearchResult  *result)
 {
   g_return_if_fail (reducer);
+  g_return_if_fail (reducer->heap);
   g_return_if_fail (GB_IS_SEARCH_RESULT (result));
 
-  if (reducer->max_results <= g_sequence_get_length (reducer->sequence))
+  if (reducer->count < reducer->max_results)
     {
-      GSequenceIter *iter;
-      GbSearchResult *lowest;
-
-      /* Remove lowest score */
-      iter = g_sequence_get_begin_iter (reducer->sequence);
-      lowest = g_sequence_get (iter);
-      gb_search_context_remove_result (reducer->context, reducer->provider,
-                                       lowest);
-      g_sequence_remove (iter);
+      reducer->heap [reducer->count] = g_object_ref (result);
+      gb_search_reducer_sift_up (reducer, reducer->count++);
+    }
+  else
+    {
+      /* Replace the lowest score */
+      g_object_unref (reducer->heap [0]);
+      reducer->heap [0] = g_object_ref (result);
+      gb_search_reducer_sift_down (reducer, 0);
     }
-
-  g_sequence_insert_sorted (reducer->sequence,
-                            g_object_ref (result),
-                            (GCompareDataFunc)gb_search_result_compare,
-                            NULL);
-  gb_search_context_add_result (reducer->context, reducer->provider, result);
 }
 
 gboolean
 gb_search_reducer_accepts (GbSearchReducer *reducer,
                            gfloat           score)
 {
-  GSequenceIter *iter;
-
   g_return_val_if_fail (reducer, FALSE);
 
-  if (g_sequence_get_length (reducer->sequence) < reducer->max_results)
+  if (reducer->count < reducer->max_results)
     return TRUE;
 
-  iter = g_sequence_get_begin_iter (reducer->sequence);
+  return score > gb_search_result_get_score (reducer->heap [0]);
+}
 
-  if (iter)
-    {
-      GbSearchResult *result;
+static gint
+compare_descending (gconstpointer a,
+                    gconstpointer b,
+                    gpointer      user_data)
+{
+  return gb_search_result_compare (*(GbSearchResult * const *)b,
+                                   *(GbSearchResult * const *)a);
+}
+
+/**
+ * gb_search_reducer_finish:
+ * @reducer: A #GbSearchReducer.
+ *
+ * Adds the results kept by @reducer to its context, best first. Results
+ * are only sorted once, here, rather than on every push. Call this once
+ * the provider has pushed all of its results and before
+ * gb_search_reducer_destroy().
+ */
+void
+gb_search_reducer_finish (GbSearchReducer *reducer)
+{
+  gsize i;
+
+  g_return_if_fail (reducer);
+  g_return_if_fail (reducer->heap);
 
-      result = g_sequence_get (iter);
-      if (result)
-        return score > gb_search_result_get_score (result);
+  g_qsort_with_data (reducer->heap, reducer->count, sizeof (GbSearchResult *),
+                     compare_descending, NULL);
+
+  for (i = 0; i < reducer->count; i++)
+    {
+      gb_search_context_add_result (reducer->context, reducer->provider,
+                                    reducer->heap [i]);
+      g_object_unref (reducer->heap [i]);
     }
 
-  return FALSE;
+  reducer->count = 0;
 }
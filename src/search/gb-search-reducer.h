@@ -29,18 +29,20 @@ typedef struct
 {
   GbSearchContext  *context;
   GbSearchProvider *provider;
-  GSequence        *sequence;
+  GbSearchResult  **heap;
   gsize             max_results;
   gsize             count;
 } GbSearchReducer;
 
 void     gb_search_reducer_init    (GbSearchReducer  *reducer,
                                     GbSearchContext  *context,
-                                    GbSearchProvider *provider);
+                                    GbSearchProvider *provider,
+                                    gsize             max_results);
 gboolean gb_search_reducer_accepts (GbSearchReducer  *reducer,
                                     gfloat            score);
 void     gb_search_reducer_push    (GbSearchReducer  *reducer,
                                     GbSearchResult   *result);
+void     gb_search_reducer_finish  (GbSearchReducer  *reducer);
 void     gb_search_reducer_destroy (GbSearchReducer  *reducer);
 
 
@@ -22,6 +22,18 @@
 #include "gb-source-snippet-completion-item.h"
 #include "gb-source-snippet-completion-provider.h"
 
+/*
+ * Only the first page of proposals is built for short triggers.
+ */
+#define MAX_PROPOSALS 100
+
+/*
+ * When no trigger starts with the word, allow for a typo in words that
+ * are long enough for that to still be meaningful.
+ */
+#define MIN_FUZZY_CHARS 3
+#define MAX_FUZZY_EDITS 1
+
 static void init_provider (GtkSourceCompletionProviderIface *iface);
 
 G_DEFINE_TYPE_EXTENDED (GbSourceSnippetCompletionProvider,
@@ -42,6 +54,7 @@ typedef struct
   GtkSourceCompletionProvider *provider;
   gchar                       *word;
   GList                       *list;
+  gboolean                     fuzzy;
 } SearchState;
 
 enum {
@@ -272,7 +285,7 @@ foreach_snippet (gpointer data,
   const char *trigger;
 
   trigger = gb_source_snippet_get_trigger (snippet);
-  if (!g_str_has_prefix (trigger, state->word))
+  if (!state->fuzzy && !g_str_has_prefix (trigger, state->word))
     return;
 
   item = gb_source_snippet_completion_item_new (snippet);
@@ -302,8 +315,17 @@ provider_populate (GtkSourceCompletionProvider *provider,
   state.word = get_word (provider, &iter);
 
   if (state.word && *state.word)
-    gb_source_snippets_foreach (priv->snippets, state.word, foreach_snippet,
-                                &state);
+    gb_source_snippets_foreach_max (priv->snippets, state.word, MAX_PROPOSALS,
+                                    foreach_snippet, &state);
+
+  if (!state.list && state.word &&
+      (g_utf8_strlen (state.word, -1) >= MIN_FUZZY_CHARS))
+    {
+      state.fuzzy = TRUE;
+      gb_source_snippets_foreach_fuzzy (priv->snippets, state.word,
+                                        MAX_FUZZY_EDITS, MAX_PROPOSALS,
+                                        foreach_snippet, &state);
+    }
 
   /*
    * XXX: GtkSourceView seems to be warning quite a bit inside here
@@ -41,8 +41,12 @@ gb_source_snippets_manager_load_file (GbSourceSnippetsManager *manager,
   GbSourceSnippets *snippets;
   GbSourceSnippetParser *parser;
   GbSourceSnippet *snippet;
+  GHashTableIter hiter;
+  GHashTable *by_language;
+  GPtrArray *to_add;
+  const gchar *language;
   GList *iter;
-  
+
   g_return_val_if_fail (GB_IS_SOURCE_SNIPPETS_MANAGER (manager), FALSE);
   g_return_val_if_fail (G_IS_FILE (file), FALSE);
 
@@ -53,12 +57,32 @@ gb_source_snippets_manager_load_file (GbSourceSnippetsManager *manager,
       return FALSE;
     }
 
+  /*
+   * Group the snippets by language so that each set is updated at once
+   * instead of one snippet at a time.
+   */
+  by_language = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                       (GDestroyNotify)g_ptr_array_unref);
+
   iter = gb_source_snippet_parser_get_snippets (parser);
-  for (; iter; iter = iter->next) 
+  for (; iter; iter = iter->next)
     {
-      const gchar *language;
       snippet  = iter->data;
-      language = gb_source_snippet_get_language(snippet);
+      language = gb_source_snippet_get_language (snippet);
+      to_add = g_hash_table_lookup (by_language, language);
+
+      if (!to_add)
+        {
+          to_add = g_ptr_array_new ();
+          g_hash_table_insert (by_language, (gchar *)language, to_add);
+        }
+
+      g_ptr_array_add (to_add, snippet);
+    }
+
+  g_hash_table_iter_init (&hiter, by_language);
+  while (g_hash_table_iter_next (&hiter, (gpointer *)&language, (gpointer *)&to_add))
+    {
       snippets = g_hash_table_lookup (manager->priv->by_language_id, language);
 
       if (!snippets)
@@ -68,9 +92,11 @@ gb_source_snippets_manager_load_file (GbSourceSnippetsManager *manager,
                                g_strdup (language),
                                snippets);
         }
-      gb_source_snippets_add (snippets, snippet);
+
+      gb_source_snippets_add_all (snippets, to_add);
     }
 
+  g_hash_table_unref (by_language);
   g_object_unref (parser);
 
   return TRUE;
@@ -28,11 +28,26 @@
 
 G_DEFINE_TYPE (GbSourceSnippets, gb_source_snippets, G_TYPE_OBJECT)
 
+/*
+ * Readers take the current version of the trie from @snippets and never
+ * block. Writers build a new trie, which is published once complete, and
+ * are serialized by @writer_lock so that concurrent updates are not lost.
+ * This allows snippets to be reloaded from a worker thread while
+ * completion keeps using the previous version.
+ */
 struct _GbSourceSnippetsPrivate
 {
-  Trie *snippets;
+  TrieRcu *snippets;
+  GMutex   writer_lock;
 };
 
+typedef struct
+{
+  gchar           *key;
+  GbSourceSnippet *snippet;
+  guint            seq;
+} SnippetEntry;
+
 GbSourceSnippets *
 gb_source_snippets_new (void)
 {
@@ -49,93 +64,369 @@ gb_source_snippets_clear (GbSourceSnippets *snippets)
 
   priv = snippets->priv;
 
-  trie_destroy (priv->snippets);
-  priv->snippets = trie_new (g_object_unref);
+  g_mutex_lock (&priv->writer_lock);
+  trie_rcu_publish (priv->snippets, trie_new (g_object_unref));
+  g_mutex_unlock (&priv->writer_lock);
 }
 
 static gboolean
-copy_into (Trie        *trie,
-           const gchar *key,
-           gpointer     value,
-           gpointer     user_data)
+collect_entries (Trie        *trie,
+                 const gchar *key,
+                 gpointer     value,
+                 gpointer     user_data)
 {
-  GbSourceSnippet *snippet = value;
-  Trie *dest = user_data;
+  GArray *entries = user_data;
+  SnippetEntry entry;
 
-  g_assert (dest);
-  g_assert (GB_IS_SOURCE_SNIPPET (snippet));
+  g_assert (GB_IS_SOURCE_SNIPPET (value));
 
-  trie_insert (dest, key, g_object_ref (snippet));
+  entry.key = g_strdup (key);
+  entry.snippet = g_object_ref (value);
+  entry.seq = entries->len;
+
+  g_array_append_val (entries, entry);
 
   return FALSE;
 }
 
+static gint
+compare_entries (gconstpointer a,
+                 gconstpointer b)
+{
+  const SnippetEntry *entry_a = a;
+  const SnippetEntry *entry_b = b;
+  gint ret;
+
+  if (!(ret = strcmp (entry_a->key, entry_b->key)))
+    ret = (entry_a->seq < entry_b->seq) ? -1 : (entry_a->seq > entry_b->seq);
+
+  return ret;
+}
+
+/*
+ * Merges @added into @entries, both of which must be sorted and are
+ * consumed. Entries from @added replace those in @entries with the same
+ * key, as they come after them. Returns the merged entries.
+ */
+static GArray *
+merge_entries (GArray *entries,
+               GArray *added)
+{
+  GArray *merged;
+  guint i = 0;
+  guint j = 0;
+
+  if (!added->len)
+    {
+      g_array_unref (added);
+      return entries;
+    }
+
+  merged = g_array_sized_new (FALSE, FALSE, sizeof (SnippetEntry),
+                              entries->len + added->len);
+
+  while ((i < entries->len) || (j < added->len))
+    {
+      SnippetEntry *entry;
+
+      if ((j == added->len) ||
+          ((i < entries->len) &&
+           (strcmp (g_array_index (entries, SnippetEntry, i).key,
+                    g_array_index (added, SnippetEntry, j).key) <= 0)))
+        entry = &g_array_index (entries, SnippetEntry, i++);
+      else
+        entry = &g_array_index (added, SnippetEntry, j++);
+
+      entry->seq = merged->len;
+      g_array_append_val (merged, *entry);
+    }
+
+  g_array_unref (entries);
+  g_array_unref (added);
+
+  return merged;
+}
+
+/*
+ * Replaces the snippets with @entries, which must be sorted and is
+ * consumed. Sorted entries let the trie be built in a single pass rather
+ * than one insert at a time. Entries later in @entries replace earlier
+ * ones with the same key.
+ *
+ * The caller must hold the writer lock.
+ */
+static void
+gb_source_snippets_rebuild (GbSourceSnippets *snippets,
+                            GArray           *entries)
+{
+  GbSourceSnippetsPrivate *priv = snippets->priv;
+  const gchar **keys;
+  gpointer *values;
+  guint i;
+
+  keys = g_new (const gchar *, entries->len);
+  values = g_new (gpointer, entries->len);
+
+  for (i = 0; i < entries->len; i++)
+    {
+      SnippetEntry *entry = &g_array_index (entries, SnippetEntry, i);
+
+      keys [i] = entry->key;
+      values [i] = entry->snippet;
+    }
+
+  trie_rcu_publish (priv->snippets,
+                    trie_new_from_sorted (g_object_unref,
+                                          (const gchar * const *)keys,
+                                          values,
+                                          entries->len));
+
+  for (i = 0; i < entries->len; i++)
+    g_free (g_array_index (entries, SnippetEntry, i).key);
+
+  g_free (keys);
+  g_free (values);
+  g_array_unref (entries);
+}
+
+static void
+gb_source_snippets_collect_entries (GbSourceSnippets *snippets,
+                                    GArray           *entries)
+{
+  Trie *trie;
+
+  trie = trie_rcu_acquire (snippets->priv->snippets);
+  trie_traverse (trie,
+                 "",
+                 G_PRE_ORDER,
+                 G_TRAVERSE_LEAVES,
+                 -1,
+                 collect_entries,
+                 entries);
+  trie_unref (trie);
+}
+
+/*
+ * A trie built by gb_source_snippets_rebuild() is traversed in key order,
+ * so the entries usually come out sorted and only need to be checked.
+ */
+static GArray *
+gb_source_snippets_get_entries (GbSourceSnippets *snippets)
+{
+  GArray *entries;
+  guint i;
+
+  entries = g_array_new (FALSE, FALSE, sizeof (SnippetEntry));
+  gb_source_snippets_collect_entries (snippets, entries);
+
+  for (i = 1; i < entries->len; i++)
+    {
+      if (compare_entries (&g_array_index (entries, SnippetEntry, i - 1),
+                           &g_array_index (entries, SnippetEntry, i)) > 0)
+        {
+          g_array_sort (entries, compare_entries);
+          break;
+        }
+    }
+
+  return entries;
+}
+
 void
 gb_source_snippets_merge (GbSourceSnippets *snippets,
                           GbSourceSnippets *other)
 {
+  GbSourceSnippetsPrivate *priv;
+  GArray *entries;
+
   g_return_if_fail (GB_IS_SOURCE_SNIPPETS (snippets));
   g_return_if_fail (GB_IS_SOURCE_SNIPPETS (other));
 
-  trie_traverse (other->priv->snippets,
-                 "",
-                 G_PRE_ORDER,
-                 G_TRAVERSE_LEAVES,
-                 -1,
-                 copy_into,
-                 snippets->priv->snippets);
+  priv = snippets->priv;
+
+  g_mutex_lock (&priv->writer_lock);
+  entries = merge_entries (gb_source_snippets_get_entries (snippets),
+                           gb_source_snippets_get_entries (other));
+  gb_source_snippets_rebuild (snippets, entries);
+  g_mutex_unlock (&priv->writer_lock);
 }
 
+/**
+ * gb_source_snippets_add:
+ * @snippets: A #GbSourceSnippets.
+ * @snippet: A #GbSourceSnippet.
+ *
+ * Adds @snippet, replacing any snippet with the same trigger. Each call
+ * copies and publishes all of the snippets, so adding them one at a time
+ * takes quadratic time.
+ *
+ * Deprecated: Use gb_source_snippets_add_all() instead.
+ */
 void
 gb_source_snippets_add (GbSourceSnippets *snippets,
                         GbSourceSnippet  *snippet)
 {
-  const gchar *trigger;
+  GPtrArray *to_add;
 
   g_return_if_fail (GB_IS_SOURCE_SNIPPETS (snippets));
   g_return_if_fail (GB_IS_SOURCE_SNIPPET (snippet));
 
-  trigger = gb_source_snippet_get_trigger (snippet);
-  trie_insert (snippets->priv->snippets, trigger, g_object_ref (snippet));
+  to_add = g_ptr_array_new ();
+  g_ptr_array_add (to_add, snippet);
+  gb_source_snippets_add_all (snippets, to_add);
+  g_ptr_array_unref (to_add);
 }
 
-gboolean
-gb_source_snippets_foreach_cb (Trie        *trie,
-                               const gchar *key,
-                               gpointer     value,
-                               gpointer     user_data)
+/**
+ * gb_source_snippets_add_all:
+ * @snippets: A #GbSourceSnippets.
+ * @to_add: (element-type GbSourceSnippet): The snippets to add.
+ *
+ * Adds each snippet in @to_add, replacing any snippet with the same
+ * trigger. When several snippets in @to_add share a trigger, the last one
+ * wins. Only @to_add is sorted; it is then merged with the existing
+ * snippets, which are already in order, and the trie is rebuilt in a
+ * single pass.
+ *
+ * This may be called from any thread. Callers iterating @snippets at the
+ * same time keep seeing the previous snippets until they are done.
+ */
+void
+gb_source_snippets_add_all (GbSourceSnippets *snippets,
+                            GPtrArray        *to_add)
 {
-  gpointer *closure = user_data;
+  GbSourceSnippetsPrivate *priv;
+  GArray *entries;
+  GArray *added;
+  guint i;
 
-  ((GFunc) closure[0])(value, closure[1]);
+  g_return_if_fail (GB_IS_SOURCE_SNIPPETS (snippets));
+  g_return_if_fail (to_add);
 
-  return FALSE;
+  priv = snippets->priv;
+
+  added = g_array_sized_new (FALSE, FALSE, sizeof (SnippetEntry), to_add->len);
+
+  for (i = 0; i < to_add->len; i++)
+    {
+      GbSourceSnippet *snippet = g_ptr_array_index (to_add, i);
+      const gchar *trigger;
+
+      if (!GB_IS_SOURCE_SNIPPET (snippet))
+        {
+          g_warn_if_reached ();
+          continue;
+        }
+
+      if ((trigger = gb_source_snippet_get_trigger (snippet)))
+        collect_entries (NULL, trigger, snippet, added);
+    }
+
+  g_array_sort (added, compare_entries);
+
+  g_mutex_lock (&priv->writer_lock);
+  entries = merge_entries (gb_source_snippets_get_entries (snippets), added);
+  gb_source_snippets_rebuild (snippets, entries);
+  g_mutex_unlock (&priv->writer_lock);
 }
 
+/**
+ * gb_source_snippets_foreach_max:
+ * @snippets: A #GbSourceSnippets.
+ * @prefix: (allow-none): The prefix of the triggers to visit, or %NULL.
+ * @max_snippets: The most snippets to visit, or 0 for no limit.
+ * @foreach_func: (scope call): A #GFunc to call for each snippet.
+ * @user_data: User data for @foreach_func.
+ *
+ * Calls @foreach_func for each snippet whose trigger starts with @prefix,
+ * stopping after @max_snippets without visiting the rest of the snippets.
+ *
+ * The snippets visited are those present when this is called, even if
+ * they are replaced from another thread in the meantime.
+ */
 void
-gb_source_snippets_foreach (GbSourceSnippets *snippets,
-                            const gchar      *prefix,
-                            GFunc             foreach_func,
-                            gpointer          user_data)
+gb_source_snippets_foreach_max (GbSourceSnippets *snippets,
+                                const gchar      *prefix,
+                                guint             max_snippets,
+                                GFunc             foreach_func,
+                                gpointer          user_data)
 {
-  GbSourceSnippetsPrivate *priv;
-  gpointer closure[2] = { foreach_func, user_data };
+  TrieIter iter;
+  gpointer value;
+  Trie *trie;
 
   g_return_if_fail (GB_IS_SOURCE_SNIPPETS (snippets));
   g_return_if_fail (foreach_func);
 
-  priv = snippets->priv;
+  trie = trie_rcu_acquire (snippets->priv->snippets);
+  trie_iter_init_prefix (&iter, trie, prefix, max_snippets);
+  while (trie_iter_next (&iter, NULL, &value))
+    foreach_func (value, user_data);
+  trie_iter_clear (&iter);
+  trie_unref (trie);
+}
 
-  if (!prefix)
-    prefix = "";
+typedef struct
+{
+  GFunc    foreach_func;
+  gpointer user_data;
+  guint    max_snippets;
+  guint    n_snippets;
+} FuzzyClosure;
 
-  trie_traverse (priv->snippets,
-                 prefix,
-                 G_PRE_ORDER,
-                 G_TRAVERSE_LEAVES,
-                 -1,
-                 gb_source_snippets_foreach_cb,
-                 (gpointer) closure);
+static gboolean
+foreach_fuzzy_cb (Trie        *trie,
+                  const gchar *key,
+                  gpointer     value,
+                  guint        distance,
+                  gpointer     user_data)
+{
+  FuzzyClosure *closure = user_data;
+
+  closure->foreach_func (value, closure->user_data);
+
+  return (++closure->n_snippets == closure->max_snippets);
+}
+
+/**
+ * gb_source_snippets_foreach_fuzzy:
+ * @snippets: A #GbSourceSnippets.
+ * @word: The word typed so far.
+ * @max_edits: The number of typos to allow in @word.
+ * @max_snippets: The most snippets to visit, or 0 for no limit.
+ * @foreach_func: (scope call): A #GFunc to call for each snippet.
+ * @user_data: User data for @foreach_func.
+ *
+ * Like gb_source_snippets_foreach_max(), but also visits snippets whose
+ * trigger starts with something within @max_edits of @word.
+ */
+void
+gb_source_snippets_foreach_fuzzy (GbSourceSnippets *snippets,
+                                  const gchar      *word,
+                                  guint             max_edits,
+                                  guint             max_snippets,
+                                  GFunc             foreach_func,
+                                  gpointer          user_data)
+{
+  FuzzyClosure closure = { foreach_func, user_data, max_snippets, 0 };
+  Trie *trie;
+
+  g_return_if_fail (GB_IS_SOURCE_SNIPPETS (snippets));
+  g_return_if_fail (word);
+  g_return_if_fail (foreach_func);
+
+  trie = trie_rcu_acquire (snippets->priv->snippets);
+  trie_traverse_fuzzy (trie, word, max_edits, foreach_fuzzy_cb, &closure);
+  trie_unref (trie);
+}
+
+void
+gb_source_snippets_foreach (GbSourceSnippets *snippets,
+                            const gchar      *prefix,
+                            GFunc             foreach_func,
+                            gpointer          user_data)
+{
+  gb_source_snippets_foreach_max (snippets, prefix, 0, foreach_func, user_data);
 }
 
 static void
@@ -145,7 +436,8 @@ gb_source_snippets_finalize (GObject *object)
 
   priv = GB_SOURCE_SNIPPETS (object)->priv;
 
-  g_clear_pointer (&priv->snippets, (GDestroyNotify) trie_destroy);
+  g_clear_pointer (&priv->snippets, (GDestroyNotify) trie_rcu_free);
+  g_mutex_clear (&priv->writer_lock);
 
   G_OBJECT_CLASS (gb_source_snippets_parent_class)->finalize (object);
 }
@@ -167,5 +459,6 @@ gb_source_snippets_init (GbSourceSnippets *snippets)
                                                 GB_TYPE_SOURCE_SNIPPETS,
                                                 GbSourceSnippetsPrivate);
 
-  snippets->priv->snippets = trie_new (g_object_unref);
+  g_mutex_init (&snippets->priv->writer_lock);
+  snippets->priv->snippets = trie_rcu_new (trie_new (g_object_unref));
 }
@@ -50,8 +50,11 @@ struct _GbSourceSnippetsClass
   GObjectClass parent_class;
 };
 
+G_GNUC_DEPRECATED_FOR (gb_source_snippets_add_all)
 void              gb_source_snippets_add            (GbSourceSnippets *snippets,
                                                      GbSourceSnippet  *snippet);
+void              gb_source_snippets_add_all        (GbSourceSnippets *snippets,
+                                                     GPtrArray        *to_add);
 void              gb_source_snippets_clear          (GbSourceSnippets *snippets);
 void              gb_source_snippets_merge          (GbSourceSnippets *snippets,
                                                      GbSourceSnippets *other);
@@ -61,6 +64,17 @@ void              gb_source_snippets_foreach        (GbSourceSnippets *snippets,
                                                      const gchar      *prefix,
                                                      GFunc             foreach_func,
                                                      gpointer          user_data);
+void              gb_source_snippets_foreach_fuzzy  (GbSourceSnippets *snippets,
+                                                     const gchar      *word,
+                                                     guint             max_edits,
+                                                     guint             max_snippets,
+                                                     GFunc             foreach_func,
+                                                     gpointer          user_data);
+void              gb_source_snippets_foreach_max    (GbSourceSnippets *snippets,
+                                                     const gchar      *prefix,
+                                                     guint             max_snippets,
+                                                     GFunc             foreach_func,
+                                                     gpointer          user_data);
 
 G_END_DECLS
 
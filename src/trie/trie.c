@@ -26,6 +26,11 @@
 #define TRIE_64 1
 #endif
 
+#define TRIE_FROZEN_NONE G_MAXUINT
+
+#define TRIE_SLAB_MIN_CELLS   16
+#define TRIE_SLAB_MAX_CELLS 1024
+
 #define STATIC_ASSERT(a)                              \
    G_STMT_START {                                     \
       G_GNUC_UNUSED gchar static_assert[(a)? 0 : -1]; \
@@ -43,10 +48,22 @@
  * To insert a key and value pair into the #Trie use trie_insert().
  * To remove a key from the #Trie use trie_remove().
  * To traverse all children of the #Trie from a given key use trie_traverse().
+ *
+ * Tries holding a static vocabulary can be converted into a compact,
+ * read-only representation with trie_freeze(). If the keys are already
+ * sorted, trie_new_from_sorted() builds the #Trie in a single pass.
+ *
+ * To walk the keys below a prefix a few at a time, such as when only the
+ * first page of completion proposals is needed, use a #TrieIter. To
+ * tolerate typos in the prefix, use trie_traverse_fuzzy().
  */
 
-typedef struct _TrieNode      TrieNode;
-typedef struct _TrieNodeChunk TrieNodeChunk;
+typedef struct _TrieNode       TrieNode;
+typedef struct _TrieNodeChunk  TrieNodeChunk;
+typedef struct _TrieFrozen     TrieFrozen;
+typedef struct _TrieFrozenNode TrieFrozenNode;
+typedef union  _TrieCell       TrieCell;
+typedef struct _TrieIterEntry  TrieIterEntry;
 
 /**
  * Try to optimize for 64 bit vs 32 bit pointers. We are assuming that the
@@ -104,24 +121,149 @@ struct _TrieNode
 };
 #pragma pack(pop)
 
+/**
+ * TrieFrozenNode:
+ * @first_child: The index of the first child of the node.
+ * @value: The index of the node's value plus one, or zero.
+ * @key: The key of the edge leading into the node.
+ *
+ * Nodes of a frozen trie are stored in breadth-first order, so the children
+ * of a node are adjacent, sorted by @key, and directly follow the children
+ * of the previous node. The number of children is therefore the difference
+ * between @first_child of this node and of the next one.
+ *
+ * Keeping @key within the node means that finding a child only touches the
+ * run of sibling nodes, which usually shares a single cacheline.
+ */
+struct _TrieFrozenNode
+{
+   guint32 first_child;
+   guint32 value : 24;
+   guint32 key   : 8;
+};
+
+#define TRIE_FROZEN_MAX_VALUES ((1 << 24) - 1)
+
+/**
+ * TrieFrozen:
+ * @n_nodes: The number of nodes, not counting the trailing sentinel.
+ * @nodes: The nodes, followed by a sentinel whose @first_child is @n_nodes.
+ * @values: The values of the nodes that have one.
+ * @n_values: The number of elements in @values.
+ *
+ * The read-only form of a #Trie created by trie_freeze(). It contains no
+ * pointers other than the values themselves.
+ */
+struct _TrieFrozen
+{
+   guint            n_nodes;
+   guint            n_values;
+   TrieFrozenNode  *nodes;
+   gpointer        *values;
+};
+
+/**
+ * TrieCell:
+ * @next: The next free cell, while the cell is on the free list.
+ * @data: The storage for a #TrieNode or #TrieNodeChunk.
+ *
+ * Nodes and extra chunks are the same size, so both are carved out of
+ * slabs of cells owned by the #Trie.
+ */
+union _TrieCell
+{
+   TrieCell *next;
+   guint8    data[TRIE_NODE_SIZE];
+};
+
+/**
+ * TrieIterEntry:
+ * @node: The #TrieNode to visit, if the trie is not frozen.
+ * @idx: The index of the node to visit, if the trie is frozen.
+ * @len: The length of the key of the node.
+ * @key: The last byte of the key of the node, or zero for the node the
+ *    iteration started from.
+ *
+ * An entry on the stack of nodes that a #TrieIter has yet to visit.
+ */
+struct _TrieIterEntry
+{
+   union {
+      TrieNode *node;
+      guint     idx;
+   } u;
+   guint  len;
+   guint8 key;
+};
+
 /**
  * Trie:
  * @value_destroy: A #GDestroyNotify to free data pointers.
- * @root: The root TrieNode.
+ * @root: The root TrieNode, or %NULL if the trie is frozen.
+ * @frozen: The frozen representation of the trie, or %NULL.
+ * @slabs: The slab allocations that cells are carved from.
+ * @free_cells: Cells that were released with trie_free().
+ * @slab_pos: The next unused cell in the newest slab.
+ * @slab_end: The end of the newest slab.
+ * @slab_cells: The number of cells in the newest slab.
  */
 struct _Trie
 {
    GDestroyNotify  value_destroy;
    TrieNode       *root;
+   TrieFrozen     *frozen;
+   GPtrArray      *slabs;
+   TrieCell       *free_cells;
+   TrieCell       *slab_pos;
+   TrieCell       *slab_end;
+   guint           slab_cells;
+   volatile gint   ref_count;
 };
 
+struct _TrieRcu
+{
+   GMutex  mutex;
+   Trie   *current;
+};
+
+/**
+ * trie_slab_new:
+ * @trie: A #Trie.
+ *
+ * Allocates the next slab of cells for @trie. Slabs start small, since
+ * many tries only hold a handful of keys, and double in size up to
+ * %TRIE_SLAB_MAX_CELLS. Cells are aligned to their size so that each node
+ * keeps to a single cacheline.
+ */
+static void
+trie_slab_new (Trie *trie)
+{
+   gpointer slab;
+   gsize addr;
+
+   trie->slab_cells = trie->slab_cells ?
+                      MIN(trie->slab_cells * 2, TRIE_SLAB_MAX_CELLS) :
+                      TRIE_SLAB_MIN_CELLS;
+
+   slab = g_malloc((trie->slab_cells + 1) * sizeof(TrieCell));
+   g_ptr_array_add(trie->slabs, slab);
+
+   addr = GPOINTER_TO_SIZE(slab);
+   addr = (addr + sizeof(TrieCell) - 1) & ~(gsize)(sizeof(TrieCell) - 1);
+
+   trie->slab_pos = GSIZE_TO_POINTER(addr);
+   trie->slab_end = trie->slab_pos + trie->slab_cells;
+}
+
 /**
  * trie_malloc0:
  * @trie: A #Trie
  * @size: Number of bytes to allocate.
  *
- * Wrapper function to allocate a memory chunk. This gives us somewhere to
- * perform the abstraction if we want to use mmap()'d I/O at some point.
+ * Wrapper function to allocate a memory chunk. Nodes and chunks come from
+ * slabs owned by @trie rather than the general allocator, which keeps
+ * related nodes close together and lets trie_destroy() release them in
+ * bulk. Cells released with trie_free() are reused first.
  * The memory will be zero'd before being returned.
  *
  * Returns: A pointer to the allocation.
@@ -130,7 +272,20 @@ static gpointer
 trie_malloc0 (Trie  *trie,
               gsize  size)
 {
-   return g_malloc0(size);
+   TrieCell *cell;
+
+   g_assert(size <= sizeof(TrieCell));
+
+   if ((cell = trie->free_cells)) {
+      trie->free_cells = cell->next;
+   } else {
+      if (trie->slab_pos == trie->slab_end) {
+         trie_slab_new(trie);
+      }
+      cell = trie->slab_pos++;
+   }
+
+   return memset(cell, 0, sizeof *cell);
 }
 
 /**
@@ -138,13 +293,33 @@ trie_malloc0 (Trie  *trie,
  * @trie: A #Trie.
  * @data: The data to free.
  *
- * Frees a portion of memory allocated by @trie.
+ * Frees a portion of memory allocated by @trie. The cell is kept for reuse
+ * until @trie is destroyed.
  */
 static void
 trie_free (Trie     *trie,
            gpointer  data)
 {
-   g_free(data);
+   TrieCell *cell = data;
+
+   cell->next = trie->free_cells;
+   trie->free_cells = cell;
+}
+
+/**
+ * trie_free_slabs:
+ * @trie: A #Trie.
+ *
+ * Releases every node and chunk of @trie at once.
+ */
+static void
+trie_free_slabs (Trie *trie)
+{
+   g_ptr_array_set_size(trie->slabs, 0);
+   trie->free_cells = NULL;
+   trie->slab_pos = NULL;
+   trie->slab_end = NULL;
+   trie->slab_cells = 0;
 }
 
 /**
@@ -156,7 +331,7 @@ trie_free (Trie     *trie,
  * embedded in it that may contain only 4 pointers instead of the full 6 do
  * to the overhead of the TrieNode itself.
  *
- * Returns: A newly allocated TrieNode that should be freed with g_free().
+ * Returns: A newly allocated TrieNode that should be freed with trie_free().
  */
 TrieNode *
 trie_node_new (Trie     *trie,
@@ -471,6 +646,170 @@ trie_destroy_node (Trie           *trie,
    trie_free(trie, node);
 }
 
+/**
+ * trie_frozen_find_node:
+ * @frozen: A #TrieFrozen.
+ * @idx: The index of a node.
+ * @key: The key to find in this node.
+ *
+ * Searches the children of the node at @idx for @key. The children are
+ * adjacent and sorted, so this stops as soon as it passes @key.
+ *
+ * Returns: The index of the child, or %TRIE_FROZEN_NONE.
+ */
+static guint
+trie_frozen_find_node (TrieFrozen *frozen,
+                       guint       idx,
+                       guint8      key)
+{
+   guint last;
+   guint i;
+
+   g_assert(frozen);
+   g_assert(idx < frozen->n_nodes);
+
+   last = frozen->nodes[idx + 1].first_child;
+
+   for (i = frozen->nodes[idx].first_child; i < last; i++) {
+      if (frozen->nodes[i].key >= key) {
+         return (frozen->nodes[i].key == key) ? i : TRIE_FROZEN_NONE;
+      }
+   }
+
+   return TRIE_FROZEN_NONE;
+}
+
+/**
+ * trie_frozen_get_value:
+ * @frozen: A #TrieFrozen.
+ * @idx: The index of a node.
+ *
+ * Returns: (transfer none): The value of the node at @idx, or %NULL.
+ */
+static gpointer
+trie_frozen_get_value (TrieFrozen *frozen,
+                       guint       idx)
+{
+   guint value = frozen->nodes[idx].value;
+
+   return value ? frozen->values[value - 1] : NULL;
+}
+
+/**
+ * trie_frozen_traverse_node:
+ * @trie: A #Trie.
+ * @idx: The index of the node within the frozen trie.
+ * @str: The prefix for this node.
+ * @order: Either %G_PRE_ORDER or %G_POST_ORDER.
+ * @flags: The flags for which nodes to callback.
+ * @max_depth: the maximum depth to process.
+ * @func: The func to execute for each matching node.
+ * @user_data: User data for @func.
+ *
+ * The frozen counterpart of trie_traverse_node_pre_order() and
+ * trie_traverse_node_post_order(). Children are visited in key order.
+ *
+ * Returns: %TRUE if traversal was cancelled; otherwise %FALSE.
+ */
+static gboolean
+trie_frozen_traverse_node (Trie             *trie,
+                           guint             idx,
+                           GString          *str,
+                           GTraverseType     order,
+                           GTraverseFlags    flags,
+                           gint              max_depth,
+                           TrieTraverseFunc  func,
+                           gpointer          user_data)
+{
+   TrieFrozen *frozen = trie->frozen;
+   gpointer value;
+   gboolean matches;
+   guint last;
+   guint i;
+
+   if (!max_depth) {
+      return FALSE;
+   }
+
+   value = trie_frozen_get_value(frozen, idx);
+   matches = ((!value && (flags & G_TRAVERSE_NON_LEAVES)) ||
+              (value && (flags & G_TRAVERSE_LEAVES)));
+
+   if (matches && (order == G_PRE_ORDER)) {
+      if (func(trie, str->str, value, user_data)) {
+         return TRUE;
+      }
+   }
+
+   last = frozen->nodes[idx + 1].first_child;
+
+   for (i = frozen->nodes[idx].first_child; i < last; i++) {
+      g_string_append_c(str, frozen->nodes[i].key);
+      if (trie_frozen_traverse_node(trie, i, str, order, flags,
+                                    max_depth - 1, func, user_data)) {
+         return TRUE;
+      }
+      g_string_truncate(str, str->len - 1);
+   }
+
+   if (matches && (order == G_POST_ORDER)) {
+      return func(trie, str->str, value, user_data);
+   }
+
+   return FALSE;
+}
+
+/**
+ * trie_frozen_free:
+ * @frozen: A #TrieFrozen.
+ * @value_destroy: A #GDestroyNotify or %NULL.
+ *
+ * Releases @frozen and each of its values.
+ */
+static void
+trie_frozen_free (TrieFrozen     *frozen,
+                  GDestroyNotify  value_destroy)
+{
+   guint i;
+
+   if (value_destroy) {
+      for (i = 0; i < frozen->n_values; i++) {
+         value_destroy(frozen->values[i]);
+      }
+   }
+
+   g_free(frozen->nodes);
+   g_free(frozen->values);
+   g_free(frozen);
+}
+
+/**
+ * trie_node_destroy_values:
+ * @node: A #TrieNode.
+ * @value_destroy: A #GDestroyNotify.
+ *
+ * Calls @value_destroy for the value of @node and of each of its
+ * descendants. The nodes themselves are left alone, so that they can be
+ * released along with their slabs.
+ */
+static void
+trie_node_destroy_values (TrieNode       *node,
+                          GDestroyNotify  value_destroy)
+{
+   TrieNodeChunk *iter;
+   guint i;
+
+   for (iter = &node->chunk; iter; iter = iter->next) {
+      for (i = 0; i < iter->count; i++) {
+         trie_node_destroy_values(iter->children[i], value_destroy);
+      }
+   }
+
+   if (node->value) {
+      value_destroy(node->value);
+   }
+}
+
 /**
  * trie_new:
  * @value_destroy: A #GDestroyNotify, or %NULL.
@@ -493,14 +832,127 @@ trie_new (GDestroyNotify value_destroy)
    STATIC_ASSERT(sizeof(TrieNode) == 20);
    STATIC_ASSERT(sizeof(TrieNodeChunk) == 12);
 #endif
+   STATIC_ASSERT(TRIE_NODE_SIZE == TRIE_NODE_CHUNK_SIZE);
+   STATIC_ASSERT((sizeof(TrieCell) & (sizeof(TrieCell) - 1)) == 0);
 
    trie = g_new0(Trie, 1);
+   trie->ref_count = 1;
+   trie->slabs = g_ptr_array_new_with_free_func(g_free);
    trie->root = trie_node_new(trie, NULL);
    trie->value_destroy = value_destroy;
 
    return trie;
 }
 
+/**
+ * trie_node_get_last_chunk:
+ * @node: A #TrieNode.
+ *
+ * Returns: (transfer none): The last #TrieNodeChunk in the chain of @node.
+ */
+static TrieNodeChunk *
+trie_node_get_last_chunk (TrieNode *node)
+{
+   TrieNodeChunk *iter;
+
+   for (iter = &node->chunk; iter->next; iter = iter->next) { }
+
+   return iter;
+}
+
+/**
+ * trie_new_from_sorted:
+ * @value_destroy: A #GDestroyNotify, or %NULL.
+ * @keys: (array length=n_keys): The keys, sorted as by strcmp().
+ * @values: (array length=n_keys): The value for each key.
+ * @n_keys: The number of elements in @keys and @values.
+ *
+ * Creates a new #Trie containing @keys and @values in a single pass.
+ *
+ * Because the keys are sorted, each key shares its longest common prefix
+ * with the key before it, and every node below that prefix is new. This
+ * keeps the path of the previous key and appends the remainder of each
+ * key to it, without searching or reordering any chunks. Nodes are also
+ * allocated in key order.
+ *
+ * If a key is repeated, the last value wins, as with trie_insert(). If
+ * @keys turns out not to be sorted, the remaining keys are inserted with
+ * trie_insert().
+ *
+ * Returns: (transfer full): A newly allocated #Trie that should be freed
+ *   with trie_destroy().
+ */
+Trie *
+trie_new_from_sorted (GDestroyNotify       value_destroy,
+                      const gchar * const *keys,
+                      gpointer const      *values,
+                      guint                n_keys)
+{
+   const gchar *prev = "";
+   GPtrArray *path;
+   Trie *trie;
+   guint i;
+
+   g_return_val_if_fail(keys || !n_keys, NULL);
+   g_return_val_if_fail(values || !n_keys, NULL);
+
+   trie = trie_new(value_destroy);
+
+   /*
+    * path[n] is the node reached by the first n bytes of the previous key.
+    */
+   path = g_ptr_array_new();
+   g_ptr_array_add(path, trie->root);
+
+   for (i = 0; i < n_keys; i++) {
+      const gchar *key = keys[i];
+      TrieNode *node;
+      guint depth;
+
+      /*
+       * trie_insert() reports invalid keys and values for us.
+       */
+      if (!key || !values[i]) {
+         trie_insert(trie, key, values[i]);
+         continue;
+      }
+
+      for (depth = 0; prev[depth] && (prev[depth] == key[depth]); depth++) { }
+
+      if ((guint8)key[depth] < (guint8)prev[depth]) {
+         g_warning("Keys passed to trie_new_from_sorted() are not sorted.");
+         for (; i < n_keys; i++) {
+            trie_insert(trie, keys[i], values[i]);
+         }
+         break;
+      }
+
+      g_ptr_array_set_size(path, depth + 1);
+      node = g_ptr_array_index(path, depth);
+
+      for (; key[depth]; depth++) {
+         TrieNode *child;
+
+         child = trie_node_new(trie, node);
+         trie_append_to_node(trie, node, trie_node_get_last_chunk(node),
+                             key[depth], child);
+         g_ptr_array_add(path, child);
+         node = child;
+      }
+
+      if (node->value && value_destroy) {
+         value_destroy(node->value);
+      }
+
+      node->value = values[i];
+      prev = key;
+   }
+
+   g_ptr_array_free(path, TRUE);
+
+   return trie;
+}
+
 /**
  * trie_insert:
  * @trie: A #Trie.
@@ -508,6 +960,8 @@ trie_new (GDestroyNotify value_destroy)
  * @value: The value to insert.
  *
  * Inserts @value into @trie located with @key.
+ *
+ * @trie must not be frozen.
  */
 void
 trie_insert (Trie        *trie,
@@ -517,6 +971,7 @@ trie_insert (Trie        *trie,
    TrieNode *node;
 
    g_return_if_fail(trie);
+   g_return_if_fail(!trie->frozen);
    g_return_if_fail(key);
    g_return_if_fail(value);
 
@@ -555,6 +1010,19 @@ trie_lookup (Trie        *trie,
    g_return_val_if_fail(trie, NULL);
    g_return_val_if_fail(key, NULL);
 
+   if (trie->frozen) {
+      guint idx = 0;
+
+      while (*key && (idx != TRIE_FROZEN_NONE)) {
+         idx = trie_frozen_find_node(trie->frozen, idx, *key);
+         key++;
+      }
+
+      return (idx != TRIE_FROZEN_NONE) ?
+             trie_frozen_get_value(trie->frozen, idx) :
+             NULL;
+   }
+
    node = trie->root;
 
    while (*key && node) {
@@ -571,7 +1039,7 @@ trie_lookup (Trie        *trie,
  * @key: The key to remove.
  *
  * Removes @key from @trie, possibly destroying the value associated with
- * the key.
+ * the key. @trie must not be frozen.
  *
  * Returns: %TRUE if @key was found, otherwise %FALSE.
  */
@@ -582,6 +1050,7 @@ trie_remove (Trie        *trie,
    TrieNode *node;
 
    g_return_val_if_fail(trie, FALSE);
+   g_return_val_if_fail(!trie->frozen, FALSE);
    g_return_val_if_fail(key, FALSE);
 
    node = trie->root;
@@ -774,6 +1243,27 @@ trie_traverse (Trie             *trie,
 
    str = g_string_new(key);
 
+   if (trie->frozen) {
+      guint idx = 0;
+
+      while (*key && (idx != TRIE_FROZEN_NONE)) {
+         idx = trie_frozen_find_node(trie->frozen, idx, *key);
+         key++;
+      }
+
+      if (idx != TRIE_FROZEN_NONE) {
+         if ((order == G_PRE_ORDER) || (order == G_POST_ORDER)) {
+            trie_frozen_traverse_node(trie, idx, str, order, flags,
+                                      max_depth, func, user_data);
+         } else {
+            g_warning(_("Traversal order %u is not supported on Trie."), order);
+         }
+      }
+
+      g_string_free(str, TRUE);
+      return;
+   }
+
    while (*key && node) {
       node = trie_find_node(trie, node, *key);
       key++;
@@ -795,18 +1285,818 @@ trie_traverse (Trie             *trie,
 }
 
 /**
- * trie_destroy:
+ * TrieFuzzy:
+ * @trie: The #Trie being traversed.
+ * @query: The characters of the key being searched for.
+ * @query_len: The number of characters in @query.
+ * @max_edits: The largest distance to report.
+ * @rows: The rows of the edit distance table, @query_len + 1 entries for
+ *    each character of the current path.
+ * @chars: The characters of the current path.
+ * @str: The bytes of the current path.
+ * @func: The func to execute for each matching node.
+ * @user_data: User data for @func.
+ *
+ * The state of a trie_traverse_fuzzy() call.
+ */
+typedef struct
+{
+   Trie                  *trie;
+   gunichar              *query;
+   glong                  query_len;
+   guint                  max_edits;
+   GArray                *rows;
+   GArray                *chars;
+   GString               *str;
+   TrieFuzzyTraverseFunc  func;
+   gpointer               user_data;
+} TrieFuzzy;
+
+/**
+ * trie_fuzzy_push_row:
+ * @fuzzy: A #TrieFuzzy.
+ * @depth: The number of characters in the path before @ch.
+ * @ch: The next character of the path.
+ *
+ * Computes the row of the edit distance table for the path extended by
+ * @ch. Each row is the state of a Levenshtein automaton for @query after
+ * reading the path, so walking the trie only costs one row per character.
+ * Adjacent transpositions are counted as a single edit, since they are the
+ * most common typo.
+ *
+ * Returns: The smallest entry of the new row. No longer path can be closer
+ *   to any prefix of the query than this.
+ */
+static guint
+trie_fuzzy_push_row (TrieFuzzy *fuzzy,
+                     guint      depth,
+                     gunichar   ch)
+{
+   const gunichar *query = fuzzy->query;
+   guint width = fuzzy->query_len + 1;
+   const guint *prev2;
+   const guint *prev;
+   gunichar last_ch;
+   guint *row;
+   guint min_dist;
+   guint j;
+
+   g_array_set_size(fuzzy->rows, (depth + 2) * width);
+   g_array_set_size(fuzzy->chars, depth + 1);
+   g_array_index(fuzzy->chars, gunichar, depth) = ch;
+
+   prev2 = depth ? &g_array_index(fuzzy->rows, guint, (depth - 1) * width) : NULL;
+   prev = &g_array_index(fuzzy->rows, guint, depth * width);
+   row = &g_array_index(fuzzy->rows, guint, (depth + 1) * width);
+   last_ch = depth ? g_array_index(fuzzy->chars, gunichar, depth - 1) : 0;
+
+   row[0] = min_dist = depth + 1;
+
+   for (j = 1; j < width; j++) {
+      guint dist;
+
+      dist = MIN(prev[j] + 1, row[j - 1] + 1);
+      dist = MIN(dist, prev[j - 1] + (query[j - 1] != ch));
+
+      if (prev2 && (j > 1) &&
+          (query[j - 1] == last_ch) &&
+          (query[j - 2] == ch)) {
+         dist = MIN(dist, prev2[j - 2] + 1);
+      }
+
+      row[j] = dist;
+      min_dist = MIN(min_dist, dist);
+   }
+
+   return min_dist;
+}
+
+/**
+ * trie_fuzzy_visit:
+ * @fuzzy: A #TrieFuzzy.
+ * @node: The #TrieNode to visit, if the trie is not frozen.
+ * @idx: The index of the node to visit, if the trie is frozen.
+ * @depth: The number of complete characters in the path to the node.
+ * @pending: The number of bytes still missing from the last character.
+ * @best: The smallest distance between the query and any prefix of the
+ *    path so far.
+ * @settled: %TRUE if no longer path can lower @best.
+ *
+ * Visits the node and each of its children that might still be within
+ * @fuzzy->max_edits of the query. Once the distance is settled, the whole
+ * subtree matches with the same distance and no more rows are computed.
+ *
+ * Returns: %TRUE if traversal was cancelled; otherwise %FALSE.
+ */
+static gboolean
+trie_fuzzy_visit (TrieFuzzy *fuzzy,
+                  TrieNode  *node,
+                  guint      idx,
+                  guint      depth,
+                  guint      pending,
+                  guint      best,
+                  gboolean   settled)
+{
+   TrieFrozen *frozen = fuzzy->trie->frozen;
+   TrieNodeChunk *chunk = NULL;
+   gpointer value;
+   guint first;
+   guint last;
+   guint i;
+
+   value = frozen ? trie_frozen_get_value(frozen, idx) : node->value;
+
+   if (value && !pending && (best <= fuzzy->max_edits)) {
+      if (fuzzy->func(fuzzy->trie, fuzzy->str->str, value, best, fuzzy->user_data)) {
+         return TRUE;
+      }
+   }
+
+   if (frozen) {
+      first = frozen->nodes[idx].first_child;
+      last = frozen->nodes[idx + 1].first_child;
+   } else {
+      chunk = &node->chunk;
+      first = 0;
+      last = chunk->count;
+   }
+
+   while (first < last) {
+      for (i = first; i < last; i++) {
+         TrieNode *child = NULL;
+         guint child_idx = 0;
+         guint child_depth = depth;
+         guint child_pending;
+         guint child_best = best;
+         gboolean child_settled = settled;
+         guint8 key;
+
+         if (frozen) {
+            child_idx = i;
+            key = frozen->nodes[i].key;
+         } else {
+            child = chunk->children[i];
+            key = chunk->keys[i];
+         }
+
+         g_string_append_c(fuzzy->str, key);
+
+         /*
+          * Only compare whole characters. Until the last byte of a
+          * multi-byte character is reached, the row stays the same.
+          */
+         if (pending) {
+            child_pending = pending - 1;
+         } else if ((key & 0xE0) == 0xC0) {
+            child_pending = 1;
+         } else if ((key & 0xF0) == 0xE0) {
+            child_pending = 2;
+         } else if ((key & 0xF8) == 0xF0) {
+            child_pending = 3;
+         } else {
+            child_pending = 0;
+         }
+
+         if (!child_pending && !settled) {
+            const gchar *ch_begin;
+            gunichar ch;
+            guint min_dist;
+
+            ch_begin = g_utf8_find_prev_char(fuzzy->str->str,
+                                             fuzzy->str->str + fuzzy->str->len);
+            ch = g_utf8_get_char_validated(ch_begin, -1);
+            if (ch == (gunichar)-1 || ch == (gunichar)-2) {
+               ch = key;
+            }
+
+            min_dist = trie_fuzzy_push_row(fuzzy, depth, ch);
+            child_depth = depth + 1;
+            child_best = MIN(best, g_array_index(fuzzy->rows, guint,
+                                                 (child_depth * (fuzzy->query_len + 1)) +
+                                                 fuzzy->query_len));
+
+            /*
+             * Nothing below can come within range of the query, and
+             * nothing here already is.
+             */
+            if ((min_dist > fuzzy->max_edits) && (child_best > fuzzy->max_edits)) {
+               g_string_truncate(fuzzy->str, fuzzy->str->len - 1);
+               continue;
+            }
+
+            child_settled = (min_dist >= child_best);
+         }
+
+         if (trie_fuzzy_visit(fuzzy, child, child_idx, child_depth,
+                              child_pending, child_best, child_settled)) {
+            return TRUE;
+         }
+
+         g_string_truncate(fuzzy->str, fuzzy->str->len - 1);
+      }
+
+      if (frozen || !(chunk = chunk->next)) {
+         break;
+      }
+
+      first = 0;
+      last = chunk->count;
+   }
+
+   return FALSE;
+}
+
+/**
+ * trie_traverse_fuzzy:
+ * @trie: A #Trie.
+ * @key: The key to search for.
+ * @max_edits: The largest number of edits to allow.
+ * @func: The func to execute for each matching key.
+ * @user_data: User data for @func.
+ *
+ * Calls @func for each key in @trie that starts with something within
+ * @max_edits of @key. This is the typo tolerant counterpart of
+ * trie_traverse() with %G_PRE_ORDER and %G_TRAVERSE_LEAVES, so "dvi" finds
+ * "div" and "dialog" with one edit.
+ *
+ * An edit is the insertion, removal or substitution of a character, or
+ * swapping two adjacent characters. The distance passed to @func is the
+ * smallest number of edits between @key and any prefix of the key found.
+ *
+ * Subtrees that cannot come within @max_edits of @key are skipped, so the
+ * cost depends on @max_edits and the length of @key rather than on the
+ * size of @trie. If @func returns %TRUE, traversal stops.
+ */
+void
+trie_traverse_fuzzy (Trie                  *trie,
+                     const gchar           *key,
+                     guint                  max_edits,
+                     TrieFuzzyTraverseFunc  func,
+                     gpointer               user_data)
+{
+   TrieFuzzy fuzzy = { 0 };
+   guint j;
+
+   g_return_if_fail(trie);
+   g_return_if_fail(key);
+   g_return_if_fail(func);
+   g_return_if_fail(g_utf8_validate(key, -1, NULL));
+
+   fuzzy.trie = trie;
+   fuzzy.query = g_utf8_to_ucs4_fast(key, -1, &fuzzy.query_len);
+   fuzzy.max_edits = max_edits;
+   fuzzy.rows = g_array_new(FALSE, FALSE, sizeof(guint));
+   fuzzy.chars = g_array_new(FALSE, FALSE, sizeof(gunichar));
+   fuzzy.str = g_string_new(NULL);
+   fuzzy.func = func;
+   fuzzy.user_data = user_data;
+
+   /*
+    * The first row is the cost of removing each prefix of the query.
+    */
+   g_array_set_size(fuzzy.rows, fuzzy.query_len + 1);
+   for (j = 0; j <= fuzzy.query_len; j++) {
+      g_array_index(fuzzy.rows, guint, j) = j;
+   }
+
+   trie_fuzzy_visit(&fuzzy, trie->root, 0, 0, 0, fuzzy.query_len, FALSE);
+
+   g_string_free(fuzzy.str, TRUE);
+   g_array_unref(fuzzy.chars);
+   g_array_unref(fuzzy.rows);
+   g_free(fuzzy.query);
+}
+
+/**
+ * trie_iter_init_prefix:
+ * @iter: An uninitialized #TrieIter.
+ * @trie: A #Trie.
+ * @prefix: (allow-none): The prefix of the keys to iterate, or %NULL.
+ * @max_results: The most values to return, or 0 for no limit.
+ *
+ * Initializes @iter to walk the keys of @trie starting with @prefix, in the
+ * same order as trie_traverse() with %G_PRE_ORDER and %G_TRAVERSE_LEAVES.
+ *
+ * Unlike trie_traverse(), only as much of the trie is visited as has been
+ * asked for. Once @max_results values have been returned, trie_iter_next()
+ * returns %FALSE and the remaining nodes are left unvisited. Iteration can
+ * be resumed later on by raising the limit with
+ * trie_iter_set_max_results().
+ *
+ * @trie must not be modified while it is being iterated. Release the
+ * resources held by @iter with trie_iter_clear().
+ */
+void
+trie_iter_init_prefix (TrieIter    *iter,
+                       Trie        *trie,
+                       const gchar *prefix,
+                       guint        max_results)
+{
+   TrieIterEntry entry = { { 0 } };
+   const gchar *key;
+
+   g_return_if_fail(iter);
+   g_return_if_fail(trie);
+
+   prefix = prefix ? prefix : "";
+
+   iter->trie = trie;
+   iter->stack = g_array_new(FALSE, FALSE, sizeof(TrieIterEntry));
+   iter->key = g_string_new(prefix);
+   iter->n_results = 0;
+   iter->max_results = max_results;
+
+   entry.len = iter->key->len;
+
+   if (trie->frozen) {
+      guint idx = 0;
+
+      for (key = prefix; *key && (idx != TRIE_FROZEN_NONE); key++) {
+         idx = trie_frozen_find_node(trie->frozen, idx, *key);
+      }
+
+      if (idx != TRIE_FROZEN_NONE) {
+         entry.u.idx = idx;
+         g_array_append_val(iter->stack, entry);
+      }
+   } else {
+      TrieNode *node = trie->root;
+
+      for (key = prefix; *key && node; key++) {
+         node = trie_find_node(trie, node, *key);
+      }
+
+      if (node) {
+         entry.u.node = node;
+         g_array_append_val(iter->stack, entry);
+      }
+   }
+}
+
+/**
+ * trie_iter_push_children:
+ * @iter: A #TrieIter.
+ * @entry: The entry that was just visited.
+ *
+ * Pushes the children of the node of @entry onto the stack so that the
+ * first child is visited next.
+ */
+static void
+trie_iter_push_children (TrieIter            *iter,
+                         const TrieIterEntry *entry)
+{
+   TrieIterEntry child = { { 0 } };
+   TrieNodeChunk *chunk;
+   guint first;
+   guint last;
+   guint i;
+
+   child.len = entry->len + 1;
+
+   if (iter->trie->frozen) {
+      TrieFrozen *frozen = iter->trie->frozen;
+
+      first = frozen->nodes[entry->u.idx].first_child;
+
+      for (i = frozen->nodes[entry->u.idx + 1].first_child; i > first; i--) {
+         child.u.idx = i - 1;
+         child.key = frozen->nodes[i - 1].key;
+         g_array_append_val(iter->stack, child);
+      }
+
+      return;
+   }
+
+   /*
+    * Chunks can only be walked forwards, so push the children in order
+    * and then reverse them on the stack.
+    */
+   first = iter->stack->len;
+
+   for (chunk = &entry->u.node->chunk; chunk; chunk = chunk->next) {
+      for (i = 0; i < chunk->count; i++) {
+         child.u.node = chunk->children[i];
+         child.key = chunk->keys[i];
+         g_array_append_val(iter->stack, child);
+      }
+   }
+
+   for (last = iter->stack->len; (last - first) > 1; first++, last--) {
+      child = g_array_index(iter->stack, TrieIterEntry, first);
+      g_array_index(iter->stack, TrieIterEntry, first) =
+         g_array_index(iter->stack, TrieIterEntry, last - 1);
+      g_array_index(iter->stack, TrieIterEntry, last - 1) = child;
+   }
+}
+
+/**
+ * trie_iter_next:
+ * @iter: A #TrieIter.
+ * @key: (out) (allow-none): A location for the key, or %NULL.
+ * @value: (out) (allow-none): A location for the value, or %NULL.
+ *
+ * Advances @iter to the next key that has a value. The key is only valid
+ * until the next call to trie_iter_next() or trie_iter_clear().
+ *
+ * Returns: %TRUE if @key and @value were set, or %FALSE if there are no
+ *   more values or the limit given to @iter has been reached.
+ */
+gboolean
+trie_iter_next (TrieIter     *iter,
+                const gchar **key,
+                gpointer     *value)
+{
+   TrieIterEntry entry;
+   gpointer node_value;
+
+   g_return_val_if_fail(iter, FALSE);
+   g_return_val_if_fail(iter->stack, FALSE);
+
+   while (iter->stack->len) {
+      if (iter->max_results && (iter->n_results >= iter->max_results)) {
+         return FALSE;
+      }
+
+      entry = g_array_index(iter->stack, TrieIterEntry, iter->stack->len - 1);
+      g_array_set_size(iter->stack, iter->stack->len - 1);
+
+      if (entry.key) {
+         g_string_truncate(iter->key, entry.len - 1);
+         g_string_append_c(iter->key, entry.key);
+      } else {
+         g_string_truncate(iter->key, entry.len);
+      }
+
+      trie_iter_push_children(iter, &entry);
+
+      node_value = iter->trie->frozen ?
+                   trie_frozen_get_value(iter->trie->frozen, entry.u.idx) :
+                   entry.u.node->value;
+
+      if (node_value) {
+         iter->n_results++;
+         if (key) {
+            *key = iter->key->str;
+         }
+         if (value) {
+            *value = node_value;
+         }
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+/**
+ * trie_iter_set_max_results:
+ * @iter: A #TrieIter.
+ * @max_results: The most values to return in total, or 0 for no limit.
+ *
+ * Changes the limit of @iter. Raising it allows a stopped iteration to
+ * continue where it left off, such as when the next page of results is
+ * needed.
+ */
+void
+trie_iter_set_max_results (TrieIter *iter,
+                           guint     max_results)
+{
+   g_return_if_fail(iter);
+
+   iter->max_results = max_results;
+}
+
+/**
+ * trie_iter_clear:
+ * @iter: A #TrieIter.
+ *
+ * Releases the resources held by @iter.
+ */
+void
+trie_iter_clear (TrieIter *iter)
+{
+   g_return_if_fail(iter);
+
+   if (iter->stack) {
+      g_array_unref(iter->stack);
+      iter->stack = NULL;
+   }
+
+   if (iter->key) {
+      g_string_free(iter->key, TRUE);
+      iter->key = NULL;
+   }
+
+   iter->trie = NULL;
+}
+
+/**
+ * trie_ref:
+ * @trie: A #Trie.
+ *
+ * Increments the reference count of @trie. This is mostly useful for
+ * frozen tries, which may be shared between threads.
+ *
+ * Returns: (transfer full): @trie.
+ */
+Trie *
+trie_ref (Trie *trie)
+{
+   g_return_val_if_fail(trie, NULL);
+   g_return_val_if_fail(g_atomic_int_get(&trie->ref_count) > 0, NULL);
+
+   g_atomic_int_inc(&trie->ref_count);
+
+   return trie;
+}
+
+/**
+ * trie_unref:
  * @trie: A #Trie or %NULL.
  *
- * Frees @trie and all associated memory.
+ * Decrements the reference count of @trie. When it reaches zero, @trie,
+ * its values and all associated memory are freed.
  */
 void
-trie_destroy (Trie *trie)
+trie_unref (Trie *trie)
 {
    if (trie) {
-      trie_destroy_node(trie, trie->root, trie->value_destroy);
+      g_return_if_fail(g_atomic_int_get(&trie->ref_count) > 0);
+
+      if (!g_atomic_int_dec_and_test(&trie->ref_count)) {
+         return;
+      }
+
+      if (trie->frozen) {
+         trie_frozen_free(trie->frozen, trie->value_destroy);
+         trie->frozen = NULL;
+      } else if (trie->value_destroy) {
+         trie_node_destroy_values(trie->root, trie->value_destroy);
+      }
+      g_ptr_array_unref(trie->slabs);
       trie->root = NULL;
       trie->value_destroy = NULL;
       g_free(trie);
    }
 }
+
+/**
+ * trie_destroy:
+ * @trie: A #Trie or %NULL.
+ *
+ * Frees @trie and all associated memory. This is the same as
+ * trie_unref(), so a trie that is still referenced elsewhere stays
+ * alive until the last reference is dropped.
+ */
+void
+trie_destroy (Trie *trie)
+{
+   trie_unref(trie);
+}
+
+/**
+ * trie_freeze:
+ * @trie: A #Trie.
+ *
+ * Converts @trie into a compact, read-only representation. The nodes are
+ * laid out breadth-first in a single array with the keys of each node's
+ * children stored next to each other, so lookups and traversals walk
+ * contiguous memory instead of chasing pointers between chunks.
+ *
+ * This is meant for static vocabularies that are built once and then only
+ * queried. trie_lookup() and trie_traverse() work as before, although
+ * traversal visits the children of each node in key order. @trie can no
+ * longer be modified with trie_insert() or trie_remove().
+ *
+ * Freezing fails, leaving @trie unchanged, if it holds more than
+ * 2^24 - 1 values.
+ *
+ * Returns: %TRUE if @trie is now frozen, including when it already was.
+ */
+gboolean
+trie_freeze (Trie *trie)
+{
+   TrieFrozen *frozen;
+   TrieNodeChunk *iter;
+   GPtrArray *queue;
+   GArray *nodes;
+   GPtrArray *values;
+   guint head;
+   guint i;
+
+   g_return_val_if_fail(trie, FALSE);
+
+   if (trie->frozen) {
+      return TRUE;
+   }
+
+   nodes = g_array_new(FALSE, TRUE, sizeof(TrieFrozenNode));
+   values = g_ptr_array_new();
+   queue = g_ptr_array_new();
+
+   /*
+    * The position of each node in the queue is its index in the frozen trie.
+    * As nodes are visited in queue order, the children of each node are
+    * appended right after the children of the node visited before it.
+    */
+   g_ptr_array_add(queue, trie->root);
+   g_array_set_size(nodes, 1);
+
+   for (head = 0; head < queue->len; head++) {
+      TrieNode *node = g_ptr_array_index(queue, head);
+      TrieFrozenNode *fnode;
+      guint first = queue->len;
+      guint n_children;
+
+      for (iter = &node->chunk; iter; iter = iter->next) {
+         for (i = 0; i < iter->count; i++) {
+            g_ptr_array_add(queue, iter->children[i]);
+            g_array_set_size(nodes, queue->len);
+            g_array_index(nodes, TrieFrozenNode, queue->len - 1).key = iter->keys[i];
+         }
+      }
+
+      n_children = queue->len - first;
+
+      fnode = &g_array_index(nodes, TrieFrozenNode, head);
+      fnode->first_child = first;
+
+      if (node->value) {
+         if (values->len == TRIE_FROZEN_MAX_VALUES) {
+            g_warning("Trie has too many values to be frozen.");
+            g_array_free(nodes, TRUE);
+            g_ptr_array_free(values, TRUE);
+            g_ptr_array_free(queue, TRUE);
+            return FALSE;
+         }
+         g_ptr_array_add(values, node->value);
+         fnode->value = values->len;
+      }
+
+      /*
+       * Keep the children sorted by key. Nodes rarely have more than a
+       * handful of children, so an insertion sort is plenty.
+       */
+      for (i = 1; i < n_children; i++) {
+         TrieNode *child = g_ptr_array_index(queue, first + i);
+         guint8 key = g_array_index(nodes, TrieFrozenNode, first + i).key;
+         guint j;
+
+         for (j = i; j; j--) {
+            TrieFrozenNode *prev = &g_array_index(nodes, TrieFrozenNode, first + j - 1);
+
+            if (prev->key <= key) {
+               break;
+            }
+            g_array_index(nodes, TrieFrozenNode, first + j).key = prev->key;
+            g_ptr_array_index(queue, first + j) = g_ptr_array_index(queue, first + j - 1);
+         }
+
+         g_array_index(nodes, TrieFrozenNode, first + j).key = key;
+         g_ptr_array_index(queue, first + j) = child;
+      }
+   }
+
+   /*
+    * The sentinel lets the last node compute its number of children.
+    */
+   g_array_set_size(nodes, queue->len + 1);
+   g_array_index(nodes, TrieFrozenNode, queue->len).first_child = queue->len;
+
+   frozen = g_new0(TrieFrozen, 1);
+   frozen->n_nodes = queue->len;
+   frozen->n_values = values->len;
+   frozen->nodes = (TrieFrozenNode *)(gpointer)g_array_free(nodes, FALSE);
+   frozen->values = (gpointer *)g_ptr_array_free(values, FALSE);
+
+   /*
+    * The values now belong to the frozen trie, so release the nodes
+    * without destroying them.
+    */
+   trie_free_slabs(trie);
+   trie->root = NULL;
+   trie->frozen = frozen;
+
+   g_ptr_array_free(queue, TRUE);
+
+   return TRUE;
+}
+
+/**
+ * trie_rcu_new:
+ * @trie: (transfer full): The initial version of the trie.
+ *
+ * Creates a #TrieRcu, which lets any number of threads read a trie while
+ * another thread replaces it. Readers take the current version with
+ * trie_rcu_acquire() and may use it for as long as they like without any
+ * locking, since published tries are frozen and never change. A writer
+ * builds the next version on its own and swaps it in with
+ * trie_rcu_publish(). Each version is freed once the last reader is done
+ * with it.
+ *
+ * @trie is frozen if it is not already. A trie that cannot be frozen is
+ * refused, since readers rely on it never changing. The reference to
+ * @trie is consumed in that case too.
+ *
+ * Returns: (transfer full): A #TrieRcu that should be freed with
+ *   trie_rcu_free(), or %NULL if @trie could not be frozen.
+ */
+TrieRcu *
+trie_rcu_new (Trie *trie)
+{
+   TrieRcu *rcu;
+   gboolean frozen;
+
+   g_return_val_if_fail(trie, NULL);
+
+   if (!(frozen = trie_freeze(trie))) {
+      trie_unref(trie);
+   }
+
+   g_return_val_if_fail(frozen, NULL);
+
+   rcu = g_new0(TrieRcu, 1);
+   g_mutex_init(&rcu->mutex);
+   rcu->current = trie;
+
+   return rcu;
+}
+
+/**
+ * trie_rcu_acquire:
+ * @rcu: A #TrieRcu.
+ *
+ * Gets the current version of the trie. Later calls to trie_rcu_publish()
+ * do not affect the returned trie, so a lookup or traversal always sees a
+ * consistent set of keys. The mutex is only held long enough to take the
+ * reference and is never held while a new version is built.
+ *
+ * Returns: (transfer full): A frozen #Trie. Release it with trie_unref().
+ */
+Trie *
+trie_rcu_acquire (TrieRcu *rcu)
+{
+   Trie *trie;
+
+   g_return_val_if_fail(rcu, NULL);
+
+   g_mutex_lock(&rcu->mutex);
+   trie = trie_ref(rcu->current);
+   g_mutex_unlock(&rcu->mutex);
+
+   return trie;
+}
+
+/**
+ * trie_rcu_publish:
+ * @rcu: A #TrieRcu.
+ * @trie: (transfer full): The new version of the trie.
+ *
+ * Replaces the current version of the trie with @trie, freezing it first
+ * if needed. A trie that cannot be frozen is refused and the current
+ * version is kept, but the reference to @trie is still consumed. Readers
+ * that already acquired the previous version keep it until they release
+ * it.
+ *
+ * Publishing is atomic, but a writer that derives @trie from the current
+ * version must make sure no other writer publishes in the meantime.
+ */
+void
+trie_rcu_publish (TrieRcu *rcu,
+                  Trie    *trie)
+{
+   Trie *old;
+   gboolean frozen;
+
+   g_return_if_fail(rcu);
+   g_return_if_fail(trie);
+
+   if (!(frozen = trie_freeze(trie))) {
+      trie_unref(trie);
+   }
+
+   g_return_if_fail(frozen);
+
+   g_mutex_lock(&rcu->mutex);
+   old = rcu->current;
+   rcu->current = trie;
+   g_mutex_unlock(&rcu->mutex);
+
+   trie_unref(old);
+}
+
+/**
+ * trie_rcu_free:
+ * @rcu: A #TrieRcu or %NULL.
+ *
+ * Frees @rcu and drops its reference to the current version of the trie.
+ */
+void
+trie_rcu_free (TrieRcu *rcu)
+{
+   if (rcu) {
+      trie_unref(rcu->current);
+      g_mutex_clear(&rcu->mutex);
+      g_free(rcu);
+   }
+}
@@ -23,29 +23,73 @@
 
 G_BEGIN_DECLS
 
-typedef struct _Trie Trie;
+typedef struct _Trie    Trie;
+typedef struct _TrieRcu TrieRcu;
 
 typedef gboolean (*TrieTraverseFunc) (Trie        *trie,
                                       const gchar *key,
                                       gpointer     value,
                                       gpointer     user_data);
 
-void      trie_destroy  (Trie             *trie);
-void      trie_insert   (Trie             *trie,
-                         const gchar      *key,
-                         gpointer          value);
-gpointer  trie_lookup   (Trie             *trie,
-                         const gchar      *key);
-Trie     *trie_new      (GDestroyNotify    value_destroy);
-gboolean  trie_remove   (Trie             *trie,
-                         const gchar      *key);
-void      trie_traverse (Trie             *trie,
-                         const gchar      *key,
-                         GTraverseType     order,
-                         GTraverseFlags    flags,
-                         gint              max_depth,
-                         TrieTraverseFunc  func,
-                         gpointer          user_data);
+typedef gboolean (*TrieFuzzyTraverseFunc) (Trie        *trie,
+                                           const gchar *key,
+                                           gpointer     value,
+                                           guint        distance,
+                                           gpointer     user_data);
+
+typedef struct
+{
+   /*< private >*/
+   Trie    *trie;
+   GArray  *stack;
+   GString *key;
+   guint    n_results;
+   guint    max_results;
+} TrieIter;
+
+void      trie_destroy              (Trie                   *trie);
+gboolean  trie_freeze               (Trie                   *trie);
+void      trie_insert               (Trie                   *trie,
+                                     const gchar            *key,
+                                     gpointer                value);
+void      trie_iter_clear           (TrieIter               *iter);
+void      trie_iter_init_prefix     (TrieIter               *iter,
+                                     Trie                   *trie,
+                                     const gchar            *prefix,
+                                     guint                   max_results);
+gboolean  trie_iter_next            (TrieIter               *iter,
+                                     const gchar           **key,
+                                     gpointer               *value);
+void      trie_iter_set_max_results (TrieIter               *iter,
+                                     guint                   max_results);
+gpointer  trie_lookup               (Trie                   *trie,
+                                     const gchar            *key);
+Trie     *trie_new                  (GDestroyNotify          value_destroy);
+Trie     *trie_new_from_sorted      (GDestroyNotify          value_destroy,
+                                     const gchar * const    *keys,
+                                     gpointer const         *values,
+                                     guint                   n_keys);
+Trie     *trie_rcu_acquire          (TrieRcu                *rcu);
+void      trie_rcu_free             (TrieRcu                *rcu);
+TrieRcu  *trie_rcu_new              (Trie                   *trie);
+void      trie_rcu_publish          (TrieRcu                *rcu,
+                                     Trie                   *trie);
+Trie     *trie_ref                  (Trie                   *trie);
+gboolean  trie_remove               (Trie                   *trie,
+                                     const gchar            *key);
+void      trie_traverse             (Trie                   *trie,
+                                     const gchar            *key,
+                                     GTraverseType           order,
+                                     GTraverseFlags          flags,
+                                     gint                    max_depth,
+                                     TrieTraverseFunc        func,
+                                     gpointer                user_data);
+void      trie_traverse_fuzzy       (Trie                   *trie,
+                                     const gchar            *key,
+                                     guint                   max_edits,
+                                     TrieFuzzyTraverseFunc   func,
+                                     gpointer                user_data);
+void      trie_unref                (Trie                   *trie);
 
 G_END_DECLS
 
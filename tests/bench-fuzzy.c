@@ -0,0 +1,542 @@
+/* bench-fuzzy.c
+ *
+ * Copyright (C) 2015 Christian Hergert <christian@hergert.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "bench-util.h"
+#include "fuzzy.h"
+
+/*
+ * Runs the fuzzy index against synthetic corpora and the HTML completion
+ * vocabulary, or against recorded corpora passed on the command line with
+ * one key per line, such as the output of `git ls-files`. Each measurement
+ * is printed as a line of JSON. Use --size=1000000 to see how the index
+ * scales to very large checkouts.
+ */
+
+#define N_SYNTHETIC_KEYS 100000
+#define N_SAMPLED_QUERIES 200
+#define N_MATCHES 200
+#define N_INSERTS 1000
+
+static gboolean path_aware;
+static gint size = N_SYNTHETIC_KEYS;
+
+static GOptionEntry entries[] = {
+  { "path-aware", 'p', 0, G_OPTION_ARG_NONE, &path_aware,
+    "Match keys as paths, and sample needles from file names", NULL },
+  { "size", 's', 0, G_OPTION_ARG_INT, &size,
+    "The number of keys in each synthetic corpus", "N" },
+  { NULL }
+};
+
+static const gchar *words[] = {
+  "src", "editor", "document", "search", "box", "gb", "workbench",
+  "git", "provider", "view", "tree", "fuzzy", "trie", "html", "snippets",
+  "util", "animation", "frame", "source", "vim", "command", "manager",
+};
+
+static const gchar *unicode_words[] = {
+  "données", "ÉCRAN", "größe", "Überblick", "привет", "файл", "日本語",
+  "ドキュメント", "ασφάλεια", "Ελληνικά",
+};
+
+static const gchar *synthetic_queries[] = {
+  "gbed", "srcdoc", "fuzzy", "gbwb", "vimcmd", "tree", "htmlsnip",
+  "gbsearchbox", "x", "document", "zyx", "gitprov", "animfr",
+};
+
+static GPtrArray *
+build_corpus (gboolean unicode)
+{
+  GPtrArray *corpus;
+  GRand *rand;
+  guint i;
+
+  corpus = g_ptr_array_new_with_free_func (g_free);
+  rand = g_rand_new_with_seed (1234);
+
+  for (i = 0; i < (guint)size; i++)
+    {
+      GString *str = g_string_new (NULL);
+      guint n_parts;
+      guint j;
+
+      n_parts = g_rand_int_range (rand, 2, 6);
+
+      for (j = 0; j < n_parts; j++)
+        {
+          const gchar *word;
+
+          if (unicode && (g_rand_int_range (rand, 0, 4) == 0))
+            word = unicode_words [g_rand_int_range (rand, 0, G_N_ELEMENTS (unicode_words))];
+          else
+            word = words [g_rand_int_range (rand, 0, G_N_ELEMENTS (words))];
+
+          if (j)
+            g_string_append_c (str, (j == n_parts - 1) ? '/' : '-');
+          g_string_append (str, word);
+        }
+
+      g_string_append (str, ".c");
+      g_ptr_array_add (corpus, g_string_free (str, FALSE));
+    }
+
+  g_rand_free (rand);
+
+  return corpus;
+}
+
+static GPtrArray *
+build_synthetic_queries (void)
+{
+  GPtrArray *queries;
+  guint i;
+
+  queries = g_ptr_array_new ();
+  for (i = 0; i < G_N_ELEMENTS (synthetic_queries); i++)
+    g_ptr_array_add (queries, (gchar *)synthetic_queries [i]);
+
+  return queries;
+}
+
+/*
+ * Appends up to @want characters of [@begin, @end), chosen uniformly at
+ * random while keeping their order, so that the needle always matches.
+ */
+static void
+append_subsequence (GString     *str,
+                    GRand       *rand,
+                    const gchar *begin,
+                    const gchar *end,
+                    guint        want)
+{
+  const gchar *iter;
+  glong remaining;
+
+  remaining = g_utf8_strlen (begin, end - begin);
+
+  for (iter = begin; (iter < end) && want; iter = g_utf8_next_char (iter), remaining--)
+    {
+      if (g_rand_int_range (rand, 0, remaining) < want)
+        {
+          g_string_append_unichar (str, g_utf8_get_char (iter));
+          want--;
+        }
+    }
+}
+
+/*
+ * Recorded corpora come without queries, so needles are sampled from
+ * random keys instead. For paths, some of them also narrow by the
+ * directory the file is in.
+ */
+static GPtrArray *
+build_sampled_queries (GPtrArray *corpus)
+{
+  GPtrArray *queries;
+  GRand *rand;
+  guint i;
+
+  queries = g_ptr_array_new_with_free_func (g_free);
+  rand = g_rand_new_with_seed (4321);
+
+  for (i = 0; i < N_SAMPLED_QUERIES; i++)
+    {
+      const gchar *key;
+      const gchar *name;
+      const gchar *dir;
+      GString *str;
+
+      key = g_ptr_array_index (corpus, g_rand_int_range (rand, 0, corpus->len));
+      name = key;
+      str = g_string_new (NULL);
+
+      if (path_aware && (name = strrchr (key, '/')))
+        {
+          for (dir = name; (dir > key) && (dir [-1] != '/'); dir--) { }
+          if ((dir < name) && (g_rand_int_range (rand, 0, 4) == 0))
+            {
+              append_subsequence (str, rand, dir, name, 2);
+              g_string_append_c (str, '/');
+            }
+          name++;
+        }
+      else
+        {
+          name = key;
+        }
+
+      append_subsequence (str, rand, name, name + strlen (name),
+                          g_rand_int_range (rand, 2, 7));
+
+      if (str->len)
+        g_ptr_array_add (queries, g_string_free (str, FALSE));
+      else
+        g_string_free (str, TRUE);
+    }
+
+  g_rand_free (rand);
+
+  return queries;
+}
+
+static Fuzzy *
+run_build (const gchar *name,
+           GPtrArray   *corpus)
+{
+  BenchRecord *record;
+  FuzzyStats stats;
+  Fuzzy *fuzzy;
+  gint64 begin;
+  gint64 build_nsec;
+  gsize rss;
+  guint i;
+
+  rss = bench_get_rss ();
+  begin = bench_now_nsec ();
+
+  fuzzy = fuzzy_new_full (FALSE, corpus->len, NULL);
+  fuzzy_set_path_aware (fuzzy, path_aware);
+  fuzzy_begin_bulk_insert (fuzzy);
+  for (i = 0; i < corpus->len; i++)
+    fuzzy_insert (fuzzy, g_ptr_array_index (corpus, i), NULL);
+  fuzzy_end_bulk_insert (fuzzy);
+
+  build_nsec = bench_now_nsec () - begin;
+  rss = bench_get_rss () - rss;
+
+  /*
+   * Unpacked, every item would take sizeof (guint32).
+   */
+  fuzzy_get_stats (fuzzy, &stats);
+
+  record = bench_record_new ("fuzzy", name, "build");
+  bench_record_add_int (record, "keys", corpus->len);
+  bench_record_add_usec (record, "build_usec", build_nsec);
+  bench_record_add_double (record, "bytes_per_key", corpus->len ? (gdouble)rss / corpus->len : 0.0);
+  bench_record_add_int (record, "items", stats.n_items);
+  bench_record_add_int (record, "table_bytes", stats.n_table_bytes);
+  bench_record_add_double (record, "table_bytes_per_item",
+                           stats.n_items ? (gdouble)stats.n_table_bytes / stats.n_items : 0.0);
+  bench_record_add_int (record, "peak_rss_bytes", bench_get_peak_rss ());
+  bench_record_print (record);
+
+  return fuzzy;
+}
+
+static void
+run_match (const gchar *name,
+           Fuzzy       *fuzzy,
+           GPtrArray   *queries)
+{
+  BenchRecord *record;
+  FuzzyStats stats;
+  GArray *samples;
+  gint64 begin;
+  guint n_matches = 0;
+  guint n_rounds;
+  guint i;
+  guint j;
+
+  samples = bench_samples_new ();
+  n_rounds = MAX (1, N_MATCHES / queries->len);
+
+  fuzzy_reset_stats (fuzzy);
+
+  for (i = 0; i < n_rounds; i++)
+    {
+      for (j = 0; j < queries->len; j++)
+        {
+          GArray *matches;
+
+          begin = bench_now_nsec ();
+          matches = fuzzy_match (fuzzy, g_ptr_array_index (queries, j), 100);
+          bench_samples_add (samples, begin);
+
+          n_matches += matches->len;
+          g_array_unref (matches);
+        }
+    }
+
+  /*
+   * Candidates rejected by the signature prefilter never reach the
+   * character tables.
+   */
+  fuzzy_get_stats (fuzzy, &stats);
+
+  record = bench_record_new ("fuzzy", name, "match");
+  bench_record_add_samples (record, samples);
+  bench_record_add_int (record, "matches", n_matches);
+  bench_record_add_int (record, "candidates", stats.n_candidates);
+  bench_record_add_int (record, "prefiltered", stats.n_prefiltered);
+  bench_record_add_int (record, "scored", stats.n_scored);
+  bench_record_print (record);
+
+  g_array_unref (samples);
+}
+
+/*
+ * Simulates typing each query one character at a time, comparing a fresh
+ * fuzzy_match() per keystroke against a FuzzyQuery that narrows the
+ * results of the previous keystroke.
+ */
+static void
+run_typeahead (const gchar *name,
+               Fuzzy       *fuzzy,
+               GPtrArray   *queries)
+{
+  BenchRecord *record;
+  GArray *match_samples;
+  GArray *query_samples;
+  gint64 begin;
+  guint i;
+
+  match_samples = bench_samples_new ();
+  query_samples = bench_samples_new ();
+
+  for (i = 0; i < queries->len; i++)
+    {
+      const gchar *needle = g_ptr_array_index (queries, i);
+      FuzzyQuery *query;
+      const gchar *iter;
+
+      query = fuzzy_query_new (fuzzy);
+
+      for (iter = needle; *iter;)
+        {
+          gchar *prefix;
+
+          iter = g_utf8_next_char (iter);
+          prefix = g_strndup (needle, iter - needle);
+
+          begin = bench_now_nsec ();
+          g_array_unref (fuzzy_match (fuzzy, prefix, 100));
+          bench_samples_add (match_samples, begin);
+
+          begin = bench_now_nsec ();
+          g_array_unref (fuzzy_query_match (query, prefix, 100));
+          bench_samples_add (query_samples, begin);
+
+          g_free (prefix);
+        }
+
+      fuzzy_query_free (query);
+    }
+
+  record = bench_record_new ("fuzzy", name, "typeahead-match");
+  bench_record_add_samples (record, match_samples);
+  bench_record_print (record);
+
+  record = bench_record_new ("fuzzy", name, "typeahead-query");
+  bench_record_add_samples (record, query_samples);
+  bench_record_print (record);
+
+  g_array_unref (match_samples);
+  g_array_unref (query_samples);
+}
+
+/*
+ * Compares building the index against loading a saved copy of it.
+ */
+static void
+run_mapped (const gchar *name,
+            Fuzzy       *fuzzy,
+            GPtrArray   *queries)
+{
+  BenchRecord *record;
+  GError *error = NULL;
+  GArray *samples;
+  Fuzzy *loaded;
+  gchar *filename;
+  gint64 begin;
+  gint64 save_nsec;
+  gint64 load_nsec;
+  guint i;
+
+  filename = g_build_filename (g_get_tmp_dir (), "bench-fuzzy.index", NULL);
+
+  begin = bench_now_nsec ();
+  if (!fuzzy_save (fuzzy, filename, name, &error))
+    g_error ("%s", error->message);
+  save_nsec = bench_now_nsec () - begin;
+
+  begin = bench_now_nsec ();
+  if (!(loaded = fuzzy_load_mapped (filename, name, &error)))
+    g_error ("%s", error->message);
+  load_nsec = bench_now_nsec () - begin;
+
+  samples = bench_samples_new ();
+
+  for (i = 0; i < queries->len; i++)
+    {
+      begin = bench_now_nsec ();
+      g_array_unref (fuzzy_match (loaded, g_ptr_array_index (queries, i), 100));
+      bench_samples_add (samples, begin);
+    }
+
+  record = bench_record_new ("fuzzy", name, "mapped");
+  bench_record_add_usec (record, "save_usec", save_nsec);
+  bench_record_add_usec (record, "load_usec", load_nsec);
+  bench_record_add_samples (record, samples);
+  bench_record_print (record);
+
+  g_array_unref (samples);
+  fuzzy_unref (loaded);
+  g_unlink (filename);
+  g_free (filename);
+}
+
+/*
+ * Inserts keys one at a time into the built index, matching after each
+ * one so that every insert pays for packing its items.
+ */
+static void
+run_insert (const gchar *name,
+            Fuzzy       *fuzzy,
+            GPtrArray   *corpus,
+            GPtrArray   *queries)
+{
+  BenchRecord *record;
+  GArray *samples;
+  gint64 begin;
+  guint i;
+
+  samples = bench_samples_new ();
+
+  for (i = 0; i < N_INSERTS; i++)
+    {
+      gchar *key;
+
+      key = g_strdup_printf ("%s-%u",
+                             (gchar *)g_ptr_array_index (corpus, i % corpus->len), i);
+
+      begin = bench_now_nsec ();
+      fuzzy_insert (fuzzy, key, NULL);
+      bench_samples_add (samples, begin);
+
+      g_array_unref (fuzzy_match (fuzzy, g_ptr_array_index (queries, i % queries->len), 100));
+      g_free (key);
+    }
+
+  record = bench_record_new ("fuzzy", name, "insert");
+  bench_record_add_samples (record, samples);
+  bench_record_print (record);
+
+  g_array_unref (samples);
+}
+
+static void
+run_bench (const gchar *name,
+           GPtrArray   *corpus,
+           GPtrArray   *queries)
+{
+  Fuzzy *fuzzy;
+
+  if (!corpus->len || !queries->len)
+    {
+      g_printerr ("Skipping empty corpus %s\n", name);
+      return;
+    }
+
+  fuzzy = run_build (name, corpus);
+  run_match (name, fuzzy, queries);
+  run_typeahead (name, fuzzy, queries);
+  run_mapped (name, fuzzy, queries);
+  run_insert (name, fuzzy, corpus, queries);
+  fuzzy_unref (fuzzy);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GPtrArray *corpus;
+  GPtrArray *queries;
+  gint i;
+
+  context = g_option_context_new ("[CORPUS...] - benchmark fuzzy matching");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_option_context_free (context);
+
+  if (size < 1)
+    {
+      g_printerr ("--size must be positive\n");
+      return 1;
+    }
+
+  if (argc < 2)
+    {
+      queries = build_synthetic_queries ();
+
+      corpus = build_corpus (FALSE);
+      run_bench ("synthetic-ascii", corpus, queries);
+      g_ptr_array_unref (corpus);
+
+      corpus = build_corpus (TRUE);
+      run_bench ("synthetic-unicode", corpus, queries);
+      g_ptr_array_unref (corpus);
+
+      g_ptr_array_unref (queries);
+
+      corpus = bench_build_path_corpus (size);
+      queries = build_sampled_queries (corpus);
+      run_bench ("synthetic-paths", corpus, queries);
+      g_ptr_array_unref (queries);
+      g_ptr_array_unref (corpus);
+
+      corpus = bench_build_html_corpus ();
+      queries = build_sampled_queries (corpus);
+      run_bench ("html", corpus, queries);
+      g_ptr_array_unref (queries);
+      g_ptr_array_unref (corpus);
+
+      return 0;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      gchar *name;
+
+      if (!(corpus = bench_load_corpus (argv [i], &error)))
+        {
+          g_printerr ("%s\n", error->message);
+          return 1;
+        }
+
+      name = bench_get_corpus_name (argv [i]);
+      queries = build_sampled_queries (corpus);
+      run_bench (name, corpus, queries);
+
+      g_ptr_array_unref (queries);
+      g_ptr_array_unref (corpus);
+      g_free (name);
+    }
+
+  return 0;
+}
@@ -0,0 +1,535 @@
+/* bench-trie.c
+ *
+ * Copyright (C) 2015 Christian Hergert <christian@hergert.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench-util.h"
+#include "trie.h"
+
+/*
+ * Runs the trie against synthetic lists of symbols and paths and the HTML
+ * completion vocabulary, or against recorded corpora passed on the command
+ * line with one key per line, such as a ctags symbol list. Each
+ * measurement is printed as a line of JSON. Use --size=1000000 to see how
+ * the trie scales to very large symbol tables.
+ */
+
+#define N_SYNTHETIC_KEYS 200000
+#define N_LOOKUPS        10000
+#define N_TRAVERSALS     1000
+#define N_REMOVES        1000
+#define N_PAGE_RESULTS   50
+#define N_FUZZY          1000
+
+static gint size = N_SYNTHETIC_KEYS;
+
+static GOptionEntry entries[] = {
+  { "size", 's', 0, G_OPTION_ARG_INT, &size,
+    "The number of keys in each synthetic corpus", "N" },
+  { NULL }
+};
+
+static const gchar *words[] = {
+  "editor", "document", "search", "box", "workbench", "git", "provider",
+  "view", "tree", "fuzzy", "trie", "html", "snippet", "util", "animation",
+  "frame", "source", "vim", "command", "manager", "get", "set", "new",
+  "buffer", "insert", "remove", "lookup", "traverse", "context", "result",
+};
+
+static GPtrArray *
+build_corpus (void)
+{
+  GPtrArray *corpus;
+  GRand *rand;
+  guint i;
+
+  corpus = g_ptr_array_new_with_free_func (g_free);
+  rand = g_rand_new_with_seed (1234);
+
+  for (i = 0; i < (guint)size; i++)
+    {
+      GString *str = g_string_new (NULL);
+      guint n_parts;
+      guint j;
+
+      n_parts = g_rand_int_range (rand, 2, 5);
+
+      for (j = 0; j < n_parts; j++)
+        {
+          if (j)
+            g_string_append_c (str, '_');
+          g_string_append (str, words [g_rand_int_range (rand, 0, G_N_ELEMENTS (words))]);
+        }
+
+      if (g_rand_boolean (rand))
+        g_string_append_printf (str, "%u", g_rand_int_range (rand, 0, 100));
+
+      g_ptr_array_add (corpus, g_string_free (str, FALSE));
+    }
+
+  g_rand_free (rand);
+
+  return corpus;
+}
+
+static gboolean
+count_cb (Trie        *trie,
+          const gchar *key,
+          gpointer     value,
+          gpointer     user_data)
+{
+  guint *count = user_data;
+
+  (*count)++;
+
+  return FALSE;
+}
+
+static Trie *
+build_trie (GPtrArray *corpus)
+{
+  Trie *trie;
+  guint i;
+
+  trie = trie_new (NULL);
+  for (i = 0; i < corpus->len; i++)
+    trie_insert (trie, g_ptr_array_index (corpus, i), g_ptr_array_index (corpus, i));
+
+  return trie;
+}
+
+static gboolean
+page_cb (Trie        *trie,
+         const gchar *key,
+         gpointer     value,
+         guint        distance,
+         gpointer     user_data)
+{
+  guint *count = user_data;
+
+  return (++(*count) % N_PAGE_RESULTS) == 0;
+}
+
+/*
+ * Takes the first few characters of a key and swaps or replaces one of
+ * them, like a typo made while typing a completion.
+ */
+static gchar *
+make_typo (GRand       *rand,
+           const gchar *key)
+{
+  gchar *typo;
+  gsize len;
+  gsize pos;
+
+  typo = g_strndup (key, g_rand_int_range (rand, 4, 9));
+
+  /* Keep to ASCII so that a byte can be changed on its own. */
+  for (len = 0; typo [len] && !(typo [len] & 0x80); len++) { }
+  typo [len] = '\0';
+
+  if (len < 2)
+    return typo;
+
+  pos = g_rand_int_range (rand, 0, len - 1);
+
+  if (g_rand_boolean (rand))
+    {
+      gchar tmp = typo [pos];
+
+      typo [pos] = typo [pos + 1];
+      typo [pos + 1] = tmp;
+    }
+  else
+    {
+      typo [pos] = 'a' + g_rand_int_range (rand, 0, 26);
+    }
+
+  return typo;
+}
+
+/*
+ * Random queries rarely match anything, so these measure how much of the
+ * trie has to be explored before it can be ruled out.
+ */
+static gchar *
+make_random (GRand *rand)
+{
+  gchar *str;
+  guint i;
+
+  str = g_malloc0 (7);
+  for (i = 0; i < 6; i++)
+    str [i] = 'a' + g_rand_int_range (rand, 0, 26);
+
+  return str;
+}
+
+static void
+run_fuzzy (const gchar *name,
+           const gchar *test,
+           Trie        *trie,
+           GPtrArray   *corpus,
+           guint        max_edits,
+           gboolean     random)
+{
+  BenchRecord *record;
+  GArray *samples;
+  GRand *rand;
+  gint64 begin;
+  guint n_results = 0;
+  guint i;
+
+  rand = g_rand_new_with_seed (5678);
+  samples = bench_samples_new ();
+
+  for (i = 0; i < N_FUZZY; i++)
+    {
+      const gchar *key;
+      gchar *typo;
+
+      key = g_ptr_array_index (corpus, g_rand_int_range (rand, 0, corpus->len));
+      typo = random ? make_random (rand) : make_typo (rand, key);
+
+      begin = bench_now_nsec ();
+      trie_traverse_fuzzy (trie, typo, max_edits, page_cb, &n_results);
+      bench_samples_add (samples, begin);
+
+      g_free (typo);
+    }
+
+  record = bench_record_new ("trie", name, test);
+  bench_record_add_int (record, "max_edits", max_edits);
+  bench_record_add_samples (record, samples);
+  bench_record_add_int (record, "results", n_results);
+  bench_record_print (record);
+
+  g_array_unref (samples);
+  g_rand_free (rand);
+}
+
+static gint
+compare_keys (gconstpointer a,
+              gconstpointer b)
+{
+  return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+static void
+run_sorted_build (const gchar *name,
+                  GPtrArray   *corpus)
+{
+  BenchRecord *record;
+  const gchar **keys;
+  gint64 begin;
+  gint64 sort_nsec;
+  gint64 build_nsec;
+  Trie *trie;
+
+  keys = g_memdup (corpus->pdata, corpus->len * sizeof (gpointer));
+
+  begin = bench_now_nsec ();
+  qsort (keys, corpus->len, sizeof (gpointer), compare_keys);
+  sort_nsec = bench_now_nsec () - begin;
+
+  begin = bench_now_nsec ();
+  trie = trie_new_from_sorted (NULL, keys, (gpointer *)keys, corpus->len);
+  build_nsec = bench_now_nsec () - begin;
+
+  record = bench_record_new ("trie", name, "build-sorted");
+  bench_record_add_int (record, "keys", corpus->len);
+  bench_record_add_usec (record, "sort_usec", sort_nsec);
+  bench_record_add_usec (record, "build_usec", build_nsec);
+  bench_record_print (record);
+
+  trie_destroy (trie);
+  g_free (keys);
+}
+
+static void
+run_queries (const gchar *name,
+             const gchar *prefix,
+             Trie        *trie,
+             GPtrArray   *corpus)
+{
+  BenchRecord *record;
+  GPtrArray *words;
+  GArray *samples;
+  GRand *rand;
+  gchar *test;
+  gint64 begin;
+  guint n_results = 0;
+  guint i;
+
+  rand = g_rand_new_with_seed (4321);
+  samples = bench_samples_new ();
+
+  for (i = 0; i < N_LOOKUPS; i++)
+    {
+      const gchar *key;
+
+      key = g_ptr_array_index (corpus, g_rand_int_range (rand, 0, corpus->len));
+
+      begin = bench_now_nsec ();
+      if (!trie_lookup (trie, key))
+        g_error ("Failed to find %s", key);
+      bench_samples_add (samples, begin);
+    }
+
+  test = g_strconcat (prefix, "lookup", NULL);
+  record = bench_record_new ("trie", name, test);
+  g_free (test);
+  bench_record_add_samples (record, samples);
+  bench_record_print (record);
+
+  g_array_set_size (samples, 0);
+
+  /*
+   * Completion providers traverse everything below the word being typed,
+   * which is usually only a few characters long.
+   */
+  words = g_ptr_array_new_with_free_func (g_free);
+
+  for (i = 0; i < N_TRAVERSALS; i++)
+    {
+      const gchar *key;
+      const gchar *end;
+      guint n_chars;
+
+      key = g_ptr_array_index (corpus, g_rand_int_range (rand, 0, corpus->len));
+      n_chars = g_rand_int_range (rand, 2, 6);
+
+      for (end = key; *end && n_chars; end = g_utf8_next_char (end), n_chars--) { }
+      g_ptr_array_add (words, g_strndup (key, end - key));
+    }
+
+  g_array_set_size (samples, 0);
+
+  for (i = 0; i < words->len; i++)
+    {
+      begin = bench_now_nsec ();
+      trie_traverse (trie, g_ptr_array_index (words, i), G_PRE_ORDER,
+                     G_TRAVERSE_LEAVES, -1, count_cb, &n_results);
+      bench_samples_add (samples, begin);
+    }
+
+  test = g_strconcat (prefix, "traverse", NULL);
+  record = bench_record_new ("trie", name, test);
+  bench_record_add_samples (record, samples);
+  bench_record_add_int (record, "results", n_results);
+  bench_record_print (record);
+  g_free (test);
+
+  /*
+   * Only fetch what a completion popup would show at first.
+   */
+  g_array_set_size (samples, 0);
+  n_results = 0;
+
+  for (i = 0; i < words->len; i++)
+    {
+      TrieIter iter;
+
+      begin = bench_now_nsec ();
+      trie_iter_init_prefix (&iter, trie, g_ptr_array_index (words, i), N_PAGE_RESULTS);
+      while (trie_iter_next (&iter, NULL, NULL))
+        n_results++;
+      trie_iter_clear (&iter);
+      bench_samples_add (samples, begin);
+    }
+
+  test = g_strconcat (prefix, "first-page", NULL);
+  record = bench_record_new ("trie", name, test);
+  bench_record_add_samples (record, samples);
+  bench_record_add_int (record, "results", n_results);
+  bench_record_print (record);
+  g_free (test);
+
+  g_ptr_array_unref (words);
+  g_array_unref (samples);
+  g_rand_free (rand);
+}
+
+static void
+run_bench (const gchar *name,
+           GPtrArray   *corpus)
+{
+  BenchRecord *record;
+  GArray *samples;
+  GRand *rand;
+  Trie *trie;
+  gint64 begin;
+  gint64 build_nsec;
+  gint64 freeze_nsec;
+  gint64 destroy_nsec;
+  gsize rss;
+  guint i;
+
+  if (!corpus->len)
+    {
+      g_printerr ("Skipping empty corpus %s\n", name);
+      return;
+    }
+
+  rss = bench_get_rss ();
+  begin = bench_now_nsec ();
+  trie = build_trie (corpus);
+  build_nsec = bench_now_nsec () - begin;
+  rss = bench_get_rss () - rss;
+
+  record = bench_record_new ("trie", name, "build");
+  bench_record_add_int (record, "keys", corpus->len);
+  bench_record_add_usec (record, "build_usec", build_nsec);
+  bench_record_add_double (record, "bytes_per_key", (gdouble)rss / corpus->len);
+  bench_record_add_int (record, "peak_rss_bytes", bench_get_peak_rss ());
+  bench_record_print (record);
+
+  run_queries (name, "", trie, corpus);
+  run_fuzzy (name, "fuzzy", trie, corpus, 1, FALSE);
+  run_fuzzy (name, "fuzzy", trie, corpus, 2, FALSE);
+  run_fuzzy (name, "fuzzy-random", trie, corpus, 1, TRUE);
+  run_fuzzy (name, "fuzzy-random", trie, corpus, 2, TRUE);
+  run_sorted_build (name, corpus);
+
+  rand = g_rand_new_with_seed (4321);
+  samples = bench_samples_new ();
+
+  for (i = 0; i < MIN (N_REMOVES, corpus->len); i++)
+    {
+      const gchar *key;
+
+      key = g_ptr_array_index (corpus, g_rand_int_range (rand, 0, corpus->len));
+
+      begin = bench_now_nsec ();
+      trie_remove (trie, key);
+      bench_samples_add (samples, begin);
+    }
+
+  record = bench_record_new ("trie", name, "remove");
+  bench_record_add_samples (record, samples);
+  bench_record_print (record);
+
+  begin = bench_now_nsec ();
+  trie_destroy (trie);
+  destroy_nsec = bench_now_nsec () - begin;
+
+  record = bench_record_new ("trie", name, "destroy");
+  bench_record_add_usec (record, "destroy_usec", destroy_nsec);
+  bench_record_print (record);
+
+  /*
+   * Measure the frozen trie separately, as a static vocabulary would be
+   * built and then frozen without ever being modified.
+   */
+  bench_trim_heap ();
+  rss = bench_get_rss ();
+  trie = build_trie (corpus);
+
+  begin = bench_now_nsec ();
+  trie_freeze (trie);
+  freeze_nsec = bench_now_nsec () - begin;
+
+  bench_trim_heap ();
+  rss = bench_get_rss () - rss;
+
+  record = bench_record_new ("trie", name, "freeze");
+  bench_record_add_usec (record, "freeze_usec", freeze_nsec);
+  bench_record_add_double (record, "bytes_per_key", (gdouble)rss / corpus->len);
+  bench_record_print (record);
+
+  run_queries (name, "frozen-", trie, corpus);
+  run_fuzzy (name, "frozen-fuzzy", trie, corpus, 1, FALSE);
+  run_fuzzy (name, "frozen-fuzzy", trie, corpus, 2, FALSE);
+  run_fuzzy (name, "frozen-fuzzy-random", trie, corpus, 1, TRUE);
+  run_fuzzy (name, "frozen-fuzzy-random", trie, corpus, 2, TRUE);
+
+  begin = bench_now_nsec ();
+  trie_destroy (trie);
+  destroy_nsec = bench_now_nsec () - begin;
+
+  record = bench_record_new ("trie", name, "frozen-destroy");
+  bench_record_add_usec (record, "destroy_usec", destroy_nsec);
+  bench_record_print (record);
+
+  g_array_unref (samples);
+  g_rand_free (rand);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GPtrArray *corpus;
+  gint i;
+
+  context = g_option_context_new ("[CORPUS...] - benchmark the trie");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_option_context_free (context);
+
+  if (size < 1)
+    {
+      g_printerr ("--size must be positive\n");
+      return 1;
+    }
+
+  if (argc < 2)
+    {
+      corpus = build_corpus ();
+      run_bench ("synthetic-symbols", corpus);
+      g_ptr_array_unref (corpus);
+
+      corpus = bench_build_path_corpus (size);
+      run_bench ("synthetic-paths", corpus);
+      g_ptr_array_unref (corpus);
+
+      corpus = bench_build_html_corpus ();
+      run_bench ("html", corpus);
+      g_ptr_array_unref (corpus);
+
+      return 0;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      gchar *name;
+
+      if (!(corpus = bench_load_corpus (argv [i], &error)))
+        {
+          g_printerr ("%s\n", error->message);
+          return 1;
+        }
+
+      name = bench_get_corpus_name (argv [i]);
+      run_bench (name, corpus);
+
+      g_ptr_array_unref (corpus);
+      g_free (name);
+    }
+
+  return 0;
+}
@@ -0,0 +1,561 @@
+/* bench-util.c
+ *
+ * Copyright (C) 2015 Christian Hergert <christian@hergert.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif
+
+#include "bench-util.h"
+
+/*
+ * Each record is printed as a single line of JSON so that results can be
+ * collected with standard tools and compared between builds.
+ */
+struct _BenchRecord
+{
+  GString *json;
+};
+
+/*
+ * g_get_monotonic_time() only has microsecond resolution, which is
+ * coarser than a single trie lookup.
+ */
+gint64
+bench_now_nsec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ((gint64)ts.tv_sec * G_GINT64_CONSTANT (1000000000)) + ts.tv_nsec;
+}
+
+/**
+ * bench_get_rss:
+ *
+ * Gets the resident set size of the process, or 0 where that is not
+ * available.
+ *
+ * Returns: The resident set size in bytes.
+ */
+gsize
+bench_get_rss (void)
+{
+  gsize size = 0;
+  gsize resident = 0;
+  FILE *fp;
+
+  if ((fp = fopen ("/proc/self/statm", "r")))
+    {
+      if (fscanf (fp, "%"G_GSIZE_FORMAT" %"G_GSIZE_FORMAT, &size, &resident) != 2)
+        resident = 0;
+      fclose (fp);
+    }
+
+  return resident * sysconf (_SC_PAGESIZE);
+}
+
+/**
+ * bench_trim_heap:
+ *
+ * Returns free heap memory to the system where possible, so that the
+ * resident set size reflects what is still in use after large frees.
+ */
+void
+bench_trim_heap (void)
+{
+#ifdef __GLIBC__
+  malloc_trim (0);
+#endif
+}
+
+/**
+ * bench_get_peak_rss:
+ *
+ * Gets the largest resident set size of the process so far. This covers
+ * every corpus run before now, so pass a single corpus to measure it on
+ * its own.
+ *
+ * Returns: The peak resident set size in bytes.
+ */
+gsize
+bench_get_peak_rss (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return 0;
+
+  return (gsize)usage.ru_maxrss * 1024;
+}
+
+/**
+ * bench_load_corpus:
+ * @filename: A file containing one key per line.
+ * @error: A location for a #GError, or %NULL.
+ *
+ * Loads a recorded corpus such as the output of `git ls-files` or a list
+ * of symbols. Empty lines and lines that are not valid UTF-8 are skipped.
+ *
+ * Returns: (transfer full): A #GPtrArray of keys, or %NULL on failure.
+ */
+GPtrArray *
+bench_load_corpus (const gchar  *filename,
+                   GError      **error)
+{
+  GPtrArray *corpus;
+  gchar *contents;
+  gchar **lines;
+  gsize length;
+  guint i;
+
+  if (!g_file_get_contents (filename, &contents, &length, error))
+    return NULL;
+
+  corpus = g_ptr_array_new_with_free_func (g_free);
+  lines = g_strsplit (contents, "\n", -1);
+
+  for (i = 0; lines [i]; i++)
+    {
+      g_strchomp (lines [i]);
+
+      if (*lines [i] && g_utf8_validate (lines [i], -1, NULL))
+        g_ptr_array_add (corpus, g_strdup (lines [i]));
+    }
+
+  g_strfreev (lines);
+  g_free (contents);
+
+  return corpus;
+}
+
+/*
+ * Directory and file names for bench_build_path_corpus(). The mix of
+ * short, shared words gives paths the long common prefixes and repeated
+ * components of a real checkout.
+ */
+static const gchar *path_words[] = {
+  "src", "lib", "include", "tests", "docs", "data", "plugins", "core",
+  "util", "ui", "net", "io", "gfx", "audio", "video", "drivers", "arch",
+  "x86", "arm", "kernel", "fs", "mm", "tools", "scripts", "build", "po",
+  "icons", "themes", "widgets", "editor", "search", "git", "html",
+  "snippets", "vim", "workbench", "document", "provider", "view", "tree",
+  "fuzzy", "trie", "animation", "frame", "source", "command", "manager",
+  "buffer", "completion", "project", "config", "private", "internal",
+};
+
+static const gchar *path_extensions[] = {
+  ".c", ".c", ".c", ".h", ".h", ".cc", ".py", ".js", ".ui", ".css",
+  ".html", ".md", ".json", ".xml", ".png", ".svg", ".am", "",
+};
+
+#define BENCH_PATH_MAX_DEPTH     6
+#define BENCH_PATH_FILES_PER_DIR 16
+
+static void
+append_path_word (GString *str,
+                  GRand   *rand)
+{
+  g_string_append (str, path_words [g_rand_int_range (rand, 0, G_N_ELEMENTS (path_words))]);
+
+  if (g_rand_int_range (rand, 0, 3) == 0)
+    {
+      g_string_append_c (str, g_rand_boolean (rand) ? '-' : '_');
+      g_string_append (str, path_words [g_rand_int_range (rand, 0, G_N_ELEMENTS (path_words))]);
+    }
+}
+
+/**
+ * bench_build_path_corpus:
+ * @n_keys: The number of paths to generate.
+ *
+ * Generates a repeatable tree of @n_keys unique file paths, like the output
+ * of `git ls-files` for a checkout of that size. Directories are at most
+ * BENCH_PATH_MAX_DEPTH deep and hold BENCH_PATH_FILES_PER_DIR files on
+ * average.
+ *
+ * Returns: (transfer full): A #GPtrArray of paths.
+ */
+GPtrArray *
+bench_build_path_corpus (guint n_keys)
+{
+  GPtrArray *corpus;
+  GPtrArray *dirs;
+  GHashTable *seen;
+  GArray *parents;
+  GArray *depths;
+  GString *str;
+  GRand *rand;
+  guint n_dirs;
+  guint parent;
+  guint depth;
+  guint n;
+
+  corpus = g_ptr_array_new_with_free_func (g_free);
+  dirs = g_ptr_array_new_with_free_func (g_free);
+  parents = g_array_new (FALSE, FALSE, sizeof (guint));
+  depths = g_array_new (FALSE, FALSE, sizeof (guint));
+  seen = g_hash_table_new (g_str_hash, g_str_equal);
+  rand = g_rand_new_with_seed (2468);
+  str = g_string_new (NULL);
+
+  /*
+   * The root is an empty directory, so that top-level files have no
+   * leading separator.
+   */
+  g_ptr_array_add (dirs, g_strdup (""));
+  n = 0;
+  g_array_append_val (parents, n);
+  g_array_append_val (depths, n);
+
+  n_dirs = MAX (1, n_keys / BENCH_PATH_FILES_PER_DIR);
+
+  while (dirs->len < n_dirs)
+    {
+      parent = g_rand_int_range (rand, 0, dirs->len);
+      while (g_array_index (depths, guint, parent) >= BENCH_PATH_MAX_DEPTH)
+        parent = g_array_index (parents, guint, parent);
+
+      g_string_assign (str, g_ptr_array_index (dirs, parent));
+      if (str->len)
+        g_string_append_c (str, '/');
+      append_path_word (str, rand);
+
+      if (g_hash_table_contains (seen, str->str))
+        continue;
+
+      depth = g_array_index (depths, guint, parent) + 1;
+      g_ptr_array_add (dirs, g_strdup (str->str));
+      g_array_append_val (parents, parent);
+      g_array_append_val (depths, depth);
+      g_hash_table_add (seen, g_ptr_array_index (dirs, dirs->len - 1));
+    }
+
+  for (n = 0; corpus->len < n_keys; n++)
+    {
+      parent = g_rand_int_range (rand, 0, dirs->len);
+
+      g_string_assign (str, g_ptr_array_index (dirs, parent));
+      if (str->len)
+        g_string_append_c (str, '/');
+      append_path_word (str, rand);
+
+      /*
+       * Small trees run out of distinct names, so fall back to numbering
+       * them the way generated files often are.
+       */
+      if (n >= (n_keys * 2))
+        g_string_append_printf (str, "%u", n);
+
+      g_string_append (str, path_extensions [g_rand_int_range (rand, 0, G_N_ELEMENTS (path_extensions))]);
+
+      if (g_hash_table_contains (seen, str->str))
+        continue;
+
+      g_ptr_array_add (corpus, g_strdup (str->str));
+      g_hash_table_add (seen, g_ptr_array_index (corpus, corpus->len - 1));
+    }
+
+  g_string_free (str, TRUE);
+  g_rand_free (rand);
+  g_hash_table_unref (seen);
+  g_array_unref (depths);
+  g_array_unref (parents);
+  g_ptr_array_unref (dirs);
+
+  return corpus;
+}
+
+/*
+ * The elements and attributes offered by GbHtmlCompletionProvider, along
+ * with common CSS properties.
+ */
+static const gchar *html_elements[] = {
+  "a", "abbr", "acronym", "address", "applet", "area", "article", "aside",
+  "audio", "b", "base", "basefont", "bdi", "bdo", "big", "blockquote",
+  "body", "br", "button", "canvas", "caption", "center", "cite", "code",
+  "col", "colgroup", "datalist", "dd", "del", "details", "dfn", "dialog",
+  "dir", "div", "dl", "dt", "em", "embed", "fieldset", "figcaption",
+  "figure", "font", "footer", "form", "frame", "frameset", "h1", "h2", "h3",
+  "h4", "h5", "h6", "head", "header", "hgroup", "hr", "html", "i", "iframe",
+  "img", "input", "ins", "kbd", "keygen", "label", "legend", "li", "link",
+  "main", "map", "mark", "menu", "menuitem", "meta", "meter", "nav",
+  "noframes", "noscript", "object", "ol", "optgroup", "option", "output",
+  "p", "param", "pre", "progress", "q", "rp", "rt", "ruby", "s", "samp",
+  "script", "section", "select", "small", "source", "span", "strike",
+  "strong", "style", "sub", "summary", "sup", "table", "tbody", "td",
+  "textarea", "tfoot", "th", "thead", "time", "title", "tr", "track", "tt",
+  "u", "ul", "var", "video", "wbr"
+};
+
+static const gchar *html_attributes[] = {
+  "accept", "accept-charset", "accesskey", "action", "alt", "async",
+  "autocomplete", "autofocus", "autoplay", "border", "challenge", "charset",
+  "checked", "cite", "class", "cols", "colspan", "content",
+  "contenteditable", "contextmenu", "controls", "coords", "data", "datetime",
+  "default", "defer", "dir", "dirname", "disabled", "draggable", "dropzone",
+  "enctype", "for", "form", "formaction", "formenctype", "formmethod",
+  "formnovalidate", "formtarget", "headers", "height", "hidden", "high",
+  "href", "hreflang", "http-equiv", "icon", "id", "ismap", "keytype", "kind",
+  "label", "lang", "language", "list", "loop", "low", "manifest", "max",
+  "maxlength", "media", "mediagroup", "method", "min", "multiple", "muted",
+  "name", "novalidate", "open", "optimum", "pattern", "placeholder",
+  "poster", "preload", "radiogroup", "readonly", "rel", "required",
+  "reversed", "rows", "rowspan", "sandbox", "scope", "scoped", "seamless",
+  "selected", "shape", "size", "sizes", "span", "spellcheck", "src",
+  "srcdoc", "srclang", "start", "step", "style", "tabindex", "target",
+  "title", "translate", "type", "usemap", "value", "width", "wrap"
+};
+
+static const gchar *css_properties[] = {
+  "align-items", "animation", "background", "background-color",
+  "background-image", "background-position", "background-repeat",
+  "background-size", "border", "border-bottom", "border-collapse",
+  "border-color", "border-left", "border-radius", "border-right",
+  "border-style", "border-top", "border-width", "bottom", "box-shadow",
+  "box-sizing", "clear", "color", "content", "cursor", "display", "flex",
+  "flex-direction", "flex-wrap", "float", "font", "font-family",
+  "font-size", "font-style", "font-weight", "height", "justify-content",
+  "left", "letter-spacing", "line-height", "list-style", "margin",
+  "margin-bottom", "margin-left", "margin-right", "margin-top",
+  "max-height", "max-width", "min-height", "min-width", "opacity",
+  "outline", "overflow", "overflow-x", "overflow-y", "padding",
+  "padding-bottom", "padding-left", "padding-right", "padding-top",
+  "position", "right", "table-layout", "text-align", "text-decoration",
+  "text-indent", "text-overflow", "text-shadow", "text-transform", "top",
+  "transform", "transition", "vertical-align", "visibility",
+  "white-space", "width", "word-break", "word-wrap", "z-index",
+};
+
+static void
+add_unique (GPtrArray   *corpus,
+            GHashTable  *seen,
+            const gchar *key)
+{
+  if (!g_hash_table_contains (seen, key))
+    {
+      g_hash_table_add (seen, (gchar *)key);
+      g_ptr_array_add (corpus, g_strdup (key));
+    }
+}
+
+/**
+ * bench_build_html_corpus:
+ *
+ * Builds the vocabulary used when completing HTML: element names,
+ * attribute names and CSS properties, without duplicates.
+ *
+ * Returns: (transfer full): A #GPtrArray of keys.
+ */
+GPtrArray *
+bench_build_html_corpus (void)
+{
+  GPtrArray *corpus;
+  GHashTable *seen;
+  guint i;
+
+  corpus = g_ptr_array_new_with_free_func (g_free);
+  seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < G_N_ELEMENTS (html_elements); i++)
+    add_unique (corpus, seen, html_elements [i]);
+  for (i = 0; i < G_N_ELEMENTS (html_attributes); i++)
+    add_unique (corpus, seen, html_attributes [i]);
+  for (i = 0; i < G_N_ELEMENTS (css_properties); i++)
+    add_unique (corpus, seen, css_properties [i]);
+
+  g_hash_table_unref (seen);
+
+  return corpus;
+}
+
+gchar *
+bench_get_corpus_name (const gchar *filename)
+{
+  gchar *name;
+  gchar *dot;
+
+  name = g_path_get_basename (filename);
+  if ((dot = strrchr (name, '.')) && (dot != name))
+    *dot = '\0';
+
+  return name;
+}
+
+GArray *
+bench_samples_new (void)
+{
+  return g_array_new (FALSE, FALSE, sizeof (gint64));
+}
+
+void
+bench_samples_add (GArray *samples,
+                   gint64  begin_nsec)
+{
+  gint64 elapsed = bench_now_nsec () - begin_nsec;
+
+  g_array_append_val (samples, elapsed);
+}
+
+static gint
+bench_samples_compare (gconstpointer a,
+                       gconstpointer b)
+{
+  gint64 ia = *(const gint64 *)a;
+  gint64 ib = *(const gint64 *)b;
+
+  return (ia < ib) ? -1 : (ia > ib);
+}
+
+/*
+ * Nearest rank percentile of samples that have already been sorted.
+ */
+static gint64
+bench_samples_percentile (GArray  *samples,
+                          gdouble  percentile)
+{
+  guint rank;
+
+  if (!samples->len)
+    return 0;
+
+  rank = (guint)((percentile / 100.0) * samples->len + 0.5);
+  rank = CLAMP (rank, 1, samples->len);
+
+  return g_array_index (samples, gint64, rank - 1);
+}
+
+static void
+bench_record_add_string (BenchRecord *record,
+                         const gchar *name,
+                         const gchar *value)
+{
+  const gchar *iter;
+
+  g_string_append_printf (record->json, ",\"%s\":\"", name);
+
+  for (iter = value; *iter; iter++)
+    {
+      if ((*iter == '"') || (*iter == '\\'))
+        g_string_append_printf (record->json, "\\%c", *iter);
+      else if ((guchar)*iter < 0x20)
+        g_string_append_printf (record->json, "\\u%04x", *iter);
+      else
+        g_string_append_c (record->json, *iter);
+    }
+
+  g_string_append_c (record->json, '"');
+}
+
+/**
+ * bench_record_new:
+ * @bench: The name of the benchmark program.
+ * @corpus: The name of the corpus.
+ * @test: The name of the measurement.
+ *
+ * Starts a record of measurements that is written out with
+ * bench_record_print(). Durations are always reported in microseconds
+ * and sizes in bytes.
+ *
+ * Returns: (transfer full): A #BenchRecord.
+ */
+BenchRecord *
+bench_record_new (const gchar *bench,
+                  const gchar *corpus,
+                  const gchar *test)
+{
+  BenchRecord *record;
+
+  record = g_new0 (BenchRecord, 1);
+  record->json = g_string_new (NULL);
+
+  g_string_append_printf (record->json, "{\"bench\":\"%s\"", bench);
+  bench_record_add_string (record, "corpus", corpus);
+  bench_record_add_string (record, "test", test);
+
+  return record;
+}
+
+void
+bench_record_add_int (BenchRecord *record,
+                      const gchar *name,
+                      gint64       value)
+{
+  g_string_append_printf (record->json, ",\"%s\":%"G_GINT64_FORMAT, name, value);
+}
+
+void
+bench_record_add_double (BenchRecord *record,
+                         const gchar *name,
+                         gdouble      value)
+{
+  gchar buf [G_ASCII_DTOSTR_BUF_SIZE];
+
+  /*
+   * JSON always uses '.' for the decimal point, whatever the locale.
+   */
+  g_ascii_formatd (buf, sizeof buf, "%.3f", value);
+  g_string_append_printf (record->json, ",\"%s\":%s", name, buf);
+}
+
+void
+bench_record_add_usec (BenchRecord *record,
+                       const gchar *name,
+                       gint64       nsec)
+{
+  bench_record_add_double (record, name, nsec / 1000.0);
+}
+
+/**
+ * bench_record_add_samples:
+ * @record: A #BenchRecord.
+ * @samples: The duration of each operation, in nanoseconds.
+ *
+ * Adds the number of operations along with their median, 99th percentile
+ * and worst latency. @samples is sorted in place.
+ */
+void
+bench_record_add_samples (BenchRecord *record,
+                          GArray      *samples)
+{
+  g_array_sort (samples, bench_samples_compare);
+
+  bench_record_add_int (record, "ops", samples->len);
+  bench_record_add_usec (record, "p50_usec", bench_samples_percentile (samples, 50.0));
+  bench_record_add_usec (record, "p99_usec", bench_samples_percentile (samples, 99.0));
+  bench_record_add_usec (record, "max_usec", bench_samples_percentile (samples, 100.0));
+}
+
+/**
+ * bench_record_print:
+ * @record: (transfer full): A #BenchRecord.
+ *
+ * Prints @record as a line of JSON and frees it.
+ */
+void
+bench_record_print (BenchRecord *record)
+{
+  g_print ("%s}\n", record->json->str);
+  g_string_free (record->json, TRUE);
+  g_free (record);
+}
@@ -0,0 +1,58 @@
+/* bench-util.h
+ *
+ * Copyright (C) 2015 Christian Hergert <christian@hergert.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BenchRecord BenchRecord;
+
+gint64       bench_now_nsec           (void);
+gsize        bench_get_rss            (void);
+gsize        bench_get_peak_rss       (void);
+void         bench_trim_heap          (void);
+GPtrArray   *bench_load_corpus        (const gchar  *filename,
+                                       GError      **error);
+GPtrArray   *bench_build_path_corpus  (guint         n_keys);
+GPtrArray   *bench_build_html_corpus  (void);
+gchar       *bench_get_corpus_name    (const gchar  *filename);
+GArray      *bench_samples_new        (void);
+void         bench_samples_add        (GArray       *samples,
+                                       gint64        begin_nsec);
+BenchRecord *bench_record_new         (const gchar  *bench,
+                                       const gchar  *corpus,
+                                       const gchar  *test);
+void         bench_record_add_int     (BenchRecord  *record,
+                                       const gchar  *name,
+                                       gint64        value);
+void         bench_record_add_double  (BenchRecord  *record,
+                                       const gchar  *name,
+                                       gdouble       value);
+void         bench_record_add_usec    (BenchRecord  *record,
+                                       const gchar  *name,
+                                       gint64        nsec);
+void         bench_record_add_samples (BenchRecord  *record,
+                                       GArray       *samples);
+void         bench_record_print       (BenchRecord  *record);
+
+G_END_DECLS
+
+#endif /* BENCH_UTIL_H */
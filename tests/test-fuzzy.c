@@ -0,0 +1,1008 @@
+/* test-fuzzy.c
+ *
+ * Copyright (C) 2015 Christian Hergert <christian@hergert.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "fuzzy.h"
+
+static void
+test_fuzzy_basic (void)
+{
+  FuzzyMatch *match;
+  GArray *matches;
+  Fuzzy *fuzzy;
+
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_insert (fuzzy, "gb-editor-document.c", "1");
+  fuzzy_insert (fuzzy, "gb-search-box.c", "2");
+  fuzzy_insert (fuzzy, "Makefile.am", "3");
+
+  matches = fuzzy_match (fuzzy, "gbed", 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  match = &g_array_index (matches, FuzzyMatch, 0);
+  g_assert_cmpstr (match->key, ==, "gb-editor-document.c");
+  g_assert_cmpstr (match->value, ==, "1");
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "MAKE", 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "zzz", 10);
+  g_assert_cmpint (matches->len, ==, 0);
+  g_array_unref (matches);
+
+  fuzzy_unref (fuzzy);
+}
+
+static void
+test_fuzzy_boundary (void)
+{
+  FuzzyMatch *match;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  GString *str;
+  guint i;
+
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_insert (fuzzy, "foobxar.c", "1");
+  fuzzy_insert (fuzzy, "foo/bar.c", "2");
+  fuzzy_insert (fuzzy, "fooxbaR.c", "3");
+
+  /*
+   * Matching at the start of a path component beats a tighter match in
+   * the middle of a word.
+   */
+  matches = fuzzy_match (fuzzy, "fb", 10);
+  g_assert_cmpint (matches->len, ==, 3);
+  match = &g_array_index (matches, FuzzyMatch, 0);
+  g_assert_cmpstr (match->value, ==, "2");
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "fr", 10);
+  g_assert_cmpint (matches->len, ==, 3);
+  match = &g_array_index (matches, FuzzyMatch, 0);
+  g_assert_cmpstr (match->value, ==, "3");
+  g_array_unref (matches);
+
+  fuzzy_unref (fuzzy);
+
+  /*
+   * Repeated characters give every needle character many candidate
+   * positions, which must not blow up the cost of scoring.
+   */
+  str = g_string_new (NULL);
+  for (i = 0; i < 4000; i++)
+    g_string_append_c (str, 'a');
+
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_insert (fuzzy, str->str, NULL);
+  g_string_truncate (str, 200);
+  matches = fuzzy_match (fuzzy, str->str, 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_array_unref (matches);
+  fuzzy_unref (fuzzy);
+
+  g_string_free (str, TRUE);
+}
+
+static void
+count_keys (gpointer key,
+            gpointer value,
+            gpointer user_data)
+{
+  guint *n_keys = user_data;
+
+  g_assert (key);
+  (*n_keys)++;
+}
+
+static void
+test_fuzzy_remove (void)
+{
+  FuzzyMatch *match;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  gchar *key;
+  guint n_keys;
+  guint i;
+
+  fuzzy = fuzzy_new_with_free_func (FALSE, g_free);
+  fuzzy_begin_bulk_insert (fuzzy);
+  for (i = 0; i < 100; i++)
+    {
+      key = g_strdup_printf ("file-%03u.c", i);
+      fuzzy_insert (fuzzy, key, g_strdup (key));
+      g_free (key);
+    }
+  fuzzy_insert (fuzzy, "données.txt", g_strdup ("données"));
+  fuzzy_end_bulk_insert (fuzzy);
+
+  g_assert (fuzzy_remove (fuzzy, "file-042.c"));
+  g_assert (!fuzzy_remove (fuzzy, "file-042.c"));
+  g_assert (!fuzzy_remove (fuzzy, "missing.c"));
+
+  matches = fuzzy_match (fuzzy, "file042", 10);
+  g_assert_cmpint (matches->len, ==, 0);
+  g_array_unref (matches);
+
+  fuzzy_replace (fuzzy, "file-043.c", g_strdup ("replaced"));
+  fuzzy_replace (fuzzy, "new-file.c", g_strdup ("inserted"));
+
+  matches = fuzzy_match (fuzzy, "file043", 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  match = &g_array_index (matches, FuzzyMatch, 0);
+  g_assert_cmpstr (match->value, ==, "replaced");
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "newfile", 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_array_unref (matches);
+
+  /*
+   * Once a quarter of the index has been removed it is worth compacting,
+   * after which everything else must still be found.
+   */
+  g_assert (!fuzzy_needs_compact (fuzzy));
+  g_assert (fuzzy_remove (fuzzy, "données.txt"));
+  for (i = 50; i < 75; i++)
+    {
+      key = g_strdup_printf ("file-%03u.c", i);
+      g_assert (fuzzy_remove (fuzzy, key));
+      g_free (key);
+    }
+
+  g_assert (fuzzy_needs_compact (fuzzy));
+  fuzzy_compact (fuzzy);
+  g_assert (!fuzzy_needs_compact (fuzzy));
+
+  n_keys = 0;
+  fuzzy_foreach (fuzzy, count_keys, &n_keys);
+  g_assert_cmpint (n_keys, ==, 75);
+
+  matches = fuzzy_match (fuzzy, "données", 10);
+  g_assert_cmpint (matches->len, ==, 0);
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "file", 0);
+  g_assert_cmpint (matches->len, ==, 75);
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "file099", 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  match = &g_array_index (matches, FuzzyMatch, 0);
+  g_assert_cmpstr (match->key, ==, "file-099.c");
+  g_assert_cmpstr (match->value, ==, "file-099.c");
+  g_array_unref (matches);
+
+  g_assert (fuzzy_remove (fuzzy, "file-099.c"));
+  fuzzy_compact (fuzzy);
+
+  matches = fuzzy_match (fuzzy, "file", 0);
+  g_assert_cmpint (matches->len, ==, 74);
+  g_array_unref (matches);
+
+  fuzzy_unref (fuzzy);
+}
+
+static void
+test_fuzzy_unicode (void)
+{
+  FuzzyMatch *match;
+  GArray *matches;
+  Fuzzy *fuzzy;
+
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_begin_bulk_insert (fuzzy);
+  fuzzy_insert (fuzzy, "Überblick.txt", "1");
+  fuzzy_insert (fuzzy, "données/ÉCRAN.ui", "2");
+  fuzzy_insert (fuzzy, "ubuntu.txt", "3");
+  fuzzy_end_bulk_insert (fuzzy);
+
+  matches = fuzzy_match (fuzzy, "überb", 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  match = &g_array_index (matches, FuzzyMatch, 0);
+  g_assert_cmpstr (match->value, ==, "1");
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "écran", 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  match = &g_array_index (matches, FuzzyMatch, 0);
+  g_assert_cmpstr (match->value, ==, "2");
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "ü", 10);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_array_unref (matches);
+
+  fuzzy_unref (fuzzy);
+}
+
+static void
+assert_matches_equal (GArray *a,
+                      GArray *b)
+{
+  guint i;
+
+  g_assert_cmpint (a->len, ==, b->len);
+
+  for (i = 0; i < a->len; i++)
+    {
+      FuzzyMatch *ma = &g_array_index (a, FuzzyMatch, i);
+      FuzzyMatch *mb = &g_array_index (b, FuzzyMatch, i);
+
+      g_assert_cmpstr (ma->key, ==, mb->key);
+      g_assert (ma->value == mb->value);
+      g_assert_cmpfloat (ma->score, ==, mb->score);
+    }
+}
+
+static void
+test_fuzzy_query (void)
+{
+  static const gchar *needles[] = {
+    "g", "gb", "gbs", "gbse", "gbs", "gb", "gbe", "gbed", "gbedc", "x", "",
+    "doc", "docu",
+  };
+  static const gchar *keys[] = {
+    "gb-editor-document.c", "gb-search-box.c", "gb-search-display.c",
+    "gb-editor-frame.c", "document.c", "Makefile.am", "gb-source-vim.c",
+  };
+  FuzzyQuery *query;
+  Fuzzy *fuzzy;
+  guint i;
+
+  fuzzy = fuzzy_new (FALSE);
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    fuzzy_insert (fuzzy, keys [i], GINT_TO_POINTER (i + 1));
+
+  query = fuzzy_query_new (fuzzy);
+
+  for (i = 0; i < G_N_ELEMENTS (needles); i++)
+    {
+      GArray *expected;
+      GArray *matches;
+
+      expected = fuzzy_match (fuzzy, needles [i], 3);
+      matches = fuzzy_query_match (query, needles [i], 3);
+      assert_matches_equal (expected, matches);
+      g_array_unref (expected);
+      g_array_unref (matches);
+    }
+
+  /* changing the index must invalidate the cached results */
+  fuzzy_insert (fuzzy, "gb-search-manager.c", NULL);
+
+  {
+    GArray *expected;
+    GArray *matches;
+
+    expected = fuzzy_match (fuzzy, "docu", 0);
+    matches = fuzzy_query_match (query, "docu", 0);
+    assert_matches_equal (expected, matches);
+    g_array_unref (expected);
+    g_array_unref (matches);
+  }
+
+  fuzzy_query_free (query);
+  fuzzy_unref (fuzzy);
+}
+
+static void
+test_fuzzy_top (void)
+{
+  static const gchar *needles[] = { "fc", "file1", "d1/f", "src", "a" };
+  static const gsize limits[] = { 1, 2, 3, 7, 10, 64, 100 };
+  GArray *expected;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  guint i;
+  guint j;
+  guint k;
+
+  /*
+   * Many keys share a shape, so they tie on score and only the key
+   * orders them. The lengths vary as well, which lets the bounded heap
+   * skip candidates that are too long to beat the worst match so far.
+   */
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_begin_bulk_insert (fuzzy);
+  for (i = 0; i < 500; i++)
+    {
+      gchar *key;
+
+      key = g_strdup_printf ("src/d%u/%s-file%u.c",
+                             i % 7, (i % 3) ? "a" : "abcdef", i % 50);
+      fuzzy_insert (fuzzy, key, NULL);
+      g_free (key);
+    }
+  fuzzy_end_bulk_insert (fuzzy);
+
+  for (i = 0; i < G_N_ELEMENTS (needles); i++)
+    {
+      expected = fuzzy_match (fuzzy, needles [i], 0);
+      g_assert_cmpint (expected->len, >, 0);
+
+      for (j = 0; j < G_N_ELEMENTS (limits); j++)
+        {
+          matches = fuzzy_match (fuzzy, needles [i], limits [j]);
+          g_assert_cmpint (matches->len, ==, MIN (limits [j], expected->len));
+
+          for (k = 0; k < matches->len; k++)
+            {
+              FuzzyMatch *a = &g_array_index (matches, FuzzyMatch, k);
+              FuzzyMatch *b = &g_array_index (expected, FuzzyMatch, k);
+
+              g_assert_cmpstr (a->key, ==, b->key);
+              g_assert_cmpfloat (a->score, ==, b->score);
+            }
+
+          g_array_unref (matches);
+        }
+
+      g_array_unref (expected);
+    }
+
+  fuzzy_unref (fuzzy);
+}
+
+static void
+test_fuzzy_save (void)
+{
+  static const gchar *needles[] = { "gbed", "doc", "écran", "make", "zzz" };
+  GError *error = NULL;
+  GArray *expected;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  Fuzzy *loaded;
+  gchar *filename;
+  gchar *tmpdir;
+  gchar *contents;
+  gchar *key;
+  guint64 *cache_key_length;
+  gsize length;
+  guint i;
+  guint j;
+
+  tmpdir = g_dir_make_tmp ("test-fuzzy-XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (tmpdir, "index", NULL);
+
+  fuzzy = fuzzy_new_with_free_func (FALSE, g_free);
+  fuzzy_begin_bulk_insert (fuzzy);
+  fuzzy_insert (fuzzy, "gb-editor-document.c", g_strdup ("1"));
+  fuzzy_insert (fuzzy, "gb-search-box.c", NULL);
+  fuzzy_insert (fuzzy, "Makefile.am", g_strdup ("3"));
+  fuzzy_insert (fuzzy, "données/ÉCRAN.ui", g_strdup ("4"));
+  fuzzy_end_bulk_insert (fuzzy);
+
+  g_assert (fuzzy_save (fuzzy, filename, "key-1", &error));
+  g_assert_no_error (error);
+
+  loaded = fuzzy_load_mapped (filename, "key-1", &error);
+  g_assert_no_error (error);
+  g_assert (loaded);
+
+  for (i = 0; i < G_N_ELEMENTS (needles); i++)
+    {
+      expected = fuzzy_match (fuzzy, needles [i], 0);
+      matches = fuzzy_match (loaded, needles [i], 0);
+      g_assert_cmpint (expected->len, ==, matches->len);
+      for (j = 0; j < matches->len; j++)
+        {
+          FuzzyMatch *ma = &g_array_index (expected, FuzzyMatch, j);
+          FuzzyMatch *mb = &g_array_index (matches, FuzzyMatch, j);
+
+          g_assert_cmpstr (ma->key, ==, mb->key);
+          g_assert_cmpstr (ma->value, ==, mb->value);
+          g_assert_cmpfloat (ma->score, ==, mb->score);
+        }
+      g_array_unref (expected);
+      g_array_unref (matches);
+    }
+
+  /*
+   * Modifying a mapped index copies it into memory first.
+   */
+  fuzzy_insert (loaded, "gb-editor-view.c", g_strdup ("5"));
+  g_assert (fuzzy_remove (loaded, "Makefile.am"));
+
+  matches = fuzzy_match (loaded, "gbed", 0);
+  g_assert_cmpint (matches->len, ==, 2);
+  g_array_unref (matches);
+
+  matches = fuzzy_match (loaded, "make", 0);
+  g_assert_cmpint (matches->len, ==, 0);
+  g_array_unref (matches);
+
+  fuzzy_unref (loaded);
+
+  loaded = fuzzy_load_mapped (filename, "key-2", &error);
+  g_assert_error (error, FUZZY_ERROR, FUZZY_ERROR_STALE);
+  g_assert (!loaded);
+  g_clear_error (&error);
+
+  g_file_get_contents (filename, &contents, &length, &error);
+  g_assert_no_error (error);
+
+  /*
+   * A cache key length of G_MAXUINT64 must not wrap around when the
+   * terminating NUL is accounted for. The length follows the magic, eight
+   * 32-bit fields and the offset of the key.
+   */
+  cache_key_length = (guint64 *)(gpointer)(contents + 48);
+  g_assert_cmpint (*cache_key_length, ==, strlen ("key-1"));
+  *cache_key_length = G_MAXUINT64;
+  g_file_set_contents (filename, contents, length, &error);
+  g_assert_no_error (error);
+  *cache_key_length = strlen ("key-1");
+
+  loaded = fuzzy_load_mapped (filename, "key-1", &error);
+  g_assert_error (error, FUZZY_ERROR, FUZZY_ERROR_INVALID);
+  g_assert (!loaded);
+  g_clear_error (&error);
+
+  /*
+   * A key ending in the lead byte of a multi-byte sequence would step
+   * over its NUL while being matched.
+   */
+  for (key = contents; memcmp (key, "Makefile.am", sizeof "Makefile.am"); key++)
+    g_assert (key < (contents + length - sizeof "Makefile.am"));
+  key [strlen ("Makefile.am") - 1] = (gchar)0xC3;
+  g_file_set_contents (filename, contents, length, &error);
+  g_assert_no_error (error);
+  key [strlen ("Makefile.am") - 1] = 'm';
+
+  loaded = fuzzy_load_mapped (filename, "key-1", &error);
+  g_assert_error (error, FUZZY_ERROR, FUZZY_ERROR_INVALID);
+  g_assert (!loaded);
+  g_clear_error (&error);
+
+  g_file_set_contents (filename, contents, length / 2, &error);
+  g_assert_no_error (error);
+  g_free (contents);
+
+  loaded = fuzzy_load_mapped (filename, "key-1", &error);
+  g_assert_error (error, FUZZY_ERROR, FUZZY_ERROR_INVALID);
+  g_assert (!loaded);
+  g_clear_error (&error);
+
+  g_unlink (filename);
+  g_rmdir (tmpdir);
+  g_free (filename);
+  g_free (tmpdir);
+  fuzzy_unref (fuzzy);
+}
+
+static void
+test_fuzzy_wide (void)
+{
+  GError *error = NULL;
+  GArray *matches;
+  GString *str;
+  Fuzzy *fuzzy;
+  Fuzzy *loaded;
+  gchar *filename;
+  gchar *tmpdir;
+
+  /*
+   * A large capacity hint selects the wide encoding up front.
+   */
+  fuzzy = fuzzy_new_full (FALSE, 2000000, NULL);
+  fuzzy_insert (fuzzy, "gb-editor-document.c", NULL);
+  fuzzy_insert (fuzzy, "gb-search-box.c", NULL);
+  matches = fuzzy_match (fuzzy, "gbed", 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpstr (g_array_index (matches, FuzzyMatch, 0).key, ==, "gb-editor-document.c");
+  g_array_unref (matches);
+  fuzzy_unref (fuzzy);
+
+  /*
+   * Keys with characters beyond the compact position limit widen the
+   * index in place.
+   */
+  str = g_string_new ("gb-");
+  while (str->len < 5000)
+    g_string_append_c (str, 'x');
+  g_string_append (str, "/tail.c");
+
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_insert (fuzzy, "gb-editor-document.c", NULL);
+  fuzzy_insert (fuzzy, str->str, NULL);
+  fuzzy_insert (fuzzy, "tail.h", NULL);
+
+  matches = fuzzy_match (fuzzy, "gbtail", 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpstr (g_array_index (matches, FuzzyMatch, 0).key, ==, str->str);
+  g_array_unref (matches);
+
+  matches = fuzzy_match (fuzzy, "gbed", 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_array_unref (matches);
+
+  tmpdir = g_dir_make_tmp ("test-fuzzy-XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (tmpdir, "index", NULL);
+
+  g_assert (fuzzy_save (fuzzy, filename, "key", &error));
+  g_assert_no_error (error);
+
+  loaded = fuzzy_load_mapped (filename, "key", &error);
+  g_assert_no_error (error);
+  g_assert (loaded);
+
+  matches = fuzzy_match (loaded, "gbtail", 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpstr (g_array_index (matches, FuzzyMatch, 0).key, ==, str->str);
+  g_array_unref (matches);
+
+  fuzzy_unref (loaded);
+  g_unlink (filename);
+  g_rmdir (tmpdir);
+  g_free (filename);
+  g_free (tmpdir);
+  g_string_free (str, TRUE);
+  fuzzy_unref (fuzzy);
+}
+
+
+static gboolean
+is_subsequence (const gchar *needle,
+                const gchar *haystack)
+{
+  for (; *haystack && *needle; haystack++)
+    {
+      if (g_ascii_tolower (*haystack) == g_ascii_tolower (*needle))
+        needle++;
+    }
+
+  return !*needle;
+}
+
+static void
+test_fuzzy_blocks (void)
+{
+  static const gchar *needles[] = { "d3f1", "file-29", "src/d1", "f999c", "DIR36", "zz" };
+  GPtrArray *keys;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  guint expected;
+  guint i;
+  guint j;
+
+  /*
+   * Enough keys that every table spans many packed blocks.
+   */
+  keys = g_ptr_array_new_with_free_func (g_free);
+  fuzzy = fuzzy_new (FALSE);
+
+  fuzzy_begin_bulk_insert (fuzzy);
+  for (i = 0; i < 3000; i++)
+    {
+      gchar *key = g_strdup_printf ("src/dir%u/file-%u.c", i % 37, i);
+
+      g_ptr_array_add (keys, key);
+      fuzzy_insert (fuzzy, key, NULL);
+    }
+  fuzzy_end_bulk_insert (fuzzy);
+
+  for (i = 0; i < 3000; i += 3)
+    fuzzy_remove (fuzzy, g_ptr_array_index (keys, i));
+  fuzzy_compact (fuzzy);
+
+  for (i = 0; i < G_N_ELEMENTS (needles); i++)
+    {
+      expected = 0;
+      for (j = 0; j < keys->len; j++)
+        {
+          if ((j % 3) && is_subsequence (needles [i], g_ptr_array_index (keys, j)))
+            expected++;
+        }
+
+      matches = fuzzy_match (fuzzy, needles [i], 0);
+      g_assert_cmpint (matches->len, ==, expected);
+      for (j = 0; j < matches->len; j++)
+        g_assert (is_subsequence (needles [i], g_array_index (matches, FuzzyMatch, j).key));
+      g_array_unref (matches);
+    }
+
+  g_ptr_array_unref (keys);
+  fuzzy_unref (fuzzy);
+}
+
+
+static void
+test_fuzzy_shards (void)
+{
+  static const gchar *needles[] = { "f", "fi", "fil", "file1", "d3", "d3f1c", "zz" };
+  FuzzyQuery *query;
+  GPtrArray *keys;
+  GArray *matches;
+  GArray *top;
+  GArray *typed;
+  Fuzzy *fuzzy;
+  guint expected;
+  guint i;
+  guint j;
+
+  /*
+   * test-fuzzy-shards builds this with a tiny shard size, so that every
+   * lookup here is split across threads. The results must not depend on
+   * how the index was split.
+   */
+  keys = g_ptr_array_new_with_free_func (g_free);
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_begin_bulk_insert (fuzzy);
+  for (i = 0; i < 3000; i++)
+    {
+      gchar *key = g_strdup_printf ("src/d%u/file%u.c", i % 11, i % 400);
+
+      g_ptr_array_add (keys, key);
+      fuzzy_insert (fuzzy, key, NULL);
+    }
+  fuzzy_end_bulk_insert (fuzzy);
+
+  query = fuzzy_query_new (fuzzy);
+
+  for (i = 0; i < G_N_ELEMENTS (needles); i++)
+    {
+      expected = 0;
+      for (j = 0; j < keys->len; j++)
+        {
+          if (is_subsequence (needles [i], g_ptr_array_index (keys, j)))
+            expected++;
+        }
+
+      matches = fuzzy_match (fuzzy, needles [i], 0);
+      g_assert_cmpint (matches->len, ==, expected);
+
+      for (j = 1; j < matches->len; j++)
+        {
+          FuzzyMatch *a = &g_array_index (matches, FuzzyMatch, j - 1);
+          FuzzyMatch *b = &g_array_index (matches, FuzzyMatch, j);
+
+          g_assert (a->score > b->score ||
+                    (a->score == b->score && g_strcmp0 (a->key, b->key) <= 0));
+        }
+
+      typed = fuzzy_query_match (query, needles [i], 0);
+      g_assert_cmpint (typed->len, ==, matches->len);
+      for (j = 0; j < typed->len; j++)
+        g_assert (g_array_index (typed, FuzzyMatch, j).key ==
+                  g_array_index (matches, FuzzyMatch, j).key);
+      g_array_unref (typed);
+
+      top = fuzzy_match (fuzzy, needles [i], 25);
+      g_assert_cmpint (top->len, ==, MIN (25, matches->len));
+      for (j = 0; j < top->len; j++)
+        g_assert (g_array_index (top, FuzzyMatch, j).key ==
+                  g_array_index (matches, FuzzyMatch, j).key);
+      g_array_unref (top);
+
+      g_array_unref (matches);
+    }
+
+  fuzzy_query_free (query);
+  g_ptr_array_unref (keys);
+  fuzzy_unref (fuzzy);
+}
+
+static void
+test_fuzzy_insert (void)
+{
+  static const gchar *needles[] = { "d3f1", "file-29", "src/d1", "zz" };
+  GPtrArray *keys;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  guint expected;
+  guint i;
+  guint j;
+  guint k;
+
+  /*
+   * Matching between single inserts packs a few items at a time onto the
+   * end of each table, which must read back the same as packing them all
+   * at once.
+   */
+  keys = g_ptr_array_new_with_free_func (g_free);
+  fuzzy = fuzzy_new (FALSE);
+
+  for (i = 0; i < 2000; i++)
+    {
+      gchar *key = g_strdup_printf ("src/dir%u/file-%u.c", i % 37, i);
+
+      g_ptr_array_add (keys, key);
+      fuzzy_insert (fuzzy, key, NULL);
+
+      if ((i % 97) && (i != 1999))
+        continue;
+
+      for (j = 0; j < G_N_ELEMENTS (needles); j++)
+        {
+          expected = 0;
+          for (k = 0; k < keys->len; k++)
+            {
+              if (is_subsequence (needles [j], g_ptr_array_index (keys, k)))
+                expected++;
+            }
+
+          matches = fuzzy_match (fuzzy, needles [j], 0);
+          g_assert_cmpint (matches->len, ==, expected);
+          g_array_unref (matches);
+        }
+    }
+
+  g_ptr_array_unref (keys);
+  fuzzy_unref (fuzzy);
+}
+
+
+static void
+test_fuzzy_deadline (void)
+{
+  GCancellable *cancellable;
+  FuzzyQuery *query;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  gboolean truncated = TRUE;
+  guint i;
+
+  fuzzy = fuzzy_new (FALSE);
+
+  fuzzy_begin_bulk_insert (fuzzy);
+  for (i = 0; i < 2000; i++)
+    {
+      gchar *key = g_strdup_printf ("src/dir%u/file-%u.c", i % 37, i);
+
+      fuzzy_insert (fuzzy, key, NULL);
+      g_free (key);
+    }
+  fuzzy_end_bulk_insert (fuzzy);
+
+  matches = fuzzy_match_full (fuzzy, "file", 0, NULL, 0, &truncated);
+  g_assert (!truncated);
+  g_assert_cmpint (matches->len, ==, 2000);
+  g_array_unref (matches);
+
+  /*
+   * A deadline that has already passed stops before any candidates.
+   */
+  matches = fuzzy_match_full (fuzzy, "file", 0, NULL, 1, &truncated);
+  g_assert (truncated);
+  g_assert_cmpint (matches->len, ==, 0);
+  g_array_unref (matches);
+
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+
+  matches = fuzzy_match_full (fuzzy, "file", 0, cancellable, 0, &truncated);
+  g_assert (truncated);
+  g_array_unref (matches);
+
+  /*
+   * A truncated query must not be used to narrow the next needle.
+   */
+  query = fuzzy_query_new (fuzzy);
+
+  matches = fuzzy_query_match_full (query, "fil", 0, cancellable, 0, &truncated);
+  g_assert (truncated);
+  g_array_unref (matches);
+
+  matches = fuzzy_query_match_full (query, "file", 0, NULL, 0, &truncated);
+  g_assert (!truncated);
+  g_assert_cmpint (matches->len, ==, 2000);
+  g_array_unref (matches);
+
+  fuzzy_query_free (query);
+  g_object_unref (cancellable);
+  fuzzy_unref (fuzzy);
+}
+
+
+/*
+ * Whether @needle matches @path under the rules of a path aware index,
+ * checked the slow way: reach[i][p] is set if the first i characters of
+ * the needle can match with the last of them at p - 1.
+ */
+static gboolean
+is_path_match (const gchar *needle,
+               const gchar *path)
+{
+  gsize n = strlen (needle);
+  gsize m = strlen (path);
+  gboolean *reach;
+  gboolean ret = FALSE;
+  guint *component;
+  guint i;
+  guint p;
+  guint q;
+
+  reach = g_new0 (gboolean, (n + 1) * (m + 1));
+  component = g_new0 (guint, m + 1);
+
+  for (p = 1; p < m; p++)
+    component [p] = component [p - 1] + (path [p - 1] == '/');
+
+  for (q = 0; q <= m; q++)
+    reach [q] = TRUE;
+
+  for (i = 1; i <= n; i++)
+    {
+      for (p = 1; p <= m; p++)
+        {
+          if (g_ascii_tolower (path [p - 1]) != g_ascii_tolower (needle [i - 1]))
+            continue;
+
+          for (q = (i == 1) ? 0 : 1; q < p; q++)
+            {
+              if (!reach [(i - 1) * (m + 1) + q])
+                continue;
+              if ((i > 1) && (needle [i - 1] != '/') && (needle [i - 2] != '/') &&
+                  (component [q - 1] != component [p - 1]))
+                continue;
+              reach [i * (m + 1) + p] = TRUE;
+              break;
+            }
+        }
+    }
+
+  for (p = 1; p <= m; p++)
+    {
+      if (reach [n * (m + 1) + p] &&
+          ((needle [n - 1] == '/') || !strchr (path + p - 1, '/')))
+        ret = TRUE;
+    }
+
+  g_free (reach);
+  g_free (component);
+
+  return ret;
+}
+
+static void
+test_fuzzy_path (void)
+{
+  static const gchar *dirs[] = {
+    "src/editor", "src/search", "src/doc", "src/git", "src/editor/doc",
+    "src/util/editing", "doc", "tests",
+  };
+  static const gchar *files[] = {
+    "gb-editor-document.c", "doc.txt", "editing.txt", "gb-search-box.c",
+    "gb-doc.h", "README",
+  };
+  static const gchar *needles[] = {
+    "edit/doc", "src/gb-edit", "doc", "edit/", "search/box", "sr/ed/doc",
+    "gbed", "/doc", "doc/", "src/", "s/e/d/g", "editdoc",
+  };
+  GError *error = NULL;
+  GPtrArray *keys;
+  FuzzyQuery *query;
+  GArray *matches;
+  Fuzzy *fuzzy;
+  Fuzzy *loaded;
+  gchar *filename;
+  gchar *tmpdir;
+  gchar *partial;
+  guint expected;
+  guint i;
+  guint j;
+
+  keys = g_ptr_array_new_with_free_func (g_free);
+  fuzzy = fuzzy_new (FALSE);
+  fuzzy_set_path_aware (fuzzy, TRUE);
+
+  for (i = 0; i < G_N_ELEMENTS (dirs); i++)
+    {
+      for (j = 0; j < G_N_ELEMENTS (files); j++)
+        {
+          gchar *key = g_strdup_printf ("%s/%s", dirs [i], files [j]);
+
+          g_ptr_array_add (keys, key);
+          fuzzy_insert (fuzzy, key, NULL);
+        }
+    }
+
+  /*
+   * Appending a '/' moves the last segment out of the file name, so
+   * "edit/" can match files that "edit" did not.
+   */
+  g_assert (fuzzy_can_narrow (fuzzy, "edit", "editdoc"));
+  g_assert (fuzzy_can_narrow (fuzzy, "edit/", "edit/doc"));
+  g_assert (!fuzzy_can_narrow (fuzzy, "edit", "edit/"));
+  g_assert (!fuzzy_can_narrow (fuzzy, "edit", "edit/doc"));
+  g_assert (!fuzzy_can_narrow (fuzzy, "edit", "doc"));
+
+  matches = fuzzy_match (fuzzy, "edit/doc", 1);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpstr (g_array_index (matches, FuzzyMatch, 0).key, ==, "src/editor/doc.txt");
+  g_array_unref (matches);
+
+  tmpdir = g_dir_make_tmp ("test-fuzzy-XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (tmpdir, "index", NULL);
+  g_assert (fuzzy_save (fuzzy, filename, NULL, &error));
+  g_assert_no_error (error);
+  loaded = fuzzy_load_mapped (filename, NULL, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (needles); i++)
+    {
+      expected = 0;
+      for (j = 0; j < keys->len; j++)
+        {
+          if (is_path_match (needles [i], g_ptr_array_index (keys, j)))
+            expected++;
+        }
+
+      matches = fuzzy_match (fuzzy, needles [i], 0);
+      g_assert_cmpint (matches->len, ==, expected);
+      for (j = 0; j < matches->len; j++)
+        g_assert (is_path_match (needles [i], g_array_index (matches, FuzzyMatch, j).key));
+      g_array_unref (matches);
+
+      matches = fuzzy_match (loaded, needles [i], 0);
+      g_assert_cmpint (matches->len, ==, expected);
+      g_array_unref (matches);
+
+      /*
+       * Typing a '/' must not narrow the results of the shorter needle.
+       */
+      query = fuzzy_query_new (fuzzy);
+      for (j = 1; j <= strlen (needles [i]); j++)
+        {
+          partial = g_strndup (needles [i], j);
+          g_array_unref (fuzzy_query_match (query, partial, 0));
+          g_free (partial);
+        }
+      matches = fuzzy_query_match (query, needles [i], 0);
+      g_assert_cmpint (matches->len, ==, expected);
+      g_array_unref (matches);
+      fuzzy_query_free (query);
+    }
+
+  fuzzy_unref (loaded);
+  g_unlink (filename);
+  g_rmdir (tmpdir);
+  g_free (filename);
+  g_free (tmpdir);
+  g_ptr_array_unref (keys);
+  fuzzy_unref (fuzzy);
+}
+
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/Fuzzy/basic", test_fuzzy_basic);
+  g_test_add_func ("/Fuzzy/boundary", test_fuzzy_boundary);
+  g_test_add_func ("/Fuzzy/remove", test_fuzzy_remove);
+  g_test_add_func ("/Fuzzy/unicode", test_fuzzy_unicode);
+  g_test_add_func ("/Fuzzy/query", test_fuzzy_query);
+  g_test_add_func ("/Fuzzy/top", test_fuzzy_top);
+  g_test_add_func ("/Fuzzy/save", test_fuzzy_save);
+  g_test_add_func ("/Fuzzy/wide", test_fuzzy_wide);
+  g_test_add_func ("/Fuzzy/blocks", test_fuzzy_blocks);
+  g_test_add_func ("/Fuzzy/shards", test_fuzzy_shards);
+  g_test_add_func ("/Fuzzy/insert", test_fuzzy_insert);
+  g_test_add_func ("/Fuzzy/deadline", test_fuzzy_deadline);
+  g_test_add_func ("/Fuzzy/path", test_fuzzy_path);
+  return g_test_run ();
+}
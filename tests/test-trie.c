@@ -0,0 +1,637 @@
+/* test-trie.c
+ *
+ * Copyright (C) 2015 Christian Hergert <christian@hergert.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "trie.h"
+
+static const gchar *words[] = {
+  "a", "abbr", "address", "area", "article", "aside", "audio", "b", "base",
+  "bdi", "bdo", "blockquote", "body", "br", "button", "canvas", "caption",
+  "cite", "code", "col", "colgroup", "data", "datalist", "dd", "del",
+  "details", "dfn", "dialog", "div", "dl", "dt", "em", "embed", "fieldset",
+  "figcaption", "figure", "footer", "form", "h1", "h2", "h3", "head",
+  "header", "hr", "html", "i", "iframe", "img", "input", "ins", "kbd",
+  "label", "legend", "li", "link", "main", "map", "mark", "meta", "meter",
+  "nav", "noscript", "object", "ol", "optgroup", "option", "output", "p",
+  "param", "pre", "progress", "q", "rp", "rt", "ruby", "s", "samp",
+  "script", "section", "select", "small", "source", "span", "strong",
+  "style", "sub", "summary", "sup", "table", "tbody", "td", "textarea",
+  "tfoot", "th", "thead", "time", "title", "tr", "track", "u", "ul", "var",
+  "video", "wbr", "ümlaut", "ünïcödé",
+};
+
+static Trie *
+build_trie (GDestroyNotify value_destroy)
+{
+  Trie *trie;
+  guint i;
+
+  trie = trie_new (value_destroy);
+
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    trie_insert (trie, words [i], g_strdup (words [i]));
+
+  return trie;
+}
+
+static gboolean
+collect_cb (Trie        *trie,
+            const gchar *key,
+            gpointer     value,
+            gpointer     user_data)
+{
+  GPtrArray *ar = user_data;
+
+  g_assert_cmpstr (key, ==, value);
+  g_ptr_array_add (ar, g_strdup (key));
+
+  return FALSE;
+}
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+static GPtrArray *
+collect (Trie          *trie,
+         const gchar   *prefix,
+         GTraverseType  order,
+         gint           max_depth)
+{
+  GPtrArray *ar;
+
+  ar = g_ptr_array_new_with_free_func (g_free);
+  trie_traverse (trie, prefix, order, G_TRAVERSE_LEAVES, max_depth,
+                 collect_cb, ar);
+  g_ptr_array_sort (ar, compare_strings);
+
+  return ar;
+}
+
+static void
+assert_same_results (GPtrArray *a,
+                     GPtrArray *b)
+{
+  guint i;
+
+  g_assert_cmpint (a->len, ==, b->len);
+
+  for (i = 0; i < a->len; i++)
+    g_assert_cmpstr (g_ptr_array_index (a, i), ==, g_ptr_array_index (b, i));
+}
+
+static gboolean
+stop_cb (Trie        *trie,
+         const gchar *key,
+         gpointer     value,
+         gpointer     user_data)
+{
+  guint *count = user_data;
+
+  return ++(*count) == 3;
+}
+
+static gboolean
+order_cb (Trie        *trie,
+          const gchar *key,
+          gpointer     value,
+          gpointer     user_data)
+{
+  GString *str = user_data;
+
+  g_string_append_printf (str, "%s,", key);
+
+  return FALSE;
+}
+
+static void
+test_trie_freeze (void)
+{
+  const gchar *prefixes[] = { "", "a", "d", "t", "th", "ü", "x", "video", NULL };
+  const gint depths[] = { -1, 1, 2, 3 };
+  Trie *trie;
+  Trie *frozen;
+  GString *str;
+  guint count = 0;
+  guint i;
+  guint j;
+
+  trie = build_trie (g_free);
+  frozen = build_trie (g_free);
+  g_assert (trie_freeze (frozen));
+
+  /* Freezing twice does nothing. */
+  g_assert (trie_freeze (frozen));
+
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    g_assert_cmpstr (trie_lookup (frozen, words [i]), ==, words [i]);
+
+  g_assert (trie_lookup (frozen, "") == NULL);
+  g_assert (trie_lookup (frozen, "ar") == NULL);
+  g_assert (trie_lookup (frozen, "videos") == NULL);
+  g_assert (trie_lookup (frozen, "zzz") == NULL);
+
+  for (i = 0; prefixes [i]; i++)
+    {
+      for (j = 0; j < G_N_ELEMENTS (depths); j++)
+        {
+          GPtrArray *a;
+          GPtrArray *b;
+
+          a = collect (trie, prefixes [i], G_PRE_ORDER, depths [j]);
+          b = collect (frozen, prefixes [i], G_PRE_ORDER, depths [j]);
+          assert_same_results (a, b);
+          g_ptr_array_unref (b);
+
+          b = collect (frozen, prefixes [i], G_POST_ORDER, depths [j]);
+          assert_same_results (a, b);
+          g_ptr_array_unref (b);
+
+          g_ptr_array_unref (a);
+        }
+    }
+
+  /* Frozen children are visited in key order. */
+  str = g_string_new (NULL);
+  trie_traverse (frozen, "t", G_PRE_ORDER, G_TRAVERSE_LEAVES, -1, order_cb, str);
+  g_assert_cmpstr (str->str, ==,
+                   "table,tbody,td,textarea,tfoot,th,thead,time,title,tr,track,");
+  g_string_truncate (str, 0);
+  trie_traverse (frozen, "th", G_POST_ORDER, G_TRAVERSE_LEAVES, -1, order_cb, str);
+  g_assert_cmpstr (str->str, ==, "thead,th,");
+  g_string_free (str, TRUE);
+
+  trie_traverse (frozen, NULL, G_PRE_ORDER, G_TRAVERSE_LEAVES, -1, stop_cb, &count);
+  g_assert_cmpint (count, ==, 3);
+
+  trie_destroy (trie);
+  trie_destroy (frozen);
+}
+
+static void
+test_trie_freeze_empty (void)
+{
+  GPtrArray *ar;
+  Trie *trie;
+
+  trie = trie_new (NULL);
+  g_assert (trie_freeze (trie));
+
+  g_assert (trie_lookup (trie, "a") == NULL);
+  ar = collect (trie, NULL, G_PRE_ORDER, -1);
+  g_assert_cmpint (ar->len, ==, 0);
+  g_ptr_array_unref (ar);
+
+  trie_destroy (trie);
+}
+
+static void
+test_trie_sorted (void)
+{
+  const gchar *dup_keys[] = { "", "a", "ab", "ab", "b" };
+  gpointer dup_values[] = { "0", "1", "2", "3", "4" };
+  const gchar *unsorted_keys[] = { "b", "ba", "a", "bb" };
+  gpointer unsorted_values[] = { "b", "ba", "a", "bb" };
+  const gchar **keys;
+  gpointer *values;
+  GPtrArray *a;
+  GPtrArray *b;
+  Trie *trie;
+  Trie *sorted;
+  guint i;
+
+  keys = g_new (const gchar *, G_N_ELEMENTS (words));
+  values = g_new (gpointer, G_N_ELEMENTS (words));
+
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    {
+      keys [i] = words [i];
+      values [i] = g_strdup (words [i]);
+    }
+
+  trie = build_trie (g_free);
+  sorted = trie_new_from_sorted (g_free, keys, values, G_N_ELEMENTS (words));
+
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    g_assert_cmpstr (trie_lookup (sorted, words [i]), ==, words [i]);
+  g_assert (trie_lookup (sorted, "") == NULL);
+  g_assert (trie_lookup (sorted, "ar") == NULL);
+
+  a = collect (trie, NULL, G_PRE_ORDER, -1);
+  b = collect (sorted, NULL, G_PRE_ORDER, -1);
+  assert_same_results (a, b);
+  g_ptr_array_unref (a);
+  g_ptr_array_unref (b);
+
+  /* The result is an ordinary trie. */
+  g_assert (trie_remove (sorted, "th"));
+  g_assert (trie_lookup (sorted, "th") == NULL);
+  g_assert_cmpstr (trie_lookup (sorted, "thead"), ==, "thead");
+  trie_insert (sorted, "th", g_strdup ("th"));
+  g_assert_cmpstr (trie_lookup (sorted, "th"), ==, "th");
+
+  trie_destroy (trie);
+  trie_destroy (sorted);
+  g_free (keys);
+  g_free (values);
+
+  /* Repeated keys keep the last value. */
+  sorted = trie_new_from_sorted (NULL, dup_keys, dup_values, G_N_ELEMENTS (dup_keys));
+  g_assert_cmpstr (trie_lookup (sorted, ""), ==, "0");
+  g_assert_cmpstr (trie_lookup (sorted, "a"), ==, "1");
+  g_assert_cmpstr (trie_lookup (sorted, "ab"), ==, "3");
+  g_assert_cmpstr (trie_lookup (sorted, "b"), ==, "4");
+  trie_destroy (sorted);
+
+  /* Unsorted keys are still all inserted. */
+  g_test_expect_message (NULL, G_LOG_LEVEL_WARNING, "*not sorted*");
+  sorted = trie_new_from_sorted (NULL, unsorted_keys, unsorted_values,
+                                 G_N_ELEMENTS (unsorted_keys));
+  g_test_assert_expected_messages ();
+  for (i = 0; i < G_N_ELEMENTS (unsorted_keys); i++)
+    g_assert_cmpstr (trie_lookup (sorted, unsorted_keys [i]), ==, unsorted_keys [i]);
+  trie_destroy (sorted);
+
+  sorted = trie_new_from_sorted (NULL, NULL, NULL, 0);
+  g_assert (trie_lookup (sorted, "a") == NULL);
+  trie_destroy (sorted);
+}
+
+static gboolean
+append_cb (Trie        *trie,
+           const gchar *key,
+           gpointer     value,
+           gpointer     user_data)
+{
+  g_ptr_array_add (user_data, g_strdup (key));
+  return FALSE;
+}
+
+static void
+check_iter (Trie        *trie,
+            const gchar *prefix)
+{
+  GPtrArray *expected;
+  TrieIter iter;
+  const gchar *key;
+  gpointer value;
+  guint i = 0;
+
+  /* The iterator visits keys in the same order as trie_traverse(). */
+  expected = g_ptr_array_new_with_free_func (g_free);
+  trie_traverse (trie, prefix, G_PRE_ORDER, G_TRAVERSE_LEAVES, -1,
+                 append_cb, expected);
+
+  trie_iter_init_prefix (&iter, trie, prefix, 0);
+  while (trie_iter_next (&iter, &key, &value))
+    {
+      g_assert_cmpint (i, <, expected->len);
+      g_assert_cmpstr (key, ==, g_ptr_array_index (expected, i));
+      g_assert_cmpstr (key, ==, value);
+      i++;
+    }
+  g_assert_cmpint (i, ==, expected->len);
+  g_assert (!trie_iter_next (&iter, NULL, NULL));
+  trie_iter_clear (&iter);
+
+  /* Stop after a page of results and then resume. */
+  i = 0;
+  trie_iter_init_prefix (&iter, trie, prefix, 3);
+  while (trie_iter_next (&iter, &key, NULL))
+    g_assert_cmpstr (key, ==, g_ptr_array_index (expected, i++));
+  g_assert_cmpint (i, ==, MIN (3, expected->len));
+
+  trie_iter_set_max_results (&iter, 5);
+  while (trie_iter_next (&iter, &key, NULL))
+    g_assert_cmpstr (key, ==, g_ptr_array_index (expected, i++));
+  g_assert_cmpint (i, ==, MIN (5, expected->len));
+
+  trie_iter_set_max_results (&iter, 0);
+  while (trie_iter_next (&iter, &key, NULL))
+    g_assert_cmpstr (key, ==, g_ptr_array_index (expected, i++));
+  g_assert_cmpint (i, ==, expected->len);
+  trie_iter_clear (&iter);
+
+  g_ptr_array_unref (expected);
+}
+
+static void
+test_trie_iter (void)
+{
+  const gchar *prefixes[] = { NULL, "", "a", "d", "t", "th", "ü", "x", "video" };
+  Trie *trie;
+  guint i;
+
+  trie = build_trie (g_free);
+
+  for (i = 0; i < G_N_ELEMENTS (prefixes); i++)
+    check_iter (trie, prefixes [i]);
+
+  trie_freeze (trie);
+
+  for (i = 0; i < G_N_ELEMENTS (prefixes); i++)
+    check_iter (trie, prefixes [i]);
+
+  trie_destroy (trie);
+}
+
+/*
+ * Edit distance with adjacent transpositions, computed directly.
+ */
+static guint
+osa_distance (const gunichar *a,
+              glong           a_len,
+              const gunichar *b,
+              glong           b_len)
+{
+  guint *d;
+  guint ret;
+  glong w = b_len + 1;
+  glong i;
+  glong j;
+
+  d = g_new0 (guint, (a_len + 1) * w);
+
+  for (i = 0; i <= a_len; i++)
+    d [i * w] = i;
+  for (j = 0; j <= b_len; j++)
+    d [j] = j;
+
+  for (i = 1; i <= a_len; i++)
+    {
+      for (j = 1; j <= b_len; j++)
+        {
+          guint cost = (a [i - 1] != b [j - 1]);
+          guint v;
+
+          v = MIN (d [(i - 1) * w + j] + 1, d [i * w + j - 1] + 1);
+          v = MIN (v, d [(i - 1) * w + j - 1] + cost);
+          if ((i > 1) && (j > 1) && (a [i - 1] == b [j - 2]) && (a [i - 2] == b [j - 1]))
+            v = MIN (v, d [(i - 2) * w + j - 2] + 1);
+          d [i * w + j] = v;
+        }
+    }
+
+  ret = d [a_len * w + b_len];
+  g_free (d);
+
+  return ret;
+}
+
+static guint
+prefix_distance (const gchar *query,
+                 const gchar *key)
+{
+  gunichar *q;
+  gunichar *k;
+  glong q_len;
+  glong k_len;
+  guint best = G_MAXUINT;
+  glong i;
+
+  q = g_utf8_to_ucs4_fast (query, -1, &q_len);
+  k = g_utf8_to_ucs4_fast (key, -1, &k_len);
+
+  for (i = 0; i <= k_len; i++)
+    best = MIN (best, osa_distance (k, i, q, q_len));
+
+  g_free (q);
+  g_free (k);
+
+  return best;
+}
+
+static gboolean
+fuzzy_cb (Trie        *trie,
+          const gchar *key,
+          gpointer     value,
+          guint        distance,
+          gpointer     user_data)
+{
+  GHashTable *found = user_data;
+
+  g_assert_cmpstr (key, ==, value);
+  g_assert (!g_hash_table_contains (found, key));
+  g_hash_table_insert (found, g_strdup (key), GUINT_TO_POINTER (distance + 1));
+
+  return FALSE;
+}
+
+static void
+check_fuzzy (Trie        *trie,
+             const gchar *query,
+             guint        max_edits)
+{
+  GHashTable *found;
+  guint n_expected = 0;
+  guint i;
+
+  found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  trie_traverse_fuzzy (trie, query, max_edits, fuzzy_cb, found);
+
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    {
+      guint distance = prefix_distance (query, words [i]);
+
+      if (distance <= max_edits)
+        {
+          g_assert_cmpint (GPOINTER_TO_UINT (g_hash_table_lookup (found, words [i])), ==, distance + 1);
+          n_expected++;
+        }
+    }
+
+  g_assert_cmpint (g_hash_table_size (found), ==, n_expected);
+  g_hash_table_unref (found);
+}
+
+static gboolean
+fuzzy_stop_cb (Trie        *trie,
+               const gchar *key,
+               gpointer     value,
+               guint        distance,
+               gpointer     user_data)
+{
+  guint *count = user_data;
+
+  return ++(*count) == 2;
+}
+
+static void
+test_trie_fuzzy (void)
+{
+  const gchar *queries[] = {
+    "", "d", "dvi", "div", "tabel", "vidoe", "tfooter", "ümlat", "unïcödé",
+    "x", "hx", "blokcquote", "zzzz",
+  };
+  Trie *trie;
+  guint count = 0;
+  guint i;
+  guint j;
+
+  trie = build_trie (g_free);
+
+  for (j = 0; j < 2; j++)
+    {
+      for (i = 0; i < G_N_ELEMENTS (queries); i++)
+        {
+          check_fuzzy (trie, queries [i], 0);
+          check_fuzzy (trie, queries [i], 1);
+          check_fuzzy (trie, queries [i], 2);
+        }
+
+      trie_freeze (trie);
+    }
+
+  trie_traverse_fuzzy (trie, "dvi", 1, fuzzy_stop_cb, &count);
+  g_assert_cmpint (count, ==, 2);
+
+  trie_destroy (trie);
+}
+
+#define N_RCU_READERS  4
+#define N_RCU_VERSIONS 200
+
+typedef struct
+{
+  TrieRcu       *rcu;
+  volatile gint  done;
+  volatile gint  n_values;
+} RcuState;
+
+static void
+rcu_value_free (gpointer data)
+{
+  RcuState *state = *(RcuState **)data;
+
+  g_atomic_int_add (&state->n_values, -1);
+  g_free (data);
+}
+
+static Trie *
+build_rcu_version (RcuState *state,
+                   guint     version)
+{
+  Trie *trie;
+  guint i;
+
+  trie = trie_new (rcu_value_free);
+
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    {
+      RcuState **value = g_new (RcuState *, 2);
+
+      value [0] = state;
+      value [1] = GUINT_TO_POINTER (version);
+      trie_insert (trie, words [i], value);
+      g_atomic_int_inc (&state->n_values);
+    }
+
+  return trie;
+}
+
+static gboolean
+rcu_traverse_cb (Trie        *trie,
+                 const gchar *key,
+                 gpointer     value,
+                 gpointer     user_data)
+{
+  gpointer *version = user_data;
+  RcuState **data = value;
+
+  if (!*version)
+    *version = data [1];
+
+  g_assert (*version == data [1]);
+
+  return FALSE;
+}
+
+static gpointer
+rcu_reader (gpointer data)
+{
+  RcuState *state = data;
+
+  while (!g_atomic_int_get (&state->done))
+    {
+      gpointer version = NULL;
+      RcuState **value;
+      Trie *trie;
+
+      /*
+       * Every key of a snapshot must belong to the same version, even while
+       * newer versions are being published.
+       */
+      trie = trie_rcu_acquire (state->rcu);
+      trie_traverse (trie, "", G_PRE_ORDER, G_TRAVERSE_LEAVES, -1, rcu_traverse_cb, &version);
+      value = trie_lookup (trie, "video");
+      g_assert (value);
+      g_assert (value [1] == version);
+      trie_unref (trie);
+    }
+
+  return NULL;
+}
+
+static void
+test_trie_rcu (void)
+{
+  GThread *readers [N_RCU_READERS];
+  RcuState state = { 0 };
+  guint i;
+
+  state.rcu = trie_rcu_new (build_rcu_version (&state, 1));
+
+  for (i = 0; i < N_RCU_READERS; i++)
+    readers [i] = g_thread_new ("trie-rcu-reader", rcu_reader, &state);
+
+  for (i = 2; i <= N_RCU_VERSIONS; i++)
+    {
+      trie_rcu_publish (state.rcu, build_rcu_version (&state, i));
+      g_thread_yield ();
+    }
+
+  g_atomic_int_set (&state.done, TRUE);
+
+  for (i = 0; i < N_RCU_READERS; i++)
+    g_thread_join (readers [i]);
+
+  /*
+   * Only the last version is still alive.
+   */
+  g_assert_cmpint (state.n_values, ==, G_N_ELEMENTS (words));
+  trie_rcu_free (state.rcu);
+  g_assert_cmpint (state.n_values, ==, 0);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/Trie/freeze", test_trie_freeze);
+  g_test_add_func ("/Trie/freeze_empty", test_trie_freeze_empty);
+  g_test_add_func ("/Trie/sorted", test_trie_sorted);
+  g_test_add_func ("/Trie/iter", test_trie_iter);
+  g_test_add_func ("/Trie/fuzzy", test_trie_fuzzy);
+  g_test_add_func ("/Trie/rcu", test_trie_rcu);
+  return g_test_run ();
+}
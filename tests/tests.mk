@@ -10,3 +10,53 @@ TESTS += test-navigation-list
 test_navigation_list_SOURCES = tests/test-navigation-list.c
 test_navigation_list_CFLAGS = $(libgnome_builder_la_CFLAGS)
 test_navigation_list_LDADD = libgnome-builder.la
+
+
+noinst_PROGRAMS += test-fuzzy
+TESTS += test-fuzzy
+test_fuzzy_SOURCES = tests/test-fuzzy.c
+test_fuzzy_CFLAGS = $(libgnome_builder_la_CFLAGS)
+test_fuzzy_LDADD = libgnome-builder.la
+
+
+# test-fuzzy-shards builds its own copy of fuzzy that splits every lookup
+# across threads, to check that sharding does not change any results.
+noinst_PROGRAMS += test-fuzzy-shards
+TESTS += test-fuzzy-shards
+test_fuzzy_shards_SOURCES = \
+	tests/test-fuzzy.c \
+	src/fuzzy/fuzzy.c \
+	src/fuzzy/fuzzy.h
+test_fuzzy_shards_CFLAGS = \
+	$(libgnome_builder_la_CFLAGS) \
+	-DFUZZY_SHARD_MIN_CANDIDATES=2 \
+	-DFUZZY_N_THREADS=8
+test_fuzzy_shards_LDADD = $(BUILDER_LIBS)
+
+
+noinst_PROGRAMS += test-trie
+TESTS += test-trie
+test_trie_SOURCES = tests/test-trie.c
+test_trie_CFLAGS = $(libgnome_builder_la_CFLAGS)
+test_trie_LDADD = libgnome-builder.la
+
+
+# bench-fuzzy builds its own copy of fuzzy so that it can collect stats.
+noinst_PROGRAMS += bench-fuzzy
+bench_fuzzy_SOURCES = \
+	tests/bench-fuzzy.c \
+	tests/bench-util.c \
+	tests/bench-util.h \
+	src/fuzzy/fuzzy.c \
+	src/fuzzy/fuzzy.h
+bench_fuzzy_CFLAGS = $(libgnome_builder_la_CFLAGS) -DFUZZY_ENABLE_STATS
+bench_fuzzy_LDADD = $(BUILDER_LIBS)
+
+
+noinst_PROGRAMS += bench-trie
+bench_trie_SOURCES = \
+	tests/bench-trie.c \
+	tests/bench-util.c \
+	tests/bench-util.h
+bench_trie_CFLAGS = $(libgnome_builder_la_CFLAGS)
+bench_trie_LDADD = libgnome-builder.la